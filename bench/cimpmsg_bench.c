@@ -0,0 +1,643 @@
+/**
+ * Copyright 2016 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <sched.h>
+#include <pthread.h>
+#include "cimpmsg.h"
+#include "cimpmsg_hist.h"
+#include "cimpmsg_log.h"
+
+/*------------------------------------------------------------------
+ * Throughput and latency benchmark.
+ * Runs a server and N clients in this process, or clients only
+ * against the server at 'a ADDR', for every combination of message
+ * size, connection count and send mode, and prints one CSV (or JSON)
+ * row per run.
+ *
+ * Modes:
+ *  send      blocking cmsg_client_send, latency is the time in the call
+ *  nonblock  non-blocking cmsg_client_send, would-block counts as a drop
+ *  rpc       cmsg_client_call echoed by the server, latency is the round trip
+ *
+ * Each client has its own receive thread, or with 'l' all of them are
+ * read by one cmsg_client_loop thread.
+ *
+ * 'z N' compresses messages of N bytes or more both ways, and 't'
+ * picks the payload: fill (one repeated byte), json (records that
+ * differ in a few fields) or random. wire_bytes_per_msg is what the
+ * clients sent per message, with frame headers, to set against the
+ * CPU cost that shows in msgs_per_sec.
+ *
+ * Example: cimpmsg_bench s 16,1024,65535 c 1,16 m send,rpc d 3 j
+ *          cimpmsg_bench s 4096,65536 c 1 m rpc t json z 1024
+---------------------------------------------------------------------*/
+
+#define IP_ADDR "127.0.0.1"
+#define DEFAULT_PORT 7500
+#define SEND_TIMEOUT_MSECS 2000
+#define CALL_TIMEOUT_MSECS 5000
+#define DRAIN_WAIT_MSECS 5000
+#define MAX_LIST 16
+
+#define MODE_SEND	0
+#define MODE_NONBLOCK	1
+#define MODE_RPC	2
+
+static const char *mode_names[] = { "send", "nonblock", "rpc" };
+
+#define PAYLOAD_FILL	0
+#define PAYLOAD_JSON	1
+#define PAYLOAD_RANDOM	2
+
+static const char *payload_names[] = { "fill", "json", "random" };
+
+struct options {
+  const char *addr;  // NULL to run the server in process
+  unsigned int port;
+  unsigned int secs;
+  bool json;
+  bool loop;  // one client loop instead of a receive thread per client
+  unsigned compress;  // compress_threshold, 0 = off
+  int payload;
+  unsigned sizes[MAX_LIST];
+  unsigned size_count;
+  unsigned conns[MAX_LIST];
+  unsigned conn_count;
+  unsigned modes[MAX_LIST];
+  unsigned mode_count;
+} OPT = {
+  .addr = NULL, .port = DEFAULT_PORT, .secs = 2, .json = false, .loop = false,
+  .compress = 0, .payload = PAYLOAD_FILL,
+  // 65535 is the largest basic frame, larger sizes connect with max_msg_size
+  .sizes = { 16, 256, 4096, 65535 }, .size_count = 4,
+  .conns = { 1, 8, 64 }, .conn_count = 3,
+  .modes = { MODE_SEND, MODE_NONBLOCK, MODE_RPC }, .mode_count = 3
+};
+
+typedef struct bench_client {
+  client_conn_t conn;
+  pthread_t sender;
+  pthread_t receiver;
+  int mode;
+  char *msg;
+  size_t sz_msg;
+  uint64_t msgs;
+  uint64_t drops;
+  uint64_t errors;
+  cmsg_hist_t hist;
+} bench_client_t;
+
+static volatile bool bench_stop = false;
+static bool server_terminated = false;
+static cmsg_server_t *bench_server = NULL;
+static pthread_t server_thread;
+static cmsg_client_loop_t *bench_loop = NULL;
+static bool loop_terminated = false;
+static pthread_t loop_thread;
+
+uint64_t bench_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ((uint64_t) ts.tv_sec * 1000000000ULL) + (uint64_t) ts.tv_nsec;
+}
+
+// library log output goes to stderr, so it doesn't mix with the results
+void bench_log_sink (int level, uint64_t time_ns, const char *line,
+  size_t len, void *arg)
+{
+  (void) level;
+  (void) time_ns;
+  (void) arg;
+  fwrite (line, 1, len, stderr);
+}
+
+/*------------------------------------------------------------------
+ * In process server, echoes requests
+---------------------------------------------------------------------*/
+
+void bench_handle_msg (int action_code, server_rcv_msg_data_t *msg_data)
+{
+  if (action_code != CMSG_ACTION_MSG_RECEIVED)
+    return;
+  if (msg_data->msg_kind == CMSG_KIND_REQUEST)
+    cmsg_server_reply (msg_data->server, msg_data->conn, msg_data->corr_id,
+      msg_data->rcv_msg, msg_data->rcv_msg_size, false);
+  cmsg_free_msg (msg_data->rcv_msg, msg_data->rcv_msg_size);
+}
+
+void *server_listen_thread (void *arg)
+{
+  (void) arg;
+  cmsg_server_listen (bench_server, bench_handle_msg, &server_terminated);
+  return NULL;
+}
+
+int start_server (void)
+{
+  server_opts_t opts;
+  int err = 0;
+
+  memset (&opts, 0, sizeof (opts));
+  opts.compress_threshold = OPT.compress;
+  bench_server = cmsg_server_create (IP_ADDR, OPT.port, &opts, &err);
+  if (NULL == bench_server) {
+    fprintf (stderr, "Unable to create server on port %u: %s\n", 
+      OPT.port, strerror (err));
+    return err;
+  }
+  err = pthread_create (&server_thread, NULL, server_listen_thread, NULL);
+  if (err != 0) {
+    fprintf (stderr, "Unable to create server thread\n");
+    cmsg_server_destroy (bench_server);
+    bench_server = NULL;
+  }
+  return err;
+}
+
+void stop_server (void)
+{
+  if (NULL == bench_server)
+    return;
+  server_terminated = true;
+  pthread_join (server_thread, NULL);
+  cmsg_server_destroy (bench_server);
+  bench_server = NULL;
+}
+
+uint64_t server_msgs_received (void)
+{
+  cmsg_stats_t stats;
+
+  if (cmsg_server_get_stats (bench_server, &stats) != 0)
+    return 0;
+  return stats.msgs_received;
+}
+
+/*------------------------------------------------------------------
+ * Clients
+---------------------------------------------------------------------*/
+
+void *client_receiver_thread (void *arg)
+{
+  bench_client_t *client = (bench_client_t *) arg;
+
+  while (cmsg_client_receive (&client->conn) >= 0) {
+    cmsg_free_msg (client->conn.rcv_msg, client->conn.rcv_msg_size);
+    client->conn.rcv_msg = NULL;
+  }
+  return NULL;
+}
+
+void bench_loop_msg (client_conn_t *conn, int status, char *msg, size_t sz_msg,
+  void *arg)
+{
+  (void) conn;
+  (void) arg;
+  if (status == 0)
+    cmsg_free_msg (msg, sz_msg);
+}
+
+void *client_loop_thread (void *arg)
+{
+  (void) arg;
+  cmsg_client_loop_run (bench_loop, &loop_terminated);
+  return NULL;
+}
+
+int start_client_loop (void)
+{
+  int err = 0;
+
+  bench_loop = cmsg_client_loop_create (&err);
+  if (NULL == bench_loop) {
+    fprintf (stderr, "Unable to create client loop: %s\n", strerror (err));
+    return err;
+  }
+  loop_terminated = false;
+  err = pthread_create (&loop_thread, NULL, client_loop_thread, NULL);
+  if (err != 0) {
+    cmsg_client_loop_destroy (bench_loop);
+    bench_loop = NULL;
+  }
+  return err;
+}
+
+void stop_client_loop (void)
+{
+  if (NULL == bench_loop)
+    return;
+  loop_terminated = true;
+  pthread_join (loop_thread, NULL);
+  cmsg_client_loop_destroy (bench_loop);
+  bench_loop = NULL;
+}
+
+void *client_sender_thread (void *arg)
+{
+  bench_client_t *client = (bench_client_t *) arg;
+  uint64_t start_ns;
+  char *reply;
+  size_t sz_reply;
+  int rtn;
+
+  while (!bench_stop) {
+    start_ns = bench_ns ();
+    if (client->mode == MODE_RPC) {
+      rtn = cmsg_client_call (&client->conn, client->msg, client->sz_msg,
+        CALL_TIMEOUT_MSECS, &reply, &sz_reply);
+      if (rtn == 0)
+        cmsg_free_msg (reply, sz_reply);
+    } else {
+      rtn = cmsg_client_send (&client->conn, client->msg, client->sz_msg,
+        client->mode == MODE_NONBLOCK);
+    }
+    if (rtn == 0) {
+      hist_record (&client->hist, bench_ns () - start_ns, false);
+      client->msgs++;
+    } else if ((rtn == EAGAIN) || (rtn == EWOULDBLOCK)) {
+      client->drops++;
+      sched_yield ();
+    } else {
+      client->errors++;  // the connection is no longer usable
+      break;
+    }
+  }
+  return NULL;
+}
+
+void fill_payload (char *msg, size_t sz_msg)
+{
+  char record[96];
+  size_t i = 0;
+  int j, len, n = 0;
+
+  if (OPT.payload == PAYLOAD_FILL) {
+    memset (msg, 'x', sz_msg);
+    return;
+  }
+  while (i < sz_msg) {
+    if (OPT.payload == PAYLOAD_RANDOM) {
+      msg[i++] = (char) rand ();
+      continue;
+    }
+    len = snprintf (record, sizeof (record), 
+      "{\"id\":%d,\"name\":\"device-%d\",\"state\":\"%s\",\"value\":%d},",
+      n, n % 97, ((n % 3) == 0) ? "online" : "offline", (n * 7919) % 10007);
+    n++;
+    for (j = 0; (j < len) && (i < sz_msg); j++)
+      msg[i++] = record[j];
+  }
+}
+
+int start_client (bench_client_t *client, int mode, size_t sz_msg)
+{
+  static const client_conn_t conn_init = CMSG_CLIENT_CONN_INITIALIZER;
+  const char *addr = (NULL != OPT.addr) ? OPT.addr : IP_ADDR;
+  int rtn;
+
+  memset (client, 0, sizeof (*client));
+  client->conn = conn_init;
+  client->mode = mode;
+  client->sz_msg = sz_msg;
+  hist_init (&client->hist);
+  client->msg = malloc (sz_msg);
+  if (NULL == client->msg)
+    return ENOMEM;
+  fill_payload (client->msg, sz_msg);
+  if ((sz_msg > 65535) || (OPT.compress != 0)) {
+    client_opts_t opts = { .max_msg_size = (sz_msg > 65535) ? sz_msg : 0,
+      .compress_threshold = OPT.compress };
+    rtn = cmsg_connect_client_opts (&client->conn, addr, OPT.port,
+      SEND_TIMEOUT_MSECS, &opts);
+  }
+  else
+    rtn = cmsg_connect_client (&client->conn, addr, OPT.port, SEND_TIMEOUT_MSECS);
+  if (rtn != 0) {
+    fprintf (stderr, "Unable to connect to %s:%u: %s\n", addr, OPT.port,
+      strerror (rtn));
+    free (client->msg);
+    return rtn;
+  }
+  if (NULL != bench_loop)
+    rtn = cmsg_client_loop_add (bench_loop, &client->conn, bench_loop_msg, client);
+  else if (pthread_create (&client->receiver, NULL, client_receiver_thread, client) != 0)
+    rtn = EAGAIN;
+  if (rtn != 0) {
+    cmsg_shutdown_client (&client->conn);
+    free (client->msg);
+  }
+  return rtn;
+}
+
+void stop_client (bench_client_t *client)
+{
+  if (NULL != bench_loop)
+    cmsg_client_loop_remove (bench_loop, &client->conn);
+  cmsg_shutdown_client (&client->conn);
+  if (NULL == bench_loop)
+    pthread_join (client->receiver, NULL);
+  free (client->msg);
+}
+
+/*------------------------------------------------------------------
+ * Runs
+---------------------------------------------------------------------*/
+
+typedef struct bench_result {
+  int mode;
+  unsigned sz_msg;
+  unsigned conns;
+  double secs;
+  uint64_t msgs;
+  uint64_t drops;
+  uint64_t errors;
+  uint64_t wire_bytes;  // sent by the clients
+  cmsg_latency_t lat;
+} bench_result_t;
+
+int bench_run (int mode, unsigned sz_msg, unsigned conn_count, 
+  bench_result_t *result)
+{
+  bench_client_t *clients;
+  cmsg_hist_t *hist;
+  cmsg_stats_t stats;
+  uint64_t start_ns, end_ns, rcv_base = 0, sent = 0;
+  unsigned i, started;
+  int rtn = 0;
+
+  clients = calloc (conn_count, sizeof (bench_client_t));
+  hist = malloc (sizeof (cmsg_hist_t));
+  if ((NULL == clients) || (NULL == hist)) {
+    free (clients);
+    free (hist);
+    return ENOMEM;
+  }
+  for (started = 0; started < conn_count; started++) {
+    rtn = start_client (&clients[started], mode, sz_msg);
+    if (rtn != 0)
+      break;
+  }
+  if (NULL != bench_server)
+    rcv_base = server_msgs_received ();
+  bench_stop = false;
+  start_ns = bench_ns ();
+  for (i = 0; (rtn == 0) && (i < started); i++)
+    rtn = pthread_create (&clients[i].sender, NULL, client_sender_thread, &clients[i]);
+  if (rtn == 0) {
+    struct timespec run_time = { OPT.secs, 0 };
+    nanosleep (&run_time, NULL);
+  }
+  bench_stop = true;
+  while (i > 0)
+    pthread_join (clients[--i].sender, NULL);
+
+  memset (result, 0, sizeof (*result));
+  hist_init (hist);
+  for (i = 0; i < started; i++) {
+    result->msgs += clients[i].msgs;
+    result->drops += clients[i].drops;
+    result->errors += clients[i].errors;
+    hist_merge (hist, &clients[i].hist);
+  }
+  // One-way sends count once the server has read them
+  sent = result->msgs;
+  if ((NULL != bench_server) && (mode != MODE_RPC)) {
+    while ((server_msgs_received () - rcv_base < sent) &&
+        (bench_ns () - start_ns < (OPT.secs * 1000ULL + DRAIN_WAIT_MSECS) * 1000000ULL))
+      sched_yield ();
+    result->msgs = server_msgs_received () - rcv_base;
+  }
+  end_ns = bench_ns ();
+
+  for (i = 0; i < started; i++) {
+    if (cmsg_client_get_stats (&clients[i].conn, &stats) == 0)
+      result->wire_bytes += stats.bytes_sent;
+    stop_client (&clients[i]);
+  }
+  result->mode = mode;
+  result->sz_msg = sz_msg;
+  result->conns = conn_count;
+  result->secs = (double) (end_ns - start_ns) / 1e9;
+  hist_summary (hist, &result->lat);
+  free (hist);
+  free (clients);
+  return rtn;
+}
+
+void print_result (const bench_result_t *r, bool first)
+{
+  double msgs_per_sec = (double) r->msgs / r->secs;
+  double mb_per_sec = msgs_per_sec * r->sz_msg / (1024.0 * 1024.0);
+  double wire_per_msg = (r->msgs != 0) ? (double) r->wire_bytes / r->msgs : 0;
+
+  if (OPT.json) {
+    printf ("%s\n  {\"mode\": \"%s\", \"size\": %u, \"conns\": %u, \"secs\": %.3f, "
+      "\"msgs\": %llu, \"msgs_per_sec\": %.0f, \"mb_per_sec\": %.2f, "
+      "\"drops\": %llu, \"errors\": %llu, \"p50_us\": %.1f, \"p90_us\": %.1f, "
+      "\"p99_us\": %.1f, \"p999_us\": %.1f, \"max_us\": %.1f, "
+      "\"wire_bytes_per_msg\": %.0f}",
+      first ? "[" : ",", mode_names[r->mode], r->sz_msg, r->conns, r->secs,
+      (unsigned long long) r->msgs, msgs_per_sec, mb_per_sec,
+      (unsigned long long) r->drops, (unsigned long long) r->errors,
+      r->lat.p50_ns / 1e3, r->lat.p90_ns / 1e3, r->lat.p99_ns / 1e3,
+      r->lat.p999_ns / 1e3, r->lat.max_ns / 1e3, wire_per_msg);
+  } else {
+    if (first)
+      printf ("mode,size,conns,secs,msgs,msgs_per_sec,mb_per_sec,drops,errors,"
+        "p50_us,p90_us,p99_us,p999_us,max_us,wire_bytes_per_msg\n");
+    printf ("%s,%u,%u,%.3f,%llu,%.0f,%.2f,%llu,%llu,%.1f,%.1f,%.1f,%.1f,%.1f,%.0f\n",
+      mode_names[r->mode], r->sz_msg, r->conns, r->secs,
+      (unsigned long long) r->msgs, msgs_per_sec, mb_per_sec,
+      (unsigned long long) r->drops, (unsigned long long) r->errors,
+      r->lat.p50_ns / 1e3, r->lat.p90_ns / 1e3, r->lat.p99_ns / 1e3,
+      r->lat.p999_ns / 1e3, r->lat.max_ns / 1e3, wire_per_msg);
+  }
+  fflush (stdout);
+}
+
+/*------------------------------------------------------------------
+ * Arguments
+---------------------------------------------------------------------*/
+
+unsigned int parse_num_arg (const char *arg, const char *arg_name)
+{
+  unsigned int result = 0;
+  int i;
+  char c;
+
+  if (arg[0] == '\0') {
+    fprintf (stderr, "Empty %s argument\n", arg_name);
+    return (unsigned int) -1;
+  }
+  for (i=0; '\0' != (c=arg[i]); i++) {
+    if ((c<'0') || (c>'9')) {
+      fprintf (stderr, "Non-numeric %s argument\n", arg_name);
+      return (unsigned int) -1;
+    }
+    result = (result*10) + c - '0';
+  }
+  return result;
+}
+
+// parses a comma separated list. Returns the count, or 0 if invalid.
+unsigned parse_list_arg (const char *arg, const char *arg_name, 
+  unsigned *list, bool modes)
+{
+  char item[32];
+  unsigned count = 0;
+  unsigned m;
+  size_t len;
+
+  while (*arg != '\0') {
+    len = strcspn (arg, ",");
+    if ((len == 0) || (len >= sizeof (item)) || (count == MAX_LIST)) {
+      fprintf (stderr, "Invalid %s list\n", arg_name);
+      return 0;
+    }
+    memcpy (item, arg, len);
+    item[len] = '\0';
+    if (modes) {
+      for (m = 0; m <= MODE_RPC; m++)
+        if (strcmp (item, mode_names[m]) == 0)
+          break;
+      if (m > MODE_RPC) {
+        fprintf (stderr, "Unknown mode %s\n", item);
+        return 0;
+      }
+      list[count++] = m;
+    } else {
+      list[count] = parse_num_arg (item, arg_name);
+      if ((list[count] == (unsigned) -1) || (list[count] == 0))
+        return 0;
+      count++;
+    }
+    arg += len;
+    if (*arg == ',')
+      arg++;
+  }
+  return count;
+}
+
+int get_args (const int argc, const char **argv)
+{
+  int i;
+  int mode = 0;
+
+  for (i=1; i<argc; i++) {
+    const char *arg = argv[i];
+    if ((mode == 0) && (strlen (arg) == 1) && (strchr ("pasmcdzt", arg[0]) != NULL)) {
+      mode = arg[0];
+      continue;
+    }
+    if ((mode == 0) && (strcmp (arg, "j") == 0)) {
+      OPT.json = true;
+      continue;
+    }
+    if ((mode == 0) && (strcmp (arg, "l") == 0)) {
+      OPT.loop = true;
+      continue;
+    }
+    if (mode == 'p') {
+      OPT.port = parse_num_arg (arg, "port");
+      if (OPT.port == (unsigned) -1)
+        return -1;
+    } else if (mode == 'a') {
+      OPT.addr = arg;
+    } else if (mode == 's') {
+      OPT.size_count = parse_list_arg (arg, "size", OPT.sizes, false);
+      if (OPT.size_count == 0)
+        return -1;
+    } else if (mode == 'c') {
+      OPT.conn_count = parse_list_arg (arg, "connection count", OPT.conns, false);
+      if (OPT.conn_count == 0)
+        return -1;
+    } else if (mode == 'm') {
+      OPT.mode_count = parse_list_arg (arg, "mode", OPT.modes, true);
+      if (OPT.mode_count == 0)
+        return -1;
+    } else if (mode == 'z') {
+      OPT.compress = parse_num_arg (arg, "compress threshold");
+      if (OPT.compress == (unsigned) -1)
+        return -1;
+    } else if (mode == 't') {
+      for (OPT.payload = PAYLOAD_RANDOM; OPT.payload >= 0; OPT.payload--)
+        if (strcmp (arg, payload_names[OPT.payload]) == 0)
+          break;
+      if (OPT.payload < 0) {
+        fprintf (stderr, "Unknown payload %s\n", arg);
+        return -1;
+      }
+    } else if (mode == 'd') {
+      OPT.secs = parse_num_arg (arg, "seconds");
+      if ((OPT.secs == (unsigned) -1) || (OPT.secs == 0))
+        return -1;
+    } else {
+      fprintf (stderr, "Invalid argument %s\n", arg);
+      return -1;
+    }
+    mode = 0;
+  }
+  if (mode != 0) {
+    fprintf (stderr, "Missing value for %c\n", mode);
+    return -1;
+  }
+  return 0;
+}
+
+int main (int argc, const char **argv)
+{
+  bench_result_t result;
+  unsigned m, s, c;
+  bool first = true;
+  int rtn = 0;
+
+  if (get_args (argc, argv) != 0) {
+    fprintf (stderr, "Usage: %s [p port] [a server_addr] [s sizes] [c conns] "
+      "[m send,nonblock,rpc] [d secs] [z compress_threshold] [t fill,json,random] "
+      "[j] [l]\n", argv[0]);
+    return 4;
+  }
+  cmsg_log_set_level (LEVEL_ERROR);
+  cmsg_log_set_sink (bench_log_sink, NULL);
+  if ((NULL == OPT.addr) && (start_server () != 0))
+    return 4;
+  if (OPT.loop && (start_client_loop () != 0)) {
+    stop_server ();
+    return 4;
+  }
+
+  for (m = 0; (rtn == 0) && (m < OPT.mode_count); m++)
+    for (s = 0; (rtn == 0) && (s < OPT.size_count); s++)
+      for (c = 0; (rtn == 0) && (c < OPT.conn_count); c++) {
+        rtn = bench_run (OPT.modes[m], OPT.sizes[s], OPT.conns[c], &result);
+        if (rtn == 0) {
+          print_result (&result, first);
+          first = false;
+        }
+      }
+  if (OPT.json && !first)
+    printf ("\n]\n");
+  stop_client_loop ();
+  stop_server ();
+  return (rtn == 0) ? 0 : 1;
+}
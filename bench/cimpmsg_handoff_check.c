@@ -0,0 +1,257 @@
+/**
+ * Copyright 2016 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "cimpmsg.h"
+#include "cimpmsg_log.h"
+
+/*------------------------------------------------------------------
+ * Live upgrade check, run by ctest. An old server with
+ * cmsg_server_handoff_listen serves a large message client and a raw
+ * socket peer. Then:
+ *
+ *  failed_ack   a peer connects to the handoff socket and goes away
+ *               without acking. The old server must keep serving, and
+ *               listen for a handoff again.
+ *  handoff      a new server takes over with cmsg_server_create_handoff
+ *               while the raw peer has sent half a frame header.
+ *  partial_hdr  the rest of that frame reaches the new server intact.
+ *  max_msg      the max_msg_size negotiated with the old server holds
+ *               on the new one, both ways.
+ *
+ * Both servers run in this process, which passes the same fds as two
+ * processes would. Prints one line per check and exits non-zero if
+ * any fails.
+---------------------------------------------------------------------*/
+
+#define HC_PORT		6673
+#define HC_MAX_MSG	(1 << 20)
+#define HC_BIG_MSG	200000
+
+static cmsg_server_t *servers[2];
+static bool terminated[2];
+static int listen_rtn[2] = { -1, -1 };
+static unsigned msgs[2];
+static size_t last_size[2];
+static char last_msg[2][16];
+static int big_reply_rtn = -1;
+static int failures = 0;
+
+void check (const char *name, bool ok, const char *detail)
+{
+  printf ("%s,%s,%s\n", name, ok ? "ok" : "FAIL", detail);
+  fflush (stdout);
+  if (!ok)
+    failures++;
+}
+
+// waits for *count to pass base, up to 5 secs
+bool wait_count (unsigned *count, unsigned base)
+{
+  unsigned i;
+
+  for (i = 0; i < 5000; i++) {
+    if (__atomic_load_n (count, __ATOMIC_ACQUIRE) > base)
+      return true;
+    usleep (1000);
+  }
+  return false;
+}
+
+void handle_msg (int action_code, server_rcv_msg_data_t *msg_data)
+{
+  int which = (msg_data->server == servers[1]) ? 1 : 0;
+  size_t size = msg_data->rcv_msg_size;
+
+  if (action_code != CMSG_ACTION_MSG_RECEIVED)
+    return;
+  // a large message is echoed, which the server may only send if it
+  // knows the client's limit
+  if (size == HC_BIG_MSG)
+    big_reply_rtn = cmsg_server_send_msg (msg_data->server, msg_data->conn,
+      msg_data->rcv_msg, size, false);
+  snprintf (last_msg[which], sizeof (last_msg[which]), "%.*s",
+    (int) ((size < 8) ? size : 8), msg_data->rcv_msg);
+  last_size[which] = size;
+  cmsg_free_msg (msg_data->rcv_msg, size);
+  __atomic_add_fetch (&msgs[which], 1, __ATOMIC_RELEASE);
+}
+
+void *listen_thread (void *arg)
+{
+  long which = (long) arg;
+
+  listen_rtn[which] = cmsg_server_listen (servers[which], handle_msg,
+    &terminated[which]);
+  return NULL;
+}
+
+int raw_connect (void)
+{
+  struct sockaddr_in addr;
+  int sock = socket (AF_INET, SOCK_STREAM, 0);
+
+  memset (&addr, 0, sizeof (addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons (HC_PORT);
+  addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+  if (connect (sock, (struct sockaddr *) &addr, sizeof (addr)) != 0) {
+    close (sock);
+    return -1;
+  }
+  return sock;
+}
+
+// connects to the handoff socket, reads what the old server sends,
+// and closes without acking
+bool fake_new_process (const char *path)
+{
+  struct sockaddr_un addr;
+  char buf[4096];
+  int sock = socket (AF_UNIX, SOCK_STREAM, 0);
+  unsigned i;
+
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  strncpy (addr.sun_path, path, sizeof (addr.sun_path) - 1);
+  if (connect (sock, (struct sockaddr *) &addr, sizeof (addr)) != 0) {
+    close (sock);
+    return false;
+  }
+  for (i = 0; (i < 100) && (recv (sock, buf, sizeof (buf), MSG_DONTWAIT) != 0); i++)
+    usleep (2000);
+  close (sock);
+  return true;
+}
+
+// the old server listens for a handoff again soon after a failed one
+cmsg_server_t *take_over (const char *path, server_opts_t *opts, int *err)
+{
+  cmsg_server_t *server = NULL;
+  unsigned i;
+
+  for (i = 0; (NULL == server) && (i < 200); i++) {
+    server = cmsg_server_create_handoff (path, opts, err);
+    if ((NULL == server) && (*err != ENOENT) && (*err != ECONNREFUSED))
+      break;
+    if (NULL == server)
+      usleep (10000);
+  }
+  return server;
+}
+
+int main (void)
+{
+  static const client_conn_t conn_init = CMSG_CLIENT_CONN_INITIALIZER;
+  char path[64], detail[128];
+  unsigned char header[4] = { 0xEE, 0xEE, 0, 5 };
+  pthread_t threads[2];
+  server_opts_t opts;
+  client_opts_t copts;
+  client_conn_t client = conn_init;
+  char *big;
+  unsigned base;
+  int err, sock, rtn;
+
+  signal (SIGPIPE, SIG_IGN);
+  cmsg_log_set_level (LEVEL_ERROR);
+  snprintf (path, sizeof (path), "/tmp/cimpmsg_handoff_check.%d", (int) getpid ());
+  memset (&opts, 0, sizeof (opts));
+  opts.max_msg_size = HC_MAX_MSG;
+  servers[0] = cmsg_server_create ("127.0.0.1", HC_PORT, &opts, &err);
+  if ((NULL == servers[0]) || (cmsg_server_handoff_listen (servers[0], path) != 0)) {
+    fprintf (stderr, "Unable to create server: %s\n", strerror (err));
+    return 1;
+  }
+  pthread_create (&threads[0], NULL, listen_thread, (void *) 0);
+
+  memset (&copts, 0, sizeof (copts));
+  copts.max_msg_size = HC_MAX_MSG;
+  rtn = cmsg_connect_client_opts (&client, "127.0.0.1", HC_PORT, 2000, &copts);
+  sock = raw_connect ();
+  if ((rtn != 0) || (sock < 0)) {
+    fprintf (stderr, "Unable to connect\n");
+    return 1;
+  }
+
+  // failed_ack
+  rtn = fake_new_process (path);
+  base = msgs[0];
+  cmsg_client_send (&client, "still", 5, false);
+  rtn = rtn && wait_count (&msgs[0], base);
+  check ("failed_ack", rtn && (listen_rtn[0] == -1),
+    "old server still serving after a handoff without an ack");
+
+  // handoff, with half a header received from the raw peer
+  if (send (sock, header, 2, 0) != 2)
+    return 1;
+  usleep (100000);
+  servers[1] = take_over (path, &opts, &err);
+  snprintf (detail, sizeof (detail), "err %d", (NULL == servers[1]) ? err : 0);
+  check ("handoff", NULL != servers[1], detail);
+  if (NULL == servers[1])
+    return 1;
+  pthread_join (threads[0], NULL);
+  cmsg_server_destroy (servers[0]);
+  pthread_create (&threads[1], NULL, listen_thread, (void *) 1);
+
+  // partial_hdr
+  base = msgs[1];
+  if ((send (sock, header + 2, 2, 0) != 2) || (send (sock, "hello", 5, 0) != 5))
+    return 1;
+  rtn = wait_count (&msgs[1], base);
+  snprintf (detail, sizeof (detail), "got %s size %lu", last_msg[1],
+    (unsigned long) last_size[1]);
+  check ("partial_hdr", rtn && (strcmp (last_msg[1], "hello") == 0), detail);
+
+  // max_msg, client to server and back
+  big = (char *) calloc (1, HC_BIG_MSG);
+  if (NULL == big)
+    return 1;
+  memcpy (big, "bigmsg", 6);
+  base = msgs[1];
+  rtn = cmsg_client_send (&client, big, HC_BIG_MSG, false);
+  rtn = (rtn == 0) && wait_count (&msgs[1], base);
+  if (rtn && (big_reply_rtn == 0))
+    rtn = (cmsg_client_receive (&client) == HC_BIG_MSG);
+  if (rtn && (big_reply_rtn == 0))
+    cmsg_free_msg (client.rcv_msg, client.rcv_msg_size);
+  snprintf (detail, sizeof (detail), "server got size %lu, reply send %d",
+    (unsigned long) last_size[1], big_reply_rtn);
+  check ("max_msg", rtn && (last_size[1] == HC_BIG_MSG) && (big_reply_rtn == 0),
+    detail);
+
+  free (big);
+  cmsg_shutdown_client (&client);
+  close (sock);
+  terminated[1] = true;
+  pthread_join (threads[1], NULL);
+  cmsg_server_destroy (servers[1]);
+  cmsg_log_flush ();
+  return (failures == 0) ? 0 : 1;
+}
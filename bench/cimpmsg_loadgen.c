@@ -0,0 +1,830 @@
+/**
+ * Copyright 2016 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "cimpmsg.h"
+#include "cimpmsg_hist.h"
+#include "cimpmsg_log.h"
+
+/*------------------------------------------------------------------
+ * Load generator.
+ * Drives thousands of client connections from a few epoll threads,
+ * sending requests and matching the replies by correlation id to
+ * measure the round trip. The client side of the protocol is done
+ * here directly on non-blocking sockets, with its own send buffers,
+ * so the generator adds as little as possible to what it measures.
+ *
+ * Closed loop (default): each connection keeps 'w' requests
+ * outstanding. Open loop ('r RATE'): requests go out at RATE per
+ * second in total whether or not replies keep up, and latency is
+ * measured from the scheduled send time, so a slow server isn't
+ * hidden by the generator slowing down with it.
+ *
+ * Example: cimpmsg_loadgen p 6666 c 10000 t 4 r 50000 s 64:90,4096:10 x 100
+---------------------------------------------------------------------*/
+
+#define IP_ADDR "127.0.0.1"
+#define DEFAULT_PORT 6666
+#define MSG_HEADER_MARK 0xEE
+#define MSG_HEADER_MARK_EXT 0xE1
+#define MSG_HEADER_SIZE 4
+#define MSG_EXT_HEADER_SIZE 12
+#define MAX_MSG_SIZE 65535
+#define PENDING_SLOTS 64  // power of 2, max outstanding per connection
+#define MAX_THREADS 64
+#define MAX_SIZES 16
+#define MAX_EVENTS 256
+#define RCV_BUF_SIZE (MAX_MSG_SIZE + MSG_EXT_HEADER_SIZE)
+
+#define CONN_IDLE	0
+#define CONN_CONNECTING	1
+#define CONN_OPEN	2
+
+struct options {
+  const char *addr;
+  unsigned int port;
+  unsigned int conn_count;
+  unsigned int thread_count;
+  unsigned int window;      // closed loop requests outstanding
+  unsigned int rate;        // open loop requests/sec, 0 = closed loop
+  unsigned int churn;       // reconnects/sec
+  unsigned int ramp;        // new connections/sec
+  unsigned int secs;
+  bool local_server;
+  unsigned sizes[MAX_SIZES];
+  unsigned weights[MAX_SIZES];
+  unsigned size_count;
+  unsigned size_min, size_max;  // uniform if size_count is 0
+} OPT = {
+  .addr = IP_ADDR, .port = DEFAULT_PORT, .conn_count = 1000,
+  .thread_count = 4, .window = 1, .rate = 0, .churn = 0, .ramp = 5000,
+  .secs = 10, .local_server = false,
+  .sizes = { 100 }, .weights = { 1 }, .size_count = 1
+};
+
+typedef struct lg_pending {
+  uint32_t corr_id;  // 0 = free
+  uint64_t start_ns;
+} lg_pending_t;
+
+typedef struct lg_conn {
+  int sock;
+  int state;
+  uint32_t next_corr_id;
+  unsigned outstanding;
+  char *rcv_buf;
+  size_t rcv_len;
+  char *out_buf;  // bytes not yet written
+  size_t out_len;
+  size_t out_cap;
+  bool want_out;
+  lg_pending_t pending[PENDING_SLOTS];
+} lg_conn_t;
+
+// counters are written by the owning thread, read by main
+typedef struct lg_thread {
+  pthread_t tid;
+  int epoll_fd;
+  unsigned first, count;  // conns[first] .. conns[first+count-1]
+  lg_conn_t *conns;
+  unsigned rand_seed;
+  unsigned next_open;     // index of the next connection to ramp up
+  unsigned next_send;     // round robin position for open loop
+  uint64_t sent;
+  uint64_t replies;
+  uint64_t bytes_sent;
+  uint64_t connects;
+  uint64_t disconnects;
+  uint64_t conn_errors;
+  uint64_t skipped;       // open loop sends with no free slot or connection
+  uint64_t open_conns;
+  cmsg_hist_t hist;
+} lg_thread_t;
+
+static struct sockaddr_in server_addr;
+static lg_thread_t *threads = NULL;
+static char *msg_filler = NULL;
+static volatile bool lg_stop = false;
+static bool server_terminated = false;
+static cmsg_server_t *local_server = NULL;
+static pthread_t local_server_thread;
+
+uint64_t lg_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ((uint64_t) ts.tv_sec * 1000000000ULL) + (uint64_t) ts.tv_nsec;
+}
+
+void counter_inc (uint64_t *counter, uint64_t n)
+{
+  __atomic_store_n (counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+uint64_t counter_read (const uint64_t *counter)
+{
+  return __atomic_load_n (counter, __ATOMIC_RELAXED);
+}
+
+void lg_log_sink (int level, uint64_t time_ns, const char *line,
+  size_t len, void *arg)
+{
+  (void) level;
+  (void) time_ns;
+  (void) arg;
+  fwrite (line, 1, len, stderr);
+}
+
+unsigned pick_size (lg_thread_t *thr)
+{
+  unsigned total = 0, r, i;
+
+  if (OPT.size_count == 0)
+    return OPT.size_min + (rand_r (&thr->rand_seed) % (OPT.size_max - OPT.size_min + 1));
+  for (i = 0; i < OPT.size_count; i++)
+    total += OPT.weights[i];
+  r = rand_r (&thr->rand_seed) % total;
+  for (i = 0; r >= OPT.weights[i]; i++)
+    r -= OPT.weights[i];
+  return OPT.sizes[i];
+}
+
+/*------------------------------------------------------------------
+ * In process echo server, 'l' option
+---------------------------------------------------------------------*/
+
+void local_handle_msg (int action_code, server_rcv_msg_data_t *msg_data)
+{
+  if (action_code != CMSG_ACTION_MSG_RECEIVED)
+    return;
+  if (msg_data->msg_kind == CMSG_KIND_REQUEST)
+    cmsg_server_reply (msg_data->server, msg_data->conn, msg_data->corr_id,
+      msg_data->rcv_msg, msg_data->rcv_msg_size, false);
+  cmsg_free_msg (msg_data->rcv_msg, msg_data->rcv_msg_size);
+}
+
+void *local_server_listen (void *arg)
+{
+  (void) arg;
+  cmsg_server_listen (local_server, local_handle_msg, &server_terminated);
+  return NULL;
+}
+
+int start_local_server (void)
+{
+  server_opts_t opts;
+  int err = 0;
+
+  memset (&opts, 0, sizeof (opts));
+  local_server = cmsg_server_create (OPT.addr, OPT.port, &opts, &err);
+  if (NULL == local_server) {
+    fprintf (stderr, "Unable to create server: %s\n", strerror (err));
+    return err;
+  }
+  return pthread_create (&local_server_thread, NULL, local_server_listen, NULL);
+}
+
+/*------------------------------------------------------------------
+ * Connections
+---------------------------------------------------------------------*/
+
+int conn_update_events (lg_thread_t *thr, lg_conn_t *conn, bool want_out)
+{
+  struct epoll_event ev;
+
+  if (want_out == conn->want_out)
+    return 0;
+  ev.events = EPOLLIN | (want_out ? EPOLLOUT : 0);
+  ev.data.ptr = conn;
+  conn->want_out = want_out;
+  if (epoll_ctl (thr->epoll_fd, EPOLL_CTL_MOD, conn->sock, &ev) != 0)
+    return errno;
+  return 0;
+}
+
+int conn_open (lg_thread_t *thr, lg_conn_t *conn)
+{
+  struct epoll_event ev;
+  int one = 1;
+
+  conn->sock = socket (AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (conn->sock < 0) {
+    counter_inc (&thr->conn_errors, 1);
+    return errno;
+  }
+  setsockopt (conn->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+  if ((connect (conn->sock, (struct sockaddr *) &server_addr, sizeof (server_addr)) != 0)
+      && (errno != EINPROGRESS)) {
+    counter_inc (&thr->conn_errors, 1);
+    close (conn->sock);
+    conn->sock = -1;
+    return errno;
+  }
+  conn->state = CONN_CONNECTING;
+  conn->next_corr_id = 1;
+  conn->outstanding = 0;
+  conn->rcv_len = 0;
+  conn->out_len = 0;
+  conn->want_out = true;
+  memset (conn->pending, 0, sizeof (conn->pending));
+  ev.events = EPOLLIN | EPOLLOUT;
+  ev.data.ptr = conn;
+  epoll_ctl (thr->epoll_fd, EPOLL_CTL_ADD, conn->sock, &ev);
+  return 0;
+}
+
+void conn_close (lg_thread_t *thr, lg_conn_t *conn, bool error)
+{
+  if (conn->state == CONN_IDLE)
+    return;
+  if (conn->state == CONN_OPEN) {
+    counter_inc (&thr->open_conns, (uint64_t) -1);
+    counter_inc (&thr->disconnects, 1);
+  }
+  if (error)
+    counter_inc (&thr->conn_errors, 1);
+  epoll_ctl (thr->epoll_fd, EPOLL_CTL_DEL, conn->sock, NULL);
+  close (conn->sock);
+  conn->sock = -1;
+  conn->state = CONN_IDLE;
+}
+
+int conn_flush (lg_thread_t *thr, lg_conn_t *conn)
+{
+  ssize_t bytes;
+  size_t pos = 0;
+
+  while (pos < conn->out_len) {
+    bytes = send (conn->sock, conn->out_buf + pos, conn->out_len - pos,
+      MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (bytes < 0) {
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+        break;
+      return errno;
+    }
+    pos += (size_t) bytes;
+  }
+  if (pos > 0) {
+    memmove (conn->out_buf, conn->out_buf + pos, conn->out_len - pos);
+    conn->out_len -= pos;
+  }
+  return conn_update_events (thr, conn, conn->out_len != 0);
+}
+
+// queues a request and tries to write it. start_ns is when it was due.
+int conn_send_request (lg_thread_t *thr, lg_conn_t *conn, uint64_t start_ns)
+{
+  unsigned char *hdr;
+  lg_pending_t *slot;
+  unsigned sz_msg = pick_size (thr);
+  size_t need = conn->out_len + MSG_EXT_HEADER_SIZE + sz_msg;
+  uint32_t corr_id = conn->next_corr_id;
+  char *buf;
+
+  slot = &conn->pending[corr_id & (PENDING_SLOTS - 1)];
+  if (slot->corr_id != 0)
+    return EBUSY;  // window full
+  if (need > conn->out_cap) {
+    buf = realloc (conn->out_buf, need * 2);
+    if (NULL == buf)
+      return ENOMEM;
+    conn->out_buf = buf;
+    conn->out_cap = need * 2;
+  }
+  if (++conn->next_corr_id == 0)
+    conn->next_corr_id = 1;
+  hdr = (unsigned char *) conn->out_buf + conn->out_len;
+  hdr[0] = MSG_HEADER_MARK;
+  hdr[1] = MSG_HEADER_MARK_EXT;
+  hdr[2] = CMSG_KIND_REQUEST;
+  hdr[3] = 0;
+  hdr[4] = (unsigned char) (sz_msg >> 24);
+  hdr[5] = (unsigned char) (sz_msg >> 16);
+  hdr[6] = (unsigned char) (sz_msg >> 8);
+  hdr[7] = (unsigned char) sz_msg;
+  hdr[8] = (unsigned char) (corr_id >> 24);
+  hdr[9] = (unsigned char) (corr_id >> 16);
+  hdr[10] = (unsigned char) (corr_id >> 8);
+  hdr[11] = (unsigned char) corr_id;
+  memcpy (hdr + MSG_EXT_HEADER_SIZE, msg_filler, sz_msg);
+  conn->out_len = need;
+  slot->corr_id = corr_id;
+  slot->start_ns = start_ns;
+  conn->outstanding++;
+  counter_inc (&thr->sent, 1);
+  counter_inc (&thr->bytes_sent, MSG_EXT_HEADER_SIZE + sz_msg);
+  return conn_flush (thr, conn);
+}
+
+void conn_fill_window (lg_thread_t *thr, lg_conn_t *conn)
+{
+  uint64_t now_ns = lg_ns ();
+
+  while ((conn->state == CONN_OPEN) && (conn->outstanding < OPT.window))
+    if (conn_send_request (thr, conn, now_ns) != 0) {
+      if (conn->outstanding == 0)
+        conn_close (thr, conn, true);
+      break;
+    }
+}
+
+void conn_reply (lg_thread_t *thr, lg_conn_t *conn, uint32_t corr_id)
+{
+  lg_pending_t *slot = &conn->pending[corr_id & (PENDING_SLOTS - 1)];
+
+  if (slot->corr_id != corr_id)
+    return;  // not ours, or from before a reconnect
+  hist_record (&thr->hist, lg_ns () - slot->start_ns, false);
+  slot->corr_id = 0;
+  conn->outstanding--;
+  counter_inc (&thr->replies, 1);
+}
+
+// parses the frames in the receive buffer. Returns false on a bad frame.
+bool conn_parse (lg_thread_t *thr, lg_conn_t *conn)
+{
+  const unsigned char *p;
+  size_t pos = 0, hdr_size, sz_msg;
+
+  while (conn->rcv_len - pos >= MSG_HEADER_SIZE) {
+    p = (const unsigned char *) conn->rcv_buf + pos;
+    if (p[0] != MSG_HEADER_MARK)
+      return false;
+    if (p[1] == MSG_HEADER_MARK) {
+      hdr_size = MSG_HEADER_SIZE;
+      sz_msg = ((size_t) p[2] << 8) | p[3];
+    } else if (p[1] == MSG_HEADER_MARK_EXT) {
+      if (conn->rcv_len - pos < MSG_EXT_HEADER_SIZE)
+        break;
+      hdr_size = MSG_EXT_HEADER_SIZE;
+      sz_msg = ((size_t) p[4] << 24) | ((size_t) p[5] << 16) |
+        ((size_t) p[6] << 8) | p[7];
+      if (sz_msg > MAX_MSG_SIZE)
+        return false;
+    } else
+      return false;
+    if (conn->rcv_len - pos < hdr_size + sz_msg)
+      break;
+    if ((hdr_size == MSG_EXT_HEADER_SIZE) && (p[2] == CMSG_KIND_REPLY))
+      conn_reply (thr, conn, ((uint32_t) p[8] << 24) | ((uint32_t) p[9] << 16) |
+        ((uint32_t) p[10] << 8) | p[11]);
+    pos += hdr_size + sz_msg;
+  }
+  if (pos > 0) {
+    memmove (conn->rcv_buf, conn->rcv_buf + pos, conn->rcv_len - pos);
+    conn->rcv_len -= pos;
+  }
+  return true;
+}
+
+void conn_readable (lg_thread_t *thr, lg_conn_t *conn)
+{
+  ssize_t bytes;
+
+  while (true) {
+    bytes = recv (conn->sock, conn->rcv_buf + conn->rcv_len,
+      RCV_BUF_SIZE - conn->rcv_len, MSG_DONTWAIT);
+    if (bytes == 0) {
+      conn_close (thr, conn, false);
+      return;
+    }
+    if (bytes < 0) {
+      if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+        conn_close (thr, conn, true);
+      return;
+    }
+    conn->rcv_len += (size_t) bytes;
+    if (!conn_parse (thr, conn)) {
+      conn_close (thr, conn, true);
+      return;
+    }
+  }
+}
+
+void conn_event (lg_thread_t *thr, lg_conn_t *conn, uint32_t events)
+{
+  int err = 0;
+  socklen_t len = sizeof (err);
+
+  if (conn->state == CONN_CONNECTING) {
+    if (getsockopt (conn->sock, SOL_SOCKET, SO_ERROR, &err, &len) != 0)
+      err = errno;
+    if (err != 0) {
+      conn_close (thr, conn, true);
+      return;
+    }
+    conn->state = CONN_OPEN;
+    counter_inc (&thr->open_conns, 1);
+    counter_inc (&thr->connects, 1);
+    conn_update_events (thr, conn, false);
+    if (OPT.rate == 0)
+      conn_fill_window (thr, conn);
+    return;
+  }
+  if (events & (EPOLLERR | EPOLLHUP)) {
+    conn_close (thr, conn, true);
+    return;
+  }
+  if ((events & EPOLLOUT) && (conn_flush (thr, conn) != 0)) {
+    conn_close (thr, conn, true);
+    return;
+  }
+  if (events & EPOLLIN)
+    conn_readable (thr, conn);
+  if ((OPT.rate == 0) && (conn->state == CONN_OPEN))
+    conn_fill_window (thr, conn);
+}
+
+/*------------------------------------------------------------------
+ * Threads
+---------------------------------------------------------------------*/
+
+// open loop: sends the requests that are due, round robin
+void send_due (lg_thread_t *thr, uint64_t *next_ns, uint64_t interval_ns)
+{
+  uint64_t now_ns = lg_ns ();
+  lg_conn_t *conn;
+  unsigned tries;
+
+  while (*next_ns <= now_ns) {
+    for (tries = 0; tries < thr->count; tries++) {
+      conn = &thr->conns[thr->next_send];
+      if (++thr->next_send == thr->count)
+        thr->next_send = 0;
+      if (conn->state == CONN_OPEN)
+        break;
+    }
+    if ((tries == thr->count) || (conn_send_request (thr, conn, *next_ns) != 0))
+      counter_inc (&thr->skipped, 1);
+    *next_ns += interval_ns;
+  }
+}
+
+void *lg_thread (void *arg)
+{
+  lg_thread_t *thr = (lg_thread_t *) arg;
+  struct epoll_event events[MAX_EVENTS];
+  uint64_t start_ns = lg_ns ();
+  uint64_t now_ns, next_send_ns = start_ns, next_churn_ns = start_ns;
+  uint64_t send_interval_ns = 0, churn_interval_ns = 0;
+  unsigned i, per_thread;
+  int n, timeout;
+  lg_conn_t *conn;
+
+  if (OPT.rate != 0)
+    send_interval_ns = 1000000000ULL * OPT.thread_count / OPT.rate;
+  if (OPT.churn != 0)
+    churn_interval_ns = 1000000000ULL * OPT.thread_count / OPT.churn;
+  per_thread = (OPT.ramp + OPT.thread_count - 1) / OPT.thread_count;
+  while (!lg_stop) {
+    now_ns = lg_ns ();
+    // ramp up, then reopen whatever dropped
+    while ((thr->next_open < thr->count) &&
+        ((uint64_t) thr->next_open * 1000000000ULL / per_thread <= now_ns - start_ns))
+      conn_open (thr, &thr->conns[thr->next_open++]);
+    if (churn_interval_ns != 0)
+      while (next_churn_ns <= now_ns) {
+        conn = &thr->conns[rand_r (&thr->rand_seed) % thr->count];
+        conn_close (thr, conn, false);
+        next_churn_ns += churn_interval_ns;
+      }
+    if (thr->next_open == thr->count)
+      for (i = 0; i < thr->count; i++)
+        if (thr->conns[i].state == CONN_IDLE)
+          conn_open (thr, &thr->conns[i]);
+    if (send_interval_ns != 0)
+      send_due (thr, &next_send_ns, send_interval_ns);
+    timeout = 10;
+    if ((send_interval_ns != 0) && (next_send_ns > now_ns) && 
+        (next_send_ns - now_ns < 10000000ULL))
+      timeout = (int) ((next_send_ns - now_ns) / 1000000ULL);
+    n = epoll_wait (thr->epoll_fd, events, MAX_EVENTS, timeout);
+    for (i = 0; (int) i < n; i++)
+      conn_event (thr, (lg_conn_t *) events[i].data.ptr, events[i].events);
+  }
+  for (i = 0; i < thr->count; i++)
+    conn_close (thr, &thr->conns[i], false);
+  return NULL;
+}
+
+/*------------------------------------------------------------------
+ * Reports
+---------------------------------------------------------------------*/
+
+typedef struct lg_totals {
+  uint64_t sent, replies, bytes_sent, connects, disconnects, conn_errors;
+  uint64_t skipped, open_conns;
+} lg_totals_t;
+
+void get_totals (lg_totals_t *t)
+{
+  unsigned i;
+
+  memset (t, 0, sizeof (*t));
+  for (i = 0; i < OPT.thread_count; i++) {
+    t->sent += counter_read (&threads[i].sent);
+    t->replies += counter_read (&threads[i].replies);
+    t->bytes_sent += counter_read (&threads[i].bytes_sent);
+    t->connects += counter_read (&threads[i].connects);
+    t->disconnects += counter_read (&threads[i].disconnects);
+    t->conn_errors += counter_read (&threads[i].conn_errors);
+    t->skipped += counter_read (&threads[i].skipped);
+    t->open_conns += counter_read (&threads[i].open_conns);
+  }
+}
+
+void report (void)
+{
+  lg_totals_t last, now;
+  cmsg_hist_t *hist;
+  cmsg_latency_t lat;
+  struct timespec second = { 1, 0 };
+  unsigned t, i;
+
+  hist = malloc (sizeof (cmsg_hist_t));
+  if (NULL == hist)
+    return;
+  printf ("secs,open_conns,sent_per_sec,replies_per_sec,mb_per_sec,connects,"
+    "disconnects,conn_errors,skipped,p50_us,p99_us,p999_us\n");
+  get_totals (&last);
+  for (t = 1; t <= OPT.secs; t++) {
+    nanosleep (&second, NULL);
+    get_totals (&now);
+    // latency is cumulative from the start
+    hist_init (hist);
+    for (i = 0; i < OPT.thread_count; i++)
+      hist_merge (hist, &threads[i].hist);
+    hist_summary (hist, &lat);
+    printf ("%u,%llu,%llu,%llu,%.2f,%llu,%llu,%llu,%llu,%.1f,%.1f,%.1f\n", t,
+      (unsigned long long) now.open_conns,
+      (unsigned long long) (now.sent - last.sent),
+      (unsigned long long) (now.replies - last.replies),
+      (now.bytes_sent - last.bytes_sent) / (1024.0 * 1024.0),
+      (unsigned long long) (now.connects - last.connects),
+      (unsigned long long) (now.disconnects - last.disconnects),
+      (unsigned long long) (now.conn_errors - last.conn_errors),
+      (unsigned long long) (now.skipped - last.skipped),
+      lat.p50_ns / 1e3, lat.p99_ns / 1e3, lat.p999_ns / 1e3);
+    fflush (stdout);
+    last = now;
+  }
+  printf ("# total sent %llu replies %llu, latency us: min %.1f mean %.1f "
+    "p50 %.1f p90 %.1f p99 %.1f p999 %.1f max %.1f\n",
+    (unsigned long long) last.sent, (unsigned long long) last.replies,
+    lat.min_ns / 1e3, lat.mean_ns / 1e3, lat.p50_ns / 1e3, lat.p90_ns / 1e3,
+    lat.p99_ns / 1e3, lat.p999_ns / 1e3, lat.max_ns / 1e3);
+  free (hist);
+}
+
+/*------------------------------------------------------------------
+ * Arguments
+---------------------------------------------------------------------*/
+
+unsigned int parse_num_arg (const char *arg, const char *arg_name)
+{
+  unsigned int result = 0;
+  int i;
+  char c;
+
+  if (arg[0] == '\0') {
+    fprintf (stderr, "Empty %s argument\n", arg_name);
+    return (unsigned int) -1;
+  }
+  for (i=0; '\0' != (c=arg[i]); i++) {
+    if ((c<'0') || (c>'9')) {
+      fprintf (stderr, "Non-numeric %s argument\n", arg_name);
+      return (unsigned int) -1;
+    }
+    result = (result*10) + c - '0';
+  }
+  return result;
+}
+
+// MIN-MAX for uniform, else SIZE[:WEIGHT],...
+int parse_sizes (const char *arg)
+{
+  unsigned long size, weight;
+  char *end;
+
+  if (strchr (arg, '-') != NULL) {
+    OPT.size_min = (unsigned) strtoul (arg, &end, 10);
+    if (*end != '-')
+      return -1;
+    OPT.size_max = (unsigned) strtoul (end+1, &end, 10);
+    if ((*end != '\0') || (OPT.size_min > OPT.size_max) || (OPT.size_max > MAX_MSG_SIZE))
+      return -1;
+    OPT.size_count = 0;
+    return 0;
+  }
+  OPT.size_count = 0;
+  while (*arg != '\0') {
+    if (OPT.size_count == MAX_SIZES)
+      return -1;
+    size = strtoul (arg, &end, 10);
+    weight = 1;
+    if (*end == ':')
+      weight = strtoul (end+1, &end, 10);
+    if ((end == arg) || (size > MAX_MSG_SIZE) || (weight == 0) ||
+        ((*end != ',') && (*end != '\0')))
+      return -1;
+    OPT.sizes[OPT.size_count] = (unsigned) size;
+    OPT.weights[OPT.size_count++] = (unsigned) weight;
+    arg = (*end == ',') ? end+1 : end;
+  }
+  return (OPT.size_count == 0) ? -1 : 0;
+}
+
+int get_args (const int argc, const char **argv)
+{
+  unsigned int *num_arg;
+  int i;
+  int mode = 0;
+
+  for (i=1; i<argc; i++) {
+    const char *arg = argv[i];
+    if ((mode == 0) && (strlen (arg) == 1) && (strchr ("apctwrxuds", arg[0]) != NULL)) {
+      mode = arg[0];
+      continue;
+    }
+    if ((mode == 0) && (strcmp (arg, "l") == 0)) {
+      OPT.local_server = true;
+      continue;
+    }
+    num_arg = NULL;
+    if (mode == 'a') {
+      OPT.addr = arg;
+    } else if (mode == 's') {
+      if (parse_sizes (arg) != 0) {
+        fprintf (stderr, "Invalid sizes %s\n", arg);
+        return -1;
+      }
+    } else if (mode == 'p')
+      num_arg = &OPT.port;
+    else if (mode == 'c')
+      num_arg = &OPT.conn_count;
+    else if (mode == 't')
+      num_arg = &OPT.thread_count;
+    else if (mode == 'w')
+      num_arg = &OPT.window;
+    else if (mode == 'r')
+      num_arg = &OPT.rate;
+    else if (mode == 'x')
+      num_arg = &OPT.churn;
+    else if (mode == 'u')
+      num_arg = &OPT.ramp;
+    else if (mode == 'd')
+      num_arg = &OPT.secs;
+    else {
+      fprintf (stderr, "Invalid argument %s\n", arg);
+      return -1;
+    }
+    if (NULL != num_arg) {
+      *num_arg = parse_num_arg (arg, "numeric");
+      if (*num_arg == (unsigned) -1)
+        return -1;
+    }
+    mode = 0;
+  }
+  if (mode != 0) {
+    fprintf (stderr, "Missing value for %c\n", mode);
+    return -1;
+  }
+  if ((OPT.thread_count == 0) || (OPT.thread_count > MAX_THREADS) ||
+      (OPT.conn_count < OPT.thread_count) || (OPT.window == 0) ||
+      (OPT.window > PENDING_SLOTS) || (OPT.ramp == 0) || (OPT.secs == 0)) {
+    fprintf (stderr, "Invalid option value\n");
+    return -1;
+  }
+  return 0;
+}
+
+int make_server_addr (void)
+{
+  memset (&server_addr, 0, sizeof (server_addr));
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_port = htons (OPT.port);
+  if (inet_pton (AF_INET, OPT.addr, &server_addr.sin_addr) != 1) {
+    fprintf (stderr, "Invalid address %s\n", OPT.addr);
+    return -1;
+  }
+  return 0;
+}
+
+// each connection needs an fd, plus the server's when it is local
+void raise_fd_limit (void)
+{
+  struct rlimit lim;
+  rlim_t needed = (rlim_t) OPT.conn_count * (OPT.local_server ? 2 : 1) + 64;
+
+  if (getrlimit (RLIMIT_NOFILE, &lim) != 0)
+    return;
+  if (lim.rlim_cur >= needed)
+    return;
+  lim.rlim_cur = (lim.rlim_max < needed) ? lim.rlim_max : needed;
+  setrlimit (RLIMIT_NOFILE, &lim);
+  if (lim.rlim_cur < needed)
+    fprintf (stderr, "Open file limit %lu is too low for %u connections\n",
+      (unsigned long) lim.rlim_cur, OPT.conn_count);
+}
+
+int main (int argc, const char **argv)
+{
+  lg_conn_t *conns;
+  unsigned i, per_thread, first = 0;
+
+  if (get_args (argc, argv) != 0) {
+    fprintf (stderr, "Usage: %s [a addr] [p port] [c conns] [t threads] "
+      "[w window | r rate] [s MIN-MAX | s SIZE[:WEIGHT],...] [x churn/sec] "
+      "[u ramp conns/sec] [d secs] [l]\n", argv[0]);
+    return 4;
+  }
+  if (make_server_addr () != 0)
+    return 4;
+  raise_fd_limit ();
+  cmsg_log_set_level (LEVEL_ERROR);
+  cmsg_log_set_sink (lg_log_sink, NULL);
+  if (OPT.local_server && (start_local_server () != 0))
+    return 4;
+
+  msg_filler = malloc (MAX_MSG_SIZE);
+  conns = calloc (OPT.conn_count, sizeof (lg_conn_t));
+  threads = calloc (OPT.thread_count, sizeof (lg_thread_t));
+  if ((NULL == msg_filler) || (NULL == conns) || (NULL == threads)) {
+    fprintf (stderr, "Unable to allocate connections\n");
+    return 4;
+  }
+  memset (msg_filler, 'x', MAX_MSG_SIZE);
+  for (i = 0; i < OPT.conn_count; i++) {
+    conns[i].sock = -1;
+    conns[i].rcv_buf = malloc (RCV_BUF_SIZE);
+    if (NULL == conns[i].rcv_buf) {
+      fprintf (stderr, "Unable to allocate connections\n");
+      return 4;
+    }
+  }
+  for (i = 0; i < OPT.thread_count; i++) {
+    per_thread = (OPT.conn_count - first) / (OPT.thread_count - i);
+    threads[i].conns = conns + first;
+    threads[i].first = first;
+    threads[i].count = per_thread;
+    threads[i].rand_seed = i + 1;
+    hist_init (&threads[i].hist);
+    threads[i].epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+    if ((threads[i].epoll_fd < 0) ||
+        (pthread_create (&threads[i].tid, NULL, lg_thread, &threads[i]) != 0)) {
+      fprintf (stderr, "Unable to start thread %u\n", i);
+      return 4;
+    }
+    first += per_thread;
+  }
+
+  report ();
+  lg_stop = true;
+  for (i = 0; i < OPT.thread_count; i++) {
+    pthread_join (threads[i].tid, NULL);
+    close (threads[i].epoll_fd);
+  }
+  for (i = 0; i < OPT.conn_count; i++) {
+    free (conns[i].rcv_buf);
+    free (conns[i].out_buf);
+  }
+  if (OPT.local_server) {
+    server_terminated = true;
+    pthread_join (local_server_thread, NULL);
+    cmsg_server_destroy (local_server);
+  }
+  free (conns);
+  free (threads);
+  free (msg_filler);
+  return 0;
+}
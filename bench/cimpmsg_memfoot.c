@@ -0,0 +1,572 @@
+/**
+ * Copyright 2016 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+/*------------------------------------------------------------------
+ * Memory footprint per connection, server and client side.
+ * cimpmsg.c is compiled into this file with its malloc family routed
+ * through a tracking allocator, so the heap bytes and allocation
+ * counts are the library's own. RSS is the whole process.
+ *
+ * For the server side the peers are plain sockets in a child process,
+ * for the client side the server runs in a child process, so only the
+ * side being measured is in this process. Each side is measured with
+ * n idle connections, then after each connection has sent a message
+ * and made a request. Both are measured again once the connections
+ * have been idle for buf_idle_msecs, when the server's receive state
+ * has gone back to the pool and the clients, run on a client loop
+ * meanwhile, have freed their read-ahead buffers.
+ *
+ * Exits non-zero if the heap bytes per connection exceed the limits
+ * below, which ctest uses as a regression check. 'l' prints the
+ * limits, 'n N' sets the connection count (default 200). One time
+ * allocations are spread over the connections, so with small counts
+ * the figures are not per connection costs.
+---------------------------------------------------------------------*/
+
+// heap bytes per connection, with some headroom over what was measured
+// at 200 connections. The server's connections come from the slab, so
+// its figure depends a little on how full the last chunk is.
+#define LIMIT_SERVER_IDLE	192
+#define LIMIT_SERVER_ACTIVE	384
+#define LIMIT_SERVER_DRAINED	320
+#define LIMIT_CLIENT_IDLE	256
+#define LIMIT_CLIENT_ACTIVE	8192
+#define LIMIT_CLIENT_DRAINED	3584
+
+#define MF_BUF_IDLE_MSECS	100
+
+typedef struct alloc_hdr {
+  size_t size;
+  size_t offset;  // from the start of the real block
+} alloc_hdr_t;
+
+static uint64_t heap_bytes = 0;
+static uint64_t heap_allocs = 0;  // live allocations
+
+void *mf_malloc (size_t size);
+void *mf_calloc (size_t count, size_t size);
+void *mf_realloc (void *ptr, size_t size);
+void mf_free (void *ptr);
+int mf_posix_memalign (void **ptr, size_t align, size_t size);
+char *mf_strdup (const char *str);
+
+#define malloc(size) mf_malloc (size)
+#define calloc(count,size) mf_calloc (count, size)
+#define realloc(ptr,size) mf_realloc (ptr, size)
+#define free(ptr) mf_free (ptr)
+#define posix_memalign(ptr,align,size) mf_posix_memalign (ptr, align, size)
+#define strdup(str) mf_strdup (str)
+#include "cimpmsg.c"
+#undef malloc
+#undef calloc
+#undef realloc
+#undef free
+#undef posix_memalign
+#undef strdup
+
+void *mf_track (char *raw, size_t offset, size_t size)
+{
+  alloc_hdr_t *hdr;
+
+  if (NULL == raw)
+    return NULL;
+  hdr = (alloc_hdr_t *) (raw + offset) - 1;
+  hdr->size = size;
+  hdr->offset = offset;
+  __atomic_add_fetch (&heap_bytes, size, __ATOMIC_RELAXED);
+  __atomic_add_fetch (&heap_allocs, 1, __ATOMIC_RELAXED);
+  return raw + offset;
+}
+
+void *mf_malloc (size_t size)
+{
+  return mf_track (malloc (size + sizeof (alloc_hdr_t)), sizeof (alloc_hdr_t), size);
+}
+
+void *mf_calloc (size_t count, size_t size)
+{
+  void *ptr = mf_malloc (count * size);
+
+  if (NULL != ptr)
+    memset (ptr, 0, count * size);
+  return ptr;
+}
+
+void mf_free (void *ptr)
+{
+  alloc_hdr_t *hdr = (alloc_hdr_t *) ptr - 1;
+
+  if (NULL == ptr)
+    return;
+  __atomic_sub_fetch (&heap_bytes, hdr->size, __ATOMIC_RELAXED);
+  __atomic_sub_fetch (&heap_allocs, 1, __ATOMIC_RELAXED);
+  free ((char *) ptr - hdr->offset);
+}
+
+void *mf_realloc (void *ptr, size_t size)
+{
+  void *new_ptr;
+  size_t old_size;
+
+  if (NULL == ptr)
+    return mf_malloc (size);
+  new_ptr = mf_malloc (size);
+  if (NULL == new_ptr)
+    return NULL;
+  old_size = ((alloc_hdr_t *) ptr - 1)->size;
+  memcpy (new_ptr, ptr, (old_size < size) ? old_size : size);
+  mf_free (ptr);
+  return new_ptr;
+}
+
+int mf_posix_memalign (void **ptr, size_t align, size_t size)
+{
+  size_t offset = (sizeof (alloc_hdr_t) + align - 1) & ~(align - 1);
+  char *raw;
+
+  if (posix_memalign ((void **) &raw, align, size + offset) != 0)
+    return ENOMEM;
+  *ptr = mf_track (raw, offset, size);
+  return 0;
+}
+
+char *mf_strdup (const char *str)
+{
+  size_t len = strlen (str) + 1;
+  char *dup = mf_malloc (len);
+
+  if (NULL != dup)
+    memcpy (dup, str, len);
+  return dup;
+}
+
+/*------------------------------------------------------------------
+ * Measurements
+---------------------------------------------------------------------*/
+
+#define MF_PORT 7900
+#define MF_MSG "footprint"
+
+typedef struct snapshot {
+  uint64_t rss_bytes;
+  uint64_t heap_bytes;
+  uint64_t heap_allocs;
+} snapshot_t;
+
+static unsigned conn_count = 200;
+static int failures = 0;
+
+uint64_t get_rss_bytes (void)
+{
+  unsigned long size, resident;
+  FILE *f = fopen ("/proc/self/statm", "r");
+
+  if (NULL == f)
+    return 0;
+  if (fscanf (f, "%lu %lu", &size, &resident) != 2)
+    resident = 0;
+  fclose (f);
+  return (uint64_t) resident * (uint64_t) sysconf (_SC_PAGESIZE);
+}
+
+void take_snapshot (snapshot_t *snap)
+{
+  snap->rss_bytes = get_rss_bytes ();
+  snap->heap_bytes = __atomic_load_n (&heap_bytes, __ATOMIC_RELAXED);
+  snap->heap_allocs = __atomic_load_n (&heap_allocs, __ATOMIC_RELAXED);
+}
+
+void report (const char *side, const char *state, const snapshot_t *base,
+  const snapshot_t *now, uint64_t limit)
+{
+  double rss = ((double) now->rss_bytes - (double) base->rss_bytes) / conn_count;
+  double heap = ((double) now->heap_bytes - (double) base->heap_bytes) / conn_count;
+  double allocs = ((double) now->heap_allocs - (double) base->heap_allocs) / conn_count;
+  bool ok = (heap <= (double) limit);
+
+  printf ("%s,%s,%u,%.0f,%.0f,%.2f,%llu,%s\n", side, state, conn_count, rss,
+    heap, allocs, (unsigned long long) limit, ok ? "ok" : "FAIL");
+  fflush (stdout);
+  if (!ok)
+    failures++;
+}
+
+// waits for fn to return true, up to 10 secs
+bool wait_for (bool (*fn) (void *), void *arg)
+{
+  unsigned i;
+
+  for (i = 0; i < 10000; i++) {
+    if (fn (arg))
+      return true;
+    usleep (1000);
+  }
+  fprintf (stderr, "Timed out\n");
+  return false;
+}
+
+// the child side runs commands read from a pipe, and acks each one
+void child_ack (int fd)
+{
+  char c = 'k';
+
+  if (write (fd, &c, 1) != 1)
+    exit (1);
+}
+
+char child_command (int fd)
+{
+  char c;
+
+  if (read (fd, &c, 1) != 1)
+    return 'q';
+  return c;
+}
+
+bool send_command (int to_fd, int from_fd, char cmd)
+{
+  char c;
+
+  if (write (to_fd, &cmd, 1) != 1)
+    return false;
+  return (read (from_fd, &c, 1) == 1);
+}
+
+/*------------------------------------------------------------------
+ * Server side. The peers are plain sockets in a child process.
+---------------------------------------------------------------------*/
+
+static cmsg_server_t *mf_server = NULL;
+static bool server_terminated = false;
+static bool client_loop_terminated = false;
+
+void echo_handle_msg (int action_code, server_rcv_msg_data_t *msg_data)
+{
+  if (action_code != CMSG_ACTION_MSG_RECEIVED)
+    return;
+  if (msg_data->msg_kind == CMSG_KIND_REQUEST) {
+    cmsg_server_reply (msg_data->server, msg_data->conn, msg_data->corr_id,
+      msg_data->rcv_msg, msg_data->rcv_msg_size, false);
+    // also a plain message, which ends the client's cmsg_client_receive
+    cmsg_server_send_msg (msg_data->server, msg_data->conn, 
+      msg_data->rcv_msg, msg_data->rcv_msg_size, false);
+  }
+  mf_free (msg_data->rcv_msg);
+}
+
+void *server_listen_thread (void *arg)
+{
+  (void) arg;
+  cmsg_server_listen (mf_server, echo_handle_msg, &server_terminated);
+  return NULL;
+}
+
+// raw socket peers: 'c' connects, 'a' sends a message and a request
+// on each and reads the replies, 'q' closes and exits
+void raw_peer_process (int cmd_fd, int ack_fd)
+{
+  struct sockaddr_in addr;
+  char frame[64], buf[256];
+  size_t sz_frame;
+  unsigned i;
+  int *socks = calloc (conn_count, sizeof (int));
+  char cmd;
+
+  if (NULL == socks)
+    exit (1);
+  make_sockaddr (&addr, "127.0.0.1", MF_PORT, false);
+  while ((cmd = child_command (cmd_fd)) != 'q') {
+    for (i = 0; (cmd == 'c') && (i < conn_count); i++) {
+      socks[i] = socket (AF_INET, SOCK_STREAM, 0);
+      if (connect (socks[i], (struct sockaddr *) &addr, sizeof (addr)) != 0)
+        exit (1);
+    }
+    for (i = 0; (cmd == 'a') && (i < conn_count); i++) {
+      sz_frame = encode_msg_frame (frame, CMSG_KIND_MSG, 0, MF_MSG, sizeof (MF_MSG));
+      sz_frame += encode_msg_frame (frame + sz_frame, CMSG_KIND_REQUEST, i + 1, 
+        MF_MSG, sizeof (MF_MSG));
+      if (send (socks[i], frame, sz_frame, 0) != (ssize_t) sz_frame)
+        exit (1);
+    }
+    for (i = 0; (cmd == 'a') && (i < conn_count); i++)
+      if (recv (socks[i], buf, sizeof (buf), 0) <= 0)
+        exit (1);
+    child_ack (ack_fd);
+  }
+  for (i = 0; i < conn_count; i++)
+    close (socks[i]);
+  exit (0);
+}
+
+bool server_has_conns (void *arg)
+{
+  cmsg_stats_t stats;
+
+  cmsg_server_get_stats (mf_server, &stats);
+  return stats.open_conns >= *(unsigned *) arg;
+}
+
+bool server_has_msgs (void *arg)
+{
+  cmsg_stats_t stats;
+
+  cmsg_server_get_stats (mf_server, &stats);
+  return stats.msgs_received >= *(unsigned *) arg;
+}
+
+void measure_server (void)
+{
+  int cmd_pipe[2], ack_pipe[2];
+  pthread_t listen_thread;
+  server_opts_t opts;
+  snapshot_t base, now;
+  unsigned expected_msgs = 2 * conn_count;
+  pid_t child;
+  int err;
+
+  memset (&opts, 0, sizeof (opts));
+  opts.buf_idle_msecs = MF_BUF_IDLE_MSECS;
+  mf_server = cmsg_server_create ("127.0.0.1", MF_PORT, &opts, &err);
+  if (NULL == mf_server) {
+    fprintf (stderr, "Unable to create server: %s\n", strerror (err));
+    failures++;
+    return;
+  }
+  if ((pipe (cmd_pipe) != 0) || (pipe (ack_pipe) != 0))
+    exit (4);
+  child = fork ();
+  if (child == 0) {
+    close (cmd_pipe[1]);
+    close (ack_pipe[0]);
+    raw_peer_process (cmd_pipe[0], ack_pipe[1]);
+  }
+  close (cmd_pipe[0]);
+  close (ack_pipe[1]);
+  pthread_create (&listen_thread, NULL, server_listen_thread, NULL);
+  usleep (100000);  // listen thread settled
+  take_snapshot (&base);
+  if (send_command (cmd_pipe[1], ack_pipe[0], 'c') &&
+      wait_for (server_has_conns, &conn_count)) {
+    usleep (100000);
+    take_snapshot (&now);
+    report ("server", "idle", &base, &now, LIMIT_SERVER_IDLE);
+    if (send_command (cmd_pipe[1], ack_pipe[0], 'a') &&
+        wait_for (server_has_msgs, &expected_msgs)) {
+      take_snapshot (&now);
+      report ("server", "active", &base, &now, LIMIT_SERVER_ACTIVE);
+      // the listen loop wakes at least every 500 msecs to release them
+      usleep (MF_BUF_IDLE_MSECS * 1000 + 1000000);
+      take_snapshot (&now);
+      report ("server", "drained", &base, &now, LIMIT_SERVER_DRAINED);
+    } else
+      failures++;
+  } else
+    failures++;
+  send_command (cmd_pipe[1], ack_pipe[0], 'q');
+  waitpid (child, NULL, 0);
+  close (cmd_pipe[1]);
+  close (ack_pipe[0]);
+  server_terminated = true;
+  pthread_join (listen_thread, NULL);
+  cmsg_server_destroy (mf_server);
+  mf_server = NULL;
+}
+
+/*------------------------------------------------------------------
+ * Client side. The server runs in a child process.
+---------------------------------------------------------------------*/
+
+void server_process (int cmd_fd, int ack_fd)
+{
+  pthread_t listen_thread;
+  server_opts_t opts;
+  int err;
+
+  memset (&opts, 0, sizeof (opts));
+  server_terminated = false;
+  mf_server = cmsg_server_create ("127.0.0.1", MF_PORT + 1, &opts, &err);
+  if (NULL == mf_server) {
+    fprintf (stderr, "Unable to create server: %s\n", strerror (err));
+    exit (1);
+  }
+  pthread_create (&listen_thread, NULL, server_listen_thread, NULL);
+  child_ack (ack_fd);
+  child_command (cmd_fd);
+  server_terminated = true;
+  pthread_join (listen_thread, NULL);
+  exit (0);
+}
+
+void ignore_reply (int status, char *reply, size_t sz_reply, void *arg)
+{
+  (void) sz_reply;
+  (void) arg;
+  if (status == 0)
+    mf_free (reply);
+}
+
+void ignore_msg (struct client_conn *conn, int status, char *msg, 
+  size_t size, void *arg)
+{
+  (void) conn;
+  (void) size;
+  (void) arg;
+  if (status == 0)
+    mf_free (msg);
+}
+
+void *client_loop_thread (void *arg)
+{
+  cmsg_client_loop_run ((cmsg_client_loop_t *) arg, &client_loop_terminated);
+  return NULL;
+}
+
+// Runs the clients on a loop for longer than buf_idle_msecs, so that
+// their read-ahead buffers are freed, then takes them off it again.
+bool drain_clients (client_conn_t *conns)
+{
+  cmsg_client_loop_t *loop;
+  pthread_t loop_thread;
+  unsigned i;
+  int err;
+
+  loop = cmsg_client_loop_create (&err);
+  if (NULL == loop)
+    return false;
+  for (i = 0; i < conn_count; i++)
+    cmsg_client_loop_add (loop, &conns[i], ignore_msg, NULL);
+  client_loop_terminated = false;
+  pthread_create (&loop_thread, NULL, client_loop_thread, loop);
+  usleep (MF_BUF_IDLE_MSECS * 1000 + 500000);
+  client_loop_terminated = true;
+  pthread_join (loop_thread, NULL);
+  for (i = 0; i < conn_count; i++)
+    cmsg_client_loop_remove (loop, &conns[i]);
+  cmsg_client_loop_destroy (loop);
+  return true;
+}
+
+void measure_client (void)
+{
+  static const client_conn_t conn_init = CMSG_CLIENT_CONN_INITIALIZER;
+  int cmd_pipe[2], ack_pipe[2];
+  client_conn_t *conns;
+  client_opts_t opts;
+  snapshot_t base, now;
+  unsigned i;
+  pid_t child;
+  char c;
+  bool ok = true;
+
+  if ((pipe (cmd_pipe) != 0) || (pipe (ack_pipe) != 0))
+    exit (4);
+  child = fork ();
+  if (child == 0) {
+    close (cmd_pipe[1]);
+    close (ack_pipe[0]);
+    server_process (cmd_pipe[0], ack_pipe[1]);
+  }
+  close (cmd_pipe[0]);
+  close (ack_pipe[1]);
+  if (read (ack_pipe[0], &c, 1) != 1) {
+    fprintf (stderr, "Unable to start server\n");
+    failures++;
+    waitpid (child, NULL, 0);
+    return;
+  }
+  memset (&opts, 0, sizeof (opts));
+  opts.buf_idle_msecs = MF_BUF_IDLE_MSECS;
+  // the array itself is the application's, so it is not counted
+  conns = (client_conn_t *) mf_malloc (conn_count * sizeof (client_conn_t));
+  take_snapshot (&base);
+  for (i = 0; ok && (i < conn_count); i++) {
+    conns[i] = conn_init;
+    ok = (cmsg_connect_client_opts (&conns[i], "127.0.0.1", MF_PORT + 1, 2000, 
+      &opts) == 0);
+  }
+  if (ok) {
+    take_snapshot (&now);
+    report ("client", "idle", &base, &now, LIMIT_CLIENT_IDLE);
+    for (i = 0; ok && (i < conn_count); i++) {
+      ok = (cmsg_client_send (&conns[i], MF_MSG, sizeof (MF_MSG), false) == 0) &&
+        (cmsg_client_request (&conns[i], MF_MSG, sizeof (MF_MSG), 2000, 
+          ignore_reply, NULL) == 0);
+      // returns with the plain message that follows the reply
+      if (ok && (cmsg_client_receive (&conns[i]) >= 0)) {
+        mf_free (conns[i].rcv_msg);
+        conns[i].rcv_msg = NULL;
+      } else
+        ok = false;
+    }
+    if (ok) {
+      take_snapshot (&now);
+      report ("client", "active", &base, &now, LIMIT_CLIENT_ACTIVE);
+      ok = drain_clients (conns);
+    }
+    if (ok) {
+      take_snapshot (&now);
+      report ("client", "drained", &base, &now, LIMIT_CLIENT_DRAINED);
+    }
+  }
+  if (!ok) {
+    fprintf (stderr, "Client connection %u failed\n", i);
+    failures++;
+  }
+  for (i = 0; i < conn_count; i++)
+    cmsg_shutdown_client (&conns[i]);
+  mf_free (conns);
+  send_command (cmd_pipe[1], ack_pipe[0], 'q');
+  waitpid (child, NULL, 0);
+  close (cmd_pipe[1]);
+  close (ack_pipe[0]);
+}
+
+int main (int argc, const char **argv)
+{
+  int i;
+
+  for (i = 1; i < argc; i++) {
+    if ((strcmp (argv[i], "n") == 0) && (i + 1 < argc)) {
+      conn_count = (unsigned) atoi (argv[++i]);
+      if (conn_count == 0)
+        return 4;
+    } else if (strcmp (argv[i], "l") == 0) {
+      printf ("server idle %d active %d drained %d, client idle %d active %d "
+        "drained %d bytes\n", LIMIT_SERVER_IDLE, LIMIT_SERVER_ACTIVE, 
+        LIMIT_SERVER_DRAINED, LIMIT_CLIENT_IDLE, LIMIT_CLIENT_ACTIVE, 
+        LIMIT_CLIENT_DRAINED);
+      return 0;
+    } else {
+      fprintf (stderr, "Usage: %s [n conns] [l]\n", argv[0]);
+      return 4;
+    }
+  }
+  signal (SIGPIPE, SIG_IGN);
+  cmsg_log_set_level (LEVEL_ERROR);
+  printf ("side,state,conns,rss_bytes_per_conn,heap_bytes_per_conn,"
+    "allocs_per_conn,limit_bytes,result\n");
+  fflush (stdout);
+  measure_server ();
+  measure_client ();
+  return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,489 @@
+/**
+ * Copyright 2016 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/*------------------------------------------------------------------
+ * Microbenchmarks of the hot path functions in cimpmsg.c, which is
+ * compiled into this file so its internals can be called directly.
+ * Allocations are counted by routing the library's malloc family
+ * through the counters below.
+ *
+ * Prints name,param,iterations,ns_per_op,allocs_per_op. With 'q' the
+ * iteration counts are cut down, for ctest; a result that doesn't
+ * check out makes the exit status non-zero.
+---------------------------------------------------------------------*/
+
+static uint64_t mb_allocs = 0;
+
+void *mb_malloc (size_t size);
+void *mb_calloc (size_t count, size_t size);
+void *mb_realloc (void *ptr, size_t size);
+int mb_posix_memalign (void **ptr, size_t align, size_t size);
+
+#define malloc(size) mb_malloc (size)
+#define calloc(count,size) mb_calloc (count, size)
+#define realloc(ptr,size) mb_realloc (ptr, size)
+#define posix_memalign(ptr,align,size) mb_posix_memalign (ptr, align, size)
+#include "cimpmsg.c"
+#undef malloc
+#undef calloc
+#undef realloc
+#undef posix_memalign
+
+void *mb_malloc (size_t size)
+{
+  __atomic_add_fetch (&mb_allocs, 1, __ATOMIC_RELAXED);
+  return malloc (size);
+}
+
+void *mb_calloc (size_t count, size_t size)
+{
+  __atomic_add_fetch (&mb_allocs, 1, __ATOMIC_RELAXED);
+  return calloc (count, size);
+}
+
+void *mb_realloc (void *ptr, size_t size)
+{
+  __atomic_add_fetch (&mb_allocs, 1, __ATOMIC_RELAXED);
+  return realloc (ptr, size);
+}
+
+int mb_posix_memalign (void **ptr, size_t align, size_t size)
+{
+  __atomic_add_fetch (&mb_allocs, 1, __ATOMIC_RELAXED);
+  return posix_memalign (ptr, align, size);
+}
+
+static bool quick = false;
+static int failures = 0;
+static volatile uint64_t sink_value;  // keeps results alive
+
+typedef struct mb_timer {
+  uint64_t start_ns;
+  uint64_t start_allocs;
+} mb_timer_t;
+
+void mb_start (mb_timer_t *timer)
+{
+  timer->start_allocs = __atomic_load_n (&mb_allocs, __ATOMIC_RELAXED);
+  timer->start_ns = get_monotonic_ns ();
+}
+
+void mb_report (mb_timer_t *timer, const char *name, unsigned long param,
+  uint64_t ops)
+{
+  uint64_t ns = get_monotonic_ns () - timer->start_ns;
+  uint64_t allocs = __atomic_load_n (&mb_allocs, __ATOMIC_RELAXED) - timer->start_allocs;
+
+  printf ("%s,%lu,%llu,%.1f,%.2f\n", name, param, (unsigned long long) ops,
+    (double) ns / ops, (double) allocs / ops);
+  fflush (stdout);
+}
+
+void mb_check (bool ok, const char *what)
+{
+  if (!ok) {
+    fprintf (stderr, "FAILED: %s\n", what);
+    failures++;
+  }
+}
+
+uint64_t iterations (uint64_t full)
+{
+  return quick ? (full / 1000) + 1 : full;
+}
+
+/*------------------------------------------------------------------
+ * Header encode and decode, in memory
+---------------------------------------------------------------------*/
+
+void bench_header (int kind)
+{
+  const char *name_enc = (kind == CMSG_KIND_MSG) ? "encode_basic" : "encode_ext";
+  const char *name_dec = (kind == CMSG_KIND_MSG) ? "decode_basic" : "decode_ext";
+  char frame[64];
+  char msg[16];
+  uint64_t i, n = iterations (20000000);
+  uint64_t total = 0;
+  size_t msg_size;
+  uint32_t corr_id;
+  int got_kind, got_flags;
+  mb_timer_t timer;
+
+  memset (msg, 'm', sizeof (msg));
+  mb_start (&timer);
+  for (i = 0; i < n; i++) {
+    total += encode_msg_frame (frame, kind, (uint32_t) i, msg, sizeof (msg));
+    __asm__ volatile ("" : : "r" (frame) : "memory");
+  }
+  mb_report (&timer, name_enc, sizeof (msg), n);
+  sink_value = total;
+
+  mb_start (&timer);
+  for (i = 0; i < n; i++) {
+    __asm__ volatile ("" : : "r" (frame) : "memory");
+    decode_msg_header ((unsigned char *) frame, (unsigned char *) frame + MSG_HEADER_SIZE,
+      &got_kind, &got_flags, &corr_id, &msg_size);
+    total += msg_size + corr_id;
+  }
+  mb_report (&timer, name_dec, sizeof (msg), n);
+  sink_value = total;
+  mb_check ((got_kind == kind) && (msg_size == sizeof (msg)), "header round trip");
+}
+
+/*------------------------------------------------------------------
+ * Frame buffer allocation per send (make_msg_frame then free)
+---------------------------------------------------------------------*/
+
+void bench_frame_alloc (size_t sz_msg)
+{
+  char *msg = malloc (sz_msg);
+  char *frame;
+  size_t sz_frame;
+  uint64_t i, n = iterations (5000000);
+  mb_timer_t timer;
+
+  if (NULL == msg)
+    return;
+  memset (msg, 'm', sz_msg);
+  mb_start (&timer);
+  for (i = 0; i < n; i++) {
+    frame = make_msg_frame (-1, CMSG_KIND_MSG, 0, msg, sz_msg, &sz_frame);
+    cmsg_free (frame, sz_frame, CMSG_ALLOC_SEND_BUF);
+  }
+  mb_report (&timer, "frame_alloc", sz_msg, n);
+  free (msg);
+}
+
+/*------------------------------------------------------------------
+ * __send_msg on a socketpair, drained by another thread
+---------------------------------------------------------------------*/
+
+void *drain_thread (void *arg)
+{
+  int sock = *(int *) arg;
+  char buf[65536];
+
+  while (recv (sock, buf, sizeof (buf), 0) > 0)
+    ;
+  return NULL;
+}
+
+void bench_send_msg (size_t sz_msg)
+{
+  int socks[2];
+  char *msg = malloc (sz_msg);
+  uint64_t i, n = iterations ((sz_msg > 1024) ? 200000 : 1000000);
+  pthread_t drainer;
+  mb_timer_t timer;
+  int rtn = 0;
+
+  if (NULL == msg)
+    return;
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, socks) != 0) {
+    mb_check (false, "socketpair");
+    free (msg);
+    return;
+  }
+  pthread_create (&drainer, NULL, drain_thread, &socks[1]);
+  memset (msg, 'm', sz_msg);
+  mb_start (&timer);
+  for (i = 0; (i < n) && (rtn == 0); i++)
+    rtn = __send_msg (socks[0], msg, sz_msg, false);
+  mb_report (&timer, "send_msg", sz_msg, n);
+  mb_check (rtn == 0, "__send_msg");
+  shutdown (socks[0], SHUT_WR);
+  pthread_join (drainer, NULL);
+  close (socks[0]);
+  close (socks[1]);
+  free (msg);
+}
+
+/*------------------------------------------------------------------
+ * Receive side parsing of a buffer holding many frames
+---------------------------------------------------------------------*/
+
+static uint64_t parsed_msgs = 0;
+
+void count_msg (int action_code, server_rcv_msg_data_t *msg_data)
+{
+  if (action_code == CMSG_ACTION_MSG_RECEIVED)
+    parsed_msgs++;
+  cmsg_free_msg (msg_data->rcv_msg, msg_data->rcv_msg_size);
+  msg_data->rcv_msg = NULL;
+}
+
+void bench_frame_parse (size_t sz_msg)
+{
+  int socks[2];
+  unsigned frames_per_buf = 16384 / (sz_msg + MSG_HEADER_SIZE);
+  size_t sz_buf = frames_per_buf * (sz_msg + MSG_HEADER_SIZE);
+  uint64_t rounds = iterations (2000000) / frames_per_buf + 1;
+  uint64_t r, ops = 0;
+  unsigned f;
+  char *buf = malloc (sz_buf);
+  char *msg = malloc (sz_msg);
+  struct connection conn;
+  struct conn_rx rx;
+  mb_timer_t timer;
+  int rtn = 0;
+
+  if ((NULL == buf) || (NULL == msg))
+    return;
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, socks) != 0) {
+    mb_check (false, "socketpair");
+    return;
+  }
+  memset (msg, 'm', sz_msg);
+  for (f = 0; f < frames_per_buf; f++)
+    encode_msg_frame (buf + f * (sz_msg + MSG_HEADER_SIZE), CMSG_KIND_MSG, 0, 
+      msg, sz_msg);
+  init_connection (&conn);
+  memset (&rx, 0, sizeof (rx));
+  conn.rx = &rx;
+  conn.rcv_state = 0;
+  conn.sock = socks[1];
+  parsed_msgs = 0;
+  mb_start (&timer);
+  for (r = 0; (r < rounds) && (rtn >= 0); r++) {
+    if (send (socks[0], buf, sz_buf, 0) != (ssize_t) sz_buf) {
+      rtn = -1;
+      break;
+    }
+    for (f = 0; (f < frames_per_buf) && (rtn >= 0); f++) {
+      rtn = receive_msg_header (&conn);
+      if (rtn == 0)
+        rtn = receive_msg_data (&conn, count_msg, NULL);
+      ops++;
+    }
+  }
+  mb_report (&timer, "frame_parse", sz_msg, ops);
+  mb_check ((rtn >= 0) && (parsed_msgs == ops), "frame_parse message count");
+  close (socks[0]);
+  close (socks[1]);
+  free (buf);
+  free (msg);
+}
+
+/*------------------------------------------------------------------
+ * Client receive of a buffer holding many frames, into a new buffer
+ * per message (cmsg_client_receive) and into the caller's buffer
+---------------------------------------------------------------------*/
+
+void bench_client_receive (size_t sz_msg, bool into)
+{
+  int socks[2];
+  unsigned frames_per_buf = 16384 / (sz_msg + MSG_HEADER_SIZE);
+  size_t sz_buf = frames_per_buf * (sz_msg + MSG_HEADER_SIZE);
+  uint64_t rounds = iterations (2000000) / frames_per_buf + 1;
+  uint64_t r, ops = 0;
+  unsigned f;
+  char *buf = malloc (sz_buf);
+  char *msg = malloc (sz_msg);
+  struct client_conn conn;
+  mb_timer_t timer;
+  int rtn = 0;
+
+  if ((NULL == buf) || (NULL == msg))
+    return;
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, socks) != 0) {
+    mb_check (false, "socketpair");
+    return;
+  }
+  memset (msg, 'm', sz_msg);
+  for (f = 0; f < frames_per_buf; f++)
+    encode_msg_frame (buf + f * (sz_msg + MSG_HEADER_SIZE), CMSG_KIND_MSG, 0, 
+      msg, sz_msg);
+  init_client_conn (&conn);
+  conn.sock = socks[1];
+  conn.conn_state = CLIENT_STATE_CONNECTED;
+  mb_start (&timer);
+  for (r = 0; (r < rounds) && (rtn >= 0); r++) {
+    if (send (socks[0], buf, sz_buf, 0) != (ssize_t) sz_buf) {
+      rtn = -1;
+      break;
+    }
+    for (f = 0; (f < frames_per_buf) && (rtn >= 0); f++) {
+      if (into)
+        rtn = cmsg_client_receive_into (&conn, msg, sz_msg);
+      else {
+        rtn = cmsg_client_receive (&conn);
+        if (rtn >= 0)
+          cmsg_free_msg (conn.rcv_msg, conn.rcv_msg_size);
+      }
+      ops++;
+    }
+  }
+  mb_report (&timer, into ? "client_receive_into" : "client_receive", sz_msg, ops);
+  mb_check ((rtn == (int) sz_msg) && (conn.stats.msgs_received == ops), 
+    "client_receive message count");
+  cmsg_shutdown_client (&conn);
+  close (socks[0]);
+  free (buf);
+  free (msg);
+}
+
+/*------------------------------------------------------------------
+ * Message compression, of JSON-like records and of random bytes.
+ * Set the ns per op against send_msg and client_receive for the same
+ * size: compressing pays where the link is slower than the codec, and
+ * on random bytes the compressor gives up early but still costs a pass.
+---------------------------------------------------------------------*/
+
+void fill_json (char *msg, size_t sz_msg)
+{
+  char record[96];
+  size_t i = 0;
+  int j, len, n = 0;
+
+  while (i < sz_msg) {
+    len = snprintf (record, sizeof (record), 
+      "{\"id\":%d,\"name\":\"device-%d\",\"state\":\"%s\",\"value\":%d},",
+      n, n % 97, ((n % 3) == 0) ? "online" : "offline", (n * 7919) % 10007);
+    n++;
+    for (j = 0; (j < len) && (i < sz_msg); j++)
+      msg[i++] = record[j];
+  }
+}
+
+void bench_lz (size_t sz_msg, bool json)
+{
+  char *msg = malloc (sz_msg);
+  char *lz = malloc (sz_msg);
+  char *out = malloc (sz_msg);
+  size_t i, sz_lz = 0;
+  uint64_t n = iterations ((sz_msg > 4096) ? 20000 : 200000);
+  uint64_t total = 0;
+  mb_timer_t timer;
+
+  if ((NULL == msg) || (NULL == lz) || (NULL == out))
+    return;
+  if (json)
+    fill_json (msg, sz_msg);
+  else
+    for (i = 0; i < sz_msg; i++)
+      msg[i] = (char) rand ();
+  mb_start (&timer);
+  for (i = 0; i < n; i++) {
+    sz_lz = lz_compress (msg, sz_msg, lz, sz_msg - (sz_msg / 8));
+    total += sz_lz;
+  }
+  mb_report (&timer, json ? "lz_compress_json" : "lz_compress_random", sz_msg, n);
+  sink_value = total;
+  if (!json) {
+    mb_check (sz_lz == 0, "random bytes not compressed");
+    free (msg);
+    free (lz);
+    free (out);
+    return;
+  }
+  mb_check ((sz_lz != 0) && (sz_lz < sz_msg / 3), "json compresses 3x");
+  mb_start (&timer);
+  for (i = 0; (i < n) && (sz_lz != 0); i++) {
+    total += lz_decompress (lz, sz_lz, out, sz_msg);
+    __asm__ volatile ("" : : "r" (out) : "memory");
+  }
+  mb_report (&timer, "lz_decompress_json", sz_msg, n);
+  sink_value = total;
+  mb_check ((sz_lz != 0) && (memcmp (msg, out, sz_msg) == 0), "lz round trip");
+  free (msg);
+  free (lz);
+  free (out);
+}
+
+/*------------------------------------------------------------------
+ * Connection lookup, by socket (fd API) and by handle
+---------------------------------------------------------------------*/
+
+void bench_conn_lookup (unsigned conn_count)
+{
+  struct cmsg_server *srv = alloc_server ();
+  struct connection *conn;
+  cmsg_conn_t *handles;
+  uint64_t i, n, found = 0;
+  unsigned seed = 1;
+  unsigned c;
+  mb_timer_t timer;
+
+  handles = malloc (conn_count * sizeof (cmsg_conn_t));
+  if ((NULL == srv) || (NULL == handles))
+    return;
+  for (c = 0; c < conn_count; c++) {
+    conn = init_server_connection (srv, 1000 + c);
+    if (NULL == conn)
+      break;
+    LL_PREPEND (srv->connection_list, conn);
+    handles[c] = conn_handle (conn);
+  }
+  // the socket lookup is a list walk, so scale it down
+  n = iterations (100000000ULL / conn_count) + 1;
+  mb_start (&timer);
+  for (i = 0; i < n; i++)
+    if (server_sock_handle (srv, 1000 + (rand_r (&seed) % conn_count)) != CMSG_CONN_INVALID)
+      found++;
+  mb_report (&timer, "lookup_by_sock", conn_count, n);
+  mb_check (found == n, "lookup_by_sock");
+
+  found = 0;
+  n = iterations (20000000);
+  mb_start (&timer);
+  for (i = 0; i < n; i++)
+    if (NULL != server_find_conn (srv, handles[rand_r (&seed) % conn_count]))
+      found++;
+  mb_report (&timer, "lookup_by_handle", conn_count, n);
+  mb_check (found == n, "lookup_by_handle");
+
+  // free_server doesn't close sockets, so the fake fds are safe
+  srv->connection_list = NULL;
+  free_server (srv);
+  free (handles);
+}
+
+int main (int argc, const char **argv)
+{
+  static const size_t sizes[] = { 16, 256, 4096 };
+  static const size_t lz_sizes[] = { 4096, 65536 };
+  static const unsigned conn_counts[] = { 10, 100, 1000, 10000, 100000 };
+  unsigned i;
+
+  if ((argc > 1) && (strcmp (argv[1], "q") == 0))
+    quick = true;
+  cmsg_log_set_level (LEVEL_ERROR);
+  printf ("name,param,iterations,ns_per_op,allocs_per_op\n");
+  bench_header (CMSG_KIND_MSG);
+  bench_header (CMSG_KIND_REQUEST);
+  for (i = 0; i < sizeof (sizes) / sizeof (sizes[0]); i++)
+    bench_frame_alloc (sizes[i]);
+  for (i = 0; i < sizeof (sizes) / sizeof (sizes[0]); i++)
+    bench_send_msg (sizes[i]);
+  for (i = 0; i < sizeof (sizes) / sizeof (sizes[0]); i++)
+    bench_frame_parse (sizes[i]);
+  for (i = 0; i < sizeof (sizes) / sizeof (sizes[0]); i++) {
+    bench_client_receive (sizes[i], false);
+    bench_client_receive (sizes[i], true);
+  }
+  for (i = 0; i < sizeof (lz_sizes) / sizeof (lz_sizes[0]); i++) {
+    bench_lz (lz_sizes[i], true);
+    bench_lz (lz_sizes[i], false);
+  }
+  for (i = 0; i < sizeof (conn_counts) / sizeof (conn_counts[0]); i++)
+    bench_conn_lookup (conn_counts[i]);
+  return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,442 @@
+/**
+ * Copyright 2016 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "uthash.h"
+#include "cimpmsg.h"
+#include "cimpmsg_log.h"
+#include "cimpmsg_capture.h"
+
+/*------------------------------------------------------------------
+ * Replays a capture written by cmsg_server_capture against a server.
+ * Each captured connection is replayed on its own client connection,
+ * or with 'c N' the captured connections are spread over N. Frames
+ * are sent at their original spacing divided by the speed 'x', or
+ * back to back with 'x 0'. Requests are sent as requests, and their
+ * replies counted, subscriptions are re-subscribed.
+ *
+ * Example: cimpmsg_replay f /tmp/parodus.cap p 6666 x 2
+---------------------------------------------------------------------*/
+
+#define IP_ADDR "127.0.0.1"
+#define DEFAULT_PORT 6666
+#define SEND_TIMEOUT_MSECS 2000
+#define MAX_CONNS 1024
+
+struct options {
+  const char *file;
+  const char *addr;
+  unsigned int port;
+  unsigned int conn_count;  // 0 = one per captured connection
+  double speed;             // 0 = as fast as possible
+  unsigned int timeout_msecs;
+} OPT = {
+  .file = NULL, .addr = IP_ADDR, .port = DEFAULT_PORT, .conn_count = 0,
+  .speed = 1.0, .timeout_msecs = 5000
+};
+
+typedef struct conn_map {
+  uint64_t captured;
+  unsigned index;
+  UT_hash_handle hh;
+} conn_map_t;
+
+typedef struct replay_client {
+  client_conn_t conn;
+  pthread_t receiver;
+  bool connected;
+} replay_client_t;
+
+typedef struct replay_counts {
+  uint64_t records;
+  uint64_t msgs;
+  uint64_t requests;
+  uint64_t subscribes;
+  uint64_t skipped;
+  uint64_t send_errors;
+  uint64_t bytes;
+  uint64_t max_lag_ns;
+} replay_counts_t;
+
+static uint64_t replies = 0;
+static uint64_t reply_failures = 0;
+
+uint64_t replay_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ((uint64_t) ts.tv_sec * 1000000000ULL) + (uint64_t) ts.tv_nsec;
+}
+
+void sleep_until (uint64_t due_ns)
+{
+  struct timespec ts;
+
+  ts.tv_sec = (time_t) (due_ns / 1000000000ULL);
+  ts.tv_nsec = (long) (due_ns % 1000000000ULL);
+  while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    ;
+}
+
+void replay_log_sink (int level, uint64_t time_ns, const char *line,
+  size_t len, void *arg)
+{
+  (void) level;
+  (void) time_ns;
+  (void) arg;
+  fwrite (line, 1, len, stderr);
+}
+
+void on_reply (int status, char *reply, size_t sz_reply, void *arg)
+{
+  (void) arg;
+  if (status == 0) {
+    __atomic_add_fetch (&replies, 1, __ATOMIC_RELAXED);
+    cmsg_free_msg (reply, sz_reply);
+  } else
+    __atomic_add_fetch (&reply_failures, 1, __ATOMIC_RELAXED);
+}
+
+void *client_receiver_thread (void *arg)
+{
+  replay_client_t *client = (replay_client_t *) arg;
+
+  while (cmsg_client_receive (&client->conn) >= 0) {
+    cmsg_free_msg (client->conn.rcv_msg, client->conn.rcv_msg_size);
+    client->conn.rcv_msg = NULL;
+  }
+  return NULL;
+}
+
+/*------------------------------------------------------------------
+ * Capture file
+---------------------------------------------------------------------*/
+
+// returns the next record, or NULL at the end
+const cmsg_capture_rec_t *next_record (const char *map, size_t map_size, 
+  size_t *pos)
+{
+  const cmsg_capture_rec_t *rec;
+
+  if (*pos + sizeof (cmsg_capture_rec_t) > map_size)
+    return NULL;
+  rec = (const cmsg_capture_rec_t *) (map + *pos);
+  if ((rec->rec_size < sizeof (cmsg_capture_rec_t) + rec->msg_size) ||
+      (*pos + rec->rec_size > map_size))
+    return NULL;  // end of an unstopped capture, or truncated
+  *pos += rec->rec_size;
+  return rec;
+}
+
+const char *map_capture (size_t *map_size)
+{
+  const cmsg_capture_file_hdr_t *hdr;
+  struct stat st;
+  void *map;
+  int fd;
+
+  fd = open (OPT.file, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    fprintf (stderr, "Unable to open %s: %s\n", OPT.file, strerror (errno));
+    return NULL;
+  }
+  if ((fstat (fd, &st) != 0) || ((size_t) st.st_size < sizeof (cmsg_capture_file_hdr_t))) {
+    fprintf (stderr, "%s is not a capture file\n", OPT.file);
+    close (fd);
+    return NULL;
+  }
+  map = mmap (NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (MAP_FAILED == map) {
+    fprintf (stderr, "Unable to map %s: %s\n", OPT.file, strerror (errno));
+    return NULL;
+  }
+  hdr = (const cmsg_capture_file_hdr_t *) map;
+  if ((memcmp (hdr->magic, CMSG_CAPTURE_MAGIC, sizeof (hdr->magic)) != 0) ||
+      (hdr->version != CMSG_CAPTURE_VERSION) || (hdr->hdr_size > (size_t) st.st_size)) {
+    fprintf (stderr, "%s is not a version %d capture file\n", OPT.file, 
+      CMSG_CAPTURE_VERSION);
+    munmap (map, (size_t) st.st_size);
+    return NULL;
+  }
+  madvise (map, (size_t) st.st_size, MADV_SEQUENTIAL);
+  *map_size = (size_t) st.st_size;
+  return (const char *) map;
+}
+
+// assigns each captured connection a client index. Returns the number
+// of clients needed.
+unsigned map_connections (const char *map, size_t map_size, conn_map_t **conns)
+{
+  const cmsg_capture_file_hdr_t *hdr = (const cmsg_capture_file_hdr_t *) map;
+  const cmsg_capture_rec_t *rec;
+  size_t pos = hdr->hdr_size;
+  conn_map_t *entry;
+  unsigned count = 0;
+
+  while (NULL != (rec = next_record (map, map_size, &pos))) {
+    HASH_FIND (hh, *conns, &rec->conn, sizeof (rec->conn), entry);
+    if (NULL != entry)
+      continue;
+    entry = (conn_map_t *) malloc (sizeof (conn_map_t));
+    if (NULL == entry)
+      break;
+    entry->captured = rec->conn;
+    entry->index = (OPT.conn_count != 0) ? count % OPT.conn_count : count % MAX_CONNS;
+    HASH_ADD (hh, *conns, captured, sizeof (entry->captured), entry);
+    count++;
+  }
+  if (OPT.conn_count != 0)
+    return (count < OPT.conn_count) ? count : OPT.conn_count;
+  return (count < MAX_CONNS) ? count : MAX_CONNS;
+}
+
+/*------------------------------------------------------------------
+ * Replay
+---------------------------------------------------------------------*/
+
+void replay_record (replay_client_t *client, const cmsg_capture_rec_t *rec,
+  replay_counts_t *counts)
+{
+  const char *msg = (const char *) (rec + 1);
+  int rtn = 0;
+
+  switch (rec->kind) {
+    case CMSG_KIND_MSG:
+      rtn = cmsg_client_send (&client->conn, msg, rec->msg_size, false);
+      counts->msgs++;
+      break;
+    case CMSG_KIND_REQUEST:
+      rtn = cmsg_client_request (&client->conn, msg, rec->msg_size,
+        OPT.timeout_msecs, on_reply, NULL);
+      counts->requests++;
+      break;
+    case CMSG_CAPTURE_KIND_SUBSCRIBE:
+    case CMSG_CAPTURE_KIND_UNSUBSCRIBE:
+      if ((rec->msg_size == 0) || (msg[rec->msg_size-1] != '\0')) {
+        counts->skipped++;
+        return;
+      }
+      if (rec->kind == CMSG_CAPTURE_KIND_SUBSCRIBE)
+        rtn = cmsg_client_subscribe (&client->conn, msg);
+      else
+        rtn = cmsg_client_unsubscribe (&client->conn, msg);
+      counts->subscribes++;
+      break;
+    default:
+      counts->skipped++;
+      return;
+  }
+  if (rtn != 0)
+    counts->send_errors++;
+  else
+    counts->bytes += rec->msg_size;
+}
+
+int replay (const char *map, size_t map_size, conn_map_t *conns,
+  replay_client_t *clients, replay_counts_t *counts)
+{
+  const cmsg_capture_file_hdr_t *hdr = (const cmsg_capture_file_hdr_t *) map;
+  const cmsg_capture_rec_t *rec;
+  size_t pos = hdr->hdr_size;
+  uint64_t first_ns = 0, start_ns = replay_ns (), due_ns, now_ns;
+  conn_map_t *entry;
+
+  while (NULL != (rec = next_record (map, map_size, &pos))) {
+    if (counts->records++ == 0)
+      first_ns = rec->time_ns;
+    if (OPT.speed > 0) {
+      due_ns = start_ns + (uint64_t) ((double) (rec->time_ns - first_ns) / OPT.speed);
+      now_ns = replay_ns ();
+      if (now_ns < due_ns)
+        sleep_until (due_ns);
+      else if (now_ns - due_ns > counts->max_lag_ns)
+        counts->max_lag_ns = now_ns - due_ns;
+    }
+    HASH_FIND (hh, conns, &rec->conn, sizeof (rec->conn), entry);
+    if ((NULL == entry) || !clients[entry->index].connected) {
+      counts->skipped++;
+      continue;
+    }
+    replay_record (&clients[entry->index], rec, counts);
+  }
+  return 0;
+}
+
+double parse_speed (const char *arg)
+{
+  char *end;
+  double speed = strtod (arg, &end);
+
+  if ((end == arg) || (*end != '\0') || (speed < 0)) {
+    fprintf (stderr, "Invalid speed %s\n", arg);
+    return -1;
+  }
+  return speed;
+}
+
+unsigned int parse_num_arg (const char *arg, const char *arg_name)
+{
+  unsigned int result = 0;
+  int i;
+  char c;
+
+  if (arg[0] == '\0') {
+    fprintf (stderr, "Empty %s argument\n", arg_name);
+    return (unsigned int) -1;
+  }
+  for (i=0; '\0' != (c=arg[i]); i++) {
+    if ((c<'0') || (c>'9')) {
+      fprintf (stderr, "Non-numeric %s argument\n", arg_name);
+      return (unsigned int) -1;
+    }
+    result = (result*10) + c - '0';
+  }
+  return result;
+}
+
+int get_args (const int argc, const char **argv)
+{
+  int i;
+  int mode = 0;
+
+  for (i=1; i<argc; i++) {
+    const char *arg = argv[i];
+    if ((mode == 0) && (strlen (arg) == 1) && (strchr ("fapcxt", arg[0]) != NULL)) {
+      mode = arg[0];
+      continue;
+    }
+    if (mode == 'f')
+      OPT.file = arg;
+    else if (mode == 'a')
+      OPT.addr = arg;
+    else if (mode == 'p') {
+      OPT.port = parse_num_arg (arg, "port");
+      if (OPT.port == (unsigned) -1)
+        return -1;
+    } else if (mode == 'c') {
+      OPT.conn_count = parse_num_arg (arg, "connection count");
+      if ((OPT.conn_count == (unsigned) -1) || (OPT.conn_count > MAX_CONNS))
+        return -1;
+    } else if (mode == 'x') {
+      OPT.speed = parse_speed (arg);
+      if (OPT.speed < 0)
+        return -1;
+    } else if (mode == 't') {
+      OPT.timeout_msecs = parse_num_arg (arg, "timeout");
+      if (OPT.timeout_msecs == (unsigned) -1)
+        return -1;
+    } else {
+      fprintf (stderr, "Invalid argument %s\n", arg);
+      return -1;
+    }
+    mode = 0;
+  }
+  if ((mode != 0) || (NULL == OPT.file))
+    return -1;
+  return 0;
+}
+
+int main (int argc, const char **argv)
+{
+  static const client_conn_t conn_init = CMSG_CLIENT_CONN_INITIALIZER;
+  const char *map;
+  size_t map_size;
+  conn_map_t *conns = NULL;
+  conn_map_t *entry, *tmp;
+  replay_client_t *clients;
+  replay_counts_t counts;
+  unsigned i, client_count;
+  uint64_t start_ns, end_ns, wait_until_ns;
+  int rtn;
+
+  if (get_args (argc, argv) != 0) {
+    fprintf (stderr, "Usage: %s f capture_file [a addr] [p port] [c conns] "
+      "[x speed, 0 = max] [t request_timeout_msecs]\n", argv[0]);
+    return 4;
+  }
+  cmsg_log_set_level (LEVEL_ERROR);
+  cmsg_log_set_sink (replay_log_sink, NULL);
+  map = map_capture (&map_size);
+  if (NULL == map)
+    return 4;
+  client_count = map_connections (map, map_size, &conns);
+  if (client_count == 0) {
+    fprintf (stderr, "No frames in %s\n", OPT.file);
+    return 4;
+  }
+  clients = (replay_client_t *) calloc (client_count, sizeof (replay_client_t));
+  if (NULL == clients)
+    return 4;
+  for (i = 0; i < client_count; i++) {
+    clients[i].conn = conn_init;
+    rtn = cmsg_connect_client (&clients[i].conn, OPT.addr, OPT.port, SEND_TIMEOUT_MSECS);
+    if (rtn != 0) {
+      fprintf (stderr, "Unable to connect to %s:%u: %s\n", OPT.addr, OPT.port,
+        strerror (rtn));
+      continue;
+    }
+    clients[i].connected = (pthread_create (&clients[i].receiver, NULL,
+      client_receiver_thread, &clients[i]) == 0);
+  }
+
+  memset (&counts, 0, sizeof (counts));
+  start_ns = replay_ns ();
+  replay (map, map_size, conns, clients, &counts);
+  end_ns = replay_ns ();
+  // outstanding replies
+  wait_until_ns = end_ns + OPT.timeout_msecs * 1000000ULL;
+  while ((__atomic_load_n (&replies, __ATOMIC_RELAXED) +
+          __atomic_load_n (&reply_failures, __ATOMIC_RELAXED) < counts.requests) &&
+         (replay_ns () < wait_until_ns))
+    usleep (1000);
+
+  for (i = 0; i < client_count; i++)
+    if (clients[i].connected) {
+      cmsg_shutdown_client (&clients[i].conn);
+      pthread_join (clients[i].receiver, NULL);
+    }
+  printf ("records %llu over %u connections in %.3f secs (%.0f/sec)\n",
+    (unsigned long long) counts.records, client_count, (end_ns - start_ns) / 1e9,
+    counts.records / ((end_ns - start_ns) / 1e9));
+  printf ("msgs %llu requests %llu replies %llu reply_failures %llu subscribes %llu\n",
+    (unsigned long long) counts.msgs, (unsigned long long) counts.requests,
+    (unsigned long long) replies, (unsigned long long) reply_failures,
+    (unsigned long long) counts.subscribes);
+  printf ("bytes %llu send_errors %llu skipped %llu max_lag_ms %.3f\n",
+    (unsigned long long) counts.bytes, (unsigned long long) counts.send_errors,
+    (unsigned long long) counts.skipped, counts.max_lag_ns / 1e6);
+
+  HASH_ITER (hh, conns, entry, tmp) {
+    HASH_DEL (conns, entry);
+    free (entry);
+  }
+  free (clients);
+  munmap ((void *) map, map_size);
+  return (counts.send_errors == 0) ? 0 : 1;
+}
@@ -5,14 +5,27 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include "utlist.h"
+#include "uthash.h"
 #include "cimpmsg.h"
 #include "cimpmsg_log.h"
+#include "cimpmsg_hist.h"
+#include "cimpmsg_probes.h"
+#include "cimpmsg_capture.h"
+#include "cimpmsg_lz.h"
 
 /*------------------------------------------------------------------
  * client receive should be blocking, but have a timeout so we can
@@ -23,73 +36,305 @@
 *  server send should be non-bocking so we can do send all
 ---------------------------------------------------------------------*/
 
+/*------------------------------------------------------------------
+ * Frame formats
+ *   basic:    EE EE len(2)                           then len bytes
+ *   extended: EE E1 kind flags len(4) corr_id(4)     then len bytes
+ * Plain messages use the basic header so older peers can read them.
+ * The extended header is used for requests and replies, and for plain
+ * messages over 64 KB to a peer that has sent a HELLO:
+ *   hello:    version(1) flags(1) reserved(2) max_msg_size(4)
+ * A client that allows large messages, or compression, sends one after
+ * connecting, and the server answers with its own. A peer that never
+ * sends one only gets basic frames for plain messages.
+ * With FRAME_LZ in flags, len bytes are orig_size(4) then the message
+ * compressed by cimpmsg_lz.c. Only sent to a peer whose HELLO has
+ * HELLO_LZ.
+---------------------------------------------------------------------*/
 #define MSG_HEADER_MARK 0xEE
+#define MSG_HEADER_MARK_EXT 0xE1
+#define MSG_HEADER_SIZE 4
+#define MSG_EXT_HEADER_SIZE 12
+#define MAX_BASIC_MSG_SIZE 65535
+#define MAX_EXT_MSG_SIZE (16*1024*1024)
+
+// extended frame kinds handled inside the library
+#define KIND_SUBSCRIBE		3
+#define KIND_UNSUBSCRIBE	4
+#define KIND_HELLO		5
+#define KIND_MAX		KIND_HELLO
+
+#define HELLO_SIZE		8
+#define PROTO_VERSION		2
+#define HELLO_LZ		0x01  // takes compressed frames
+
+#define FRAME_LZ		0x01
+#define LZ_HEADER_SIZE		4
+// in a server connection's peer_max_msg, from HELLO_LZ
+#define PEER_LZ			0x80000000u
+
+#define MAX_ROUTE_NAME_SIZE	256
+
+#define CLIENT_STATE_IDLE		0
+#define CLIENT_STATE_DISCONNECTED	1
+#define CLIENT_STATE_CONNECTING		2
+#define CLIENT_STATE_CONNECTED		3
+
+#define DEFAULT_RECONNECT_MIN_MSECS	100
+#define DEFAULT_RECONNECT_MAX_MSECS	30000
+#define DEFAULT_MAX_QUEUED_MSGS		256
+#define RECONNECT_POLL_MSECS		20
+#define CLIENT_READ_AHEAD		4096
+#define HELLO_WAIT_MSECS		1000
 
+// where client_receive_msg leaves a message
+#define RCV_ALLOC	0  // a new buffer, freed by the caller
+#define RCV_COPY	1  // the caller's buffer
+#define RCV_VIEW	2  // the read-ahead buffer, until the next receive
+
+typedef struct client_queued_msg {
+  size_t sz_frame;
+  uint64_t queued_ns;
+  struct client_queued_msg *next;
+  char frame[];
+} client_queued_msg_t;
+
+// Client read-ahead. Frames are parsed out of it, so one recv can
+// serve several messages. Protected by rcv_mutex.
+typedef struct client_rcv_buf {
+  int sock;         // the socket the buffered bytes came from
+  size_t capacity;
+  size_t start;     // first unread byte
+  size_t end;
+  char data[];
+} client_rcv_buf_t;
 
 typedef struct conn_user_data {
   bool close_request;
+  bool handed_in;  // from cmsg_server_create_handoff, not yet announced
 } conn_user_data_t;
 
+struct route;
+
+// a connection's membership in a route
+typedef struct route_sub {
+  struct route *route;
+  struct route_sub *next;
+} route_sub_t;
+
+// subscribers of a service name or topic, hashed on name
+typedef struct route {
+  char *name;
+  unsigned sub_count;
+  unsigned sub_alloc;
+  struct connection **subs;
+  UT_hash_handle hh;
+} route_t;
+
+typedef struct client_subscription {
+  struct client_subscription *next;
+  char name[];
+} client_subscription_t;
+
+// work posted to the listen thread, see cmsg_server_post
+typedef struct server_task {
+  struct server_task *next;
+  cmsg_task_t fn;
+  void *arg;
+  uint64_t posted_ns;
+} server_task_t;
+
+typedef struct server_timer {
+  int id;
+  int fd;
+  int poll_pos;  // in the current poll set, or -1
+  bool one_shot;
+  cmsg_task_t fn;
+  void *arg;
+  struct server_timer *next;
+} server_timer_t;
+
+// per connection counters, each written under one lock or thread
+typedef struct conn_stats {
+  uint64_t msgs_rcvd;
+  uint64_t bytes_rcvd;
+  uint64_t partial_reads;
+  uint64_t msgs_sent;
+  uint64_t bytes_sent;
+  uint64_t send_errors;
+} conn_stats_t;
+
+enum {
+  STAT_MSGS_RCVD, STAT_BYTES_RCVD, STAT_MSGS_SENT, STAT_BYTES_SENT,
+  STAT_PARTIAL_READS, STAT_RCV_ERRORS, STAT_SEND_ERRORS, STAT_SEND_DROPS,
+  STAT_CONNS_ACCEPTED, STAT_CONNS_CLOSED, STAT_CONNS_REFUSED, STAT_MSGS_SHED,
+  STAT_BYTES_SHED, STAT_COUNT
+};
+
+// one cache line per thread slot
+#define STATS_SLOTS		16
+#define STATS_SLOT_SIZE		16  // uint64_t per slot, >= STAT_COUNT
+
+typedef struct stats_block {
+  uint64_t slot[STATS_SLOTS][STATS_SLOT_SIZE];
+} stats_block_t;
+
+// Receive state of a frame being read. A server connection takes one
+// from the server's pool at its first frame, and gives it back after
+// buf_idle_msecs without input, so idle connections hold none.
+typedef struct conn_rx {
+  char *rcv_msg;
+  size_t rcv_msg_size;
+  size_t rcv_end_pos;
+  uint8_t msg_kind;
+  uint8_t flags;  // FRAME_ bits of an extended header
+  uint8_t hdr_len;  // bytes of a frame header that arrived in pieces
+  unsigned char hdr[MSG_EXT_HEADER_SIZE];
+  uint32_t corr_id;
+  uint64_t last_used_ns;
+  struct conn_rx *next;  // pool link
+} conn_rx_t;
+
+// kept small, as most connections are idle (see bench/cimpmsg_memfoot.c)
 typedef struct connection {
   int oserr;
   int rcv_state;
+  int sock;
+  uint32_t slab_index;
+  uint32_t generation;
+  uint32_t next_free;  // slab free list link
   bool rcv_selected;
-  struct conn_user_data *user_data;
-  struct timespec last_active;
-  pthread_mutex_t conn_access_mutex;
-  size_t rcv_end_pos;
-  server_rcv_msg_data_t rcv_data;
+  bool read_backlog;  // stopped by the budget with input left
+  struct conn_user_data user_data;
+  uint32_t peer_max_msg;  // from the client's HELLO, 0 = basic frames only, | PEER_LZ
+  uint64_t last_active_ns;  // atomic, see set_last_active_time
+  int64_t read_deficit;  // bytes, see server_receive_conn
+  struct cmsg_server *server;  // NULL on the client side
+  struct conn_rx *rx;  // while frames are arriving
+  struct route_sub *routes;
+  conn_stats_t stats;
   struct connection * next;
 } connection_t;
 
 
-static struct server_stuff {
+struct cmsg_server {
   unsigned int port;
   struct sockaddr_in addr;
   int listen_sock;
   bool terminate_on_keypress;
   bool close_conn_on_error;
   bool linger0_on_server_shutdown;
+  bool inactive_toggle;
   int listen_state;  // 0=idle, 1=listening, 2=shutting-down
   unsigned idle_notify_secs;
   unsigned inactive_conn_notify_secs;
   unsigned max_bind_wait;
+  unsigned read_quantum;
+  unsigned read_max_msgs;
+  unsigned read_start;  // rotates where each receive pass starts
+  unsigned max_conns;
+  uint64_t shed_lag_ns;
+  unsigned shed_msg_size;
+  uint32_t max_msg_size;
+  unsigned compress_threshold;
+  uint64_t buf_idle_ns;
+  struct conn_rx *rx_pool;  // listen thread only
+  unsigned rx_pool_count;
   pthread_mutex_t connect_mutex;
   pthread_mutex_t list_mutex;
   struct connection * connection_list;
-} SRV
- = { .port = (unsigned int) -1, .listen_sock = -1,
-     .terminate_on_keypress = true,
-     .close_conn_on_error = true,
-     .linger0_on_server_shutdown = true,
-     .listen_state = 0,
-     .idle_notify_secs = 2,
-     .inactive_conn_notify_secs = 30,
-     .max_bind_wait = 75,
-     .connect_mutex = PTHREAD_MUTEX_INITIALIZER,
-     .list_mutex = PTHREAD_MUTEX_INITIALIZER,
-     .connection_list = NULL
-   };
+  struct route *routes;  // protected by list_mutex
+  // connection slab, protected by list_mutex. Chunks never move, so
+  // connection pointers stay valid while the slab grows.
+  struct connection **slab_chunks;
+  unsigned slab_chunk_count;
+  uint32_t slab_free_head;
+  unsigned slab_used;  // open connections
+  stats_block_t *stats;
+  cmsg_hist_t *latency[STATS_SLOTS];  // per thread slot, allocated on use
+  uint64_t ready_ns;  // when poll last returned, listen thread only
+  uint64_t behind_ns;  // when a pass last began with no backlog, for shedding
+  bool read_backlog;  // the last pass left a connection backlogged
+  // poll set, rebuilt by the listen thread on each wait
+  struct pollfd *poll_fds;
+  struct connection **poll_conns;  // NULL for the non connection fds
+  unsigned poll_capacity;
+  unsigned poll_count;  // entries of the last wait
+  int stats_sock;
+  char *stats_path;
+  // live upgrade, see cmsg_server_handoff_listen. Once handed_off, the
+  // sockets belong to the new process and are closed without shutdown.
+  int handoff_sock;
+  char *handoff_path;
+  bool handed_off;
+  // traffic capture, see cimpmsg_capture.h. capture_on is checked
+  // without the mutex, the rest needs capture_mutex.
+  bool capture_on;
+  pthread_mutex_t capture_mutex;
+  int capture_fd;
+  char *capture_map;
+  size_t capture_size;  // mapped and allocated
+  size_t capture_len;   // written
+  // tasks posted to the listen thread, and its timers
+  int task_fd;  // eventfd
+  bool task_wake;  // task_fd written and not yet read
+  struct server_task *task_head;  // last pushed, swapped by producers
+  struct server_task *task_tail;  // next to pop, listen thread only
+  struct server_task task_stub;
+  pthread_mutex_t timer_mutex;
+  struct server_timer *timers;
+  int last_timer_id;
+};
 
+#define CONN_SLAB_CHUNK		64
+
+#define DEFAULT_READ_QUANTUM	4096
+#define DEFAULT_READ_MAX_MSGS	1
+#define LOOP_READ_MAX_MSGS	8
+#define DEFAULT_BUF_IDLE_MSECS	1000
+#define RX_POOL_MAX		64  // spare conn_rx kept per server
+#define CONN_SLAB_NONE		((uint32_t) -1)
+
+// server used by the original single server API
+static cmsg_server_t *default_server = NULL;
+static pthread_mutex_t default_server_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// NULL hooks mean malloc, see cmsg_set_allocator
+static cmsg_allocator_t allocator = {NULL, NULL, NULL};
+
+CMSG_PROBE_SEMAPHORE (accept);
+CMSG_PROBE_SEMAPHORE (header);
+CMSG_PROBE_SEMAPHORE (msg_complete);
+CMSG_PROBE_SEMAPHORE (callback_enter);
+CMSG_PROBE_SEMAPHORE (callback_exit);
+CMSG_PROBE_SEMAPHORE (send_start);
+CMSG_PROBE_SEMAPHORE (send_end);
+CMSG_PROBE_SEMAPHORE (close);
 
 
 void init_connection (struct connection *conn)
 {
-  conn->rcv_data.sock = -1;
+  conn->sock = -1;
+  conn->server = NULL;
   conn->oserr = 0;
   conn->rcv_state = -1;
   conn->rcv_selected = false;
-  conn->rcv_data.rcv_msg_size = 0;
-  conn->user_data = NULL;
-  pthread_mutex_init (&conn->conn_access_mutex, NULL);
-  conn->rcv_end_pos = 0;
-  conn->rcv_data.rcv_msg = NULL;
+  conn->user_data.close_request = false;
+  conn->user_data.handed_in = false;
+  conn->peer_max_msg = 0;
+  conn->last_active_ns = 0;
+  conn->read_deficit = 0;
+  conn->read_backlog = false;
+  conn->rx = NULL;
+  conn->routes = NULL;
+  memset (&conn->stats, 0, sizeof (conn->stats));
   conn->next = NULL;
 }
 
 void init_client_conn (struct client_conn *conn)
 {
   conn->sock = -1;
+  conn->rcv_sock = -1;
   conn->oserr = 0;
   conn->rcv_msg = NULL;
   conn->rcv_msg_size = 0;
@@ -97,151 +342,134 @@ void init_client_conn (struct client_conn *conn)
   conn->terminated = false;
   pthread_mutex_init (&conn->send_mutex, NULL);
   pthread_mutex_init (&conn->rcv_mutex, NULL);
+  memset (&conn->opts, 0, sizeof (conn->opts));
+  conn->conn_state = CLIENT_STATE_IDLE;
+  conn->send_timeout_msecs = (unsigned int) -1;
+  conn->reconnect_attempts = 0;
+  conn->rand_seed = 0;
+  conn->queued_count = 0;
+  conn->send_queue_head = NULL;
+  conn->send_queue_tail = NULL;
+  conn->rpc = NULL;
+  conn->subscriptions = NULL;
+  conn->rcv_buf = NULL;
+  conn->peer_max_msg_size = 0;
+  conn->peer_compress = false;
+  memset (&conn->stats, 0, sizeof (conn->stats));
+  conn->latency = NULL;
 }
 
-bool time_is_older (struct timespec *t1, struct timespec *t2)
+void init_client_opts (client_opts_t *opts, const client_opts_t *options)
 {
-  static bool test_toggle = false;
+  *opts = *options;
+  if (0 == opts->reconnect_min_msecs)
+    opts->reconnect_min_msecs = DEFAULT_RECONNECT_MIN_MSECS;
+  if (0 == opts->reconnect_max_msecs)
+    opts->reconnect_max_msecs = DEFAULT_RECONNECT_MAX_MSECS;
+  if (opts->reconnect_max_msecs < opts->reconnect_min_msecs)
+    opts->reconnect_max_msecs = opts->reconnect_min_msecs;
+  if (0 == opts->max_queued_msgs)
+    opts->max_queued_msgs = DEFAULT_MAX_QUEUED_MSGS;
+  if (opts->max_msg_size > MAX_EXT_MSG_SIZE)
+    opts->max_msg_size = MAX_EXT_MSG_SIZE;
+}
 
-  if (t1->tv_sec < t2->tv_sec)
-    return true;
-  if (t1->tv_sec > t2->tv_sec)
-    return false;
-  if (t1->tv_nsec < t2->tv_nsec)
-    return true;
-  if (t1->tv_nsec > t2->tv_nsec)
-    return false;
-  test_toggle = !test_toggle;
-  return test_toggle;
+bool time_is_older (uint64_t t1_ns, uint64_t t2_ns, bool *test_toggle)
+{
+  if (t1_ns != t2_ns)
+    return t1_ns < t2_ns;
+  *test_toggle = !*test_toggle;
+  return *test_toggle;
+}
+
+void time_add_msecs (struct timespec *t, unsigned msecs)
+{
+  t->tv_sec += msecs / 1000;
+  t->tv_nsec += (long) (msecs % 1000) * 1000000L;
+  if (t->tv_nsec >= 1000000000L) {
+    t->tv_sec += 1;
+    t->tv_nsec -= 1000000000L;
+  }
+}
+
+uint64_t get_monotonic_ns (void)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return ((uint64_t) now.tv_sec * 1000000000ULL) + (uint64_t) now.tv_nsec;
 }
 
-bool time_is_out_of_date (struct timespec *t1, unsigned secs)
+// t is CLOCK_MONOTONIC
+bool time_has_arrived (struct timespec *t)
 {
   struct timespec current;
-  unsigned t1_plus_secs = t1->tv_sec + secs;
 
-  clock_gettime (CLOCK_REALTIME, &current);
-  if (t1_plus_secs < current.tv_sec)
-    return true;
-  if (t1_plus_secs > current.tv_sec)
-    return false;
-  if (t1->tv_nsec <= current.tv_nsec)
-    return true;
-  return false;
+  clock_gettime (CLOCK_MONOTONIC, &current);
+  if (current.tv_sec != t->tv_sec)
+    return (current.tv_sec > t->tv_sec);
+  return (current.tv_nsec >= t->tv_nsec);
+}
+
+cmsg_conn_t conn_handle (struct connection *conn)
+{
+  return ((cmsg_conn_t) conn->generation << 32) | conn->slab_index;
 }
 
+// written by the listen thread and senders, so stored atomically
 void set_last_active_time (struct connection *conn)
 {
-  pthread_mutex_lock (&conn->conn_access_mutex);
-  clock_gettime (CLOCK_REALTIME, &conn->last_active);
-  pthread_mutex_unlock (&conn->conn_access_mutex);
+  __atomic_store_n (&conn->last_active_ns, get_monotonic_ns (), __ATOMIC_RELAXED);
+}
+
+uint64_t get_last_active_time (struct connection *conn)
+{
+  return __atomic_load_n (&conn->last_active_ns, __ATOMIC_RELAXED);
 }
 
-void check_inactive_connections (process_message_t handle_msg)
+// what the callback is given for conn, with_msg for the frame just read
+void conn_msg_data (struct connection *conn, server_rcv_msg_data_t *data,
+  bool with_msg)
+{
+  data->server = conn->server;
+  data->conn = conn_handle (conn);
+  data->sock = conn->sock;
+  if (with_msg) {
+    data->rcv_msg = conn->rx->rcv_msg;
+    data->rcv_msg_size = conn->rx->rcv_msg_size;
+    data->msg_kind = conn->rx->msg_kind;
+    data->corr_id = conn->rx->corr_id;
+  } else {
+    data->rcv_msg = NULL;
+    data->rcv_msg_size = 0;
+    data->msg_kind = CMSG_KIND_MSG;
+    data->corr_id = 0;
+  }
+}
+
+void check_inactive_connections (struct cmsg_server *srv, process_message_t handle_msg)
 {
   struct connection *conn;
   struct connection *oldest_inactive = NULL;
+  server_rcv_msg_data_t rcv_msg_data;
 
-  LL_FOREACH (SRV.connection_list, conn)
+  LL_FOREACH (srv->connection_list, conn)
     if (conn->rcv_state >= 0) {
       if ((NULL == oldest_inactive) ||
-          (time_is_older (&conn->last_active, &oldest_inactive->last_active)) )
+          (time_is_older (get_last_active_time (conn), 
+             get_last_active_time (oldest_inactive), &srv->inactive_toggle)) )
         oldest_inactive = conn;
     }
 
   if (NULL != oldest_inactive)
-    if (time_is_out_of_date (&oldest_inactive->last_active, SRV.inactive_conn_notify_secs)) {
-      handle_msg (CMSG_ACTION_CONN_INACTIVE, &oldest_inactive->rcv_data);
+    if (get_monotonic_ns () - get_last_active_time (oldest_inactive) >= 
+        (uint64_t) srv->inactive_conn_notify_secs * 1000000000ULL) {
+      conn_msg_data (oldest_inactive, &rcv_msg_data, false);
+      handle_msg (CMSG_ACTION_CONN_INACTIVE, &rcv_msg_data);
       set_last_active_time (oldest_inactive);
     }
 }
 
-int wait_server_ready (process_message_t handle_msg, bool *terminated, bool *any_closing)
-{
-  struct timeval select_timeout;
-  struct connection *conn;
-  int rtn, sock, highest_sock;
-  unsigned idle_timeout_count = 0;
-  unsigned max_idle_count;
-  fd_set fds;
-  server_rcv_msg_data_t notify_data = {
-    .sock = -1, .rcv_msg = NULL, .rcv_msg_size = 0
-  };
-
-  max_idle_count = SRV.idle_notify_secs * 2; 
-  highest_sock = -1;
-
-  while (1)
-  {
-    check_inactive_connections (handle_msg);
-    select_timeout.tv_sec = 0;
-    select_timeout.tv_usec = 500000;
-    FD_ZERO (&fds);
-    if (SRV.listen_sock != -1) {
-      FD_SET (SRV.listen_sock, &fds);
-      highest_sock = SRV.listen_sock;
-      // printf ("Waiting on listener %d\n", listen_sock);
-    }
-    // Prepare for 'select'
-    LL_FOREACH (SRV.connection_list, conn) {
-      conn->rcv_selected = false;
-      if (conn->rcv_state >= 0) {
-        sock = conn->rcv_data.sock;
-        if (conn->user_data->close_request) {
-          conn->rcv_state = -2;
-          *any_closing = true;
-          cmsg_log (LEVEL_DEBUG, ("CIMPMSG: Got close request for socket %d\n", sock));
-          continue;
-        } 
-        // printf ("Waiting on %d\n", sock);
-        if (sock > highest_sock)
-          highest_sock = sock;
-        FD_SET (sock, &fds);
-      }
-    }
-    if (SRV.terminate_on_keypress) {
-      FD_SET (STDIN_FILENO, &fds);
-    }
-    rtn = select (highest_sock+1, &fds, NULL, NULL, &select_timeout);
-    if (rtn < 0) {
-      cmsg_log (LEVEL_ERROR, ("CIMPMSG: Error on select for receive\n"));
-      return -1;
-    }
-    if (rtn != 0)
-      break;
-    if (*any_closing)
-      break;
-    if (max_idle_count != 0) {
-      ++idle_timeout_count;
-      if (idle_timeout_count >= max_idle_count) {
-        handle_msg (CMSG_ACTION_ALL_IDLE_NOTIFY, &notify_data);
-        idle_timeout_count = 0;
-      }
-    }
-    if (NULL != terminated)
-      if (*terminated)
-        break;
-  }
-  rtn = 0;
-  if (SRV.listen_sock != -1)
-    if (FD_ISSET (SRV.listen_sock, &fds))
-      rtn = 1;
-  // flag all sockets ready to read as indicated by 'select'
-  LL_FOREACH (SRV.connection_list, conn) {
-    if (conn->rcv_state >= 0) {
-      if (FD_ISSET (conn->rcv_data.sock, &fds)) {
-        conn->rcv_selected = true;
-        rtn |= 2;
-      }
-    }
-  }
-  if (SRV.terminate_on_keypress) {
-    if (FD_ISSET (STDIN_FILENO, &fds))
-      rtn |= 4;
-  }
-  return rtn;
-}
-
 int make_sockaddr (struct sockaddr_in *addr, 
   const char *ip_addr, unsigned int port, bool rcv_any)
 {
@@ -263,13 +491,19 @@ int make_sockaddr (struct sockaddr_in *addr,
   return 0;
 }
 
-int server_bind_to_sock (int sock)
+int server_bind_to_sock (struct cmsg_server *srv, int sock)
 {
-  unsigned delay = 0;
-  unsigned total_delay = 0;
+  unsigned delay_ms = 0;
+  unsigned total_ms = 0;
+  int on = 1;
 
+  // TIME_WAIT sockets left by the last run (whose listener also set
+  // SO_REUSEADDR) must not block the bind, only a live listener does
+  if (setsockopt (sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on)) != 0)
+    cmsg_log_err (LEVEL_ERROR, errno, 
+	("CIMPMSG: Unable to set SO_REUSEADDR on receive socket"));
   while (true) {
-    if (bind (sock, (struct sockaddr *) &SRV.addr, 
+    if (bind (sock, (struct sockaddr *) &srv->addr, 
          sizeof (struct sockaddr_in)) == 0) 
        return 0;
     if (errno != EADDRINUSE) {
@@ -277,268 +511,3077 @@ int server_bind_to_sock (int sock)
 	  ("CIMPMSG: Unable to bind to receive socket"));
       return errno;
     }
-    if (total_delay >= SRV.max_bind_wait)
+    if (total_ms >= srv->max_bind_wait * 1000)
       return errno;
-    if (delay == 0)
-      delay = 5;
-    else if (delay == 5)
-      delay = 10;
+    // the previous process is usually just exiting, so start short
+    if (delay_ms == 0)
+      delay_ms = 50;
+    else if (delay_ms < 2500)
+      delay_ms *= 2;
     else
-      delay = 15;
-    cmsg_log (LEVEL_INFO, ("CIMPMSG: bind address already in use. Waiting %u secs\n",
-      delay));
-    sleep (delay);
-    total_delay += delay;
+      delay_ms = 5000;
+    if (delay_ms >= 1000)
+      cmsg_log (LEVEL_INFO, 
+        ("CIMPMSG: bind address already in use. Waiting %u msecs\n", delay_ms));
+    usleep (delay_ms * 1000);
+    total_ms += delay_ms;
   } 
 }
 
+// Finds a listening socket passed by the service manager (systemd
+// socket activation: LISTEN_PID and LISTEN_FDS, fds from 3) that is
+// bound to the server's address and port. Returns -1 if there is none.
+int server_inherited_sock (struct cmsg_server *srv)
+{
+  const char *env;
+  struct sockaddr_in addr;
+  socklen_t len;
+  int fd, fd_count, val;
 
-int cmsg_connect_server (const char *ip_addr, unsigned int port,
-  server_opts_t *options)
+  env = getenv ("LISTEN_PID");
+  if ((NULL == env) || (strtol (env, NULL, 10) != (long) getpid ()))
+    return -1;
+  env = getenv ("LISTEN_FDS");
+  if (NULL == env)
+    return -1;
+  fd_count = (int) strtol (env, NULL, 10);
+  for (fd = 3; fd < 3 + fd_count; fd++) {
+    len = sizeof (val);
+    if ((getsockopt (fd, SOL_SOCKET, SO_ACCEPTCONN, &val, &len) != 0) || !val)
+      continue;
+    len = sizeof (val);
+    if ((getsockopt (fd, SOL_SOCKET, SO_TYPE, &val, &len) != 0) || 
+        (val != SOCK_STREAM))
+      continue;
+    len = sizeof (addr);
+    if ((getsockname (fd, (struct sockaddr *) &addr, &len) != 0) ||
+        (addr.sin_family != AF_INET) || (addr.sin_port != srv->addr.sin_port))
+      continue;
+    if ((addr.sin_addr.s_addr != INADDR_ANY) && 
+        (addr.sin_addr.s_addr != srv->addr.sin_addr.s_addr))
+      continue;
+    fcntl (fd, F_SETFD, FD_CLOEXEC);
+    cmsg_log (LEVEL_INFO, ("CIMPMSG: Using inherited listen socket %d\n", fd));
+    return fd;
+  }
+  return -1;
+}
+
+
+/*------------------------------------------------------------------
+ * Runtime statistics. Server totals are kept in per-thread slots: the
+ * first STATS_SLOTS-1 threads that count something each own a slot
+ * and update it with plain relaxed stores, later threads share the
+ * last slot using atomic adds. Readers sum the slots.
+---------------------------------------------------------------------*/
+
+static __thread unsigned stats_thread_slot = 0;  // slot + 1, 0 = unassigned
+static unsigned stats_slots_taken = 0;
+
+unsigned stats_get_slot (void)
 {
-	int sock, rtn;
+  unsigned slot;
 
-	pthread_mutex_lock (&SRV.connect_mutex);
-	if (SRV.listen_sock != -1) {
-	  cmsg_log (LEVEL_ERROR, ("CIMPMSG: server already connected\n"));
-	  pthread_mutex_unlock (&SRV.connect_mutex);
-	  return EALREADY;
-	}
-	if (NULL != options) {
-		SRV.terminate_on_keypress = options->terminate_on_keypress;
-		SRV.idle_notify_secs = options->all_idle_notify_secs;
-                if (0 != options->inactive_conn_notify_secs)
-                  SRV.inactive_conn_notify_secs = options->inactive_conn_notify_secs;
-	}
+  if (stats_thread_slot == 0) {
+    slot = __atomic_fetch_add (&stats_slots_taken, 1, __ATOMIC_RELAXED);
+    if (slot >= STATS_SLOTS)
+      slot = STATS_SLOTS - 1;
+    stats_thread_slot = slot + 1;
+  }
+  return stats_thread_slot - 1;
+}
 
-	if ((NULL == ip_addr) || ((unsigned int) -1 == port)) {
-		SRV.listen_sock = -1;
-		cmsg_log (LEVEL_ERROR, 
-		  ("CIMPMSG: Invalid ip addr or port for cmsg_server_connect\n"));
-		pthread_mutex_unlock (&SRV.connect_mutex);
-		return EINVAL;
-	}
+void stats_add (stats_block_t *stats, int stat, uint64_t n)
+{
+  unsigned slot = stats_get_slot ();
+  uint64_t *counter = &stats->slot[slot][stat];
 
-	if (make_sockaddr (&SRV.addr, ip_addr, port, false) != 0) {
-	  pthread_mutex_unlock (&SRV.connect_mutex);
-          return EINVAL;
-	}
-	sock = socket (AF_INET, SOCK_STREAM, 0);
-	if (sock < 0) {
-	  cmsg_log_err (LEVEL_ERROR, errno, 
-		("CIMPMSG: Unable to create rcv socket"));
-	  pthread_mutex_unlock (&SRV.connect_mutex);
-	  return errno;
-	}
-#if 0
-	int flags = fcntl (sock, F_GETFL);
-	if (flags == -1) {
-		dbg_err (errno, "Unable to get socket flags: \n");
-		close (sock);
- 		return -1;
-	}
-	flags |= O_NONBLOCK;
-	if (fcntl (sock, F_SETFL, flags) == -1) {
-		dbg_err (errno, "Unable to set socket flags: \n");
-		close (sock);
- 		return -1;
-	}
-#endif
-        rtn = server_bind_to_sock (sock);
-	if (rtn != 0) {
-	  close (sock);
-	  pthread_mutex_unlock (&SRV.connect_mutex);
-	  return rtn;
-	}
-	if (listen (sock, 50) == -1) {
-	  cmsg_log_err (LEVEL_ERROR, errno, 
-		("CIMPMSG: Listen error on receive socket:"));
-	  rtn = errno;
-	  close (sock);
-	  pthread_mutex_unlock (&SRV.connect_mutex);
-	  return rtn;
-	}
-	SRV.listen_sock = sock;
-	pthread_mutex_unlock (&SRV.connect_mutex);
-	return 0;
+  if (slot == STATS_SLOTS - 1)
+    __atomic_fetch_add (counter, n, __ATOMIC_RELAXED);
+  else
+    __atomic_store_n (counter, 
+      __atomic_load_n (counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
 }
 
-struct connection *init_server_connection (int sock)
+uint64_t stats_sum (stats_block_t *stats, int stat)
 {
-  struct connection *conn;
+  unsigned i;
+  uint64_t sum = 0;
 
-  conn = (struct connection *) malloc (sizeof (struct connection));
-  if (NULL == conn) {
-    cmsg_log (LEVEL_ERROR, 
-	("CIMPMSG: Unable to malloc connection structure in receiver accept\n"));
-    return NULL;
-  }
-  init_connection (conn);
-  conn->rcv_state = 0;
-  conn->rcv_data.sock = sock;
-  conn->user_data = (struct conn_user_data *) malloc (sizeof (struct conn_user_data));
-  if (NULL == conn) {
-    cmsg_log (LEVEL_ERROR, 
-	("CIMPMSG: Unable to malloc connection user data in receiver accept\n"));
-    return NULL;
-  }
-  conn->user_data->close_request = false;
-  return conn;
+  for (i=0; i<STATS_SLOTS; i++)
+    sum += __atomic_load_n (&stats->slot[i][stat], __ATOMIC_RELAXED);
+  return sum;
 }
 
-int server_accept (process_message_t handle_msg)
+// for counters with a single writer at a time
+void counter_add (uint64_t *counter, uint64_t n)
 {
-  int sock;
-  struct connection *conn;
-  server_rcv_msg_data_t rcv_msg_data;
+  __atomic_store_n (counter, 
+    __atomic_load_n (counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
 
-  sock = accept (SRV.listen_sock, NULL, NULL);
-  if (sock < 0) {
-    if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
-      return 1;
-    cmsg_log_err (LEVEL_ERROR, errno, ("CIMPMSG: Accept error on receive socket:"));
-    close (SRV.listen_sock);
-    return 2;
-  }
-  cmsg_log (LEVEL_INFO, ("Accepted %d\n", sock));
-#if 0
-  int flags = fcntl (sock, F_GETFL);
-  if (flags == -1) {
-	dbg_err (errno, "Unable to get socket flags: \n");
-	close (sock);
-	return -1;
-  }
-  flags |= O_NONBLOCK;
-  if (fcntl (sock, F_SETFL, flags) == -1) {
-	dbg_err (errno, "Unable to set socket flags: \n");
-	close (sock);
-	return -1;
-  }
-#endif
-  conn = init_server_connection (sock);
-  if (NULL == conn) {
-    return -1;
-  }
-  rcv_msg_data = conn->rcv_data; // save data for the callback
-  clock_gettime (CLOCK_REALTIME, &conn->last_active);
-  pthread_mutex_lock (&SRV.list_mutex);
-  LL_APPEND (SRV.connection_list, conn);
-  pthread_mutex_unlock (&SRV.list_mutex);
-  // Don't want callback in the mutex lock
-  handle_msg (CMSG_ACTION_CONN_ADDED, &rcv_msg_data);
-  return 0;
+void *cmsg_alloc (size_t size, size_t align, int kind)
+{
+  void *ptr;
 
+  if (NULL != allocator.alloc)
+    return (* allocator.alloc) (size, align, kind, allocator.ctx);
+  if (align <= sizeof (void *) * 2)
+    return malloc (size);
+  if (posix_memalign (&ptr, align, size) != 0)
+    return NULL;
+  return ptr;
 }
 
-void close_sock_linger0 (int sock)
+void cmsg_free (void *ptr, size_t size, int kind)
 {
-    struct linger linger_opt = {1, 0};
+  if (NULL == ptr)
+    return;
+  if (NULL != allocator.free)
+    (* allocator.free) (ptr, size, kind, allocator.ctx);
+  else
+    free (ptr);
+}
 
-    if (setsockopt (sock, SOL_SOCKET, SO_LINGER, &linger_opt, sizeof linger_opt) < 0) {
-      cmsg_log_err (LEVEL_ERROR, errno, 
-        ("CIMPMSG: Error setting linger sockopt for socket %d", sock));
-      return;
-    }      
-    if (close (sock) != 0)
-      cmsg_log_err (LEVEL_ERROR, errno, ("CIMPMSG: Error closing socket %d", sock));
+// malloc (0) may legitimately return NULL, so empty messages get a byte
+char *msg_buf_alloc (size_t sz_msg)
+{
+  return (char *) cmsg_alloc ((sz_msg != 0) ? sz_msg : 1, 0, CMSG_ALLOC_RCV_MSG);
 }
 
-void shutdown_sock (int sock)
+void msg_buf_free (char *msg, size_t sz_msg)
 {
-#if 0 // I don't think this helps
-    if (shutdown (sock, SHUT_RDWR) != 0)
-      cmsg_log_err (LEVEL_ERROR, errno, 
-       ("CIMPMSG: Error shutting down socket %d", sock));
-#endif
-    if (close (sock) == 0)
-      return;
-    cmsg_log_err (LEVEL_ERROR, errno, ("CIMPMSG: Error closing socket %d", sock));
-    close_sock_linger0 (sock);
+  cmsg_free (msg, (sz_msg != 0) ? sz_msg : 1, CMSG_ALLOC_RCV_MSG);
 }
 
-void shutdown_server_sock (int sock)
+int cmsg_set_allocator (const cmsg_allocator_t *new_allocator)
 {
-   //if ((SRV.listen_state == 2) && SRV.linger0_on_server_shutdown)
-   if (SRV.linger0_on_server_shutdown)
-      close_sock_linger0 (sock);
-   else
-      shutdown_sock (sock);
+  if (NULL == new_allocator) {
+    memset (&allocator, 0, sizeof (allocator));
+    return 0;
+  }
+  if ((NULL == new_allocator->alloc) || (NULL == new_allocator->free))
+    return EINVAL;
+  allocator = *new_allocator;
+  return 0;
 }
 
-void shutdown_connection (struct connection *conn)
+void cmsg_free_msg (char *msg, size_t sz_msg)
 {
-  if (conn->rcv_state != -1) {
-    shutdown_server_sock (conn->rcv_data.sock); 
-    conn->rcv_data.sock = -1;
-    conn->rcv_state = -1;
-    pthread_mutex_destroy (&conn->conn_access_mutex);
-    if (NULL != conn->user_data)
-      free (conn->user_data);
+  msg_buf_free (msg, sz_msg);
+}
+
+uint64_t counter_get (uint64_t *counter)
+{
+  return __atomic_load_n (counter, __ATOMIC_RELAXED);
+}
+
+cmsg_hist_t *latency_create (void)
+{
+  unsigned i;
+  cmsg_hist_t *latency;
+
+  latency = (cmsg_hist_t *) 
+    cmsg_alloc (CMSG_LAT_COUNT * sizeof (cmsg_hist_t), 0, CMSG_ALLOC_OTHER);
+  if (NULL == latency) {
+    cmsg_log (LEVEL_ERROR, ("CIMPMSG: Unable to malloc latency histograms\n"));
+    return NULL;
   }
+  for (i=0; i<CMSG_LAT_COUNT; i++)
+    hist_init (&latency[i]);
+  return latency;
 }
- 
-void shutdown_server (void)
+
+void latency_free (cmsg_hist_t *latency)
 {
-  struct connection *conn;
-  struct connection *tmp;
+  cmsg_free (latency, CMSG_LAT_COUNT * sizeof (cmsg_hist_t), CMSG_ALLOC_OTHER);
+}
 
-  pthread_mutex_lock (&SRV.connect_mutex);
-  SRV.listen_state = 2;
-  pthread_mutex_unlock (&SRV.connect_mutex);
+// The first record from a thread slot allocates its histograms.
+void server_record_latency (struct cmsg_server *srv, int which, uint64_t ns)
+{
+  unsigned slot = stats_get_slot ();
+  cmsg_hist_t *latency;
+  cmsg_hist_t *expected = NULL;
 
-  if (SRV.listen_sock != -1) {
-    LL_FOREACH_SAFE (SRV.connection_list, conn, tmp) {
-      LL_DELETE (SRV.connection_list, conn);
-      shutdown_connection (conn);
-      free (conn);
+  latency = __atomic_load_n (&srv->latency[slot], __ATOMIC_ACQUIRE);
+  if (NULL == latency) {
+    latency = latency_create ();
+    if (NULL == latency)
+      return;
+    if (!__atomic_compare_exchange_n (&srv->latency[slot], &expected, latency,
+        false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      latency_free (latency);  // the shared slot, another thread was first
+      latency = expected;
     }
-    shutdown_server_sock (SRV.listen_sock);
   }
+  hist_record (&latency[which], ns, slot == STATS_SLOTS - 1);
 }
 
-int cmsg_connect_client (struct client_conn *conn, 
-  const char *ip_addr, unsigned int port, unsigned int send_timeout_msecs)
+stats_block_t *stats_create (void)
 {
-	int sock;
-	struct timeval send_timeout;
-	struct timeval rcv_timeout;
+  void *stats;
 
-	init_client_conn (conn);
+  stats = cmsg_alloc (sizeof (stats_block_t), 64, CMSG_ALLOC_OTHER);
+  if (NULL == stats) {
+    cmsg_log (LEVEL_ERROR, ("CIMPMSG: Unable to malloc stats\n"));
+    return NULL;
+  }
+  memset (stats, 0, sizeof (stats_block_t));
+  return (stats_block_t *) stats;
+}
 
-	if ((unsigned int) -1 == port) {
-		conn->sock = -1;
-		return EINVAL;
-	}
-	if (make_sockaddr (&conn->addr, ip_addr, port, false) != 0)
-          return EINVAL;
+void stats_free (stats_block_t *stats)
+{
+  cmsg_free (stats, sizeof (stats_block_t), CMSG_ALLOC_OTHER);
+}
+
+// Gives conn a receive state from the server's pool, listen thread only
+int conn_rx_attach (struct connection *conn)
+{
+  struct cmsg_server *srv = conn->server;
+  struct conn_rx *rx = srv->rx_pool;
+
+  if (NULL != rx) {
+    srv->rx_pool = rx->next;
+    srv->rx_pool_count--;
+  } else {
+    rx = (struct conn_rx *) cmsg_alloc (sizeof (struct conn_rx), 0, CMSG_ALLOC_CONN);
+    if (NULL == rx)
+      return ENOMEM;
+  }
+  memset (rx, 0, sizeof (struct conn_rx));
+  conn->rx = rx;
+  return 0;
+}
+
+void conn_rx_release (struct cmsg_server *srv, struct connection *conn)
+{
+  struct conn_rx *rx = conn->rx;
+
+  if (NULL == rx)
+    return;
+  conn->rx = NULL;
+  msg_buf_free (rx->rcv_msg, rx->rcv_msg_size);
+  if (srv->rx_pool_count >= RX_POOL_MAX) {
+    cmsg_free (rx, sizeof (struct conn_rx), CMSG_ALLOC_CONN);
+    return;
+  }
+  rx->next = srv->rx_pool;
+  srv->rx_pool = rx;
+  srv->rx_pool_count++;
+}
+
+void rx_pool_free (struct cmsg_server *srv)
+{
+  struct conn_rx *rx;
+
+  while (NULL != (rx = srv->rx_pool)) {
+    srv->rx_pool = rx->next;
+    cmsg_free (rx, sizeof (struct conn_rx), CMSG_ALLOC_CONN);
+  }
+  srv->rx_pool_count = 0;
+}
+
+/*------------------------------------------------------------------
+ * Work run on the listen thread. cmsg_server_post pushes onto an
+ * intrusive MPSC queue (Vyukov): producers swap the head and then link
+ * the old head to the new node, and only the listen thread pops. An
+ * eventfd wakes the loop, written only when task_wake was clear, so a
+ * burst of posts costs one write. Timers are timerfds in the poll set.
+---------------------------------------------------------------------*/
+
+void task_push (struct cmsg_server *srv, server_task_t *task)
+{
+  server_task_t *prev;
+
+  task->next = NULL;
+  prev = __atomic_exchange_n (&srv->task_head, task, __ATOMIC_ACQ_REL);
+  __atomic_store_n (&prev->next, task, __ATOMIC_RELEASE);
+}
+
+// listen thread only. NULL when empty, or while a push is half done,
+// in which case the pusher's wakeup comes after it is linked.
+server_task_t *task_pop (struct cmsg_server *srv)
+{
+  server_task_t *tail = srv->task_tail;
+  server_task_t *next = __atomic_load_n (&tail->next, __ATOMIC_ACQUIRE);
+
+  if (tail == &srv->task_stub) {
+    if (NULL == next)
+      return NULL;
+    srv->task_tail = next;
+    tail = next;
+    next = __atomic_load_n (&next->next, __ATOMIC_ACQUIRE);
+  }
+  if (NULL != next) {
+    srv->task_tail = next;
+    return tail;
+  }
+  if (tail != __atomic_load_n (&srv->task_head, __ATOMIC_ACQUIRE))
+    return NULL;
+  task_push (srv, &srv->task_stub);
+  next = __atomic_load_n (&tail->next, __ATOMIC_ACQUIRE);
+  if (NULL != next) {
+    srv->task_tail = next;
+    return tail;
+  }
+  return NULL;
+}
+
+void server_wake (struct cmsg_server *srv)
+{
+  uint64_t one = 1;
+
+  if (!__atomic_exchange_n (&srv->task_wake, true, __ATOMIC_SEQ_CST))
+    if (write (srv->task_fd, &one, sizeof (one)) < 0)
+      cmsg_log_err (LEVEL_ERROR, errno, ("CIMPMSG: Unable to wake listen thread"));
+}
+
+void server_run_tasks (struct cmsg_server *srv)
+{
+  server_task_t *task;
+  uint64_t count;
+
+  if (read (srv->task_fd, &count, sizeof (count)) < 0)
+    return;
+  // posts from here on write the eventfd again
+  __atomic_store_n (&srv->task_wake, false, __ATOMIC_SEQ_CST);
+  while (NULL != (task = task_pop (srv))) {
+    server_record_latency (srv, CMSG_LAT_QUEUE_DELAY, 
+      get_monotonic_ns () - task->posted_ns);
+    if (NULL != task->fn)  // NULL just wakes the loop
+      task->fn (srv, task->arg);
+    cmsg_free (task, sizeof (server_task_t), CMSG_ALLOC_OTHER);
+  }
+}
+
+void server_free_tasks (struct cmsg_server *srv)
+{
+  server_task_t *task;
+  server_timer_t *timer;
+  server_timer_t *tmp;
+
+  while (NULL != (task = task_pop (srv)))
+    cmsg_free (task, sizeof (server_task_t), CMSG_ALLOC_OTHER);
+  LL_FOREACH_SAFE (srv->timers, timer, tmp) {
+    close (timer->fd);
+    cmsg_free (timer, sizeof (server_timer_t), CMSG_ALLOC_OTHER);
+  }
+  srv->timers = NULL;
+}
+
+int cmsg_server_post (cmsg_server_t *srv, cmsg_task_t fn, void *arg)
+{
+  server_task_t *task;
+
+  task = (server_task_t *) 
+    cmsg_alloc (sizeof (server_task_t), 0, CMSG_ALLOC_OTHER);
+  if (NULL == task) {
+    cmsg_log (LEVEL_ERROR, ("CIMPMSG: Unable to malloc posted task\n"));
+    return ENOMEM;
+  }
+  task->fn = fn;
+  task->arg = arg;
+  task->posted_ns = get_monotonic_ns ();
+  task_push (srv, task);
+  server_wake (srv);
+  return 0;
+}
+
+int cmsg_server_add_timer (cmsg_server_t *srv, unsigned first_msecs,
+  unsigned interval_msecs, cmsg_task_t fn, void *arg, int *timer_id)
+{
+  struct itimerspec spec;
+  server_timer_t *timer;
+
+  if (NULL == fn)
+    return EINVAL;
+  if (first_msecs == 0) {
+    if (interval_msecs == 0)
+      return EINVAL;
+    first_msecs = interval_msecs;
+  }
+  timer = (server_timer_t *) 
+    cmsg_alloc (sizeof (server_timer_t), 0, CMSG_ALLOC_OTHER);
+  if (NULL == timer)
+    return ENOMEM;
+  timer->fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (timer->fd < 0) {
+    cmsg_log_err (LEVEL_ERROR, errno, ("CIMPMSG: Unable to create timer"));
+    cmsg_free (timer, sizeof (server_timer_t), CMSG_ALLOC_OTHER);
+    return errno;
+  }
+  spec.it_value.tv_sec = first_msecs / 1000;
+  spec.it_value.tv_nsec = (first_msecs % 1000) * 1000000L;
+  spec.it_interval.tv_sec = interval_msecs / 1000;
+  spec.it_interval.tv_nsec = (interval_msecs % 1000) * 1000000L;
+  timerfd_settime (timer->fd, 0, &spec, NULL);
+  timer->poll_pos = -1;
+  timer->one_shot = (interval_msecs == 0);
+  timer->fn = fn;
+  timer->arg = arg;
+  timer->next = NULL;
+  pthread_mutex_lock (&srv->timer_mutex);
+  timer->id = ++srv->last_timer_id;
+  LL_APPEND (srv->timers, timer);
+  pthread_mutex_unlock (&srv->timer_mutex);
+  if (NULL != timer_id)
+    *timer_id = timer->id;
+  server_wake (srv);  // so the loop polls the new fd
+  return 0;
+}
+
+int cmsg_server_cancel_timer (cmsg_server_t *srv, int timer_id)
+{
+  server_timer_t *timer;
+
+  pthread_mutex_lock (&srv->timer_mutex);
+  LL_FOREACH (srv->timers, timer)
+    if (timer->id == timer_id)
+      break;
+  if (NULL != timer) {
+    LL_DELETE (srv->timers, timer);
+    close (timer->fd);
+    cmsg_free (timer, sizeof (server_timer_t), CMSG_ALLOC_OTHER);
+  }
+  pthread_mutex_unlock (&srv->timer_mutex);
+  return (NULL != timer) ? 0 : ENOENT;
+}
+
+// Runs the timers that fired, without holding timer_mutex in the
+// callback so it may add or cancel timers. Returns how many fired.
+unsigned server_run_timers (struct cmsg_server *srv)
+{
+  server_timer_t *timer;
+  cmsg_task_t fn;
+  void *arg;
+  uint64_t expirations;
+  unsigned fired = 0;
+
+  while (true) {
+    pthread_mutex_lock (&srv->timer_mutex);
+    LL_FOREACH (srv->timers, timer)
+      if ((timer->poll_pos >= 0) && (srv->poll_fds[timer->poll_pos].revents != 0))
+        break;
+    if (NULL == timer) {
+      pthread_mutex_unlock (&srv->timer_mutex);
+      return fired;
+    }
+    timer->poll_pos = -1;
+    fired++;
+    fn = timer->fn;
+    arg = timer->arg;
+    if (read (timer->fd, &expirations, sizeof (expirations)) < 0)
+      fn = NULL;  // cancelled and set up again since the poll
+    else if (timer->one_shot) {
+      LL_DELETE (srv->timers, timer);
+      close (timer->fd);
+      cmsg_free (timer, sizeof (server_timer_t), CMSG_ALLOC_OTHER);
+    }
+    pthread_mutex_unlock (&srv->timer_mutex);
+    if (NULL != fn)
+      fn (srv, arg);
+  }
+}
+
+// adds fd to the poll set, returns its index or -1
+int server_poll_add (struct cmsg_server *srv, unsigned *count, int fd,
+  struct connection *conn)
+{
+  unsigned capacity;
+  struct pollfd *fds;
+  struct connection **conns;
+
+  if (*count == srv->poll_capacity) {
+    capacity = (srv->poll_capacity == 0) ? 64 : srv->poll_capacity * 2;
+    fds = (struct pollfd *) realloc (srv->poll_fds, capacity * sizeof (struct pollfd));
+    if (NULL == fds)
+      return -1;
+    srv->poll_fds = fds;
+    conns = (struct connection **) realloc (srv->poll_conns, 
+      capacity * sizeof (struct connection *));
+    if (NULL == conns)
+      return -1;
+    srv->poll_conns = conns;
+    srv->poll_capacity = capacity;
+  }
+  srv->poll_fds[*count].fd = fd;
+  srv->poll_fds[*count].events = POLLIN;
+  srv->poll_fds[*count].revents = 0;
+  srv->poll_conns[*count] = conn;
+  return (int) (*count)++;
+}
+
+int server_poll_add_timers (struct cmsg_server *srv, unsigned *count)
+{
+  server_timer_t *timer;
+  int rtn = 0;
+
+  pthread_mutex_lock (&srv->timer_mutex);
+  LL_FOREACH (srv->timers, timer) {
+    timer->poll_pos = server_poll_add (srv, count, timer->fd, NULL);
+    if (timer->poll_pos < 0)
+      rtn = ENOMEM;
+  }
+  pthread_mutex_unlock (&srv->timer_mutex);
+  return rtn;
+}
+
+int wait_server_ready (struct cmsg_server *srv, process_message_t handle_msg,
+  bool *terminated, bool *any_closing)
+{
+  struct connection *conn;
+  int rtn, sock;
+  int listen_pos, stats_pos, handoff_pos, task_pos, stdin_pos;
+  unsigned i, count;
+  uint64_t idle_start_ns = get_monotonic_ns ();
+  uint64_t idle_ns, now_ns;
+  server_rcv_msg_data_t notify_data = {
+    .server = srv, .sock = -1, .rcv_msg = NULL, .rcv_msg_size = 0,
+    .msg_kind = CMSG_KIND_MSG, .corr_id = 0
+  };
+
+  idle_ns = (uint64_t) srv->idle_notify_secs * 1000000000ULL;
+
+  while (1)
+  {
+    check_inactive_connections (srv, handle_msg);
+    now_ns = get_monotonic_ns ();
+    // Prepare for 'poll'. Unlike select, there is no limit on the fd.
+    count = 0;
+    listen_pos = stats_pos = handoff_pos = stdin_pos = -1;
+    task_pos = server_poll_add (srv, &count, srv->task_fd, NULL);
+    if (srv->listen_sock != -1)
+      listen_pos = server_poll_add (srv, &count, srv->listen_sock, NULL);
+    LL_FOREACH (srv->connection_list, conn) {
+      conn->rcv_selected = false;
+      if (conn->rcv_state >= 0) {
+        sock = conn->sock;
+        if (conn->user_data.close_request) {
+          conn->rcv_state = -2;
+          *any_closing = true;
+          cmsg_log (LEVEL_DEBUG, ("CIMPMSG: Got close request for socket %d\n", sock));
+          continue;
+        } 
+        if ((NULL != conn->rx) && (conn->rcv_state == 0) && 
+            (conn->rx->hdr_len == 0) &&
+            (now_ns - conn->rx->last_used_ns >= srv->buf_idle_ns))
+          conn_rx_release (srv, conn);
+        if (server_poll_add (srv, &count, sock, conn) < 0) {
+          cmsg_log (LEVEL_ERROR, ("CIMPMSG: Unable to allocate poll set\n"));
+          return -1;
+        }
+      }
+    }
+    if (srv->stats_sock != -1)
+      stats_pos = server_poll_add (srv, &count, srv->stats_sock, NULL);
+    if (srv->handoff_sock != -1)
+      handoff_pos = server_poll_add (srv, &count, srv->handoff_sock, NULL);
+    if (srv->terminate_on_keypress)
+      stdin_pos = server_poll_add (srv, &count, STDIN_FILENO, NULL);
+    if ((task_pos < 0) || (server_poll_add_timers (srv, &count) != 0)) {
+      cmsg_log (LEVEL_ERROR, ("CIMPMSG: Unable to allocate poll set\n"));
+      return -1;
+    }
+    rtn = poll (srv->poll_fds, count, 500);
+    if ((rtn < 0) && (errno != EINTR)) {
+      cmsg_log (LEVEL_ERROR, ("CIMPMSG: Error on poll for receive\n"));
+      return -1;
+    }
+    // tasks and timers are run here, and are not activity for the
+    // idle notification
+    if ((rtn > 0) && (srv->poll_fds[task_pos].revents != 0)) {
+      server_run_tasks (srv);
+      rtn--;
+    }
+    if (rtn > 0)
+      rtn -= server_run_timers (srv);
+    if (rtn > 0) {
+      srv->ready_ns = get_monotonic_ns ();
+      if (!srv->read_backlog)
+        srv->behind_ns = srv->ready_ns;
+      break;
+    }
+    if (*any_closing)
+      break;
+    // Idle time is measured on the clock, so a poll cut short by a
+    // signal (EINTR) doesn't count as a 500 ms timeout, and the
+    // notification is only made after a poll that timed out.
+    if ((rtn == 0) && (idle_ns != 0) && 
+        (get_monotonic_ns () - idle_start_ns >= idle_ns)) {
+      handle_msg (CMSG_ACTION_ALL_IDLE_NOTIFY, &notify_data);
+      idle_start_ns = get_monotonic_ns ();
+    }
+    if (NULL != terminated)
+      if (*terminated)
+        break;
+  }
+  if (rtn <= 0)
+    return 0;
+  rtn = 0;
+  srv->poll_count = count;
+  if ((listen_pos >= 0) && (srv->poll_fds[listen_pos].revents != 0))
+    rtn = 1;
+  // flag all sockets ready to read as indicated by 'poll'
+  for (i=0; i<count; i++) {
+    conn = srv->poll_conns[i];
+    if ((NULL != conn) && (srv->poll_fds[i].revents != 0)) {
+      conn->rcv_selected = true;
+      rtn |= 2;
+    }
+  }
+  if ((stdin_pos >= 0) && (srv->poll_fds[stdin_pos].revents != 0))
+    rtn |= 4;
+  if ((stats_pos >= 0) && (srv->poll_fds[stats_pos].revents != 0))
+    rtn |= 8;
+  if ((handoff_pos >= 0) && (srv->poll_fds[handoff_pos].revents != 0))
+    rtn |= 16;
+  return rtn;
+}
+
+/*------------------------------------------------------------------
+ * Connection slab. Connections are allocated from fixed size chunks
+ * and found from a cmsg_conn_t by array index. The generation in the
+ * handle is bumped on every release, so stale handles don't match.
+ * All functions need list_mutex, except while the server is created.
+---------------------------------------------------------------------*/
+
+struct connection *conn_slab_at (struct cmsg_server *srv, uint32_t index)
+{
+  return &srv->slab_chunks[index / CONN_SLAB_CHUNK][index % CONN_SLAB_CHUNK];
+}
+
+int conn_slab_grow (struct cmsg_server *srv)
+{
+  unsigned i;
+  uint32_t index;
+  struct connection *chunk;
+  struct connection **new_chunks;
+
+  new_chunks = (struct connection **) realloc (srv->slab_chunks,
+    (srv->slab_chunk_count + 1) * sizeof (struct connection *));
+  if (NULL == new_chunks) {
+    cmsg_log (LEVEL_ERROR, ("CIMPMSG: Unable to grow connection slab\n"));
+    return ENOMEM;
+  }
+  srv->slab_chunks = new_chunks;
+  chunk = (struct connection *) cmsg_alloc (
+    CONN_SLAB_CHUNK * sizeof (struct connection), 64, CMSG_ALLOC_CONN);
+  if (NULL == chunk) {
+    cmsg_log (LEVEL_ERROR, ("CIMPMSG: Unable to grow connection slab\n"));
+    return ENOMEM;
+  }
+  index = srv->slab_chunk_count * CONN_SLAB_CHUNK;
+  srv->slab_chunks[srv->slab_chunk_count++] = chunk;
+  // link new slots in index order, so the lowest are used first
+  for (i=CONN_SLAB_CHUNK; i>0; i--) {
+    chunk[i-1].slab_index = index + i - 1;
+    chunk[i-1].generation = 1;
+    chunk[i-1].rcv_state = -1;
+    chunk[i-1].next_free = srv->slab_free_head;
+    srv->slab_free_head = index + i - 1;
+  }
+  return 0;
+}
+
+struct connection *conn_slab_alloc (struct cmsg_server *srv)
+{
+  struct connection *conn;
+
+  if ((srv->slab_free_head == CONN_SLAB_NONE) && (conn_slab_grow (srv) != 0))
+    return NULL;
+  conn = conn_slab_at (srv, srv->slab_free_head);
+  srv->slab_free_head = conn->next_free;
+  srv->slab_used++;
+  return conn;
+}
+
+void conn_slab_release (struct cmsg_server *srv, struct connection *conn)
+{
+  conn->generation++;
+  if (conn->generation == 0)
+    conn->generation = 1;
+  conn->rcv_state = -1;
+  conn->next_free = srv->slab_free_head;
+  srv->slab_free_head = conn->slab_index;
+  srv->slab_used--;
+}
+
+// returns NULL if the handle is stale or its connection is closing
+struct connection *server_find_conn (struct cmsg_server *srv, cmsg_conn_t handle)
+{
+  uint32_t index = (uint32_t) handle;
+  struct connection *conn;
+
+  if (index >= srv->slab_chunk_count * CONN_SLAB_CHUNK)
+    return NULL;
+  conn = conn_slab_at (srv, index);
+  if ((conn->generation != (uint32_t) (handle >> 32)) || (conn->rcv_state < 0))
+    return NULL;
+  return conn;
+}
+
+// for the fd based API
+cmsg_conn_t server_sock_handle (struct cmsg_server *srv, int sock)
+{
+  cmsg_conn_t handle = CMSG_CONN_INVALID;
+  struct connection *conn;
+
+  pthread_mutex_lock (&srv->list_mutex);
+  LL_FOREACH (srv->connection_list, conn)
+    if ((conn->rcv_state >= 0) && (conn->sock == sock)) {
+      handle = conn_handle (conn);
+      break;
+    }
+  pthread_mutex_unlock (&srv->list_mutex);
+  return handle;
+}
+
+struct cmsg_server *alloc_server (void)
+{
+  struct cmsg_server *srv;
+
+  srv = (struct cmsg_server *) 
+    cmsg_alloc (sizeof (struct cmsg_server), 0, CMSG_ALLOC_OTHER);
+  if (NULL == srv) {
+    cmsg_log (LEVEL_ERROR, ("CIMPMSG: Unable to malloc server structure\n"));
+    return NULL;
+  }
+  srv->port = (unsigned int) -1;
+  srv->listen_sock = -1;
+  srv->terminate_on_keypress = true;
+  srv->close_conn_on_error = true;
+  srv->linger0_on_server_shutdown = true;
+  srv->inactive_toggle = false;
+  srv->listen_state = 0;
+  srv->idle_notify_secs = 2;
+  srv->inactive_conn_notify_secs = 30;
+  srv->max_bind_wait = 75;
+  srv->read_quantum = DEFAULT_READ_QUANTUM;
+  srv->read_max_msgs = DEFAULT_READ_MAX_MSGS;
+  srv->read_start = 0;
+  srv->max_conns = 0;
+  srv->shed_lag_ns = 0;
+  srv->shed_msg_size = 0;
+  srv->max_msg_size = MAX_EXT_MSG_SIZE;
+  srv->compress_threshold = 0;
+  srv->buf_idle_ns = DEFAULT_BUF_IDLE_MSECS * 1000000ULL;
+  srv->rx_pool = NULL;
+  srv->rx_pool_count = 0;
+  pthread_mutex_init (&srv->connect_mutex, NULL);
+  pthread_mutex_init (&srv->list_mutex, NULL);
+  srv->connection_list = NULL;
+  srv->routes = NULL;
+  srv->slab_chunks = NULL;
+  srv->slab_chunk_count = 0;
+  srv->slab_free_head = CONN_SLAB_NONE;
+  srv->slab_used = 0;
+  srv->stats_sock = -1;
+  srv->stats_path = NULL;
+  srv->handoff_sock = -1;
+  srv->handoff_path = NULL;
+  srv->handed_off = false;
+  memset (srv->latency, 0, sizeof (srv->latency));
+  srv->ready_ns = 0;
+  srv->behind_ns = 0;
+  srv->read_backlog = false;
+  srv->poll_fds = NULL;
+  srv->poll_conns = NULL;
+  srv->poll_capacity = 0;
+  srv->poll_count = 0;
+  srv->capture_on = false;
+  pthread_mutex_init (&srv->capture_mutex, NULL);
+  srv->capture_fd = -1;
+  srv->capture_map = NULL;
+  srv->capture_size = 0;
+  srv->capture_len = 0;
+  srv->task_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  srv->task_wake = false;
+  srv->task_stub.next = NULL;
+  srv->task_head = &srv->task_stub;
+  srv->task_tail = &srv->task_stub;
+  pthread_mutex_init (&srv->timer_mutex, NULL);
+  srv->timers = NULL;
+  srv->last_timer_id = 0;
+  srv->stats = stats_create ();
+  if ((NULL == srv->stats) || (srv->task_fd < 0) || (conn_slab_grow (srv) != 0)) {
+    if (srv->task_fd >= 0)
+      close (srv->task_fd);
+    pthread_mutex_destroy (&srv->timer_mutex);
+    stats_free (srv->stats);
+    free (srv->slab_chunks);
+    pthread_mutex_destroy (&srv->connect_mutex);
+    pthread_mutex_destroy (&srv->list_mutex);
+    pthread_mutex_destroy (&srv->capture_mutex);
+    cmsg_free (srv, sizeof (struct cmsg_server), CMSG_ALLOC_OTHER);
+    return NULL;
+  }
+  return srv;
+}
+
+void free_server (struct cmsg_server *srv)
+{
+  unsigned i;
+  struct route *route;
+  struct route *tmp;
+
+  HASH_ITER (hh, srv->routes, route, tmp) {
+    HASH_DEL (srv->routes, route);
+    free (route->subs);
+    free (route->name);
+    cmsg_free (route, sizeof (struct route), CMSG_ALLOC_OTHER);
+  }
+  for (i=0; i<srv->slab_chunk_count; i++)
+    cmsg_free (srv->slab_chunks[i], CONN_SLAB_CHUNK * sizeof (struct connection),
+      CMSG_ALLOC_CONN);
+  free (srv->slab_chunks);
+  stats_free (srv->stats);
+  free (srv->stats_path);
+  free (srv->handoff_path);
+  free (srv->poll_fds);
+  free (srv->poll_conns);
+  rx_pool_free (srv);
+  for (i=0; i<STATS_SLOTS; i++)
+    latency_free (srv->latency[i]);
+  cmsg_server_capture (srv, NULL);
+  server_free_tasks (srv);
+  close (srv->task_fd);
+  pthread_mutex_destroy (&srv->timer_mutex);
+  pthread_mutex_destroy (&srv->connect_mutex);
+  pthread_mutex_destroy (&srv->list_mutex);
+  pthread_mutex_destroy (&srv->capture_mutex);
+  cmsg_free (srv, sizeof (struct cmsg_server), CMSG_ALLOC_OTHER);
+}
+
+void server_set_opts (struct cmsg_server *srv, server_opts_t *options)
+{
+  if (NULL != options) {
+    srv->terminate_on_keypress = options->terminate_on_keypress;
+    srv->idle_notify_secs = options->all_idle_notify_secs;
+    if (0 != options->inactive_conn_notify_secs)
+      srv->inactive_conn_notify_secs = options->inactive_conn_notify_secs;
+    if (0 != options->read_quantum_bytes)
+      srv->read_quantum = options->read_quantum_bytes;
+    if (0 != options->read_max_msgs)
+      srv->read_max_msgs = options->read_max_msgs;
+    srv->max_conns = options->max_conns;
+    srv->shed_lag_ns = (uint64_t) options->shed_lag_msecs * 1000000ULL;
+    srv->shed_msg_size = options->shed_msg_size;
+    if (0 != options->buf_idle_msecs)
+      srv->buf_idle_ns = (uint64_t) options->buf_idle_msecs * 1000000ULL;
+    if ((0 != options->max_msg_size) && (options->max_msg_size < MAX_EXT_MSG_SIZE))
+      srv->max_msg_size = options->max_msg_size;
+    srv->compress_threshold = options->compress_threshold;
+  }
+}
+
+int server_connect (struct cmsg_server *srv, const char *ip_addr, unsigned int port,
+  server_opts_t *options)
+{
+	int sock, rtn;
+
+	pthread_mutex_lock (&srv->connect_mutex);
+	server_set_opts (srv, options);
+
+	if ((NULL == ip_addr) || ((unsigned int) -1 == port)) {
+		srv->listen_sock = -1;
+		cmsg_log (LEVEL_ERROR, 
+		  ("CIMPMSG: Invalid ip addr or port for cmsg_server_connect\n"));
+		pthread_mutex_unlock (&srv->connect_mutex);
+		return EINVAL;
+	}
+
+	if (make_sockaddr (&srv->addr, ip_addr, port, false) != 0) {
+	  pthread_mutex_unlock (&srv->connect_mutex);
+          return EINVAL;
+	}
+	sock = server_inherited_sock (srv);
+	if (sock >= 0) {
+	  srv->port = port;
+	  srv->listen_sock = sock;
+	  pthread_mutex_unlock (&srv->connect_mutex);
+	  return 0;
+	}
 	sock = socket (AF_INET, SOCK_STREAM, 0);
 	if (sock < 0) {
-	  conn->oserr = errno;
-	  cmsg_log_err (LEVEL_ERROR, errno, ("CIMPMSG: Unable to create send socket"));
- 	  return conn->oserr;
+	  cmsg_log_err (LEVEL_ERROR, errno, 
+		("CIMPMSG: Unable to create rcv socket"));
+	  pthread_mutex_unlock (&srv->connect_mutex);
+	  return errno;
 	}
-	if (send_timeout_msecs != (unsigned int) -1) {
-		send_timeout.tv_sec = send_timeout_msecs / 1000;
-		send_timeout.tv_usec = (send_timeout_msecs % 1000) * 1000;
-		if (setsockopt (sock, SOL_SOCKET, SO_SNDTIMEO, 
-		  &send_timeout, sizeof (send_timeout)) < 0) {
-			conn->oserr = errno;
-			cmsg_log_err (LEVEL_ERROR, errno, 
-			  ("CIMPMSG: Unable to set socket send timeout:"));
-			close (sock);
-	 		return conn->oserr;
-		}
+#if 0
+	int flags = fcntl (sock, F_GETFL);
+	if (flags == -1) {
+		dbg_err (errno, "Unable to get socket flags: \n");
+		close (sock);
+ 		return -1;
 	}
-	rcv_timeout.tv_sec = 0;
-	rcv_timeout.tv_usec = 500000;
-	if (setsockopt (sock, SOL_SOCKET, SO_RCVTIMEO, 
-		  &rcv_timeout, sizeof (rcv_timeout)) < 0) {
-			conn->oserr = errno;
-			cmsg_log_err (LEVEL_ERROR, errno, 
-			  ("CIMPMSG: Unable to set socket rcv timeout:"));
-			close (sock);
-	 		return conn->oserr;
-		}
+	flags |= O_NONBLOCK;
+	if (fcntl (sock, F_SETFL, flags) == -1) {
+		dbg_err (errno, "Unable to set socket flags: \n");
+		close (sock);
+ 		return -1;
+	}
+#endif
+        rtn = server_bind_to_sock (srv, sock);
+	if (rtn != 0) {
+	  close (sock);
+	  pthread_mutex_unlock (&srv->connect_mutex);
+	  return rtn;
+	}
+	if (listen (sock, 50) == -1) {
+	  cmsg_log_err (LEVEL_ERROR, errno, 
+		("CIMPMSG: Listen error on receive socket:"));
+	  rtn = errno;
+	  close (sock);
+	  pthread_mutex_unlock (&srv->connect_mutex);
+	  return rtn;
+	}
+	srv->port = port;
+	srv->listen_sock = sock;
+	pthread_mutex_unlock (&srv->connect_mutex);
+	return 0;
+}
+
+cmsg_server_t *cmsg_server_create (const char *ip_addr, unsigned int port,
+  server_opts_t *options, int *err)
+{
+  int rtn;
+  struct cmsg_server *srv;
+
+  srv = alloc_server ();
+  if (NULL == srv) {
+    rtn = ENOMEM;
+  } else {
+    rtn = server_connect (srv, ip_addr, port, options);
+    if (rtn != 0) {
+      free_server (srv);
+      srv = NULL;
+    }
+  }
+  if (NULL != err)
+    *err = rtn;
+  return srv;
+}
+
+int cmsg_connect_server (const char *ip_addr, unsigned int port,
+  server_opts_t *options)
+{
+  int rtn;
+  struct cmsg_server *srv;
+
+  pthread_mutex_lock (&default_server_mutex);
+  if (NULL != default_server) {
+    cmsg_log (LEVEL_ERROR, ("CIMPMSG: server already connected\n"));
+    pthread_mutex_unlock (&default_server_mutex);
+    return EALREADY;
+  }
+  srv = cmsg_server_create (ip_addr, port, options, &rtn);
+  if (NULL != srv)
+    __atomic_store_n (&default_server, srv, __ATOMIC_RELEASE);
+  pthread_mutex_unlock (&default_server_mutex);
+  return rtn;
+}
+
+struct cmsg_server *get_default_server (void)
+{
+  return __atomic_load_n (&default_server, __ATOMIC_ACQUIRE);
+}
+
+// list_mutex must be held
+struct connection *init_server_connection (struct cmsg_server *srv, int sock)
+{
+  struct connection *conn;
+
+  conn = conn_slab_alloc (srv);
+  if (NULL == conn) {
+    cmsg_log (LEVEL_ERROR, 
+	("CIMPMSG: Unable to allocate connection structure in receiver accept\n"));
+    return NULL;
+  }
+  init_connection (conn);
+  conn->rcv_state = 0;
+  conn->sock = sock;
+  conn->server = srv;
+  return conn;
+}
+
+void close_sock_linger0 (int sock)
+{
+    struct linger linger_opt = {1, 0};
+
+    if (setsockopt (sock, SOL_SOCKET, SO_LINGER, &linger_opt, sizeof linger_opt) < 0) {
+      cmsg_log_err (LEVEL_ERROR, errno, 
+        ("CIMPMSG: Error setting linger sockopt for socket %d", sock));
+      return;
+    }      
+    if (close (sock) != 0)
+      cmsg_log_err (LEVEL_ERROR, errno, ("CIMPMSG: Error closing socket %d", sock));
+}
+
+int server_accept (struct cmsg_server *srv, process_message_t handle_msg)
+{
+  int sock;
+  struct connection *conn;
+  server_rcv_msg_data_t rcv_msg_data;
+
+  sock = accept (srv->listen_sock, NULL, NULL);
+  if (sock < 0) {
+    if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+      return 1;
+    cmsg_log_err (LEVEL_ERROR, errno, ("CIMPMSG: Accept error on receive socket:"));
+    close (srv->listen_sock);
+    return 2;
+  }
+  // slab_used only changes on this thread
+  if ((srv->max_conns != 0) && (srv->slab_used >= srv->max_conns)) {
+    cmsg_log (LEVEL_DEBUG, ("CIMPMSG: Refused %d, at max connections\n", sock));
+    close_sock_linger0 (sock);
+    stats_add (srv->stats, STAT_CONNS_REFUSED, 1);
+    return 0;
+  }
+  cmsg_log (LEVEL_INFO, ("Accepted %d\n", sock));
+  CMSG_PROBE (accept, sock, 0);
+#if 0
+  int flags = fcntl (sock, F_GETFL);
+  if (flags == -1) {
+	dbg_err (errno, "Unable to get socket flags: \n");
+	close (sock);
+	return -1;
+  }
+  flags |= O_NONBLOCK;
+  if (fcntl (sock, F_SETFL, flags) == -1) {
+	dbg_err (errno, "Unable to set socket flags: \n");
+	close (sock);
+	return -1;
+  }
+#endif
+  pthread_mutex_lock (&srv->list_mutex);
+  conn = init_server_connection (srv, sock);
+  if (NULL == conn) {
+    pthread_mutex_unlock (&srv->list_mutex);
+    close (sock);
+    return -1;
+  }
+  conn_msg_data (conn, &rcv_msg_data, false); // save data for the callback
+  set_last_active_time (conn);
+  LL_APPEND (srv->connection_list, conn);
+  pthread_mutex_unlock (&srv->list_mutex);
+  stats_add (srv->stats, STAT_CONNS_ACCEPTED, 1);
+  // Don't want callback in the mutex lock
+  handle_msg (CMSG_ACTION_CONN_ADDED, &rcv_msg_data);
+  return 0;
+
+}
+
+/*------------------------------------------------------------------
+ * Routing table. Clients subscribe to service names or topics and
+ * cmsg_server_publish sends to every subscriber of a name with one
+ * hash lookup and one encoded frame. All functions need list_mutex.
+---------------------------------------------------------------------*/
+
+struct route *route_find (struct cmsg_server *srv, const char *name)
+{
+  struct route *route;
+
+  HASH_FIND (hh, srv->routes, name, strlen (name), route);
+  return route;
+}
+
+struct route *route_create (struct cmsg_server *srv, const char *name)
+{
+  struct route *route;
+
+  route = (struct route *) cmsg_alloc (sizeof (struct route), 0, CMSG_ALLOC_OTHER);
+  if (NULL == route)
+    return NULL;
+  route->name = strdup (name);
+  if (NULL == route->name) {
+    cmsg_free (route, sizeof (struct route), CMSG_ALLOC_OTHER);
+    return NULL;
+  }
+  route->sub_count = 0;
+  route->sub_alloc = 0;
+  route->subs = NULL;
+  HASH_ADD_KEYPTR (hh, srv->routes, route->name, strlen (route->name), route);
+  return route;
+}
+
+void route_delete (struct cmsg_server *srv, struct route *route)
+{
+  HASH_DEL (srv->routes, route);
+  free (route->subs);
+  free (route->name);
+  cmsg_free (route, sizeof (struct route), CMSG_ALLOC_OTHER);
+}
+
+int route_add (struct cmsg_server *srv, struct connection *conn, const char *name)
+{
+  struct route *route;
+  struct route_sub *rsub;
+  struct connection **new_subs;
+
+  route = route_find (srv, name);
+  if (NULL == route) {
+    route = route_create (srv, name);
+    if (NULL == route)
+      return ENOMEM;
+  }
+  LL_FOREACH (conn->routes, rsub)
+    if (rsub->route == route)
+      return 0;
+  rsub = (struct route_sub *) 
+    cmsg_alloc (sizeof (struct route_sub), 0, CMSG_ALLOC_OTHER);
+  if (NULL == rsub)
+    goto add_failed;
+  if (route->sub_count >= route->sub_alloc) {
+    unsigned new_alloc = (route->sub_alloc == 0) ? 4 : route->sub_alloc * 2;
+    new_subs = (struct connection **) 
+      realloc (route->subs, new_alloc * sizeof (struct connection *));
+    if (NULL == new_subs) {
+      cmsg_free (rsub, sizeof (struct route_sub), CMSG_ALLOC_OTHER);
+      goto add_failed;
+    }
+    route->subs = new_subs;
+    route->sub_alloc = new_alloc;
+  }
+  route->subs[route->sub_count++] = conn;
+  rsub->route = route;
+  LL_PREPEND (conn->routes, rsub);
+  return 0;
+
+add_failed:
+  cmsg_log (LEVEL_ERROR, ("CIMPMSG: Unable to malloc route for %s\n", name));
+  if (route->sub_count == 0)
+    route_delete (srv, route);
+  return ENOMEM;
+}
+
+void route_remove_sub (struct cmsg_server *srv, struct connection *conn, 
+  struct route_sub *rsub)
+{
+  unsigned i;
+  struct route *route = rsub->route;
+
+  for (i=0; i<route->sub_count; i++)
+    if (route->subs[i] == conn) {
+      route->subs[i] = route->subs[--route->sub_count];
+      break;
+    }
+  LL_DELETE (conn->routes, rsub);
+  cmsg_free (rsub, sizeof (struct route_sub), CMSG_ALLOC_OTHER);
+  if (route->sub_count == 0)
+    route_delete (srv, route);
+}
+
+int route_remove (struct cmsg_server *srv, struct connection *conn, const char *name)
+{
+  struct route_sub *rsub;
+
+  LL_FOREACH (conn->routes, rsub)
+    if (strcmp (rsub->route->name, name) == 0) {
+      route_remove_sub (srv, conn, rsub);
+      return 0;
+    }
+  return ENOENT;
+}
+
+void route_remove_conn (struct cmsg_server *srv, struct connection *conn)
+{
+  while (NULL != conn->routes)
+    route_remove_sub (srv, conn, conn->routes);
+}
+
+void shutdown_sock (int sock)
+{
+#if 0 // I don't think this helps
+    if (shutdown (sock, SHUT_RDWR) != 0)
+      cmsg_log_err (LEVEL_ERROR, errno, 
+       ("CIMPMSG: Error shutting down socket %d", sock));
+#endif
+    if (close (sock) == 0)
+      return;
+    cmsg_log_err (LEVEL_ERROR, errno, ("CIMPMSG: Error closing socket %d", sock));
+    close_sock_linger0 (sock);
+}
+
+void shutdown_server_sock (struct cmsg_server *srv, int sock)
+{
+   //if ((srv->listen_state == 2) && srv->linger0_on_server_shutdown)
+   if (srv->handed_off)
+      close (sock);  // the new process has its own reference
+   else if (srv->linger0_on_server_shutdown)
+      close_sock_linger0 (sock);
+   else
+      shutdown_sock (sock);
+}
+
+void shutdown_connection (struct cmsg_server *srv, struct connection *conn)
+{
+  route_remove_conn (srv, conn);
+  conn_rx_release (srv, conn);  // with any partly received message
+  if (conn->rcv_state != -1) {
+    CMSG_PROBE (close, conn->sock, 0);
+    stats_add (srv->stats, STAT_CONNS_CLOSED, 1);
+    shutdown_server_sock (srv, conn->sock); 
+    conn->sock = -1;
+    conn->rcv_state = -1;
+  }
+  conn_slab_release (srv, conn);
+}
+ 
+void shutdown_server (struct cmsg_server *srv)
+{
+  struct connection *conn;
+  struct connection *tmp;
+
+  pthread_mutex_lock (&srv->connect_mutex);
+  srv->listen_state = 2;
+  pthread_mutex_unlock (&srv->connect_mutex);
+
+  if (srv->listen_sock != -1) {
+    pthread_mutex_lock (&srv->list_mutex);
+    LL_FOREACH_SAFE (srv->connection_list, conn, tmp) {
+      LL_DELETE (srv->connection_list, conn);
+      shutdown_connection (srv, conn);
+    }
+    pthread_mutex_unlock (&srv->list_mutex);
+    shutdown_server_sock (srv, srv->listen_sock);
+  }
+  if (srv->stats_sock != -1) {
+    close (srv->stats_sock);
+    srv->stats_sock = -1;
+    unlink (srv->stats_path);
+  }
+  if (srv->handoff_sock != -1) {
+    close (srv->handoff_sock);
+    srv->handoff_sock = -1;
+    unlink (srv->handoff_path);
+  }
+}
+
+uint32_t get_be32 (const unsigned char *buf)
+{
+  return ((uint32_t) buf[0] << 24) | ((uint32_t) buf[1] << 16) |
+    ((uint32_t) buf[2] << 8) | (uint32_t) buf[3];
+}
+
+void put_be32 (unsigned char *buf, uint32_t val)
+{
+  buf[0] = (unsigned char) (val >> 24);
+  buf[1] = (unsigned char) (val >> 16);
+  buf[2] = (unsigned char) (val >> 8);
+  buf[3] = (unsigned char) val;
+}
+
+size_t msg_frame_size (int kind, size_t sz_msg)
+{
+  if ((kind == CMSG_KIND_MSG) && (sz_msg <= MAX_BASIC_MSG_SIZE))
+    return sz_msg + MSG_HEADER_SIZE;
+  return sz_msg + MSG_EXT_HEADER_SIZE;
+}
+
+void encode_ext_header (char *frame, int kind, int flags, uint32_t corr_id,
+  size_t sz_data)
+{
+  frame[0] = MSG_HEADER_MARK;
+  frame[1] = MSG_HEADER_MARK_EXT;
+  frame[2] = (char) kind;
+  frame[3] = (char) flags;
+  put_be32 ((unsigned char *) frame+4, (uint32_t) sz_data);
+  put_be32 ((unsigned char *) frame+8, corr_id);
+}
+
+size_t encode_msg_frame (char *frame, int kind, uint32_t corr_id,
+  const char *msg, size_t sz_msg)
+{
+  size_t hdr_size = MSG_HEADER_SIZE;
+
+  if ((kind == CMSG_KIND_MSG) && (sz_msg <= MAX_BASIC_MSG_SIZE)) {
+    frame[0] = MSG_HEADER_MARK;
+    frame[1] = MSG_HEADER_MARK;
+    frame[2] = sz_msg / 256;
+    frame[3] = sz_msg % 256;
+  } else {
+    encode_ext_header (frame, kind, 0, corr_id, sz_msg);
+    hdr_size = MSG_EXT_HEADER_SIZE;
+  }
+  memcpy (frame+hdr_size, msg, sz_msg);
+  return sz_msg + hdr_size;
+}
+
+// A frame as received, before any decompression
+size_t rx_frame_size (const conn_rx_t *rx)
+{
+  if (rx->flags != 0)
+    return rx->rcv_msg_size + MSG_EXT_HEADER_SIZE;
+  return msg_frame_size (rx->msg_kind, rx->rcv_msg_size);
+}
+
+// true if the peer can read a message of this size. peer_max is from
+// its HELLO, 0 if it sent none, and then only plain messages that fit
+// a basic frame are known to be safe.
+bool msg_size_ok (int kind, size_t sz_msg, uint32_t peer_max)
+{
+  if (peer_max == 0)
+    return (kind != CMSG_KIND_MSG) || (sz_msg <= MAX_BASIC_MSG_SIZE);
+  return sz_msg <= peer_max;
+}
+
+void encode_hello (char *hello, uint32_t max_msg_size, int flags)
+{
+  memset (hello, 0, HELLO_SIZE);
+  hello[0] = PROTO_VERSION;
+  hello[1] = (char) flags;
+  put_be32 ((unsigned char *) hello+4, max_msg_size);
+}
+
+// Returns the peer's max message size, 0 if the HELLO is not valid.
+// Later versions may append fields.
+uint32_t decode_hello (const char *hello, size_t sz_hello, int *flags)
+{
+  uint32_t max_msg_size;
+
+  if ((sz_hello < HELLO_SIZE) || ((unsigned char) hello[0] < PROTO_VERSION)) {
+    cmsg_log (LEVEL_ERROR, ("CIMPMSG: Invalid hello, %lu bytes\n", sz_hello));
+    return 0;
+  }
+  *flags = (unsigned char) hello[1];
+  max_msg_size = get_be32 ((const unsigned char *) hello+4);
+  if (max_msg_size < MAX_BASIC_MSG_SIZE)
+    max_msg_size = MAX_BASIC_MSG_SIZE;
+  return max_msg_size;
+}
+
+char *make_msg_frame (int sock, int kind, uint32_t corr_id,
+  const char *msg, size_t sz_msg, size_t *sz_frame)
+{
+  char *msg_buf;
+
+  msg_buf = (char *) 
+    cmsg_alloc (msg_frame_size (kind, sz_msg), 0, CMSG_ALLOC_SEND_BUF);
+  if (NULL == msg_buf) {
+    cmsg_log (LEVEL_ERROR, 
+	("CIMPMSG: Unable to malloc msg buffer for socket %d\n", sock));
+    return NULL;
+  }
+  *sz_frame = encode_msg_frame (msg_buf, kind, corr_id, msg, sz_msg);
+  return msg_buf;
+}
+
+// Encodes msg compressed, in an extended frame with FRAME_LZ. Returns
+// NULL if that wouldn't save an eighth, and the caller then sends it
+// plain. The buffer is sz_alloc bytes, more than the frame.
+char *make_lz_frame (int kind, uint32_t corr_id, const char *msg, size_t sz_msg,
+  size_t *sz_frame, size_t *sz_alloc)
+{
+  size_t hdr_size = MSG_EXT_HEADER_SIZE + LZ_HEADER_SIZE;
+  size_t sz_max = sz_msg - (sz_msg / 8);
+  size_t sz_lz;
+  char *frame;
+
+  frame = (char *) cmsg_alloc (hdr_size + sz_max, 0, CMSG_ALLOC_SEND_BUF);
+  if (NULL == frame)
+    return NULL;
+  sz_lz = lz_compress (msg, sz_msg, frame + hdr_size, sz_max);
+  if (sz_lz == 0) {
+    cmsg_free (frame, hdr_size + sz_max, CMSG_ALLOC_SEND_BUF);
+    return NULL;
+  }
+  encode_ext_header (frame, kind, FRAME_LZ, corr_id, LZ_HEADER_SIZE + sz_lz);
+  put_be32 ((unsigned char *) frame + MSG_EXT_HEADER_SIZE, (uint32_t) sz_msg);
+  *sz_frame = hdr_size + sz_lz;
+  *sz_alloc = hdr_size + sz_max;
+  return frame;
+}
+
+// Replaces a FRAME_LZ payload with the message it expands to, in a
+// new buffer. On error *msg is left for the caller to free.
+int msg_unpack (char **msg, size_t *sz_msg, size_t max_size)
+{
+  char *out;
+  size_t sz_out;
+
+  if (*sz_msg < LZ_HEADER_SIZE) {
+    cmsg_log (LEVEL_ERROR, ("CIMPMSG: Compressed msg of %lu bytes too short\n", *sz_msg));
+    return CMSG_ERR_RCV_BAD_COMPRESSED;
+  }
+  sz_out = get_be32 ((const unsigned char *) *msg);
+  if (sz_out > max_size) {
+    cmsg_log (LEVEL_ERROR, 
+      ("CIMPMSG: Compressed msg expands to %lu bytes, over the limit\n", sz_out));
+    return CMSG_ERR_RCV_MSG_TOO_BIG;
+  }
+  out = msg_buf_alloc (sz_out);
+  if (NULL == out)
+    return CMSG_ERR_RCV_MSG_MALLOC_FAIL;
+  if (lz_decompress (*msg + LZ_HEADER_SIZE, *sz_msg - LZ_HEADER_SIZE, out, sz_out) != 0) {
+    cmsg_log (LEVEL_ERROR, ("CIMPMSG: Invalid compressed msg of %lu bytes\n", *sz_msg));
+    msg_buf_free (out, sz_out);
+    return CMSG_ERR_RCV_BAD_COMPRESSED;
+  }
+  msg_buf_free (*msg, *sz_msg);
+  *msg = out;
+  *sz_msg = sz_out;
+  return 0;
+}
+
+int send_msg_frame (int sock, const char *frame, size_t sz_frame, int flags)
+{
+  ssize_t bytes;
+
+  CMSG_PROBE (send_start, sock, sz_frame);
+  bytes = send (sock, frame, sz_frame, flags | MSG_NOSIGNAL);
+  CMSG_PROBE (send_end, sock, sz_frame);
+  if (bytes < 0) { 
+	cmsg_log_err (LEVEL_ERROR, errno, ("CIMPMSG: Error sending msg:"));
+	return errno;
+  }
+  if ((size_t) bytes != sz_frame) {
+    cmsg_log (LEVEL_ERROR, ("CIMPMSG: Not all bytes sent, just %ld\n", bytes));
+    return EIO;
+  }
+  return 0;
+}
+
+// like send_msg_frame, also giving the time spent in send ()
+int send_msg_frame_timed (int sock, const char *frame, size_t sz_frame,
+  int flags, uint64_t *send_ns)
+{
+  int rtn;
+  uint64_t start_ns = get_monotonic_ns ();
+
+  rtn = send_msg_frame (sock, frame, sz_frame, flags);
+  *send_ns = get_monotonic_ns () - start_ns;
+  return rtn;
+}
+
+// send_ns, if not NULL, gets the time spent in send (). Messages of
+// lz_threshold bytes or more are compressed, 0 = none. sz_sent, if not
+// NULL, gets the frame size.
+int send_msg_timed (int sock, int kind, uint32_t corr_id,
+  const char *msg, size_t sz_msg, bool non_block, uint64_t *send_ns,
+  size_t lz_threshold, size_t *sz_sent)
+{
+  int flags = 0;
+  int rtn;
+  size_t sz_frame = 0;
+  size_t sz_alloc = 0;
+  char *msg_buf = NULL;
+
+  if ((lz_threshold != 0) && (sz_msg >= lz_threshold))
+    msg_buf = make_lz_frame (kind, corr_id, msg, sz_msg, &sz_frame, &sz_alloc);
+  if (NULL == msg_buf) {
+    msg_buf = make_msg_frame (sock, kind, corr_id, msg, sz_msg, &sz_frame);
+    if (NULL == msg_buf)
+      return ENOMEM;
+    sz_alloc = sz_frame;
+  }
+  if (NULL != sz_sent)
+    *sz_sent = sz_frame;
+
+#if 0
+  if (wait_send_ready () < 0)
+     return -1;
+#endif
+  if (non_block)
+    flags = MSG_DONTWAIT;
+  if (NULL != send_ns)
+    rtn = send_msg_frame_timed (sock, msg_buf, sz_frame, flags, send_ns);
+  else
+    rtn = send_msg_frame (sock, msg_buf, sz_frame, flags);
+  cmsg_free (msg_buf, sz_alloc, CMSG_ALLOC_SEND_BUF);
+  return rtn;
+}
+
+int send_msg_kind (int sock, int kind, uint32_t corr_id,
+  const char *msg, size_t sz_msg, bool non_block)
+{
+  return send_msg_timed (sock, kind, corr_id, msg, sz_msg, non_block, NULL, 0, NULL);
+}
+
+/*------------------------------------------------------------------
+ * Pending requests of a client connection.
+ * Slots are indexed by corr_id & mask, so matching a reply is O(1).
+ * A binary heap ordered by deadline finds expired requests.
+---------------------------------------------------------------------*/
+
+#define RPC_INITIAL_SLOTS	64
+#define RPC_NOT_IN_HEAP		((unsigned) -1)
+
+typedef struct rpc_pending {
+  uint32_t id;  // 0 = free slot
+  uint32_t epoch;
+  unsigned heap_pos;
+  uint64_t deadline_ns;
+  cmsg_reply_handler_t on_reply;
+  void *arg;
+} rpc_pending_t;
+
+typedef struct cmsg_rpc {
+  pthread_mutex_t mutex;
+  uint32_t next_id;
+  unsigned capacity;  // power of 2
+  unsigned count;
+  unsigned heap_count;
+  uint32_t epoch;         // bumped each time the connection is lost
+  uint32_t failed_epoch;  // requests before this epoch have been failed
+  int wake_fd;            // wakes the receive thread for an earlier deadline
+  rpc_pending_t *slots;
+  uint32_t *heap;     // ids ordered by deadline
+} cmsg_rpc_t;
+
+struct cmsg_rpc *rpc_create (void)
+{
+  struct cmsg_rpc *rpc;
+
+  rpc = (struct cmsg_rpc *) cmsg_alloc (sizeof (struct cmsg_rpc), 0, CMSG_ALLOC_OTHER);
+  if (NULL == rpc)
+    return NULL;
+  rpc->slots = (rpc_pending_t *) cmsg_alloc (
+    RPC_INITIAL_SLOTS * sizeof (rpc_pending_t), 0, CMSG_ALLOC_OTHER);
+  rpc->heap = (uint32_t *) cmsg_alloc (
+    RPC_INITIAL_SLOTS * sizeof (uint32_t), 0, CMSG_ALLOC_OTHER);
+  rpc->wake_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if ((NULL == rpc->slots) || (NULL == rpc->heap) || (rpc->wake_fd < 0)) {
+    if (rpc->wake_fd >= 0)
+      close (rpc->wake_fd);
+    cmsg_free (rpc->slots, RPC_INITIAL_SLOTS * sizeof (rpc_pending_t), CMSG_ALLOC_OTHER);
+    cmsg_free (rpc->heap, RPC_INITIAL_SLOTS * sizeof (uint32_t), CMSG_ALLOC_OTHER);
+    cmsg_free (rpc, sizeof (struct cmsg_rpc), CMSG_ALLOC_OTHER);
+    return NULL;
+  }
+  memset (rpc->slots, 0, RPC_INITIAL_SLOTS * sizeof (rpc_pending_t));
+  pthread_mutex_init (&rpc->mutex, NULL);
+  rpc->next_id = 1;
+  rpc->capacity = RPC_INITIAL_SLOTS;
+  rpc->count = 0;
+  rpc->heap_count = 0;
+  rpc->epoch = 0;
+  rpc->failed_epoch = 0;
+  return rpc;
+}
+
+void rpc_destroy (struct cmsg_rpc *rpc)
+{
+  close (rpc->wake_fd);
+  pthread_mutex_destroy (&rpc->mutex);
+  cmsg_free (rpc->slots, rpc->capacity * sizeof (rpc_pending_t), CMSG_ALLOC_OTHER);
+  cmsg_free (rpc->heap, rpc->capacity * sizeof (uint32_t), CMSG_ALLOC_OTHER);
+  cmsg_free (rpc, sizeof (struct cmsg_rpc), CMSG_ALLOC_OTHER);
+}
+
+rpc_pending_t *rpc_slot (struct cmsg_rpc *rpc, uint32_t id)
+{
+  return &rpc->slots[id & (rpc->capacity - 1)];
+}
+
+uint64_t rpc_heap_deadline (struct cmsg_rpc *rpc, unsigned pos)
+{
+  return rpc_slot (rpc, rpc->heap[pos])->deadline_ns;
+}
+
+void rpc_heap_set (struct cmsg_rpc *rpc, unsigned pos, uint32_t id)
+{
+  rpc->heap[pos] = id;
+  rpc_slot (rpc, id)->heap_pos = pos;
+}
+
+void rpc_heap_up (struct cmsg_rpc *rpc, unsigned pos)
+{
+  uint32_t id = rpc->heap[pos];
+  uint64_t deadline = rpc_slot (rpc, id)->deadline_ns;
+  unsigned parent;
+
+  while (pos > 0) {
+    parent = (pos - 1) / 2;
+    if (rpc_heap_deadline (rpc, parent) <= deadline)
+      break;
+    rpc_heap_set (rpc, pos, rpc->heap[parent]);
+    pos = parent;
+  }
+  rpc_heap_set (rpc, pos, id);
+}
+
+void rpc_heap_down (struct cmsg_rpc *rpc, unsigned pos)
+{
+  uint32_t id = rpc->heap[pos];
+  uint64_t deadline = rpc_slot (rpc, id)->deadline_ns;
+  unsigned child;
+
+  while (true) {
+    child = (2 * pos) + 1;
+    if (child >= rpc->heap_count)
+      break;
+    if (((child + 1) < rpc->heap_count) &&
+        (rpc_heap_deadline (rpc, child + 1) < rpc_heap_deadline (rpc, child)))
+      child++;
+    if (deadline <= rpc_heap_deadline (rpc, child))
+      break;
+    rpc_heap_set (rpc, pos, rpc->heap[child]);
+    pos = child;
+  }
+  rpc_heap_set (rpc, pos, id);
+}
+
+void rpc_heap_remove (struct cmsg_rpc *rpc, unsigned pos)
+{
+  rpc->heap_count--;
+  if (pos == rpc->heap_count)
+    return;
+  rpc_heap_set (rpc, pos, rpc->heap[rpc->heap_count]);
+  rpc_heap_down (rpc, pos);
+  rpc_heap_up (rpc, rpc_slot (rpc, rpc->heap[pos])->heap_pos);
+}
+
+// Ids that collide under the old mask can't collide under the larger one
+int rpc_grow (struct cmsg_rpc *rpc)
+{
+  unsigned i;
+  unsigned new_capacity = rpc->capacity * 2;
+  rpc_pending_t *old_slots = rpc->slots;
+  unsigned old_capacity = rpc->capacity;
+  rpc_pending_t *new_slots;
+  uint32_t *new_heap;
+
+  new_heap = (uint32_t *) cmsg_alloc (new_capacity * sizeof (uint32_t), 0, 
+    CMSG_ALLOC_OTHER);
+  new_slots = (rpc_pending_t *) cmsg_alloc (new_capacity * sizeof (rpc_pending_t), 0,
+    CMSG_ALLOC_OTHER);
+  if ((NULL == new_heap) || (NULL == new_slots)) {
+    cmsg_free (new_heap, new_capacity * sizeof (uint32_t), CMSG_ALLOC_OTHER);
+    cmsg_free (new_slots, new_capacity * sizeof (rpc_pending_t), CMSG_ALLOC_OTHER);
+    return ENOMEM;
+  }
+  memcpy (new_heap, rpc->heap, rpc->heap_count * sizeof (uint32_t));
+  cmsg_free (rpc->heap, old_capacity * sizeof (uint32_t), CMSG_ALLOC_OTHER);
+  rpc->heap = new_heap;
+  memset (new_slots, 0, new_capacity * sizeof (rpc_pending_t));
+  rpc->slots = new_slots;
+  rpc->capacity = new_capacity;
+  for (i=0; i<old_capacity; i++)
+    if (old_slots[i].id != 0)
+      *rpc_slot (rpc, old_slots[i].id) = old_slots[i];
+  cmsg_free (old_slots, old_capacity * sizeof (rpc_pending_t), CMSG_ALLOC_OTHER);
+  return 0;
+}
+
+// rpc->mutex must be held. Returns the new id, or 0 if out of memory.
+uint32_t rpc_add_pending (struct cmsg_rpc *rpc, unsigned timeout_msecs,
+  cmsg_reply_handler_t on_reply, void *arg)
+{
+  uint32_t id;
+  rpc_pending_t *slot;
+
+  if (((rpc->count + 1) * 2) > rpc->capacity)
+    if (rpc_grow (rpc) != 0)
+      return 0;
+  // skip ids whose slot is held by a long outstanding request
+  while (true) {
+    id = rpc->next_id++;
+    if (0 == id)
+      continue;
+    slot = rpc_slot (rpc, id);
+    if (slot->id == 0)
+      break;
+  }
+  slot->id = id;
+  slot->epoch = __atomic_load_n (&rpc->epoch, __ATOMIC_RELAXED);
+  slot->on_reply = on_reply;
+  slot->arg = arg;
+  slot->heap_pos = RPC_NOT_IN_HEAP;
+  if (timeout_msecs != 0) {
+    slot->deadline_ns = get_monotonic_ns () + ((uint64_t) timeout_msecs * 1000000ULL);
+    rpc->heap[rpc->heap_count] = id;
+    slot->heap_pos = rpc->heap_count++;
+    rpc_heap_up (rpc, slot->heap_pos);
+    if (slot->heap_pos == 0) {
+      uint64_t one = 1;
+      if (write (rpc->wake_fd, &one, sizeof (one)) < 0)
+        cmsg_log (LEVEL_DEBUG, ("CIMPMSG: request deadline wakeup not written\n"));
+    }
+  }
+  rpc->count++;
+  return id;
+}
+
+// rpc->mutex must be held. Returns false if id is not pending.
+bool rpc_remove_pending (struct cmsg_rpc *rpc, uint32_t id, rpc_pending_t *removed)
+{
+  rpc_pending_t *slot = rpc_slot (rpc, id);
+
+  if ((0 == id) || (slot->id != id))
+    return false;
+  if (slot->heap_pos != RPC_NOT_IN_HEAP)
+    rpc_heap_remove (rpc, slot->heap_pos);
+  *removed = *slot;
+  slot->id = 0;
+  rpc->count--;
+  return true;
+}
+
+// delivers a reply, or drops it if its request already timed out
+void rpc_complete (struct cmsg_rpc *rpc, uint32_t id, char *reply, size_t sz_reply)
+{
+  rpc_pending_t pending;
+  bool found = false;
+
+  if (NULL != rpc) {
+    pthread_mutex_lock (&rpc->mutex);
+    found = rpc_remove_pending (rpc, id, &pending);
+    pthread_mutex_unlock (&rpc->mutex);
+  }
+  if (!found) {
+    cmsg_log (LEVEL_DEBUG, ("CIMPMSG: Dropping reply %u with no pending request\n", id));
+    msg_buf_free (reply, sz_reply);
+    return;
+  }
+  pending.on_reply (0, reply, sz_reply, pending.arg);
+}
+
+// fails a request whose reply arrived but could not be taken
+void rpc_fail (struct cmsg_rpc *rpc, uint32_t id, int status)
+{
+  rpc_pending_t pending;
+  bool found = false;
+
+  if (NULL != rpc) {
+    pthread_mutex_lock (&rpc->mutex);
+    found = rpc_remove_pending (rpc, id, &pending);
+    pthread_mutex_unlock (&rpc->mutex);
+  }
+  if (found)
+    pending.on_reply (status, NULL, 0, pending.arg);
+}
+
+// Fails expired requests with ETIMEDOUT.
+// Returns msecs until the next deadline, or -1 if there is none.
+int rpc_expire (struct cmsg_rpc *rpc)
+{
+  rpc_pending_t pending;
+  uint64_t now, deadline;
+
+  pthread_mutex_lock (&rpc->mutex);
+  now = get_monotonic_ns ();
+  while (rpc->heap_count != 0) {
+    deadline = rpc_heap_deadline (rpc, 0);
+    if (deadline > now) {
+      pthread_mutex_unlock (&rpc->mutex);
+      return (int) ((deadline - now + 999999ULL) / 1000000ULL);
+    }
+    rpc_remove_pending (rpc, rpc->heap[0], &pending);
+    pthread_mutex_unlock (&rpc->mutex);
+    pending.on_reply (ETIMEDOUT, NULL, 0, pending.arg);
+    pthread_mutex_lock (&rpc->mutex);
+    now = get_monotonic_ns ();
+  }
+  pthread_mutex_unlock (&rpc->mutex);
+  return -1;
+}
+
+// fails requests sent before the current epoch, or all if all is set
+void rpc_fail_requests (struct cmsg_rpc *rpc, int status, bool all)
+{
+  unsigned i;
+  uint32_t epoch = __atomic_load_n (&rpc->epoch, __ATOMIC_ACQUIRE);
+  rpc_pending_t pending;
+
+  pthread_mutex_lock (&rpc->mutex);
+  for (i=0; i<rpc->capacity; i++) {
+    if (rpc->slots[i].id == 0)
+      continue;
+    if (!all && (rpc->slots[i].epoch == epoch))
+      continue;
+    rpc_remove_pending (rpc, rpc->slots[i].id, &pending);
+    pthread_mutex_unlock (&rpc->mutex);
+    pending.on_reply (status, NULL, 0, pending.arg);
+    pthread_mutex_lock (&rpc->mutex);
+  }
+  pthread_mutex_unlock (&rpc->mutex);
+}
+
+// Replies to requests sent on a lost connection will never come.
+// Only called from the receive thread.
+void rpc_fail_lost_requests (struct cmsg_rpc *rpc)
+{
+  uint32_t epoch = __atomic_load_n (&rpc->epoch, __ATOMIC_ACQUIRE);
+
+  if (epoch == rpc->failed_epoch)
+    return;
+  rpc->failed_epoch = epoch;
+  rpc_fail_requests (rpc, ECONNRESET, false);
+}
+
+int set_sock_nonblock (int sock, bool non_block)
+{
+  int flags = fcntl (sock, F_GETFL);
+
+  if (flags == -1)
+    return errno;
+  if (non_block)
+    flags |= O_NONBLOCK;
+  else
+    flags &= ~O_NONBLOCK;
+  if (fcntl (sock, F_SETFL, flags) == -1)
+    return errno;
+  return 0;
+}
+
+int client_create_socket (struct client_conn *conn)
+{
+	int sock;
+	struct timeval send_timeout;
+	struct timeval rcv_timeout;
+
+	sock = socket (AF_INET, SOCK_STREAM, 0);
+	if (sock < 0) {
+	  conn->oserr = errno;
+	  cmsg_log_err (LEVEL_ERROR, errno, ("CIMPMSG: Unable to create send socket"));
+ 	  return -1;
+	}
+	if (conn->send_timeout_msecs != (unsigned int) -1) {
+		send_timeout.tv_sec = conn->send_timeout_msecs / 1000;
+		send_timeout.tv_usec = (conn->send_timeout_msecs % 1000) * 1000;
+		if (setsockopt (sock, SOL_SOCKET, SO_SNDTIMEO, 
+		  &send_timeout, sizeof (send_timeout)) < 0) {
+			conn->oserr = errno;
+			cmsg_log_err (LEVEL_ERROR, errno, 
+			  ("CIMPMSG: Unable to set socket send timeout:"));
+			close (sock);
+	 		return -1;
+		}
+	}
+	rcv_timeout.tv_sec = 0;
+	rcv_timeout.tv_usec = 500000;
+	if (setsockopt (sock, SOL_SOCKET, SO_RCVTIMEO, 
+		  &rcv_timeout, sizeof (rcv_timeout)) < 0) {
+			conn->oserr = errno;
+			cmsg_log_err (LEVEL_ERROR, errno, 
+			  ("CIMPMSG: Unable to set socket rcv timeout:"));
+			close (sock);
+	 		return -1;
+		}
+	return sock;
+}
+
+// Only with opts.record_latency. The histograms are allocated by the
+// first record, so a connection that never carries traffic doesn't
+// hold them. Records come from the sending and the receiving thread.
+void client_record_latency (struct client_conn *conn, int which, uint64_t ns)
+{
+  cmsg_hist_t *latency;
+  cmsg_hist_t *expected = NULL;
+
+  if (!conn->opts.record_latency)
+    return;
+  latency = __atomic_load_n (&conn->latency, __ATOMIC_ACQUIRE);
+  if (NULL == latency) {
+    latency = latency_create ();
+    if (NULL == latency)
+      return;
+    if (!__atomic_compare_exchange_n (&conn->latency, &expected, latency,
+        false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      latency_free (latency);
+      latency = expected;
+    }
+  }
+  hist_record (&latency[which], ns, false);
+}
+
+// send_mutex must be held
+void client_count_send (struct client_conn *conn, int rtn, size_t sz_frame)
+{
+  if (rtn == 0) {
+    counter_add (&conn->stats.msgs_sent, 1);
+    counter_add (&conn->stats.bytes_sent, sz_frame);
+  } else if ((rtn == EAGAIN) || (rtn == EWOULDBLOCK) || (rtn == ENOBUFS))
+    counter_add (&conn->stats.send_drops, 1);
+  else
+    counter_add (&conn->stats.send_errors, 1);
+}
+
+void queued_msg_free (struct client_queued_msg *qmsg)
+{
+  cmsg_free (qmsg, sizeof (*qmsg) + qmsg->sz_frame, CMSG_ALLOC_SEND_BUF);
+}
+
+void subscription_free (struct client_subscription *csub)
+{
+  cmsg_free (csub, sizeof (*csub) + strlen (csub->name) + 1, CMSG_ALLOC_OTHER);
+}
+
+void client_free_send_queue (struct client_conn *conn)
+{
+  struct client_queued_msg *qmsg;
+
+  while (NULL != conn->send_queue_head) {
+    qmsg = conn->send_queue_head;
+    conn->send_queue_head = qmsg->next;
+    queued_msg_free (qmsg);
+  }
+  conn->send_queue_tail = NULL;
+  conn->queued_count = 0;
+}
+
+void client_free_subscriptions (struct client_conn *conn)
+{
+  struct client_subscription *csub;
+
+  while (NULL != conn->subscriptions) {
+    csub = conn->subscriptions;
+    conn->subscriptions = csub->next;
+    subscription_free (csub);
+  }
+}
+
+// Frees the read-ahead buffer. rcv_mutex must be held.
+void client_rcv_buf_free (struct client_conn *cconn)
+{
+  struct client_rcv_buf *rb = cconn->rcv_buf;
+
+  if (NULL == rb)
+    return;
+  cmsg_free (rb, sizeof (*rb) + rb->capacity, CMSG_ALLOC_RCV_MSG);
+  cconn->rcv_buf = NULL;
+}
+
+// how long an empty read-ahead buffer is kept
+uint64_t client_buf_idle_ns (struct client_conn *cconn)
+{
+  unsigned msecs = cconn->opts.buf_idle_msecs;
+
+  if (msecs == 0)
+    msecs = DEFAULT_BUF_IDLE_MSECS;
+  return (uint64_t) msecs * 1000000ULL;
+}
+
+// Backoff doubles from reconnect_min_msecs up to reconnect_max_msecs.
+// Half the delay is random so clients of a restarted server spread out.
+void client_schedule_reconnect (struct client_conn *conn)
+{
+  unsigned base = conn->opts.reconnect_min_msecs;
+  unsigned i, delay;
+
+  for (i=0; i<conn->reconnect_attempts; i++) {
+    if (base >= conn->opts.reconnect_max_msecs)
+      break;
+    base *= 2;
+  }
+  if (base > conn->opts.reconnect_max_msecs)
+    base = conn->opts.reconnect_max_msecs;
+  delay = (base / 2) + ((unsigned) rand_r (&conn->rand_seed) % ((base / 2) + 1));
+  conn->reconnect_attempts++;
+  clock_gettime (CLOCK_MONOTONIC, &conn->next_connect_time);
+  time_add_msecs (&conn->next_connect_time, delay);
+  cmsg_log (LEVEL_DEBUG, ("CIMPMSG: client reconnect attempt %u in %u msecs\n",
+    conn->reconnect_attempts, delay));
+}
+
+// send_mutex must be held
+void client_disconnect (struct client_conn *conn)
+{
+  if (conn->sock != -1) {
+    CMSG_PROBE (close, conn->sock, 0);
+    // A receive may still be reading it without send_mutex. It is only
+    // shut down then, so the reconnect can't get the same fd, and the
+    // receive side closes it in client_rcv_sock.
+    if (conn->sock == conn->rcv_sock)
+      shutdown (conn->sock, SHUT_RDWR);
+    else
+      shutdown_sock (conn->sock);
+    conn->sock = -1;
+  }
+  conn->conn_state = CLIENT_STATE_DISCONNECTED;
+  __atomic_store_n (&conn->peer_max_msg_size, 0, __ATOMIC_RELEASE);
+  __atomic_store_n (&conn->peer_compress, false, __ATOMIC_RELEASE);
+  if (NULL != conn->rpc)
+    __atomic_add_fetch (&conn->rpc->epoch, 1, __ATOMIC_RELEASE);
+  client_schedule_reconnect (conn);
+}
+
+// Returns conn->sock as the socket the receive side now reads, and
+// closes the one it read before if that was disconnected meanwhile.
+// send_mutex must be held.
+int client_rcv_sock (struct client_conn *conn)
+{
+  if ((conn->rcv_sock != -1) && (conn->rcv_sock != conn->sock))
+    shutdown_sock (conn->rcv_sock);
+  conn->rcv_sock = conn->sock;
+  return conn->sock;
+}
+
+bool client_wants_hello (struct client_conn *conn)
+{
+  return (conn->opts.max_msg_size > MAX_BASIC_MSG_SIZE) || 
+    (conn->opts.compress_threshold != 0);
+}
+
+// Tells the server this client takes messages over 64 KB, or
+// compressed ones. send_mutex must be held, or the client not yet shared.
+int client_send_hello (struct client_conn *conn)
+{
+  char hello[HELLO_SIZE];
+  int rtn;
+
+  encode_hello (hello, conn->opts.max_msg_size, 
+    (conn->opts.compress_threshold != 0) ? HELLO_LZ : 0);
+  rtn = send_msg_kind (conn->sock, KIND_HELLO, 0, hello, HELLO_SIZE, false);
+  client_count_send (conn, rtn, msg_frame_size (KIND_HELLO, HELLO_SIZE));
+  return rtn;
+}
+
+// send_mutex must be held
+bool client_connect_complete (struct client_conn *conn)
+{
+  struct client_queued_msg *qmsg;
+  struct client_subscription *csub;
+  uint64_t send_ns;
+  int rtn;
+
+  rtn = set_sock_nonblock (conn->sock, false);
+  if (rtn != 0) {
+    conn->oserr = rtn;
+    client_disconnect (conn);
+    return false;
+  }
+  conn->conn_state = CLIENT_STATE_CONNECTED;
+  conn->reconnect_attempts = 0;
+  cmsg_log (LEVEL_INFO, ("CIMPMSG: client connected on socket %d\n", conn->sock));
+  if (client_wants_hello (conn)) {
+    rtn = client_send_hello (conn);
+    if (rtn != 0) {
+      conn->oserr = rtn;
+      client_disconnect (conn);
+      return false;
+    }
+  }
+  LL_FOREACH (conn->subscriptions, csub) {
+    rtn = send_msg_kind (conn->sock, KIND_SUBSCRIBE, 0, 
+      csub->name, strlen (csub->name) + 1, false);
+    client_count_send (conn, rtn, 
+      msg_frame_size (KIND_SUBSCRIBE, strlen (csub->name) + 1));
+    if (rtn != 0) {
+      conn->oserr = rtn;
+      client_disconnect (conn);
+      return false;
+    }
+  }
+  while (NULL != conn->send_queue_head) {
+    qmsg = conn->send_queue_head;
+    rtn = send_msg_frame_timed (conn->sock, qmsg->frame, qmsg->sz_frame, 0, &send_ns);
+    client_count_send (conn, rtn, qmsg->sz_frame);
+    client_record_latency (conn, CMSG_LAT_SEND, send_ns);
+    if (rtn == 0)
+      client_record_latency (conn, CMSG_LAT_QUEUE_DELAY, 
+        get_monotonic_ns () - qmsg->queued_ns);
+    if (rtn != 0) {
+      conn->oserr = rtn;
+      client_disconnect (conn);
+      return false;
+    }
+    conn->send_queue_head = qmsg->next;
+    if (NULL == conn->send_queue_head)
+      conn->send_queue_tail = NULL;
+    conn->queued_count--;
+    queued_msg_free (qmsg);
+  }
+  return true;
+}
+
+// Advances an auto_reconnect client towards the connected state without
+// blocking. Returns true if connected. send_mutex must be held.
+bool client_reconnect_step (struct client_conn *conn)
+{
+  int sock, err, rtn;
+  socklen_t errlen = sizeof (err);
+  struct pollfd pfd;
+
+  if (conn->conn_state == CLIENT_STATE_DISCONNECTED) {
+    if (!time_has_arrived (&conn->next_connect_time))
+      return false;
+    sock = client_create_socket (conn);
+    if (sock < 0) {
+      client_schedule_reconnect (conn);
+      return false;
+    }
+    conn->sock = sock;
+    rtn = set_sock_nonblock (sock, true);
+    if (rtn != 0) {
+      conn->oserr = rtn;
+      client_disconnect (conn);
+      return false;
+    }
+    if (connect (sock, (struct sockaddr *) &conn->addr, sizeof (conn->addr)) == 0)
+      return client_connect_complete (conn);
+    if (errno != EINPROGRESS) {
+      conn->oserr = errno;
+      cmsg_log_err (LEVEL_DEBUG, errno, 
+        ("CIMPMSG: Unable to connect to client socket:"));
+      client_disconnect (conn);
+      return false;
+    }
+    conn->conn_state = CLIENT_STATE_CONNECTING;
+  }
+  if (conn->conn_state == CLIENT_STATE_CONNECTING) {
+    pfd.fd = conn->sock;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    rtn = poll (&pfd, 1, 0);
+    if (rtn == 0)
+      return false;
+    if (rtn < 0)
+      err = errno;
+    else if (getsockopt (conn->sock, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0)
+      err = errno;
+    if (err != 0) {
+      conn->oserr = err;
+      cmsg_log_err (LEVEL_DEBUG, err, 
+        ("CIMPMSG: Unable to connect to client socket:"));
+      client_disconnect (conn);
+      return false;
+    }
+    return client_connect_complete (conn);
+  }
+  return (conn->conn_state == CLIENT_STATE_CONNECTED);
+}
+
+void cmsg_shutdown_client (struct client_conn *conn)
+{
+  if ((conn->sock != -1) || (conn->conn_state != CLIENT_STATE_IDLE)) {
+	// Wake a thread in cmsg_client_receive and wait for it to leave,
+	// since the receive side state is freed below.
+	__atomic_store_n (&conn->terminated, true, __ATOMIC_RELEASE);
+	if (conn->sock != -1)
+	  shutdown (conn->sock, SHUT_RDWR);
+	pthread_mutex_lock (&conn->rcv_mutex);
+	if (conn->sock != -1) {
+	  CMSG_PROBE (close, conn->sock, 0);
+	  shutdown_sock (conn->sock);
+	}
+	if ((conn->rcv_sock != -1) && (conn->rcv_sock != conn->sock))
+	  shutdown_sock (conn->rcv_sock);
+	conn->rcv_sock = -1;
+	client_free_send_queue (conn);
+	client_free_subscriptions (conn);
+	client_rcv_buf_free (conn);
+	latency_free (conn->latency);
+	conn->latency = NULL;
+	if (NULL != conn->rpc) {
+	  rpc_fail_requests (conn->rpc, ECANCELED, true);
+	  rpc_destroy (conn->rpc);
+	  conn->rpc = NULL;
+	}
+	pthread_mutex_unlock (&conn->rcv_mutex);
+	pthread_mutex_destroy (&conn->send_mutex);
+	pthread_mutex_destroy (&conn->rcv_mutex);
+	conn->sock = -1;
+	conn->conn_state = CLIENT_STATE_IDLE;
+  }
+}
+
+
+// Without terminated, only what is buffered is read, and -3 means
+// there was nothing.
+ssize_t socket_receive (struct connection *conn, void *buf, size_t len, bool *terminated)
+{
+  ssize_t bytes;
+  int flags = (NULL == terminated) ? MSG_DONTWAIT : 0;
+
+  while (true) {
+    bytes = recv (conn->sock, buf, len, flags);
+    if (bytes >= 0)
+      return bytes;
+    if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+      if (NULL == terminated)
+        return -3;
+      if (*terminated)
+        return -2;
+      continue; 
+    }
+    conn->oserr = errno;
+    if (errno == ECONNRESET) // socket closed by peer
+      return 0;
+    return -1;
+  }
+}
+
+// Decodes a frame header. ext is the rest of an extended header, and is
+// only read when header[1] is MSG_HEADER_MARK_EXT.
+int decode_msg_header (const unsigned char *header, const unsigned char *ext,
+  int *kind, int *flags, uint32_t *corr_id, size_t *msg_size)
+{
+  if (header[0] != MSG_HEADER_MARK) {
+	cmsg_log (LEVEL_ERROR, ("CIMPMSG: Invalid msg header mark\n"));
+	return CMSG_ERR_RCV_BAD_HDR_MARK;
+  }
+  if (header[1] == MSG_HEADER_MARK) {
+    *msg_size = ((size_t) header[2] << 8) + (size_t) header[3]; 
+    *kind = CMSG_KIND_MSG;
+    *flags = 0;
+    *corr_id = 0;
+  } else if (header[1] == MSG_HEADER_MARK_EXT) {
+    *msg_size = get_be32 (ext);
+    if ((header[2] > KIND_MAX) || ((header[3] & ~FRAME_LZ) != 0) ||
+        (*msg_size > MAX_EXT_MSG_SIZE)) {
+      cmsg_log (LEVEL_ERROR, 
+        ("CIMPMSG: Invalid extended msg header, kind %u flags %u size %lu\n",
+        header[2], header[3], *msg_size));
+      return CMSG_ERR_RCV_BAD_HDR_MARK;
+    }
+    *kind = header[2];
+    *flags = header[3];
+    *corr_id = get_be32 (ext+4);
+  } else {
+	cmsg_log (LEVEL_ERROR, ("CIMPMSG: Invalid msg header mark\n"));
+	return CMSG_ERR_RCV_BAD_HDR_MARK;
+  }
+  return 0;
+}
+
+// true if the listen loop is far enough behind to drop this message
+bool server_shed_msg (struct cmsg_server *srv, int kind, size_t msg_size)
+{
+  uint64_t lag;
+
+  if ((srv->shed_lag_ns == 0) || (msg_size < srv->shed_msg_size) ||
+      (kind >= KIND_SUBSCRIBE))
+    return false;
+  lag = get_monotonic_ns () - srv->behind_ns;
+  if (kind == CMSG_KIND_MSG)
+    return lag >= srv->shed_lag_ns;
+  return lag >= 2 * srv->shed_lag_ns;  // the client is waiting on requests
+}
+
+// Keeps the first bytes of a frame header until the rest arrives
+int receive_header_save (struct connection *conn, const unsigned char *header,
+  size_t len)
+{
+  if (len == 0)
+    return 0;
+  if ((NULL == conn->rx) && (conn_rx_attach (conn) != 0)) {
+    cmsg_log (LEVEL_ERROR, 
+      ("CIMPMSG: Unable to malloc receive state for socket %d\n", conn->sock));
+    return CMSG_ERR_RCV_MSG_MALLOC_FAIL;
+  }
+  memcpy (conn->rx->hdr, header, len);
+  conn->rx->hdr_len = (uint8_t) len;
+  if (NULL != conn->server) {
+    conn->rx->last_used_ns = conn->server->ready_ns;
+    stats_add (conn->server->stats, STAT_PARTIAL_READS, 1);
+  }
+  counter_add (&conn->stats.partial_reads, 1);
+  return 0;
+}
+
+// Reads the next frame header. Server sockets block, so it only takes
+// what is buffered: a header that arrives in pieces is kept in the
+// receive state, and 0 is returned with rcv_state still 0 until the
+// rest comes. A peer that stops mid-header can't hold up the others.
+int receive_msg_header (struct connection *conn)
+{
+  int sock = conn->sock;
+  int rtn, kind, flags;
+  uint32_t corr_id;
+  ssize_t bytes;
+  size_t msg_size;
+  size_t len = 0;
+  size_t need = MSG_HEADER_SIZE;
+  unsigned char header[MSG_EXT_HEADER_SIZE];
+
+  if ((NULL != conn->rx) && (conn->rx->hdr_len != 0)) {
+    len = conn->rx->hdr_len;
+    memcpy (header, conn->rx->hdr, len);
+    conn->rx->hdr_len = 0;
+  }
+  while (true) {
+    if ((len >= 2) && (header[0] == MSG_HEADER_MARK) && 
+        (header[1] == MSG_HEADER_MARK_EXT))
+      need = MSG_EXT_HEADER_SIZE;
+    if (len == need)
+      break;
+    bytes = recv (sock, header+len, need-len, MSG_DONTWAIT);
+    if (bytes > 0) {
+      len += (size_t) bytes;
+      continue;
+    }
+    if (bytes == 0) {
+      cmsg_log (LEVEL_DEBUG, ("CIMPMSG: Receive message. Socket %d closed by sender\n", sock));
+      return CMSG_ERR_RCV_SOCKET_CLOSED;
+    }
+    if (errno == EINTR)
+      continue;
+    if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+      return receive_header_save (conn, header, len);
+    conn->oserr = errno;
+    if (errno == ECONNRESET) // socket closed by peer
+      return CMSG_ERR_RCV_SOCKET_CLOSED;
+    cmsg_log_err (LEVEL_ERROR, conn->oserr, 
+	("CIMPMSG: Error receiving msg header for socket %d", sock));
+    return CMSG_ERR_RCV_OS_ERROR;
+  }
+  rtn = decode_msg_header (header, header + MSG_HEADER_SIZE, &kind, &flags,
+    &corr_id, &msg_size);
+  if (rtn < 0)
+    return rtn;
+  if ((NULL != conn->server) && (msg_size > conn->server->max_msg_size)) {
+    cmsg_log (LEVEL_ERROR, 
+      ("CIMPMSG: Message of %lu bytes on socket %d is over the limit\n", msg_size, sock));
+    return CMSG_ERR_RCV_MSG_TOO_BIG;
+  }
+  if (NULL == conn->rx) {
+    if (conn_rx_attach (conn) != 0) {
+      cmsg_log (LEVEL_ERROR, 
+        ("CIMPMSG: Unable to malloc receive state for socket %d\n", sock));
+      return CMSG_ERR_RCV_MSG_MALLOC_FAIL;
+    }
+  }
+  if (NULL != conn->server)
+    conn->rx->last_used_ns = conn->server->ready_ns;
+  conn->rx->msg_kind = kind;
+  conn->rx->flags = flags;
+  conn->rx->corr_id = corr_id;
+  if ((NULL != conn->server) && 
+      server_shed_msg (conn->server, kind, msg_size)) {
+    conn->rx->rcv_msg = NULL;
+    conn->rx->rcv_msg_size = msg_size;
+    conn->rx->rcv_end_pos = 0;
+    conn->rcv_state = 2;
+    return 0;
+  }
+  conn->rx->rcv_msg = msg_buf_alloc (msg_size);
+  if (NULL == conn->rx->rcv_msg) {
+    cmsg_log (LEVEL_ERROR, 
+      ("CIMPMSG: Unable to malloc msg buffer for socket %d\n", sock));
+    return CMSG_ERR_RCV_MSG_MALLOC_FAIL;
+  }
+  conn->rx->rcv_msg_size = msg_size;
+  conn->rx->rcv_end_pos = 0;
+  conn->rcv_state = 1;
+  CMSG_PROBE (header, sock, msg_size);
+  return 0;
+}
+
+
+/*------------------------------------------------------------------
+ * Traffic capture. Received frames are appended to a memory mapped
+ * file, which is extended CAPTURE_CHUNK at a time. The blocks are
+ * allocated up front so a full disk fails the grow instead of faulting
+ * on a write to the mapping.
+---------------------------------------------------------------------*/
+
+#define CAPTURE_CHUNK		(16*1024*1024)
+
+// capture_mutex must be held
+void capture_close (struct cmsg_server *srv)
+{
+  __atomic_store_n (&srv->capture_on, false, __ATOMIC_RELAXED);
+  if (srv->capture_fd == -1)
+    return;
+  munmap (srv->capture_map, srv->capture_size);
+  if (ftruncate (srv->capture_fd, (off_t) srv->capture_len) != 0)
+    cmsg_log_err (LEVEL_ERROR, errno, ("CIMPMSG: Unable to truncate capture file"));
+  close (srv->capture_fd);
+  srv->capture_fd = -1;
+  srv->capture_map = NULL;
+  srv->capture_size = 0;
+  srv->capture_len = 0;
+}
+
+// capture_mutex must be held
+int capture_grow (struct cmsg_server *srv, size_t needed)
+{
+  size_t new_size = srv->capture_size;
+  void *map;
+  int rtn;
+
+  while (new_size < srv->capture_len + needed)
+    new_size += CAPTURE_CHUNK;
+  rtn = posix_fallocate (srv->capture_fd, 0, (off_t) new_size);
+  if (rtn != 0)
+    return rtn;
+  if (NULL == srv->capture_map)
+    map = mmap (NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, 
+      srv->capture_fd, 0);
+  else
+    map = mremap (srv->capture_map, srv->capture_size, new_size, MREMAP_MAYMOVE);
+  if (MAP_FAILED == map)
+    return errno;
+  srv->capture_map = (char *) map;
+  srv->capture_size = new_size;
+  return 0;
+}
+
+void capture_frame (struct cmsg_server *srv, struct connection *conn)
+{
+  cmsg_capture_rec_t *rec;
+  size_t msg_size = conn->rx->rcv_msg_size;
+  size_t rec_size = (sizeof (cmsg_capture_rec_t) + msg_size + 7) & ~(size_t) 7;
+  uint64_t now_ns = get_monotonic_ns ();
+  int rtn;
+
+  pthread_mutex_lock (&srv->capture_mutex);
+  if (srv->capture_fd == -1) {
+    pthread_mutex_unlock (&srv->capture_mutex);
+    return;
+  }
+  if (srv->capture_len + rec_size > srv->capture_size) {
+    rtn = capture_grow (srv, rec_size);
+    if (rtn != 0) {
+      cmsg_log_err (LEVEL_ERROR, rtn, ("CIMPMSG: Unable to extend capture file, capture stopped"));
+      capture_close (srv);
+      pthread_mutex_unlock (&srv->capture_mutex);
+      return;
+    }
+  }
+  rec = (cmsg_capture_rec_t *) (srv->capture_map + srv->capture_len);
+  rec->rec_size = (uint32_t) rec_size;
+  rec->kind = (uint8_t) conn->rx->msg_kind;
+  memset (rec->reserved, 0, sizeof (rec->reserved));
+  rec->corr_id = conn->rx->corr_id;
+  rec->msg_size = (uint32_t) msg_size;
+  rec->conn = conn_handle (conn);
+  rec->time_ns = now_ns;
+  memcpy (rec + 1, conn->rx->rcv_msg, msg_size);
+  srv->capture_len += rec_size;
+  pthread_mutex_unlock (&srv->capture_mutex);
+}
+
+int cmsg_server_capture (cmsg_server_t *srv, const char *path)
+{
+  cmsg_capture_file_hdr_t *hdr;
+  int rtn;
+
+  pthread_mutex_lock (&srv->capture_mutex);
+  if (NULL == path) {
+    capture_close (srv);
+    pthread_mutex_unlock (&srv->capture_mutex);
+    return 0;
+  }
+  if (srv->capture_fd != -1) {
+    pthread_mutex_unlock (&srv->capture_mutex);
+    return EALREADY;
+  }
+  srv->capture_fd = open (path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (srv->capture_fd < 0) {
+    rtn = errno;
+    cmsg_log_err (LEVEL_ERROR, rtn, ("CIMPMSG: Unable to open capture file %s", path));
+    srv->capture_fd = -1;
+    pthread_mutex_unlock (&srv->capture_mutex);
+    return rtn;
+  }
+  rtn = capture_grow (srv, sizeof (cmsg_capture_file_hdr_t));
+  if (rtn != 0) {
+    cmsg_log_err (LEVEL_ERROR, rtn, ("CIMPMSG: Unable to map capture file %s", path));
+    capture_close (srv);
+    pthread_mutex_unlock (&srv->capture_mutex);
+    return rtn;
+  }
+  hdr = (cmsg_capture_file_hdr_t *) srv->capture_map;
+  memcpy (hdr->magic, CMSG_CAPTURE_MAGIC, sizeof (hdr->magic));
+  hdr->version = CMSG_CAPTURE_VERSION;
+  hdr->hdr_size = sizeof (cmsg_capture_file_hdr_t);
+  hdr->start_ns = get_monotonic_ns ();
+  srv->capture_len = sizeof (cmsg_capture_file_hdr_t);
+  __atomic_store_n (&srv->capture_on, true, __ATOMIC_RELAXED);
+  pthread_mutex_unlock (&srv->capture_mutex);
+  return 0;
+}
+
+
+// handles a subscribe or unsubscribe frame from a client
+void server_route_request (struct connection *conn, process_message_t handle_msg)
+{
+  int rtn, action;
+  server_rcv_msg_data_t rcv_msg_data;
+  struct cmsg_server *srv = conn->server;
+  char *name = conn->rx->rcv_msg;
+  size_t sz_name = conn->rx->rcv_msg_size;
+
+  if ((NULL == srv) || (sz_name == 0) || (sz_name > MAX_ROUTE_NAME_SIZE) ||
+      (name[sz_name-1] != '\0')) {
+    cmsg_log (LEVEL_ERROR, ("CIMPMSG: Invalid route request on socket %d\n",
+      conn->sock));
+    return;
+  }
+  pthread_mutex_lock (&srv->list_mutex);
+  if (conn->rx->msg_kind == KIND_SUBSCRIBE) {
+    action = CMSG_ACTION_ROUTE_ADDED;
+    rtn = route_add (srv, conn, name);
+  } else {
+    action = CMSG_ACTION_ROUTE_REMOVED;
+    rtn = route_remove (srv, conn, name);
+  }
+  pthread_mutex_unlock (&srv->list_mutex);
+  if ((rtn == 0) && (NULL != handle_msg)) {
+    conn_msg_data (conn, &rcv_msg_data, true);
+    handle_msg (action, &rcv_msg_data);
+  }
+}
+
+// list_mutex must be held
+void server_count_send (struct cmsg_server *srv, struct connection *conn,
+  int rtn, size_t sz_frame)
+{
+  if (rtn == 0) {
+    counter_add (&conn->stats.msgs_sent, 1);
+    counter_add (&conn->stats.bytes_sent, sz_frame);
+    stats_add (srv->stats, STAT_MSGS_SENT, 1);
+    stats_add (srv->stats, STAT_BYTES_SENT, sz_frame);
+  } else if ((rtn == EAGAIN) || (rtn == EWOULDBLOCK)) {
+    stats_add (srv->stats, STAT_SEND_DROPS, 1);
+  } else {
+    counter_add (&conn->stats.send_errors, 1);
+    stats_add (srv->stats, STAT_SEND_ERRORS, 1);
+  }
+}
+
+// Records what the client accepts and answers with what this server
+// accepts. Replies to the client's HELLO are the only frame the listen
+// thread sends on its own.
+void server_hello (struct connection *conn)
+{
+  struct cmsg_server *srv = conn->server;
+  char hello[HELLO_SIZE];
+  int rtn, flags = 0;
+  uint32_t peer_max = decode_hello (conn->rx->rcv_msg, conn->rx->rcv_msg_size, &flags);
+
+  if (0 == peer_max)
+    return;
+  if (flags & HELLO_LZ)
+    peer_max |= PEER_LZ;
+  encode_hello (hello, srv->max_msg_size, HELLO_LZ);
+  pthread_mutex_lock (&srv->list_mutex);
+  conn->peer_max_msg = peer_max;
+  rtn = send_msg_kind (conn->sock, KIND_HELLO, 0, hello, HELLO_SIZE, false);
+  server_count_send (srv, conn, rtn, msg_frame_size (KIND_HELLO, HELLO_SIZE));
+  pthread_mutex_unlock (&srv->list_mutex);
+  cmsg_log (LEVEL_DEBUG, ("CIMPMSG: hello on socket %d, max msg %u, flags %d\n", 
+    conn->sock, peer_max & ~PEER_LZ, flags));
+}
+
+int receive_msg_complete (struct connection *conn, process_message_t handle_msg)
+{
+  int sock = conn->sock;
+  size_t size = conn->rx->rcv_msg_size;
+  size_t sz_frame;
+  uint64_t start_ns;
+  int rtn;
+  struct cmsg_server *srv = conn->server;
+  server_rcv_msg_data_t rcv_msg_data;
+
+  conn->rcv_state = 0;
+  set_last_active_time (conn);
+  CMSG_PROBE (msg_complete, conn->sock, conn->rx->rcv_msg_size);
+  sz_frame = rx_frame_size (conn->rx);
+  counter_add (&conn->stats.msgs_rcvd, 1);
+  counter_add (&conn->stats.bytes_rcvd, sz_frame);
+  if (NULL != srv) {
+    stats_add (srv->stats, STAT_MSGS_RCVD, 1);
+    stats_add (srv->stats, STAT_BYTES_RCVD, sz_frame);
+  }
+  if ((conn->rx->flags & FRAME_LZ) && (NULL != srv)) {
+    rtn = msg_unpack (&conn->rx->rcv_msg, &conn->rx->rcv_msg_size, srv->max_msg_size);
+    if (rtn < 0) {
+      msg_buf_free (conn->rx->rcv_msg, conn->rx->rcv_msg_size);
+      conn->rx->rcv_msg = NULL;
+      return rtn;
+    }
+    conn->rx->flags = 0;
+    size = conn->rx->rcv_msg_size;
+  }
+  if ((NULL != srv) && __atomic_load_n (&srv->capture_on, __ATOMIC_RELAXED))
+    capture_frame (srv, conn);
+  if ((conn->rx->msg_kind == KIND_HELLO) && (NULL != srv)) {
+    server_hello (conn);
+    msg_buf_free (conn->rx->rcv_msg, conn->rx->rcv_msg_size);
+    conn->rx->rcv_msg = NULL;
+    return 1;
+  }
+  if ((conn->rx->msg_kind == KIND_SUBSCRIBE) || 
+      (conn->rx->msg_kind == KIND_UNSUBSCRIBE)) {
+    server_route_request (conn, handle_msg);
+    msg_buf_free (conn->rx->rcv_msg, conn->rx->rcv_msg_size);
+    conn->rx->rcv_msg = NULL;
+    return 1;
+  }
+  if (NULL == handle_msg)
+    return 1;  // the client takes the message from rx
+  // the message now belongs to the callback
+  conn_msg_data (conn, &rcv_msg_data, true);
+  conn->rx->rcv_msg = NULL;
+  if (NULL == srv) {
+    handle_msg (CMSG_ACTION_MSG_RECEIVED, &rcv_msg_data);
+    return 1;
+  }
+  start_ns = get_monotonic_ns ();
+  server_record_latency (srv, CMSG_LAT_READY_TO_CALLBACK, start_ns - srv->ready_ns);
+  CMSG_PROBE (callback_enter, sock, size);
+  handle_msg (CMSG_ACTION_MSG_RECEIVED, &rcv_msg_data);
+  CMSG_PROBE (callback_exit, sock, size);
+  server_record_latency (srv, CMSG_LAT_CALLBACK, get_monotonic_ns () - start_ns);
+  return 1;
+}
+
+// reads and drops the body of a shed message (rcv_state 2)
+int receive_msg_discard (struct connection *conn, bool *terminated)
+{
+  ssize_t bytes;
+  size_t read_len = conn->rx->rcv_msg_size - conn->rx->rcv_end_pos;
+  struct cmsg_server *srv = conn->server;
+  char scratch[4096];
+
+  if (read_len != 0) {
+    if (read_len > sizeof (scratch))
+      read_len = sizeof (scratch);
+    bytes = socket_receive (conn, scratch, read_len, terminated);
+    if (bytes == -3)
+      return 0;
+    if (bytes == -2)
+      return CMSG_ERR_RCV_TERMINATED;
+    if (bytes < 0) {
+      cmsg_log_err (LEVEL_ERROR, conn->oserr, 
+	("CIMPMSG: Error receiving msg data for socket %d", conn->sock));
+      return CMSG_ERR_RCV_OS_ERROR;
+    }
+    if (bytes == 0)
+      return CMSG_ERR_RCV_SOCKET_CLOSED;
+    conn->rx->rcv_end_pos += bytes;
+    if (conn->rx->rcv_end_pos < conn->rx->rcv_msg_size)
+      return 0;
+  }
+  conn->rcv_state = 0;
+  stats_add (srv->stats, STAT_MSGS_SHED, 1);
+  stats_add (srv->stats, STAT_BYTES_SHED, rx_frame_size (conn->rx));
+  return 1;
+}
+
+// returned msg must be freed
+int receive_msg_data (struct connection *conn, process_message_t handle_msg,
+  bool *terminated)
+{
+  ssize_t bytes;
+  size_t read_len = conn->rx->rcv_msg_size - conn->rx->rcv_end_pos;
+  int sock = conn->sock;
+  char *buf = conn->rx->rcv_msg;
+
+  if (conn->rcv_state == 2)
+    return receive_msg_discard (conn, terminated);
+  if (read_len == 0)
+    return receive_msg_complete (conn, handle_msg);
+  bytes = socket_receive (conn, buf+conn->rx->rcv_end_pos, read_len, terminated);
+  if (bytes == -3)
+    return 0;
+  if (bytes < 0) { 
+    if (bytes == -2)
+      return CMSG_ERR_RCV_TERMINATED;
+    cmsg_log_err (LEVEL_ERROR, conn->oserr, 
+	("CIMPMSG: Error receiving msg data for socket %d", sock));
+    return CMSG_ERR_RCV_OS_ERROR;
+  }
+
+  if (bytes == 0) {
+    cmsg_log (LEVEL_DEBUG, ("CIMPMSG: Receive message. Socket %d closed by sender\n", sock));
+    return CMSG_ERR_RCV_SOCKET_CLOSED;
+  }
+  if ((size_t) bytes > read_len) {
+    cmsg_log (LEVEL_ERROR, ("CIMPMSG: bytes received %ld not eq read_len in header %lu\n",
+	bytes, read_len));
+    return CMSG_ERR_RCV_BAD_DATA_BYTE_CT;
+  }
+  conn->rx->rcv_end_pos += bytes;
+  if ((size_t) bytes < read_len) {
+    counter_add (&conn->stats.partial_reads, 1);
+    if (NULL != conn->server)
+      stats_add (conn->server->stats, STAT_PARTIAL_READS, 1);
+    cmsg_log (LEVEL_DEBUG, 
+      ("CIMPMSG: Not all bytes received, only %ld of %lu. Waiting for remainder\n",
+        bytes, read_len));
+    return 0;
+  }
+  return receive_msg_complete (conn, handle_msg);
+}
+
+// Waits for the socket to be readable, timing out requests meanwhile.
+// Also returns every 500 msecs to check the terminated flag. With
+// idle_ns, returns 1 once that long has passed without input.
+int client_wait_readable (struct client_conn *cconn, int sock, uint64_t idle_ns)
+{
+  int wait, rtn;
+  nfds_t nfds;
+  uint64_t count, elapsed_ns;
+  uint64_t start_ns = (idle_ns != 0) ? get_monotonic_ns () : 0;
+  struct cmsg_rpc *rpc;
+  struct pollfd pfd[2];
+
+  while (true) {
+    wait = -1;
+    nfds = 1;
+    rpc = __atomic_load_n (&cconn->rpc, __ATOMIC_ACQUIRE);
+    if (NULL != rpc) {
+      wait = rpc_expire (rpc);
+      pfd[1].fd = rpc->wake_fd;
+      pfd[1].events = POLLIN;
+      pfd[1].revents = 0;
+      nfds = 2;
+    }
+    if ((wait < 0) || (wait > 500))
+      wait = 500;
+    if (idle_ns != 0) {
+      elapsed_ns = get_monotonic_ns () - start_ns;
+      if (elapsed_ns >= idle_ns)
+        return 1;
+      if ((idle_ns - elapsed_ns) / 1000000 < (uint64_t) wait)
+        wait = (int) ((idle_ns - elapsed_ns) / 1000000) + 1;
+    }
+    pfd[0].fd = sock;
+    pfd[0].events = POLLIN;
+    pfd[0].revents = 0;
+    rtn = poll (pfd, nfds, wait);
+    if (rtn < 0) {
+      if (errno != EINTR)
+        return 0;  // let recv report the error
+      continue;
+    }
+    if ((nfds == 2) && (pfd[1].revents != 0))
+      if (read (rpc->wake_fd, &count, sizeof (count)) < 0)
+        cmsg_log (LEVEL_DEBUG, ("CIMPMSG: request deadline wakeup not read\n"));
+    if (pfd[0].revents != 0)
+      return 0;  // readable, or an error recv will report
+    if (cconn->terminated)
+      return CMSG_ERR_RCV_TERMINATED;
+  }
+}
+
+// Makes room for need bytes from rb->start, by moving the unread bytes
+// to the front or by growing the buffer. A buffer grown for a large
+// message goes back to the default size once it is empty.
+int client_rcv_buf_reserve (struct client_conn *cconn, size_t need)
+{
+  struct client_rcv_buf *rb = cconn->rcv_buf;
+  struct client_rcv_buf *bigger;
+  size_t unread = 0;
+  size_t capacity = CLIENT_READ_AHEAD;
+  int sock = -1;
+
+  if (NULL != rb) {
+    unread = rb->end - rb->start;
+    sock = rb->sock;
+    if ((unread == 0) && (rb->capacity > CLIENT_READ_AHEAD) &&
+        (need <= CLIENT_READ_AHEAD)) {
+      client_rcv_buf_free (cconn);
+      rb = NULL;
+    } else if (rb->start + need <= rb->capacity) 
+      return 0;
+    else if (need <= rb->capacity) {
+      memmove (rb->data, rb->data + rb->start, unread);
+      rb->start = 0;
+      rb->end = unread;
+      return 0;
+    }
+  }
+  if (need > capacity)
+    capacity = need;
+  bigger = (struct client_rcv_buf *) cmsg_alloc (sizeof (*bigger) + capacity, 0, 
+    CMSG_ALLOC_RCV_MSG);
+  if (NULL == bigger) {
+    cmsg_log (LEVEL_ERROR, ("CIMPMSG: Unable to malloc client receive buffer\n"));
+    return CMSG_ERR_RCV_MSG_MALLOC_FAIL;
+  }
+  bigger->sock = sock;
+  bigger->capacity = capacity;
+  bigger->start = 0;
+  bigger->end = unread;
+  if (NULL != rb) {
+    memcpy (bigger->data, rb->data + rb->start, unread);
+    client_rcv_buf_free (cconn);
+  }
+  cconn->rcv_buf = bigger;
+  return 0;
+}
+
+// Reads whatever the socket has, at least one byte, into dest.
+ssize_t client_rcv_read (struct client_conn *cconn, int sock, char *dest, size_t len)
+{
+  ssize_t bytes;
+  int rtn;
+
+  while (true) {
+    rtn = client_wait_readable (cconn, sock, 0);
+    if (rtn < 0)
+      return rtn;
+    bytes = recv (sock, dest, len, MSG_DONTWAIT);
+    if (bytes > 0)
+      return bytes;
+    if (bytes == 0) {
+      cmsg_log (LEVEL_DEBUG, ("CIMPMSG: Receive message. Socket %d closed by sender\n", sock));
+      return CMSG_ERR_RCV_SOCKET_CLOSED;
+    }
+    if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+      continue;
+    cconn->oserr = errno;
+    if (errno == ECONNRESET) // socket closed by peer
+      return CMSG_ERR_RCV_SOCKET_CLOSED;
+    cmsg_log_err (LEVEL_ERROR, errno, 
+      ("CIMPMSG: Error receiving msg for socket %d", sock));
+    return CMSG_ERR_RCV_OS_ERROR;
+  }
+}
+
+// Reads until need bytes from rb->start are buffered. Each read takes
+// as much as fits, so the frames that follow are often buffered too.
+int client_rcv_fill (struct client_conn *cconn, int sock, size_t need)
+{
+  struct client_rcv_buf *rb;
+  ssize_t bytes;
+  int rtn;
+
+  rtn = client_rcv_buf_reserve (cconn, need);
+  if (rtn < 0)
+    return rtn;
+  rb = cconn->rcv_buf;
+  while (rb->end - rb->start < need) {
+    bytes = client_rcv_read (cconn, sock, rb->data + rb->end, rb->capacity - rb->end);
+    if (bytes < 0)
+      return (int) bytes;
+    rb->end += (size_t) bytes;
+  }
+  return 0;
+}
+
+// Moves the next len bytes of the stream into dest, or drops them if
+// dest is NULL. Buffered bytes go first. A remainder as big as the
+// buffer is read straight into dest instead of through the buffer.
+int client_rcv_copy (struct client_conn *cconn, int sock, char *dest, size_t len)
+{
+  struct client_rcv_buf *rb = cconn->rcv_buf;
+  ssize_t bytes;
+  size_t n;
+  int rtn;
+  bool partial = false;
+
+  while (len > 0) {
+    n = rb->end - rb->start;
+    if (n == 0) {
+      if (!partial) {
+        counter_add (&cconn->stats.partial_reads, 1);
+        partial = true;
+      }
+      if ((NULL != dest) && (len >= rb->capacity)) {
+        bytes = client_rcv_read (cconn, sock, dest, len);
+        if (bytes < 0)
+          return (int) bytes;
+        dest += bytes;
+        len -= (size_t) bytes;
+        continue;
+      }
+      rb->start = 0;
+      rb->end = 0;
+      rtn = client_rcv_fill (cconn, sock, 1);
+      if (rtn < 0)
+        return rtn;
+      continue;
+    }
+    if (n > len)
+      n = len;
+    if (NULL != dest) {
+      memcpy (dest, rb->data + rb->start, n);
+      dest += n;
+    }
+    rb->start += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// Waits for the next frame while nothing is buffered. A read-ahead
+// buffer left empty for buf_idle_msecs is freed meanwhile, as the
+// server frees an idle connection's receive state, and is allocated
+// again once input arrives.
+int client_rcv_wait_frame (struct client_conn *cconn, int sock)
+{
+  struct client_rcv_buf *rb = cconn->rcv_buf;
+  int rtn;
+
+  if ((NULL == rb) || (rb->end > rb->start))
+    return 0;
+  rtn = client_wait_readable (cconn, sock, client_buf_idle_ns (cconn));
+  if (rtn != 1)
+    return rtn;
+  client_rcv_buf_free (cconn);
+  return client_wait_readable (cconn, sock, 0);
+}
+
+// what this client told the server it takes
+size_t client_max_msg (struct client_conn *cconn)
+{
+  if (cconn->opts.max_msg_size > MAX_BASIC_MSG_SIZE)
+    return cconn->opts.max_msg_size;
+  return MAX_BASIC_MSG_SIZE;
+}
+
+// Takes the next frame header from the read-ahead buffer.
+int client_rcv_header (struct client_conn *cconn, int sock, int *kind,
+  int *flags, uint32_t *corr_id, size_t *msg_size)
+{
+  unsigned char *header;
+  int rtn;
+
+  rtn = client_rcv_wait_frame (cconn, sock);
+  if (rtn < 0)
+    return rtn;
+  rtn = client_rcv_fill (cconn, sock, MSG_HEADER_SIZE);
+  if (rtn < 0)
+    return rtn;
+  header = (unsigned char *) cconn->rcv_buf->data + cconn->rcv_buf->start;
+  if ((header[0] == MSG_HEADER_MARK) && (header[1] == MSG_HEADER_MARK_EXT)) {
+    rtn = client_rcv_fill (cconn, sock, MSG_EXT_HEADER_SIZE);
+    if (rtn < 0)
+      return rtn;
+    header = (unsigned char *) cconn->rcv_buf->data + cconn->rcv_buf->start;
+  }
+  rtn = decode_msg_header (header, header + MSG_HEADER_SIZE, kind, flags, corr_id,
+    msg_size);
+  if (rtn < 0)
+    return rtn;
+  if (*msg_size > client_max_msg (cconn)) {
+    cmsg_log (LEVEL_ERROR, 
+      ("CIMPMSG: Message of %lu bytes on socket %d is over the limit\n", *msg_size, sock));
+    return CMSG_ERR_RCV_MSG_TOO_BIG;
+  }
+  cconn->rcv_buf->start += (header[1] == MSG_HEADER_MARK_EXT) ? 
+    MSG_EXT_HEADER_SIZE : MSG_HEADER_SIZE;
+  CMSG_PROBE (header, sock, *msg_size);
+  return 0;
+}
+
+void client_set_peer (struct client_conn *cconn, uint32_t peer_max, int flags)
+{
+  if (0 == peer_max)
+    return;
+  __atomic_store_n (&cconn->peer_max_msg_size, peer_max, __ATOMIC_RELEASE);
+  __atomic_store_n (&cconn->peer_compress, (flags & HELLO_LZ) != 0, __ATOMIC_RELEASE);
+}
+
+// Takes the server's HELLO out of the read-ahead buffer.
+int client_rcv_hello (struct client_conn *cconn, int sock, size_t size)
+{
+  uint32_t peer_max = 0;
+  int rtn, flags = 0;
+
+  if (size > CLIENT_READ_AHEAD)
+    return client_rcv_copy (cconn, sock, NULL, size);  // not a HELLO we know
+  rtn = client_rcv_fill (cconn, sock, size);
+  if (rtn < 0)
+    return rtn;
+  peer_max = decode_hello (cconn->rcv_buf->data + cconn->rcv_buf->start, size, &flags);
+  cconn->rcv_buf->start += size;
+  client_set_peer (cconn, peer_max, flags);
+  return 0;
+}
+
+// Waits up to HELLO_WAIT_MSECS for the server's HELLO, so that a
+// client that only sends learns the server's limits too. Frames that
+// come before it stay in the read-ahead buffer for cmsg_client_receive.
+// The client must not be shared yet.
+int client_wait_hello (struct client_conn *cconn, int sock)
+{
+  struct client_rcv_buf *rb;
+  unsigned char *header;
+  size_t pos = 0, need, unread, sz_header, size;
+  uint64_t start_ns = get_monotonic_ns ();
+  uint64_t wait_ns = HELLO_WAIT_MSECS * 1000000ULL;
+  uint64_t elapsed_ns;
+  uint32_t corr_id, peer_max;
+  ssize_t bytes;
+  int rtn, kind, flags, hello_flags = 0;
+
+  while (true) {
+    // frames from rb->start to pos have been passed over
+    rb = cconn->rcv_buf;
+    unread = (NULL == rb) ? 0 : rb->end - rb->start;
+    need = pos + MSG_EXT_HEADER_SIZE;
+    while (unread >= pos + MSG_HEADER_SIZE) {
+      header = (unsigned char *) rb->data + rb->start + pos;
+      sz_header = MSG_HEADER_SIZE;
+      if ((header[0] == MSG_HEADER_MARK) && (header[1] == MSG_HEADER_MARK_EXT))
+        sz_header = MSG_EXT_HEADER_SIZE;
+      if (unread < pos + sz_header)
+        break;
+      rtn = decode_msg_header (header, header + MSG_HEADER_SIZE, &kind, &flags,
+        &corr_id, &size);
+      if (rtn < 0)
+        return rtn;
+      if (size > client_max_msg (cconn)) {
+        cmsg_log (LEVEL_ERROR, 
+          ("CIMPMSG: Message of %lu bytes on socket %d is over the limit\n", size, sock));
+        return CMSG_ERR_RCV_MSG_TOO_BIG;
+      }
+      if (kind != KIND_HELLO) {
+        pos += sz_header + size;
+        need = pos + MSG_EXT_HEADER_SIZE;
+        continue;
+      }
+      need = pos + sz_header + size;
+      if (unread < need)
+        break;
+      peer_max = decode_hello ((char *) header + sz_header, size, &hello_flags);
+      client_set_peer (cconn, peer_max, hello_flags);
+      counter_add (&cconn->stats.msgs_received, 1);
+      counter_add (&cconn->stats.bytes_received, sz_header + size);
+      memmove (header, header + sz_header + size, unread - need);
+      rb->end -= sz_header + size;
+      return 0;
+    }
+    elapsed_ns = get_monotonic_ns () - start_ns;
+    if (elapsed_ns >= wait_ns)
+      return 0;  // sends stay within 65535 until a receive gets it
+    rtn = client_wait_readable (cconn, sock, wait_ns - elapsed_ns);
+    if (rtn != 0)
+      return (rtn == 1) ? 0 : rtn;
+    rtn = client_rcv_buf_reserve (cconn, (need > unread) ? need : unread + 1);
+    if (rtn < 0)
+      return rtn;
+    rb = cconn->rcv_buf;
+    rb->sock = sock;
+    bytes = client_rcv_read (cconn, sock, rb->data + rb->end, rb->capacity - rb->end);
+    if (bytes < 0)
+      return (int) bytes;
+    rb->end += (size_t) bytes;
+  }
+}
+
+int cmsg_connect_client_opts (struct client_conn *conn, 
+  const char *ip_addr, unsigned int port, unsigned int send_timeout_msecs,
+  client_opts_t *options)
+{
+	int sock, rtn;
+	struct timespec now;
+
+	init_client_conn (conn);
+	if (NULL != options)
+		init_client_opts (&conn->opts, options);
+
+	if ((unsigned int) -1 == port) {
+		conn->sock = -1;
+		return EINVAL;
+	}
+	if (make_sockaddr (&conn->addr, ip_addr, port, false) != 0)
+          return EINVAL;
+	conn->send_timeout_msecs = send_timeout_msecs;
+	if (conn->opts.auto_reconnect) {
+		clock_gettime (CLOCK_MONOTONIC, &now);
+		conn->rand_seed = (unsigned int) getpid () ^ (unsigned int) now.tv_nsec;
+		conn->next_connect_time = now;
+		conn->conn_state = CLIENT_STATE_DISCONNECTED;
+		pthread_mutex_lock (&conn->send_mutex);
+		client_reconnect_step (conn);
+		pthread_mutex_unlock (&conn->send_mutex);
+		return 0;
+	}
+	sock = client_create_socket (conn);
+	if (sock < 0)
+ 	  return conn->oserr;
 	if (connect (sock, (struct sockaddr *) &conn->addr, sizeof (conn->addr)) < 0) {
 		conn->oserr = errno;
 		cmsg_log_err (LEVEL_ERROR, errno, 
@@ -547,363 +3590,2186 @@ int cmsg_connect_client (struct client_conn *conn,
 		return conn->oserr;
 	}
 	conn->sock = sock;
+	if (client_wants_hello (conn)) {
+		rtn = client_send_hello (conn);
+		if (rtn == 0) {
+			rtn = client_wait_hello (conn, sock);
+			if (rtn < 0)
+				rtn = (rtn == CMSG_ERR_RCV_OS_ERROR) ? conn->oserr : ECONNRESET;
+		}
+		if (rtn != 0) {
+			conn->oserr = rtn;
+			shutdown_sock (sock);
+			client_rcv_buf_free (conn);
+			conn->sock = -1;
+			return rtn;
+		}
+	}
+	conn->conn_state = CLIENT_STATE_CONNECTED;
 	return 0;
 }
 
-void cmsg_shutdown_client (struct client_conn *conn)
+int cmsg_connect_client (struct client_conn *conn, 
+  const char *ip_addr, unsigned int port, unsigned int send_timeout_msecs)
+{
+	return cmsg_connect_client_opts (conn, ip_addr, port, 
+	  send_timeout_msecs, NULL);
+}
+
+// Fails the request a reply was for, when the reply can't be
+// allocated (ENOMEM) or expanded (EBADMSG), rather than leaving it
+// to time out.
+void client_fail_reply (struct client_conn *cconn, uint32_t corr_id, int rtn)
+{
+  rpc_fail (cconn->rpc, corr_id, 
+    (rtn == CMSG_ERR_RCV_MSG_MALLOC_FAIL) ? ENOMEM : EBADMSG);
+}
+
+// Reads and expands a compressed message, and leaves it where
+// client_receive_msg would leave a plain one. *size is the frame's
+// payload size on entry and the message size on return.
+int client_rcv_unpack (struct client_conn *cconn, int sock, int kind, 
+  uint32_t corr_id, int mode, char *buf, size_t sz_buf, char **msg, size_t *size)
+{
+  struct client_rcv_buf *rb;
+  size_t sz_data = *size;
+  char *data;
+  int rtn;
+
+  data = msg_buf_alloc (sz_data);
+  if (NULL == data) {
+    cmsg_log (LEVEL_ERROR, 
+      ("CIMPMSG: Unable to malloc msg buffer for socket %d\n", sock));
+    if (kind == CMSG_KIND_REPLY)
+      client_fail_reply (cconn, corr_id, CMSG_ERR_RCV_MSG_MALLOC_FAIL);
+    return CMSG_ERR_RCV_MSG_MALLOC_FAIL;
+  }
+  rtn = client_rcv_copy (cconn, sock, data, sz_data);
+  if (rtn == 0) {
+    rtn = msg_unpack (&data, &sz_data, client_max_msg (cconn));
+    if ((rtn < 0) && (kind == CMSG_KIND_REPLY))
+      client_fail_reply (cconn, corr_id, rtn);
+  }
+  if (rtn < 0) {
+    msg_buf_free (data, sz_data);
+    return rtn;
+  }
+  *size = sz_data;
+  if ((kind == CMSG_KIND_REPLY) || (mode == RCV_ALLOC)) {
+    *msg = data;
+    return 0;
+  }
+  if (mode == RCV_COPY) {
+    memcpy (buf, data, (sz_data < sz_buf) ? sz_data : sz_buf);
+    *msg = buf;
+  } else {
+    // past the unread bytes, so it stays until the next receive
+    rtn = client_rcv_buf_reserve (cconn, 
+      cconn->rcv_buf->end - cconn->rcv_buf->start + sz_data);
+    if (rtn == 0) {
+      rb = cconn->rcv_buf;
+      memcpy (rb->data + rb->end, data, sz_data);
+      *msg = rb->data + rb->end;
+    }
+  }
+  msg_buf_free (data, sz_data);
+  return rtn;
+}
+
+// Receives frames until a message that isn't a reply arrives, and
+// leaves it in cconn->rcv_msg as the mode says. Returns its size.
+// rcv_mutex must be held.
+int client_receive_msg (struct client_conn *cconn, int sock, int mode,
+  char *buf, size_t sz_buf)
+{
+  int rtn, kind, flags;
+  uint32_t corr_id;
+  size_t size, n, sz_frame;
+  uint64_t ready_ns, start_ns;
+  char *msg;
+
+  if ((NULL != cconn->rcv_buf) && (cconn->rcv_buf->sock != sock)) {
+    // left from an earlier connection, whose fd client_rcv_sock kept
+    // from being reused while this side could still read it
+    cconn->rcv_buf->start = 0;
+    cconn->rcv_buf->end = 0;
+    cconn->rcv_buf->sock = sock;
+  }
+  while (true) {
+    rtn = client_rcv_header (cconn, sock, &kind, &flags, &corr_id, &size);
+    if (rtn < 0)
+      return rtn;  // counted by client_receive
+    cconn->rcv_buf->sock = sock;
+    if (kind == KIND_HELLO) {
+      rtn = client_rcv_hello (cconn, sock, size);
+      if (rtn < 0)
+        return rtn;
+      counter_add (&cconn->stats.msgs_received, 1);
+      counter_add (&cconn->stats.bytes_received, msg_frame_size (kind, size));
+      continue;
+    }
+    ready_ns = get_monotonic_ns ();
+    sz_frame = (flags != 0) ? size + MSG_EXT_HEADER_SIZE : msg_frame_size (kind, size);
+    msg = buf;
+    n = size;
+    if (flags & FRAME_LZ) {
+      rtn = client_rcv_unpack (cconn, sock, kind, corr_id, mode, buf, sz_buf, 
+        &msg, &size);
+      if (rtn < 0)
+        return rtn;
+    } else {
+      if ((kind == CMSG_KIND_REPLY) || (mode == RCV_ALLOC)) {
+        msg = msg_buf_alloc (size);
+        if (NULL == msg) {
+          cmsg_log (LEVEL_ERROR, 
+            ("CIMPMSG: Unable to malloc msg buffer for socket %d\n", sock));
+          if (kind == CMSG_KIND_REPLY)
+            client_fail_reply (cconn, corr_id, CMSG_ERR_RCV_MSG_MALLOC_FAIL);
+          return CMSG_ERR_RCV_MSG_MALLOC_FAIL;
+        }
+      } else if (mode == RCV_VIEW) {
+        rtn = client_rcv_fill (cconn, sock, size);
+        if (rtn < 0)
+          return rtn;
+        msg = cconn->rcv_buf->data + cconn->rcv_buf->start;
+        cconn->rcv_buf->start += size;
+        n = 0;
+      } else if (n > sz_buf)
+        n = sz_buf;
+      rtn = client_rcv_copy (cconn, sock, msg, n);
+      if ((rtn == 0) && (n < size) && (mode != RCV_VIEW))
+        rtn = client_rcv_copy (cconn, sock, NULL, size - n);  // truncated
+      if (rtn < 0) {
+        if (msg != buf)
+          msg_buf_free (msg, size);
+        return rtn;
+      }
+    }
+    CMSG_PROBE (msg_complete, sock, size);
+    counter_add (&cconn->stats.msgs_received, 1);
+    counter_add (&cconn->stats.bytes_received, sz_frame);
+    start_ns = get_monotonic_ns ();
+    client_record_latency (cconn, CMSG_LAT_READY_TO_CALLBACK, start_ns - ready_ns);
+    if (kind == CMSG_KIND_REPLY) {
+      CMSG_PROBE (callback_enter, sock, size);
+      rpc_complete (cconn->rpc, corr_id, msg, size);
+      CMSG_PROBE (callback_exit, sock, size);
+      client_record_latency (cconn, CMSG_LAT_CALLBACK, get_monotonic_ns () - start_ns);
+      continue;
+    }
+    cconn->rcv_msg = msg;
+    cconn->rcv_msg_size = size; 
+    cconn->rcv_count++;
+    return (int) size;
+  }
+}
+
+// Waits until an auto_reconnect client is connected.
+// Returns the socket, or -1 if terminated or shut down.
+int client_wait_connected (struct client_conn *conn)
+{
+  int sock;
+
+  while (true) {
+    if (conn->terminated)
+      return -1;
+    pthread_mutex_lock (&conn->send_mutex);
+    if (conn->conn_state == CLIENT_STATE_IDLE) {
+      pthread_mutex_unlock (&conn->send_mutex);
+      return -1;
+    }
+    sock = -1;
+    if (client_reconnect_step (conn))
+      sock = client_rcv_sock (conn);
+    pthread_mutex_unlock (&conn->send_mutex);
+    if (NULL != conn->rpc)
+      rpc_fail_lost_requests (conn->rpc);
+    if (sock != -1)
+      return sock;
+    if (conn->terminated)
+      return -1;
+    poll (NULL, 0, RECONNECT_POLL_MSECS);
+  }
+}
+
+void client_lost_connection (struct client_conn *conn, int sock)
+{
+  pthread_mutex_lock (&conn->send_mutex);
+  if ((conn->conn_state == CLIENT_STATE_CONNECTED) && (conn->sock == sock)) {
+    cmsg_log (LEVEL_INFO, ("CIMPMSG: client lost connection on socket %d\n", sock));
+    client_disconnect (conn);
+  }
+  pthread_mutex_unlock (&conn->send_mutex);
+}
+
+int client_receive (struct client_conn *cconn, int mode, char *buf, size_t sz_buf)
+{
+  int rtn, sock;
+
+  pthread_mutex_lock (&cconn->rcv_mutex);
+  while (true) {
+    sock = cconn->sock;
+    if (cconn->opts.auto_reconnect) {
+      sock = client_wait_connected (cconn);
+      if (sock < 0) {
+        rtn = CMSG_ERR_RCV_TERMINATED;
+        break;
+      }
+    }
+    rtn = client_receive_msg (cconn, sock, mode, buf, sz_buf);
+    if ((rtn < 0) && (NULL != cconn->rcv_buf)) {
+      cconn->rcv_buf->start = 0;  // the stream is out of step
+      cconn->rcv_buf->end = 0;
+    }
+    if ((rtn < 0) && (rtn != CMSG_ERR_RCV_TERMINATED) && 
+        (rtn != CMSG_ERR_RCV_SOCKET_CLOSED))
+      counter_add (&cconn->stats.receive_errors, 1);
+    if ((rtn >= 0) || !cconn->opts.auto_reconnect)
+      break;
+    if ((rtn == CMSG_ERR_RCV_TERMINATED) || (rtn == CMSG_ERR_RCV_MSG_MALLOC_FAIL))
+      break;
+    client_lost_connection (cconn, sock);
+  }
+  pthread_mutex_unlock (&cconn->rcv_mutex);
+  return rtn;
+}
+
+int cmsg_client_receive (struct client_conn *cconn)
+{
+  return client_receive (cconn, RCV_ALLOC, NULL, 0);
+}
+
+int cmsg_client_receive_into (struct client_conn *cconn, char *buf, size_t sz_buf)
+{
+  if (NULL == buf)
+    return client_receive (cconn, RCV_VIEW, NULL, 0);
+  return client_receive (cconn, RCV_COPY, buf, sz_buf);
+}
+
+// true if the socket has input. The next read then won't block, as
+// one that gets part of a header keeps it (see receive_msg_header).
+bool conn_has_input (struct connection *conn)
+{
+  int avail = 0;
+
+  return (ioctl (conn->sock, FIONREAD, &avail) == 0) && (avail > 0);
+}
+
+// Reads from a ready connection. Deficit round robin: each pass adds
+// read_quantum to the connection's deficit, completed frames are
+// charged against it, and further frames are read while it is positive,
+// fewer than read_max_msgs were read and more input is buffered. A
+// connection that runs out of input loses its deficit, so a quiet
+// client never saves up a burst. One stopped by the budget with input
+// left is marked as backlogged.
+// Reads don't wait, so the first needs no conn_has_input check: poll
+// reported input or end of file. A body is read along with its header,
+// as it usually arrives with it.
+int server_receive_conn (struct cmsg_server *srv, struct connection *conn,
+  process_message_t handle_msg)
+{
+  int rtn;
+  unsigned msgs = 0;
+  uint64_t bytes_before;
+
+  conn->read_deficit += srv->read_quantum;
+  conn->read_backlog = false;
+  while (true) {
+    bytes_before = conn->stats.bytes_rcvd;
+    if (conn->rcv_state == 0) {
+      rtn = receive_msg_header (conn);
+      if ((rtn == 0) && (conn->rcv_state != 0))
+        rtn = receive_msg_data (conn, handle_msg, NULL);
+    } else
+      rtn = receive_msg_data (conn, handle_msg, NULL);
+    if (rtn < 0)
+      return rtn;
+    if (rtn == 1) {
+      msgs++;
+      conn->read_deficit -= (int64_t) (conn->stats.bytes_rcvd - bytes_before);
+    }
+    if (conn->user_data.close_request)
+      break;
+    if (!conn_has_input (conn)) {
+      conn->read_deficit = 0;
+      break;
+    }
+    if ((conn->read_deficit <= 0) || (msgs >= srv->read_max_msgs)) {
+      conn->read_backlog = true;
+      break;
+    }
+  }
+  // one huge frame costs at most one pass without extra frames
+  if (conn->read_deficit < -(int64_t) srv->read_quantum)
+    conn->read_deficit = -(int64_t) srv->read_quantum;
+  return 0;
+}
+
+// Serves the connections poll found ready, those that were not
+// backlogged first, so a quiet client waits for at most one budget
+// (by default one frame) from each busy one. Each pass starts one
+// further along the poll set.
+void server_receive_msgs (struct cmsg_server *srv, process_message_t handle_msg,
+  bool *any_closing)
+{
+  int rtn;
+  unsigned i, count = srv->poll_count;
+  unsigned start;
+  bool backlog;
+  struct connection *conn;
+  server_rcv_msg_data_t rcv_msg_data;
+
+  srv->read_backlog = false;
+  if (count == 0)
+    return;
+  start = srv->read_start++ % count;
+  for (backlog = false; ; backlog = true) {
+    for (i = 0; i < count; i++) {
+      conn = srv->poll_conns[(start + i) % count];
+      if ((NULL != conn) && conn->rcv_selected && (conn->rcv_state >= 0) && 
+          (conn->read_backlog == backlog)) {
+        conn->rcv_selected = false;
+        rtn = server_receive_conn (srv, conn, handle_msg);
+        if (conn->read_backlog)
+          srv->read_backlog = true;
+        if (rtn < 0) {
+          if (rtn != CMSG_ERR_RCV_SOCKET_CLOSED)
+            stats_add (srv->stats, STAT_RCV_ERRORS, 1);
+          if (srv->close_conn_on_error) {
+            conn->rcv_state = -2;
+            *any_closing = true;
+            conn_msg_data (conn, &rcv_msg_data, false);
+            handle_msg (CMSG_ACTION_CONN_DROPPED, &rcv_msg_data);
+          } else {
+            conn->rcv_state = 0; // Ignore
+            conn_rx_release (srv, conn);  // drops a partial message
+          }
+        }
+      }
+    }
+    if (backlog)
+      break;
+  }
+}
+
+void server_close_connections (struct cmsg_server *srv)
+{
+  struct connection *conn;
+  struct connection *tmp;
+
+  cmsg_log (LEVEL_DEBUG, ("CIMPMSG: server_close_connections\n"));
+  pthread_mutex_lock (&srv->list_mutex);
+  LL_FOREACH_SAFE (srv->connection_list, conn, tmp)
+    if (conn->rcv_state == -2) {
+        LL_DELETE (srv->connection_list, conn);
+        cmsg_log (LEVEL_INFO, 
+	  ("CIMPMSG: Closing connection for socket %d\n", conn->sock));
+        shutdown_connection (srv, conn);
+    }
+  pthread_mutex_unlock (&srv->list_mutex);
+}
+
+
+// appends the latency histograms as Prometheus summaries, in seconds
+int server_format_latency (struct cmsg_server *srv, const char *labels,
+  char *buf, size_t sz_buf)
+{
+  static const char *names[CMSG_LAT_COUNT] = {
+    "ready_to_callback", "callback", "send", "queue_delay"
+  };
+  int which, n;
+  size_t len = 0;
+  cmsg_latency_t lat;
+
+  n = snprintf (buf, sz_buf, "# HELP cimpmsg_latency_seconds %s\n"
+    "# TYPE cimpmsg_latency_seconds summary\n",
+    "Event loop and send latency");
+  if (n < 0)
+    return n;
+  len = n;
+  for (which=0; which<CMSG_LAT_COUNT; which++) {
+    if (cmsg_server_get_latency (srv, which, &lat) != 0)
+      continue;
+    n = snprintf (buf+len, (len < sz_buf) ? sz_buf-len : 0,
+      "cimpmsg_latency_seconds{%s,kind=\"%s\",quantile=\"0.5\"} %.9f\n"
+      "cimpmsg_latency_seconds{%s,kind=\"%s\",quantile=\"0.99\"} %.9f\n"
+      "cimpmsg_latency_seconds{%s,kind=\"%s\",quantile=\"0.999\"} %.9f\n"
+      "cimpmsg_latency_seconds_sum{%s,kind=\"%s\"} %.9f\n"
+      "cimpmsg_latency_seconds_count{%s,kind=\"%s\"} %llu\n",
+      labels, names[which], lat.p50_ns / 1e9,
+      labels, names[which], lat.p99_ns / 1e9,
+      labels, names[which], lat.p999_ns / 1e9,
+      labels, names[which], (lat.mean_ns * lat.count) / 1e9,
+      labels, names[which], (unsigned long long) lat.count);
+    if (n < 0)
+      return n;
+    len += n;
+  }
+  return (int) len;
+}
+
+// answers one connection on the stats socket with a snapshot
+void server_serve_stats (struct cmsg_server *srv)
+{
+  int sock, len, n;
+  char labels[32];
+  char buf[8192];
+  cmsg_stats_t stats;
+
+  sock = accept (srv->stats_sock, NULL, NULL);
+  if (sock < 0) {
+    cmsg_log_err (LEVEL_ERROR, errno, ("CIMPMSG: Accept error on stats socket:"));
+    return;
+  }
+  cmsg_server_get_stats (srv, &stats);
+  snprintf (labels, sizeof (labels), "port=\"%u\"", srv->port);
+  len = cmsg_stats_format (&stats, labels, buf, sizeof (buf));
+  if ((len >= 0) && (len < (int) sizeof (buf))) {
+    n = server_format_latency (srv, labels, buf+len, sizeof (buf) - len);
+    if (n > 0)
+      len += n;
+  }
+  if (len >= (int) sizeof (buf))
+    len = sizeof (buf) - 1;
+  // the snapshot fits in the socket buffer, so never block the loop
+  if (send (sock, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+    cmsg_log_err (LEVEL_DEBUG, errno, ("CIMPMSG: Error sending stats:"));
+  close (sock);
+}
+
+/*------------------------------------------------------------------
+ * Live upgrade. The old process listens on a Unix socket, and the new
+ * process connects to it with cmsg_server_create_handoff. The old
+ * listen thread then sends the listening socket and each connection
+ * with SCM_RIGHTS, one record per fd followed by the connection's
+ * partially received frame header or message and its route names. The
+ * list lock is held throughout, so no sends interleave with the
+ * handoff, and the old process keeps serving if it fails.
+---------------------------------------------------------------------*/
+
+#define HANDOFF_MAGIC		0x434d4832  // "CMH2"
+#define HANDOFF_LISTEN		1
+#define HANDOFF_CONN		2
+#define HANDOFF_END		3
+#define HANDOFF_TIMEOUT_SECS	5
+
+typedef struct handoff_rec {
+  uint32_t magic;
+  uint32_t type;
+  int32_t rcv_state;
+  int32_t msg_kind;      // and the frame flags << 8
+  uint32_t corr_id;
+  uint32_t port;         // of the listening socket
+  uint32_t peer_max_msg;
+  uint32_t hdr_len;      // bytes of a frame header received so far
+  unsigned char hdr[16];  // MSG_EXT_HEADER_SIZE, padded
+  uint64_t msg_size;
+  uint64_t end_pos;     // bytes of the message received, which follow
+  uint64_t routes_len;  // then the route names, each '\0' terminated
+} handoff_rec_t;
+
+int handoff_send_all (int sock, const char *buf, size_t len)
+{
+  ssize_t bytes;
+
+  while (len > 0) {
+    bytes = send (sock, buf, len, MSG_NOSIGNAL);
+    if (bytes < 0) {
+      if (errno == EINTR)
+        continue;
+      return errno;
+    }
+    buf += bytes;
+    len -= bytes;
+  }
+  return 0;
+}
+
+int handoff_recv_all (int sock, char *buf, size_t len)
+{
+  ssize_t bytes;
+
+  while (len > 0) {
+    bytes = recv (sock, buf, len, 0);
+    if (bytes < 0) {
+      if (errno == EINTR)
+        continue;
+      return errno;
+    }
+    if (bytes == 0)
+      return ECONNRESET;
+    buf += bytes;
+    len -= bytes;
+  }
+  return 0;
+}
+
+// sends rec with fd attached, then the payload
+int handoff_send_rec (int sock, handoff_rec_t *rec, int fd,
+  const char *payload, size_t sz_payload)
+{
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union {
+    char buf[CMSG_SPACE (sizeof (int))];
+    struct cmsghdr align;
+  } control;
+  ssize_t bytes;
+
+  memset (&msg, 0, sizeof (msg));
+  iov.iov_base = rec;
+  iov.iov_len = sizeof (*rec);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (fd >= 0) {
+    memset (&control, 0, sizeof (control));
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof (control.buf);
+    cmsg = CMSG_FIRSTHDR (&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN (sizeof (int));
+    memcpy (CMSG_DATA (cmsg), &fd, sizeof (int));
+  }
+  do
+    bytes = sendmsg (sock, &msg, MSG_NOSIGNAL);
+  while ((bytes < 0) && (errno == EINTR));
+  if (bytes < 0)
+    return errno;
+  // the fd went with the first byte, so the rest is plain data
+  if (handoff_send_all (sock, (char *) rec + bytes, sizeof (*rec) - bytes) != 0)
+    return EIO;
+  return handoff_send_all (sock, payload, sz_payload);
+}
+
+// receives a record, and the fd attached to it in *fd (or -1)
+int handoff_recv_rec (int sock, handoff_rec_t *rec, int *fd)
+{
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union {
+    char buf[CMSG_SPACE (sizeof (int))];
+    struct cmsghdr align;
+  } control;
+  ssize_t bytes;
+
+  *fd = -1;
+  memset (&msg, 0, sizeof (msg));
+  iov.iov_base = rec;
+  iov.iov_len = sizeof (*rec);
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof (control.buf);
+  do
+    bytes = recvmsg (sock, &msg, MSG_CMSG_CLOEXEC);
+  while ((bytes < 0) && (errno == EINTR));
+  if (bytes < 0)
+    return errno;
+  if (bytes == 0)
+    return ECONNRESET;
+  for (cmsg = CMSG_FIRSTHDR (&msg); NULL != cmsg; cmsg = CMSG_NXTHDR (&msg, cmsg))
+    if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS))
+      memcpy (fd, CMSG_DATA (cmsg), sizeof (int));
+  if (handoff_recv_all (sock, (char *) rec + bytes, sizeof (*rec) - bytes) != 0)
+    return EIO;
+  if (rec->magic != HANDOFF_MAGIC)
+    return EPROTO;
+  return 0;
+}
+
+// list_mutex must be held
+int handoff_send_conn (int sock, struct connection *conn)
+{
+  handoff_rec_t rec;
+  struct route_sub *rsub;
+  size_t routes_len = 0;
+  size_t len;
+  char *payload;
+  int rtn;
+
+  memset (&rec, 0, sizeof (rec));
+  rec.magic = HANDOFF_MAGIC;
+  rec.type = HANDOFF_CONN;
+  rec.rcv_state = conn->rcv_state;
+  rec.peer_max_msg = conn->peer_max_msg;
+  if ((conn->rcv_state == 0) && (NULL != conn->rx) && (conn->rx->hdr_len != 0)) {
+    rec.hdr_len = conn->rx->hdr_len;
+    memcpy (rec.hdr, conn->rx->hdr, conn->rx->hdr_len);
+  } else if (conn->rcv_state == 1) {
+    rec.msg_kind = conn->rx->msg_kind | (conn->rx->flags << 8);
+    rec.corr_id = conn->rx->corr_id;
+    rec.msg_size = conn->rx->rcv_msg_size;
+    rec.end_pos = conn->rx->rcv_end_pos;
+  } else if (conn->rcv_state == 2) {
+    rec.msg_kind = conn->rx->msg_kind | (conn->rx->flags << 8);
+    rec.msg_size = conn->rx->rcv_msg_size - conn->rx->rcv_end_pos;  // to drop
+  }
+  LL_FOREACH (conn->routes, rsub)
+    routes_len += strlen (rsub->route->name) + 1;
+  rec.routes_len = routes_len;
+  payload = (char *) cmsg_alloc (rec.end_pos + routes_len + 1, 0, CMSG_ALLOC_OTHER);
+  if (NULL == payload)
+    return ENOMEM;
+  if (rec.end_pos != 0)
+    memcpy (payload, conn->rx->rcv_msg, rec.end_pos);
+  len = rec.end_pos;
+  LL_FOREACH (conn->routes, rsub) {
+    strcpy (payload + len, rsub->route->name);
+    len += strlen (rsub->route->name) + 1;
+  }
+  rtn = handoff_send_rec (sock, &rec, conn->sock, payload, len);
+  cmsg_free (payload, rec.end_pos + routes_len + 1, CMSG_ALLOC_OTHER);
+  return rtn;
+}
+
+// creates the listening Unix socket at path
+int handoff_listen_sock (const char *path, int *sock)
+{
+  struct sockaddr_un addr;
+  int rtn;
+
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, path);
+  *sock = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (*sock < 0) {
+    cmsg_log_err (LEVEL_ERROR, errno, ("CIMPMSG: Unable to create handoff socket"));
+    return errno;
+  }
+  unlink (path);  // left behind by an earlier run
+  if ((bind (*sock, (struct sockaddr *) &addr, sizeof (addr)) != 0) ||
+      (listen (*sock, 1) != 0)) {
+    rtn = errno;
+    cmsg_log_err (LEVEL_ERROR, rtn, ("CIMPMSG: Unable to listen on handoff socket %s", path));
+    close (*sock);
+    *sock = -1;
+    return rtn;
+  }
+  return 0;
+}
+
+// Serves a new process on the handoff socket. Returns true when it has
+// taken over, after which this server must stop.
+bool server_handoff (struct cmsg_server *srv)
+{
+  struct timeval timeout = {HANDOFF_TIMEOUT_SECS, 0};
+  struct connection *conn;
+  handoff_rec_t rec;
+  unsigned count = 0;
+  int sock, rtn;
+  char ack = 0;
+
+  sock = accept (srv->handoff_sock, NULL, NULL);
+  if (sock < 0) {
+    cmsg_log_err (LEVEL_ERROR, errno, ("CIMPMSG: Accept error on handoff socket:"));
+    return false;
+  }
+  setsockopt (sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof (timeout));
+  setsockopt (sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof (timeout));
+  memset (&rec, 0, sizeof (rec));
+  rec.magic = HANDOFF_MAGIC;
+  rec.type = HANDOFF_LISTEN;
+  rec.port = srv->port;
+  pthread_mutex_lock (&srv->list_mutex);
+  rtn = handoff_send_rec (sock, &rec, srv->listen_sock, NULL, 0);
+  LL_FOREACH (srv->connection_list, conn)
+    if ((rtn == 0) && (conn->rcv_state >= 0)) {
+      rtn = handoff_send_conn (sock, conn);
+      count++;
+    }
+  if (rtn == 0) {
+    rec.type = HANDOFF_END;
+    rtn = handoff_send_rec (sock, &rec, -1, NULL, 0);
+  }
+  if (rtn == 0) {
+    // the new process may set up its own handoff socket at this path
+    // as soon as it has acked, so it must be gone by then
+    close (srv->handoff_sock);
+    srv->handoff_sock = -1;
+    unlink (srv->handoff_path);
+    rtn = handoff_recv_all (sock, &ack, 1);
+    if ((rtn == 0) && (ack != 'k'))
+      rtn = EPROTO;
+    // the new process failed, so listen again for the next one
+    if (rtn != 0)
+      handoff_listen_sock (srv->handoff_path, &srv->handoff_sock);
+  }
+  if (rtn == 0) {
+    srv->handed_off = true;
+    srv->listen_state = 2;  // fails sends from other threads from now on
+  }
+  pthread_mutex_unlock (&srv->list_mutex);
+  close (sock);
+  if (rtn != 0) {
+    cmsg_log_err (LEVEL_ERROR, rtn, ("CIMPMSG: Handoff failed, still serving"));
+    return false;
+  }
+  cmsg_log (LEVEL_INFO, ("CIMPMSG: Handed off %u connections\n", count));
+  return true;
+}
+
+int cmsg_server_handoff_listen (cmsg_server_t *srv, const char *path)
+{
+  struct sockaddr_un addr;
+  int sock, rtn;
+  char *handoff_path;
+
+  if ((NULL == path) || (strlen (path) >= sizeof (addr.sun_path)))
+    return EINVAL;
+  if (srv->handoff_sock != -1)
+    return EALREADY;
+  handoff_path = strdup (path);
+  if (NULL == handoff_path)
+    return ENOMEM;
+  rtn = handoff_listen_sock (path, &sock);
+  if (rtn != 0) {
+    free (handoff_path);
+    return rtn;
+  }
+  free (srv->handoff_path);
+  srv->handoff_path = handoff_path;
+  srv->handoff_sock = sock;
+  return 0;
+}
+
+// adds a handed over connection, list_mutex must be held
+int handoff_add_conn (struct cmsg_server *srv, int sock, handoff_rec_t *rec,
+  char *payload)
+{
+  struct connection *conn;
+  char *name;
+  size_t pos;
+
+  conn = init_server_connection (srv, sock);
+  if (NULL == conn)
+    return ENOMEM;
+  if ((rec->rcv_state == 1) || (rec->rcv_state == 2) || (rec->hdr_len != 0)) {
+    if (conn_rx_attach (conn) != 0) {
+      conn_slab_release (srv, conn);
+      return ENOMEM;
+    }
+    conn->rx->last_used_ns = get_monotonic_ns ();
+  }
+  if (rec->hdr_len != 0) {
+    memcpy (conn->rx->hdr, rec->hdr, rec->hdr_len);
+    conn->rx->hdr_len = (uint8_t) rec->hdr_len;
+  } else if (rec->rcv_state == 1) {
+    conn->rx->rcv_msg = msg_buf_alloc (rec->msg_size);
+    if (NULL == conn->rx->rcv_msg) {
+      conn_rx_release (srv, conn);
+      conn_slab_release (srv, conn);
+      return ENOMEM;
+    }
+    memcpy (conn->rx->rcv_msg, payload, rec->end_pos);
+    conn->rx->msg_kind = rec->msg_kind & 255;
+    conn->rx->flags = rec->msg_kind >> 8;
+    conn->rx->corr_id = rec->corr_id;
+    conn->rx->rcv_msg_size = rec->msg_size;
+    conn->rx->rcv_end_pos = rec->end_pos;
+    conn->rcv_state = 1;
+  } else if (rec->rcv_state == 2) {
+    conn->rx->msg_kind = rec->msg_kind & 255;
+    conn->rx->flags = rec->msg_kind >> 8;
+    conn->rx->rcv_msg_size = rec->msg_size;
+    conn->rcv_state = 2;
+  }
+  conn->user_data.handed_in = true;
+  conn->peer_max_msg = rec->peer_max_msg;
+  set_last_active_time (conn);
+  LL_APPEND (srv->connection_list, conn);
+  for (pos = rec->end_pos; pos < rec->end_pos + rec->routes_len; pos += strlen (name) + 1) {
+    name = payload + pos;
+    route_add (srv, conn, name);
+  }
+  return 0;
+}
+
+int handoff_receive (struct cmsg_server *srv, int sock)
+{
+  handoff_rec_t rec;
+  socklen_t len;
+  char *payload;
+  int fd, rtn;
+
+  while (true) {
+    rtn = handoff_recv_rec (sock, &rec, &fd);
+    if (rtn != 0)
+      return rtn;
+    if (rec.type == HANDOFF_END)
+      return (srv->listen_sock == -1) ? EPROTO : 0;
+    if (fd < 0)
+      return EPROTO;
+    if (rec.type == HANDOFF_LISTEN) {
+      srv->listen_sock = fd;
+      srv->port = rec.port;
+      len = sizeof (srv->addr);
+      getsockname (fd, (struct sockaddr *) &srv->addr, &len);
+      continue;
+    }
+    // connections come after the listening socket
+    if ((rec.type != HANDOFF_CONN) || (srv->listen_sock == -1) || 
+        (rec.end_pos > rec.msg_size) || (rec.hdr_len > MSG_EXT_HEADER_SIZE) ||
+        ((rec.hdr_len != 0) && (rec.rcv_state != 0)) ||
+        (rec.msg_size > MAX_EXT_MSG_SIZE) || (rec.routes_len > MAX_EXT_MSG_SIZE)) {
+      close (fd);
+      return EPROTO;
+    }
+    // the extra byte terminates the route names if the sender didn't
+    payload = (char *) cmsg_alloc (rec.end_pos + rec.routes_len + 1, 0, CMSG_ALLOC_OTHER);
+    if (NULL == payload) {
+      close (fd);
+      return ENOMEM;
+    }
+    rtn = handoff_recv_all (sock, payload, rec.end_pos + rec.routes_len);
+    payload[rec.end_pos + rec.routes_len] = '\0';
+    if (rtn == 0) {
+      pthread_mutex_lock (&srv->list_mutex);
+      rtn = handoff_add_conn (srv, fd, &rec, payload);
+      pthread_mutex_unlock (&srv->list_mutex);
+    }
+    cmsg_free (payload, rec.end_pos + rec.routes_len + 1, CMSG_ALLOC_OTHER);
+    if (rtn != 0) {
+      close (fd);
+      return rtn;
+    }
+  }
+}
+
+cmsg_server_t *cmsg_server_create_handoff (const char *path,
+  server_opts_t *options, int *err)
+{
+  struct timeval timeout = {HANDOFF_TIMEOUT_SECS, 0};
+  struct sockaddr_un addr;
+  struct cmsg_server *srv;
+  int sock, rtn;
+  char ack = 'k';
+
+  if ((NULL == path) || (strlen (path) >= sizeof (addr.sun_path))) {
+    rtn = EINVAL;
+    goto create_failed;
+  }
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, path);
+  sock = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock < 0) {
+    rtn = errno;
+    goto create_failed;
+  }
+  if (connect (sock, (struct sockaddr *) &addr, sizeof (addr)) != 0) {
+    rtn = errno;
+    cmsg_log_err (LEVEL_DEBUG, rtn, ("CIMPMSG: No server to take over at %s", path));
+    close (sock);
+    goto create_failed;
+  }
+  setsockopt (sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof (timeout));
+  srv = alloc_server ();
+  if (NULL == srv) {
+    close (sock);
+    rtn = ENOMEM;
+    goto create_failed;
+  }
+  server_set_opts (srv, options);
+  rtn = handoff_receive (srv, sock);
+  if (rtn == 0)
+    rtn = handoff_send_all (sock, &ack, 1);
+  close (sock);
+  if (rtn != 0) {
+    cmsg_log_err (LEVEL_ERROR, rtn, ("CIMPMSG: Handoff from %s failed", path));
+    // the old process still owns the sockets
+    srv->handed_off = true;
+    shutdown_server (srv);
+    free_server (srv);
+    goto create_failed;
+  }
+  if (NULL != err)
+    *err = 0;
+  return srv;
+
+create_failed:
+  if (NULL != err)
+    *err = rtn;
+  return NULL;
+}
+
+// tells the application about the connections it took over
+void server_announce_handed_in (struct cmsg_server *srv, process_message_t handle_msg)
 {
-  if (conn->sock != -1) {
-	shutdown_sock (conn->sock);
-	pthread_mutex_destroy (&conn->send_mutex);
-	pthread_mutex_destroy (&conn->rcv_mutex);
-	conn->sock = -1;
+  struct connection *conn;
+  server_rcv_msg_data_t rcv_msg_data;
+
+  pthread_mutex_lock (&srv->list_mutex);
+  LL_FOREACH (srv->connection_list, conn)
+    if (conn->user_data.handed_in) {
+      conn->user_data.handed_in = false;
+      conn_msg_data (conn, &rcv_msg_data, false);
+      pthread_mutex_unlock (&srv->list_mutex);
+      // the list is only changed by this thread, so conn stays valid
+      handle_msg (CMSG_ACTION_CONN_ADDED, &rcv_msg_data);
+      pthread_mutex_lock (&srv->list_mutex);
+    }
+  pthread_mutex_unlock (&srv->list_mutex);
+}
+
+int cmsg_server_listen (cmsg_server_t *srv, process_message_t handle_msg, bool *terminated)
+{
+  int rtn;
+  bool any_closing;
+  char inbuf[10];
+
+  pthread_mutex_lock (&srv->connect_mutex);
+  if (srv->listen_sock == -1) {
+    cmsg_log (LEVEL_ERROR, ("CIMPMSG: cmsg_server_listen_for_msgs: not connected\n"));
+    pthread_mutex_unlock (&srv->connect_mutex);
+    return ENOTCONN;
+  }
+  if (srv->listen_state != 0) {
+    if (srv->listen_state == 1)
+      cmsg_log (LEVEL_ERROR, ("CIMPMSG: server already listening for messages\n"));
+    else
+      cmsg_log (LEVEL_ERROR, ("CIMPMSG: server shutting down\n"));
+    pthread_mutex_unlock (&srv->connect_mutex);
+    return EALREADY;
+  }
+  srv->listen_state = 1;
+  pthread_mutex_unlock (&srv->connect_mutex);
+  server_announce_handed_in (srv, handle_msg);
+
+  while (1)
+  {
+    any_closing = false;
+    rtn = wait_server_ready (srv, handle_msg, terminated, &any_closing);
+    if (rtn < 0)
+      break;
+    if (rtn & 1)
+      server_accept (srv, handle_msg);
+    if (rtn & 2)
+      server_receive_msgs (srv, handle_msg, &any_closing);
+    if (rtn & 8)
+      server_serve_stats (srv);
+    if ((rtn & 16) && server_handoff (srv))
+      break;
+    if (any_closing)
+      server_close_connections (srv);
+    if (srv->terminate_on_keypress) {
+      if (rtn & 4) { // key pressed
+	fgets (inbuf, 10, stdin);
+	break;
+      }
+    }
+    if (NULL != terminated)
+      if (*terminated)
+	break;
+  }
+  cmsg_log (LEVEL_INFO, ("CIMPMSG: Exiting cmsg_server_listen_for_msgs\n"));
+
+  shutdown_server (srv);
+  return 0;
+}
+
+int cmsg_server_listen_for_msgs (process_message_t handle_msg, bool *terminated)
+{
+  struct cmsg_server *srv = get_default_server ();
+
+  if (NULL == srv) {
+    cmsg_log (LEVEL_ERROR, ("CIMPMSG: cmsg_server_listen_for_msgs: not connected\n"));
+    return ENOTCONN;
   }
+  return cmsg_server_listen (srv, handle_msg, terminated);
 }
 
+void cmsg_server_destroy (cmsg_server_t *srv)
+{
+  if (NULL == srv)
+    return;
+  pthread_mutex_lock (&default_server_mutex);
+  if (srv == default_server)
+    __atomic_store_n (&default_server, NULL, __ATOMIC_RELEASE);
+  pthread_mutex_unlock (&default_server_mutex);
+  if (srv->listen_state == 0)
+    shutdown_server (srv);
+  free_server (srv);
+}
 
-ssize_t socket_receive (struct connection *conn, void *buf, size_t len, bool *terminated)
+int __send_msg (int sock, const char *msg, size_t sz_msg, bool non_block)
+{
+  return send_msg_kind (sock, CMSG_KIND_MSG, 0, msg, sz_msg, non_block);
+}
+
+// send_mutex must be held
+int client_queue_msg (struct client_conn *conn, int kind, uint32_t corr_id,
+  const char *msg, size_t sz_msg)
+{
+  struct client_queued_msg *qmsg;
+
+  if (conn->queued_count >= conn->opts.max_queued_msgs) {
+    cmsg_log (LEVEL_DEBUG, ("CIMPMSG: client send queue full\n"));
+    return ENOBUFS;
+  }
+  qmsg = (struct client_queued_msg *) cmsg_alloc (
+    sizeof (*qmsg) + msg_frame_size (kind, sz_msg), 0, CMSG_ALLOC_SEND_BUF);
+  if (NULL == qmsg) {
+    cmsg_log (LEVEL_ERROR, ("CIMPMSG: Unable to malloc queued client msg\n"));
+    return ENOMEM;
+  }
+  qmsg->sz_frame = encode_msg_frame (qmsg->frame, kind, corr_id, msg, sz_msg);
+  qmsg->queued_ns = get_monotonic_ns ();
+  qmsg->next = NULL;
+  if (NULL == conn->send_queue_tail)
+    conn->send_queue_head = qmsg;
+  else
+    conn->send_queue_tail->next = qmsg;
+  conn->send_queue_tail = qmsg;
+  conn->queued_count++;
+  return 0;
+}
+
+bool send_err_is_disconnect (int err)
+{
+  return (err == EPIPE) || (err == ECONNRESET) || (err == ENOTCONN) ||
+    (err == EIO) || (err == EBADF);
+}
+
+// Until the server's HELLO arrives, a client is held to what a client
+// without a HELLO may send, as that is all the server is known to take.
+bool client_msg_size_ok (struct client_conn *conn, int kind, size_t sz_msg)
+{
+  uint32_t peer_max = __atomic_load_n (&conn->peer_max_msg_size, __ATOMIC_ACQUIRE);
+
+  return msg_size_ok (kind, sz_msg, peer_max);
+}
+
+size_t client_lz_threshold (struct client_conn *conn)
+{
+  if (!__atomic_load_n (&conn->peer_compress, __ATOMIC_ACQUIRE))
+    return 0;
+  return conn->opts.compress_threshold;
+}
+
+// send_mutex must be held
+int client_send_locked (struct client_conn *conn, int kind, uint32_t corr_id,
+  const char *msg, size_t sz_msg, bool non_block)
+{
+  int rtn;
+  uint64_t send_ns = 0;
+  size_t sz_frame = 0;
+
+  if (!client_msg_size_ok (conn, kind, sz_msg)) {
+    cmsg_log (LEVEL_ERROR, ("CIMPMSG: Message of %lu bytes is too big for the server\n",
+      sz_msg));
+    client_count_send (conn, EMSGSIZE, 0);
+    return EMSGSIZE;
+  }
+  if (conn->opts.auto_reconnect) {
+    if (conn->conn_state == CLIENT_STATE_IDLE)
+      return EBADF;
+    if (client_reconnect_step (conn)) {
+      rtn = send_msg_timed (conn->sock, kind, corr_id, msg, sz_msg, non_block, &send_ns,
+        client_lz_threshold (conn), &sz_frame);
+      client_record_latency (conn, CMSG_LAT_SEND, send_ns);
+      if (!send_err_is_disconnect (rtn)) {
+        client_count_send (conn, rtn, sz_frame);
+        return rtn;
+      }
+      conn->oserr = rtn;
+      client_disconnect (conn);
+    }
+    rtn = client_queue_msg (conn, kind, corr_id, msg, sz_msg);
+    if (rtn != 0)
+      client_count_send (conn, rtn, 0);
+    return rtn;
+  }
+  if (-1 == conn->sock) {
+    cmsg_log (LEVEL_ERROR, ("CIMPMSG: Invalid socket for cmsg_client_send\n"));
+    return EBADF;
+  }
+  rtn = send_msg_timed (conn->sock, kind, corr_id, msg, sz_msg, non_block, &send_ns,
+    client_lz_threshold (conn), &sz_frame);
+  client_count_send (conn, rtn, sz_frame);
+  client_record_latency (conn, CMSG_LAT_SEND, send_ns);
+  return rtn;
+}
+
+int cmsg_client_send (struct client_conn *conn, const char *msg, size_t sz_msg, bool non_block)
+{
+  int rtn;
+
+  pthread_mutex_lock (&conn->send_mutex);
+  rtn = client_send_locked (conn, CMSG_KIND_MSG, 0, msg, sz_msg, non_block);
+  pthread_mutex_unlock (&conn->send_mutex);
+  return rtn;
+}
+
+int cmsg_client_subscribe (struct client_conn *conn, const char *name)
+{
+  int rtn;
+  size_t sz_name;
+  struct client_subscription *csub;
+
+  if ((NULL == name) || (name[0] == '\0'))
+    return EINVAL;
+  sz_name = strlen (name) + 1;
+  if (sz_name > MAX_ROUTE_NAME_SIZE)
+    return EINVAL;
+  pthread_mutex_lock (&conn->send_mutex);
+  LL_FOREACH (conn->subscriptions, csub)
+    if (strcmp (csub->name, name) == 0)
+      break;
+  if (NULL == csub) {
+    csub = (struct client_subscription *) 
+      cmsg_alloc (sizeof (*csub) + sz_name, 0, CMSG_ALLOC_OTHER);
+    if (NULL == csub) {
+      cmsg_log (LEVEL_ERROR, ("CIMPMSG: Unable to malloc client subscription\n"));
+      pthread_mutex_unlock (&conn->send_mutex);
+      return ENOMEM;
+    }
+    memcpy (csub->name, name, sz_name);
+    LL_APPEND (conn->subscriptions, csub);
+  }
+  rtn = client_send_locked (conn, KIND_SUBSCRIBE, 0, name, sz_name, false);
+  pthread_mutex_unlock (&conn->send_mutex);
+  return rtn;
+}
+
+int cmsg_client_unsubscribe (struct client_conn *conn, const char *name)
+{
+  int rtn;
+  struct client_subscription *csub;
+
+  if (NULL == name)
+    return EINVAL;
+  pthread_mutex_lock (&conn->send_mutex);
+  LL_FOREACH (conn->subscriptions, csub)
+    if (strcmp (csub->name, name) == 0)
+      break;
+  if (NULL == csub) {
+    pthread_mutex_unlock (&conn->send_mutex);
+    return ENOENT;
+  }
+  LL_DELETE (conn->subscriptions, csub);
+  subscription_free (csub);
+  rtn = client_send_locked (conn, KIND_UNSUBSCRIBE, 0, name, strlen (name) + 1, false);
+  pthread_mutex_unlock (&conn->send_mutex);
+  return rtn;
+}
+
+int cmsg_client_request (struct client_conn *conn, const char *msg, size_t sz_msg,
+  unsigned int timeout_msecs, cmsg_reply_handler_t on_reply, void *arg)
+{
+  int rtn;
+  uint32_t id;
+  rpc_pending_t pending;
+
+  if (NULL == on_reply)
+    return EINVAL;
+  // pending is added under send_mutex so its epoch matches the connection
+  // the request goes out on
+  pthread_mutex_lock (&conn->send_mutex);
+  if (NULL == conn->rpc) {
+    __atomic_store_n (&conn->rpc, rpc_create (), __ATOMIC_RELEASE);
+    if (NULL == conn->rpc) {
+      cmsg_log (LEVEL_ERROR, ("CIMPMSG: Unable to malloc client request table\n"));
+      pthread_mutex_unlock (&conn->send_mutex);
+      return ENOMEM;
+    }
+  }
+  pthread_mutex_lock (&conn->rpc->mutex);
+  id = rpc_add_pending (conn->rpc, timeout_msecs, on_reply, arg);
+  pthread_mutex_unlock (&conn->rpc->mutex);
+  if (0 == id) {
+    pthread_mutex_unlock (&conn->send_mutex);
+    return ENOMEM;
+  }
+  rtn = client_send_locked (conn, CMSG_KIND_REQUEST, id, msg, sz_msg, false);
+  if (rtn != 0) {
+    pthread_mutex_lock (&conn->rpc->mutex);
+    rpc_remove_pending (conn->rpc, id, &pending);
+    pthread_mutex_unlock (&conn->rpc->mutex);
+  }
+  pthread_mutex_unlock (&conn->send_mutex);
+  return rtn;
+}
+
+typedef struct rpc_call_wait {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  bool done;
+  int status;
+  char *reply;
+  size_t sz_reply;
+} rpc_call_wait_t;
+
+void rpc_call_done (int status, char *reply, size_t sz_reply, void *arg)
+{
+  struct rpc_call_wait *wait = (struct rpc_call_wait *) arg;
+
+  pthread_mutex_lock (&wait->mutex);
+  wait->status = status;
+  wait->reply = reply;
+  wait->sz_reply = sz_reply;
+  wait->done = true;
+  pthread_cond_signal (&wait->cond);
+  pthread_mutex_unlock (&wait->mutex);
+}
+
+int cmsg_client_call (struct client_conn *conn, const char *msg, size_t sz_msg,
+  unsigned int timeout_msecs, char **reply, size_t *sz_reply)
+{
+  int rtn;
+  struct rpc_call_wait wait;
+
+  pthread_mutex_init (&wait.mutex, NULL);
+  pthread_cond_init (&wait.cond, NULL);
+  wait.done = false;
+  wait.reply = NULL;
+  wait.sz_reply = 0;
+  rtn = cmsg_client_request (conn, msg, sz_msg, timeout_msecs, rpc_call_done, &wait);
+  if (rtn == 0) {
+    pthread_mutex_lock (&wait.mutex);
+    while (!wait.done)
+      pthread_cond_wait (&wait.cond, &wait.mutex);
+    pthread_mutex_unlock (&wait.mutex);
+    rtn = wait.status;
+  }
+  pthread_cond_destroy (&wait.cond);
+  pthread_mutex_destroy (&wait.mutex);
+  *reply = wait.reply;
+  *sz_reply = wait.sz_reply;
+  return rtn;
+}
+
+/*------------------------------------------------------------------
+ * Client loop. One thread serves many client connections: it polls
+ * their sockets and request wakeups together, reads ready ones into
+ * their read-ahead buffers without blocking, and delivers the whole
+ * frames found there to a handler. A frame split across reads waits
+ * in the buffer for the rest, so a slow server only delays itself.
+ * Connections
+ * are flagged on remove and freed by the loop thread, so one removed
+ * while the loop is in poll is never touched again.
+---------------------------------------------------------------------*/
+
+typedef struct loop_conn {
+  struct client_conn *cconn;
+  cmsg_client_handler_t on_msg;
+  void *arg;
+  int sock;        // the socket being read, -1 while down
+  uint32_t epoch;  // rpc epoch the receive state belongs to
+  uint64_t last_rcv_ns;  // of the last read, to free an idle read-ahead
+  bool removed;
+  bool failed;     // lost without auto_reconnect, no longer polled
+  struct loop_conn *next;
+} loop_conn_t;
+
+struct cmsg_client_loop {
+  pthread_mutex_t mutex;  // recursive, so handlers can remove connections
+  int wake_fd;
+  bool running;
+  struct loop_conn *conns;
+  unsigned count;
+  unsigned pfd_capacity;
+  struct pollfd *pfds;
+  struct loop_conn **pfd_conns;
+};
+
+cmsg_client_loop_t *cmsg_client_loop_create (int *err)
+{
+  struct cmsg_client_loop *loop;
+  pthread_mutexattr_t attr;
+
+  loop = (struct cmsg_client_loop *) 
+    cmsg_alloc (sizeof (struct cmsg_client_loop), 0, CMSG_ALLOC_OTHER);
+  if (NULL == loop) {
+    if (NULL != err)
+      *err = ENOMEM;
+    return NULL;
+  }
+  loop->wake_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (loop->wake_fd < 0) {
+    if (NULL != err)
+      *err = errno;
+    cmsg_free (loop, sizeof (struct cmsg_client_loop), CMSG_ALLOC_OTHER);
+    return NULL;
+  }
+  pthread_mutexattr_init (&attr);
+  pthread_mutexattr_settype (&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init (&loop->mutex, &attr);
+  pthread_mutexattr_destroy (&attr);
+  loop->running = false;
+  loop->conns = NULL;
+  loop->count = 0;
+  loop->pfd_capacity = 0;
+  loop->pfds = NULL;
+  loop->pfd_conns = NULL;
+  if (NULL != err)
+    *err = 0;
+  return loop;
+}
+
+void loop_wake (struct cmsg_client_loop *loop)
+{
+  uint64_t one = 1;
+
+  if (write (loop->wake_fd, &one, sizeof (one)) < 0)
+    cmsg_log (LEVEL_DEBUG, ("CIMPMSG: client loop wakeup not written\n"));
+}
+
+// drops a partially received frame, rcv_mutex must be held
+void loop_conn_reset_rx (struct loop_conn *lc)
+{
+  struct client_rcv_buf *rb = lc->cconn->rcv_buf;
+
+  if (NULL != rb) {
+    rb->start = 0;
+    rb->end = 0;
+  }
+}
+
+void loop_conn_free (struct loop_conn *lc)
+{
+  cmsg_free (lc, sizeof (struct loop_conn), CMSG_ALLOC_OTHER);
+}
+
+int cmsg_client_loop_add (cmsg_client_loop_t *loop, struct client_conn *conn,
+  cmsg_client_handler_t on_msg, void *arg)
+{
+  struct loop_conn *lc;
+
+  if (NULL == on_msg)
+    return EINVAL;
+  if ((conn->sock == -1) && (conn->conn_state == CLIENT_STATE_IDLE))
+    return ENOTCONN;
+  // the rpc is created up front so its wakeup fd can be polled
+  pthread_mutex_lock (&conn->send_mutex);
+  if (NULL == conn->rpc)
+    __atomic_store_n (&conn->rpc, rpc_create (), __ATOMIC_RELEASE);
+  pthread_mutex_unlock (&conn->send_mutex);
+  if (NULL == conn->rpc) {
+    cmsg_log (LEVEL_ERROR, ("CIMPMSG: Unable to malloc client request table\n"));
+    return ENOMEM;
+  }
+  lc = (struct loop_conn *) cmsg_alloc (sizeof (struct loop_conn), 0, CMSG_ALLOC_OTHER);
+  if (NULL == lc)
+    return ENOMEM;
+  lc->cconn = conn;
+  lc->on_msg = on_msg;
+  lc->arg = arg;
+  lc->sock = -1;
+  lc->epoch = __atomic_load_n (&conn->rpc->epoch, __ATOMIC_ACQUIRE);
+  lc->last_rcv_ns = 0;
+  lc->removed = false;
+  lc->failed = false;
+  pthread_mutex_lock (&loop->mutex);
+  LL_PREPEND (loop->conns, lc);
+  loop->count++;
+  pthread_mutex_unlock (&loop->mutex);
+  loop_wake (loop);
+  return 0;
+}
+
+// frees removed connections, loop->mutex must be held
+void loop_sweep (struct cmsg_client_loop *loop)
+{
+  struct loop_conn *lc;
+  struct loop_conn *tmp;
+
+  LL_FOREACH_SAFE (loop->conns, lc, tmp) {
+    if (!lc->removed)
+      continue;
+    LL_DELETE (loop->conns, lc);
+    loop->count--;
+    loop_conn_free (lc);
+  }
+}
+
+int cmsg_client_loop_remove (cmsg_client_loop_t *loop, struct client_conn *conn)
+{
+  struct loop_conn *lc;
+
+  pthread_mutex_lock (&loop->mutex);
+  LL_FOREACH (loop->conns, lc)
+    if ((lc->cconn == conn) && !lc->removed)
+      break;
+  if (NULL == lc) {
+    pthread_mutex_unlock (&loop->mutex);
+    return ENOENT;
+  }
+  lc->removed = true;
+  if (!loop->running)
+    loop_sweep (loop);
+  pthread_mutex_unlock (&loop->mutex);
+  return 0;
+}
+
+// Hands over a frame's payload, which is still in the read-ahead
+// buffer. Returns an error for one that doesn't decompress.
+// rcv_mutex must be held.
+int loop_conn_deliver (struct loop_conn *lc, int kind, int flags, 
+  uint32_t corr_id, const char *data, size_t size, uint64_t ready_ns)
+{
+  struct client_conn *cconn = lc->cconn;
+  char *msg;
+  uint64_t start_ns;
+  uint32_t peer_max;
+  int rtn, hello_flags = 0;
+
+  if (kind == KIND_HELLO) {
+    peer_max = decode_hello (data, size, &hello_flags);
+    client_set_peer (cconn, peer_max, hello_flags);
+    return 0;
+  }
+  msg = msg_buf_alloc (size);
+  if (NULL == msg) {
+    cmsg_log (LEVEL_ERROR, 
+      ("CIMPMSG: Unable to malloc msg buffer for socket %d\n", lc->sock));
+    counter_add (&cconn->stats.receive_errors, 1);
+    if (kind == CMSG_KIND_REPLY)
+      client_fail_reply (cconn, corr_id, CMSG_ERR_RCV_MSG_MALLOC_FAIL);
+    return 0;  // the stream is still in step
+  }
+  memcpy (msg, data, size);
+  if (flags & FRAME_LZ) {
+    rtn = msg_unpack (&msg, &size, client_max_msg (cconn));
+    if (rtn < 0) {
+      msg_buf_free (msg, size);
+      if (kind == CMSG_KIND_REPLY)
+        client_fail_reply (cconn, corr_id, rtn);
+      return rtn;  // a connection error, as for client_receive
+    }
+  }
+  start_ns = get_monotonic_ns ();
+  client_record_latency (cconn, CMSG_LAT_READY_TO_CALLBACK, start_ns - ready_ns);
+  CMSG_PROBE (callback_enter, lc->sock, size);
+  if (kind == CMSG_KIND_REPLY)
+    rpc_complete (cconn->rpc, corr_id, msg, size);
+  else {
+    cconn->rcv_count++;
+    lc->on_msg (cconn, 0, msg, size, lc->arg);
+  }
+  CMSG_PROBE (callback_exit, lc->sock, size);
+  client_record_latency (cconn, CMSG_LAT_CALLBACK, get_monotonic_ns () - start_ns);
+  return 0;
+}
+
+// Delivers the frames that are whole in the read-ahead buffer. Sets
+// *need to the bytes the next one needs from rb->start.
+// rcv_mutex must be held.
+int loop_conn_take (struct loop_conn *lc, uint64_t ready_ns, unsigned *msgs,
+  size_t *need)
+{
+  struct client_conn *cconn = lc->cconn;
+  struct client_rcv_buf *rb = cconn->rcv_buf;
+  unsigned char *header;
+  size_t unread, sz_header, size;
+  int rtn, kind, flags;
+  uint32_t corr_id;
+
+  while (true) {
+    *need = MSG_HEADER_SIZE;
+    if (lc->removed || (NULL == rb))
+      return 0;
+    unread = rb->end - rb->start;
+    if (unread < MSG_HEADER_SIZE)
+      return 0;
+    header = (unsigned char *) rb->data + rb->start;
+    sz_header = MSG_HEADER_SIZE;
+    if ((header[0] == MSG_HEADER_MARK) && (header[1] == MSG_HEADER_MARK_EXT))
+      sz_header = MSG_EXT_HEADER_SIZE;
+    *need = sz_header;
+    if (unread < sz_header)
+      return 0;
+    rtn = decode_msg_header (header, header + MSG_HEADER_SIZE, &kind, &flags,
+      &corr_id, &size);
+    if (rtn < 0)
+      return rtn;
+    if (size > client_max_msg (cconn)) {
+      cmsg_log (LEVEL_ERROR, 
+        ("CIMPMSG: Message of %lu bytes on socket %d is over the limit\n", size, lc->sock));
+      return CMSG_ERR_RCV_MSG_TOO_BIG;
+    }
+    *need = sz_header + size;
+    if (unread < *need)
+      return 0;
+    rb->start += *need;
+    CMSG_PROBE (msg_complete, lc->sock, size);
+    counter_add (&cconn->stats.msgs_received, 1);
+    counter_add (&cconn->stats.bytes_received, *need);
+    rtn = loop_conn_deliver (lc, kind, flags, corr_id, 
+      (char *) header + sz_header, size, ready_ns);
+    if (rtn < 0)
+      return rtn;
+    (*msgs)++;
+  }
+}
+
+// Reads from a ready connection until the socket is empty or
+// LOOP_READ_MAX_MSGS frames have been delivered, so one busy server
+// doesn't hold up the rest. It stops only with no whole frame left in
+// the buffer, as poll only wakes it for more input.
+void loop_conn_read (struct loop_conn *lc)
 {
+  struct client_conn *cconn = lc->cconn;
+  struct client_rcv_buf *rb;
+  unsigned msgs = 0;
+  uint64_t ready_ns = get_monotonic_ns ();
   ssize_t bytes;
+  size_t need = MSG_HEADER_SIZE;
+  int rtn, sock = lc->sock;
 
+  pthread_mutex_lock (&cconn->rcv_mutex);
   while (true) {
-    bytes = recv (conn->rcv_data.sock, buf, len, 0);
-    if (bytes >= 0)
-      return bytes;
-    if (NULL != terminated) {
-      if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
-        if (*terminated)
-          return -2;
-        continue; 
+    rtn = client_rcv_buf_reserve (cconn, need);
+    if (rtn < 0)
+      break;
+    rb = cconn->rcv_buf;
+    rb->sock = sock;
+    bytes = recv (sock, rb->data + rb->end, rb->capacity - rb->end, MSG_DONTWAIT);
+    if (bytes == 0) {
+      cmsg_log (LEVEL_DEBUG, ("CIMPMSG: Receive message. Socket %d closed by sender\n", sock));
+      rtn = CMSG_ERR_RCV_SOCKET_CLOSED;
+      break;
+    }
+    if (bytes < 0) {
+      rtn = 0;
+      if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+        break;
+      cconn->oserr = errno;
+      rtn = CMSG_ERR_RCV_SOCKET_CLOSED;
+      if (errno != ECONNRESET) {
+        cmsg_log_err (LEVEL_ERROR, errno, 
+          ("CIMPMSG: Error receiving msg for socket %d", sock));
+        rtn = CMSG_ERR_RCV_OS_ERROR;
       }
+      break;
+    }
+    rb->end += (size_t) bytes;
+    lc->last_rcv_ns = ready_ns;
+    rtn = loop_conn_take (lc, ready_ns, &msgs, &need);
+    if (rtn < 0)
+      break;
+    if (cconn->rcv_buf->end > cconn->rcv_buf->start)
+      counter_add (&cconn->stats.partial_reads, 1);  // ended inside a frame
+    if (lc->removed || (msgs >= LOOP_READ_MAX_MSGS))
+      break;
+  }
+  if (rtn >= 0) {
+    pthread_mutex_unlock (&cconn->rcv_mutex);
+    return;
+  }
+  if (rtn != CMSG_ERR_RCV_SOCKET_CLOSED)
+    counter_add (&cconn->stats.receive_errors, 1);
+  loop_conn_reset_rx (lc);
+  lc->sock = -1;
+  pthread_mutex_unlock (&cconn->rcv_mutex);
+  if (cconn->opts.auto_reconnect) {
+    client_lost_connection (cconn, sock);
+    return;
+  }
+  lc->failed = true;
+  lc->on_msg (cconn, rtn, NULL, 0, lc->arg);
+}
+
+// Frees a read-ahead buffer left empty for buf_idle_msecs, as
+// client_rcv_wait_frame does for a blocking receive, or lowers *wait
+// to when it will be.
+void loop_conn_release_idle (struct loop_conn *lc, int *wait)
+{
+  struct client_conn *cconn = lc->cconn;
+  struct client_rcv_buf *rb;
+  uint64_t idle_ns = client_buf_idle_ns (cconn);
+  uint64_t elapsed_ns;
+  int ms;
+
+  pthread_mutex_lock (&cconn->rcv_mutex);
+  rb = cconn->rcv_buf;
+  if ((NULL != rb) && (rb->end == rb->start)) {
+    elapsed_ns = get_monotonic_ns () - lc->last_rcv_ns;
+    if (elapsed_ns >= idle_ns)
+      client_rcv_buf_free (cconn);
+    else {
+      ms = (int) ((idle_ns - elapsed_ns) / 1000000) + 1;
+      if (ms < *wait)
+        *wait = ms;
     }
-    conn->oserr = errno;
-    if (errno == ECONNRESET) // socket closed by peer
-      return 0;
-    return -1;
   }
+  pthread_mutex_unlock (&cconn->rcv_mutex);
 }
 
-int receive_msg_header (struct connection *conn, bool *terminated)
+// Reconnects, times out requests, and picks up a new socket, then
+// adds the connection's fds to the poll set. Lowers *wait to the next
+// thing this connection needs done.
+void loop_conn_prepare (struct cmsg_client_loop *loop, struct loop_conn *lc,
+  unsigned *nfds, int *wait)
 {
-  int sock = conn->rcv_data.sock;
-  ssize_t bytes;
-  size_t msg_size;
-  unsigned char header[4];
+  struct client_conn *cconn = lc->cconn;
+  struct cmsg_rpc *rpc = cconn->rpc;
+  int sock, ms;
+  uint32_t epoch;
 
-  bytes = socket_receive (conn, header, 4, terminated);
-  if (bytes < 0) { 
-    if (bytes == -2)
-      return CMSG_ERR_RCV_TERMINATED;
-    cmsg_log_err (LEVEL_ERROR, conn->oserr, 
-	("CIMPMSG: Error receiving msg header for socket %d", sock));
-    return CMSG_ERR_RCV_OS_ERROR;
-  }
-  if (bytes == 0) {
-    cmsg_log (LEVEL_DEBUG, ("CIMPMSG: Receive message. Socket %d closed by sender\n", sock));
-    return CMSG_ERR_RCV_SOCKET_CLOSED;
-  }
-  if (bytes != 4) {
-    cmsg_log (LEVEL_ERROR, 
-	  ("CIMPMSG: Expecting 4 byte msg header. Got %ld bytes\n", bytes));
-    return CMSG_ERR_RCV_BAD_HDR_BYTE_CT;
+  if (lc->failed || cconn->terminated)
+    return;
+  if (cconn->opts.auto_reconnect) {
+    pthread_mutex_lock (&cconn->send_mutex);
+    if (cconn->conn_state == CLIENT_STATE_IDLE) {
+      pthread_mutex_unlock (&cconn->send_mutex);
+      return;
+    }
+    sock = -1;
+    if (client_reconnect_step (cconn))
+      sock = client_rcv_sock (cconn);
+    pthread_mutex_unlock (&cconn->send_mutex);
+    rpc_fail_lost_requests (rpc);
+    if ((sock == -1) && (*wait > RECONNECT_POLL_MSECS))
+      *wait = RECONNECT_POLL_MSECS;
+  } else
+    sock = cconn->sock;
+  // a new connection, even one that got the same fd, starts a new stream
+  epoch = __atomic_load_n (&rpc->epoch, __ATOMIC_ACQUIRE);
+  if ((sock != lc->sock) || (epoch != lc->epoch)) {
+    pthread_mutex_lock (&cconn->rcv_mutex);
+    loop_conn_reset_rx (lc);
+    lc->sock = sock;
+    pthread_mutex_unlock (&cconn->rcv_mutex);
+    lc->epoch = epoch;
   }
-  if ((header[0] != MSG_HEADER_MARK) || (header[1] != MSG_HEADER_MARK)) {
-	cmsg_log (LEVEL_ERROR, ("CIMPMSG: Invalid msg header mark\n"));
-	return CMSG_ERR_RCV_BAD_HDR_MARK;
+  ms = rpc_expire (rpc);
+  if ((ms >= 0) && (ms < *wait))
+    *wait = ms;
+  if (lc->removed)
+    return;  // by a timed out request's handler
+  loop_conn_release_idle (lc, wait);
+  if (sock != -1) {
+    loop->pfds[*nfds].fd = sock;
+    loop->pfds[*nfds].events = POLLIN;
+    loop->pfds[*nfds].revents = 0;
+    loop->pfd_conns[(*nfds)++] = lc;
   }
-  msg_size = ((size_t) header[2] << 8) + (size_t) header[3]; 
-  conn->rcv_data.rcv_msg = malloc (msg_size);
-  if (NULL == conn->rcv_data.rcv_msg) {
-    cmsg_log (LEVEL_ERROR, 
-      ("CIMPMSG: Unable to malloc msg buffer for socket %d\n", sock));
-    return CMSG_ERR_RCV_MSG_MALLOC_FAIL;
+  loop->pfds[*nfds].fd = rpc->wake_fd;
+  loop->pfds[*nfds].events = POLLIN;
+  loop->pfds[*nfds].revents = 0;
+  loop->pfd_conns[(*nfds)++] = lc;
+}
+
+// builds the poll set, loop->mutex must be held
+int loop_prepare (struct cmsg_client_loop *loop, unsigned *nfds, int *wait)
+{
+  unsigned needed = 1 + (2 * loop->count);
+  struct pollfd *pfds;
+  struct loop_conn **pfd_conns;
+  struct loop_conn *lc;
+
+  if (needed > loop->pfd_capacity) {
+    pfds = (struct pollfd *) realloc (loop->pfds, needed * sizeof (struct pollfd));
+    if (NULL == pfds)
+      return ENOMEM;
+    loop->pfds = pfds;
+    pfd_conns = (struct loop_conn **) 
+      realloc (loop->pfd_conns, needed * sizeof (struct loop_conn *));
+    if (NULL == pfd_conns)
+      return ENOMEM;
+    loop->pfd_conns = pfd_conns;
+    loop->pfd_capacity = needed;
   }
-  conn->rcv_data.rcv_msg_size = msg_size;
-  conn->rcv_end_pos = 0;
-  conn->rcv_state = 1;
+  loop->pfds[0].fd = loop->wake_fd;
+  loop->pfds[0].events = POLLIN;
+  loop->pfds[0].revents = 0;
+  loop->pfd_conns[0] = NULL;
+  *nfds = 1;
+  *wait = 500;
+  LL_FOREACH (loop->conns, lc)
+    if (!lc->removed)
+      loop_conn_prepare (loop, lc, nfds, wait);
   return 0;
 }
 
-
-// returned msg must be freed
-int receive_msg_data (struct connection *conn, process_message_t handle_msg,
-  bool *terminated)
+void loop_dispatch (struct cmsg_client_loop *loop, unsigned nfds)
 {
-  ssize_t bytes;
-  size_t read_len = conn->rcv_data.rcv_msg_size - conn->rcv_end_pos;
-  int sock = conn->rcv_data.sock;
-  char *buf = conn->rcv_data.rcv_msg;
-
-  bytes = socket_receive (conn, buf+conn->rcv_end_pos, read_len, terminated);
+  unsigned i;
+  uint64_t count;
+  struct loop_conn *lc;
 
-  if (bytes < 0) { 
-    if (bytes == -2)
-      return CMSG_ERR_RCV_TERMINATED;
-    cmsg_log_err (LEVEL_ERROR, conn->oserr, 
-	("CIMPMSG: Error receiving msg data for socket %d", sock));
-    return CMSG_ERR_RCV_OS_ERROR;
+  for (i=0; i<nfds; i++) {
+    if (loop->pfds[i].revents == 0)
+      continue;
+    lc = loop->pfd_conns[i];
+    if ((NULL != lc) && (lc->removed || lc->failed))
+      continue;
+    if ((NULL == lc) || (loop->pfds[i].fd == lc->cconn->rpc->wake_fd)) {
+      // wakeups only make the next pass prepare again
+      if (read (loop->pfds[i].fd, &count, sizeof (count)) < 0)
+        cmsg_log (LEVEL_DEBUG, ("CIMPMSG: client loop wakeup not read\n"));
+    } else if (loop->pfds[i].fd == lc->sock)
+      loop_conn_read (lc);
   }
+}
 
-  if (bytes == 0) {
-    cmsg_log (LEVEL_DEBUG, ("CIMPMSG: Receive message. Socket %d closed by sender\n", sock));
-    return CMSG_ERR_RCV_SOCKET_CLOSED;
+int cmsg_client_loop_run (cmsg_client_loop_t *loop, bool *terminated)
+{
+  int rtn = 0;
+  int wait;
+  unsigned nfds;
+
+  pthread_mutex_lock (&loop->mutex);
+  if (loop->running) {
+    cmsg_log (LEVEL_ERROR, ("CIMPMSG: client loop already running\n"));
+    pthread_mutex_unlock (&loop->mutex);
+    return EALREADY;
   }
-  if ((size_t) bytes > read_len) {
-    cmsg_log (LEVEL_ERROR, ("CIMPMSG: bytes received %ld not eq read_len in header %lu\n",
-	bytes, read_len));
-    return CMSG_ERR_RCV_BAD_DATA_BYTE_CT;
+  loop->running = true;
+  while ((NULL == terminated) || !*terminated) {
+    rtn = loop_prepare (loop, &nfds, &wait);
+    if (rtn != 0)
+      break;
+    pthread_mutex_unlock (&loop->mutex);
+    rtn = poll (loop->pfds, nfds, wait);
+    pthread_mutex_lock (&loop->mutex);
+    if (rtn < 0) {
+      if (errno != EINTR) {
+        rtn = errno;
+        cmsg_log_err (LEVEL_ERROR, errno, ("CIMPMSG: client loop poll failed:"));
+        break;
+      }
+      rtn = 0;
+      continue;
+    }
+    if (rtn > 0)
+      loop_dispatch (loop, nfds);
+    loop_sweep (loop);
+    rtn = 0;
   }
-  conn->rcv_end_pos += bytes;
-  if ((size_t) bytes < read_len) {
-    cmsg_log (LEVEL_DEBUG, 
-      ("CIMPMSG: Not all bytes received, only %ld of %lu. Waiting for remainder\n",
-        bytes, read_len));
-    return 0;
+  loop->running = false;
+  loop_sweep (loop);
+  pthread_mutex_unlock (&loop->mutex);
+  return rtn;
+}
+
+void cmsg_client_loop_destroy (cmsg_client_loop_t *loop)
+{
+  struct loop_conn *lc;
+  struct loop_conn *tmp;
+
+  if (NULL == loop)
+    return;
+  LL_FOREACH_SAFE (loop->conns, lc, tmp) {
+    LL_DELETE (loop->conns, lc);
+    loop_conn_free (lc);
   }
-  conn->rcv_state = 0;
-  set_last_active_time (conn);
-  if (NULL != handle_msg)
-    handle_msg (CMSG_ACTION_MSG_RECEIVED, &conn->rcv_data);
-  return 1;
+  close (loop->wake_fd);
+  free (loop->pfds);
+  free (loop->pfd_conns);
+  pthread_mutex_destroy (&loop->mutex);
+  cmsg_free (loop, sizeof (struct cmsg_client_loop), CMSG_ALLOC_OTHER);
 }
 
-int cmsg_client_receive (struct client_conn *cconn)
+size_t server_lz_threshold (struct cmsg_server *srv, struct connection *conn)
 {
-  int rtn;
-  struct connection rconn;
+  if ((conn->peer_max_msg & PEER_LZ) == 0)
+    return 0;
+  return srv->compress_threshold;
+}
 
-  pthread_mutex_lock (&cconn->rcv_mutex);
-  init_connection (&rconn);
-  rconn.rcv_data.sock = cconn->sock;
-  rconn.rcv_state = 0;
+int server_send_kind (struct cmsg_server *srv, cmsg_conn_t handle, int kind, uint32_t corr_id,
+  const char *msg, size_t sz_msg, bool non_block)
+{
+  int rtn = EBADF;
+  uint64_t send_ns = 0;
+  size_t sz_frame = 0;
+  struct connection *conn;
 
-  rtn = receive_msg_header (&rconn, &cconn->terminated);
-  if (rtn < 0) {
-    pthread_mutex_unlock (&cconn->rcv_mutex);
+  pthread_mutex_lock (&srv->list_mutex);
+  if (srv->listen_state != 1) {
+    if (srv->listen_state == 0)
+      cmsg_log (LEVEL_DEBUG, ("CIMPMSG: cannot send, server not started\n"));
+    else
+      cmsg_log (LEVEL_DEBUG, ("CIMPMSG: cannot send, server shutting down\n"));
+    pthread_mutex_unlock (&srv->list_mutex);
     return rtn;
   }
-  while (true) {
-    rtn = receive_msg_data (&rconn, NULL, &cconn->terminated);
-    if (rtn == 1) {
-      cconn->rcv_msg = rconn.rcv_data.rcv_msg;
-      cconn->rcv_msg_size = rconn.rcv_data.rcv_msg_size; 
-      cconn->rcv_count++;
-      rtn = (ssize_t) rconn.rcv_data.rcv_msg_size;
-      pthread_mutex_unlock (&cconn->rcv_mutex);
-      return rtn;
-    }
-    if (rtn < 0)
-      break;
+  conn = server_find_conn (srv, handle);
+  if ((NULL != conn) && !msg_size_ok (kind, sz_msg, conn->peer_max_msg & ~PEER_LZ)) {
+    rtn = EMSGSIZE;
+    server_count_send (srv, conn, rtn, 0);
+  } else if (NULL != conn) {
+    rtn = send_msg_timed (conn->sock, kind, corr_id, msg, sz_msg,
+      non_block, &send_ns, server_lz_threshold (srv, conn), &sz_frame);
+    server_count_send (srv, conn, rtn, sz_frame);
+    server_record_latency (srv, CMSG_LAT_SEND, send_ns);
+    if (0 == rtn)
+      set_last_active_time (conn);
   }
-  pthread_mutex_unlock (&cconn->rcv_mutex);
+  pthread_mutex_unlock (&srv->list_mutex);
   return rtn;
 }
 
-void server_receive_msgs (process_message_t handle_msg, bool *any_closing)
+int cmsg_server_send_msg (cmsg_server_t *srv, cmsg_conn_t conn, 
+  const char *msg, size_t sz_msg, bool non_block)
 {
-  int rtn;
-  struct connection *conn;
-  
-  LL_FOREACH (SRV.connection_list, conn)
-    if (conn->rcv_selected) {
-      if (conn->rcv_state == 0)
-        rtn = receive_msg_header (conn, NULL);
-      else if (conn->rcv_state == 1)
-        rtn = receive_msg_data (conn, handle_msg, NULL);
-      else
-        continue;
-      if (rtn < 0) {
-        if (SRV.close_conn_on_error) {
-          conn->rcv_state = -2;
-          *any_closing = true;
-          handle_msg (CMSG_ACTION_CONN_DROPPED, &conn->rcv_data);
-        } else {
-          conn->rcv_state = 0; // Ignore
-        }
-      }
-    }
+  return server_send_kind (srv, conn, CMSG_KIND_MSG, 0, msg, sz_msg, non_block);
 }
 
-void server_close_connections (void)
+int cmsg_server_reply (cmsg_server_t *srv, cmsg_conn_t conn, unsigned int corr_id,
+  const char *msg, size_t sz_msg, bool non_block)
 {
+  return server_send_kind (srv, conn, CMSG_KIND_REPLY, corr_id, msg, sz_msg, non_block);
+}
+
+int server_change_route (struct cmsg_server *srv, cmsg_conn_t handle, const char *name,
+  bool add)
+{
+  int rtn = EBADF;
   struct connection *conn;
-  struct connection *tmp;
 
-  cmsg_log (LEVEL_DEBUG, ("CIMPMSG: server_close_connections\n"));
-  pthread_mutex_lock (&SRV.list_mutex);
-  LL_FOREACH_SAFE (SRV.connection_list, conn, tmp)
-    if (conn->rcv_state == -2) {
-        LL_DELETE (SRV.connection_list, conn);
-        cmsg_log (LEVEL_INFO, 
-	  ("CIMPMSG: Closing connection for socket %d\n", conn->rcv_data.sock));
-        shutdown_connection (conn);
-        free (conn);
+  if ((NULL == name) || (name[0] == '\0') || 
+      (strlen (name) >= MAX_ROUTE_NAME_SIZE))
+    return EINVAL;
+  pthread_mutex_lock (&srv->list_mutex);
+  if (srv->listen_state == 1) {
+    conn = server_find_conn (srv, handle);
+    if (NULL != conn) {
+      if (add)
+        rtn = route_add (srv, conn, name);
+      else
+        rtn = route_remove (srv, conn, name);
     }
-  pthread_mutex_unlock (&SRV.list_mutex);
+  }
+  pthread_mutex_unlock (&srv->list_mutex);
+  return rtn;
 }
 
+int cmsg_server_add_route (cmsg_server_t *srv, cmsg_conn_t conn, const char *name)
+{
+  return server_change_route (srv, conn, name, true);
+}
 
-int cmsg_server_listen_for_msgs (process_message_t handle_msg, bool *terminated)
+int cmsg_server_remove_route (cmsg_server_t *srv, cmsg_conn_t conn, 
+  const char *name)
 {
-  int rtn;
-  bool any_closing;
-  char inbuf[10];
+  return server_change_route (srv, conn, name, false);
+}
 
-  pthread_mutex_lock (&SRV.connect_mutex);
-  if (SRV.listen_sock == -1) {
-    cmsg_log (LEVEL_ERROR, ("CIMPMSG: cmsg_server_listen_for_msgs: not connected\n"));
-    pthread_mutex_unlock (&SRV.connect_mutex);
-    return ENOTCONN;
+int cmsg_server_publish (cmsg_server_t *srv, const char *name,
+  const char *msg, size_t sz_msg, bool non_block, unsigned int *sent_count)
+{
+  int rtn = 0;
+  int send_rtn;
+  unsigned i, sent = 0;
+  uint64_t send_ns;
+  struct route *route;
+  struct connection *sub;
+  char *frame;
+  size_t sz_frame = 0;
+  char *lz_frame = NULL;  // made for the first subscriber that takes it
+  size_t sz_lz_frame = 0, sz_lz_alloc = 0;
+  bool lz, lz_tried = false;
+
+  if (NULL != sent_count)
+    *sent_count = 0;
+  if (NULL == name)
+    return EINVAL;
+  pthread_mutex_lock (&srv->list_mutex);
+  if (srv->listen_state != 1) {
+    pthread_mutex_unlock (&srv->list_mutex);
+    return EBADF;
   }
-  if (SRV.listen_state != 0) {
-    if (SRV.listen_state == 1)
-      cmsg_log (LEVEL_ERROR, ("CIMPMSG: server already listening for messages\n"));
-    else
-      cmsg_log (LEVEL_ERROR, ("CIMPMSG: server shutting down\n"));
-    pthread_mutex_unlock (&SRV.connect_mutex);
-    return EALREADY;
+  route = route_find (srv, name);
+  if (NULL == route) {
+    pthread_mutex_unlock (&srv->list_mutex);
+    return ENOENT;
   }
-  SRV.listen_state = 1;
-  pthread_mutex_unlock (&SRV.connect_mutex);
-
-  while (1)
-  {
-    any_closing = false;
-    rtn = wait_server_ready (handle_msg, terminated, &any_closing);
-    if (rtn < 0)
-      break;
-    if (rtn & 1)
-      server_accept (handle_msg);
-    if (rtn & 2)
-      server_receive_msgs (handle_msg, &any_closing);
-    if (any_closing)
-      server_close_connections ();
-    if (SRV.terminate_on_keypress) {
-      if (rtn & 4) { // key pressed
-	fgets (inbuf, 10, stdin);
-	break;
-      }
+  frame = make_msg_frame (-1, CMSG_KIND_MSG, 0, msg, sz_msg, &sz_frame);
+  if (NULL == frame) {
+    pthread_mutex_unlock (&srv->list_mutex);
+    return ENOMEM;
+  }
+  for (i=0; i<route->sub_count; i++) {
+    sub = route->subs[i];
+    if (sub->rcv_state < 0)
+      continue;
+    if (!msg_size_ok (CMSG_KIND_MSG, sz_msg, sub->peer_max_msg & ~PEER_LZ)) {
+      server_count_send (srv, sub, EMSGSIZE, 0);
+      rtn = EMSGSIZE;
+      continue;
     }
-    if (NULL != terminated)
-      if (*terminated)
-	break;
+    lz = (server_lz_threshold (srv, sub) != 0) && (sz_msg >= srv->compress_threshold);
+    if (lz && !lz_tried) {
+      lz_frame = make_lz_frame (CMSG_KIND_MSG, 0, msg, sz_msg, &sz_lz_frame, &sz_lz_alloc);
+      lz_tried = true;
+    }
+    lz = lz && (NULL != lz_frame);
+    send_rtn = send_msg_frame_timed (sub->sock, lz ? lz_frame : frame, 
+      lz ? sz_lz_frame : sz_frame, non_block ? MSG_DONTWAIT : 0, &send_ns);
+    server_count_send (srv, sub, send_rtn, lz ? sz_lz_frame : sz_frame);
+    server_record_latency (srv, CMSG_LAT_SEND, send_ns);
+    if (send_rtn == 0) {
+      sent++;
+      set_last_active_time (sub);
+    } else
+      rtn = send_rtn;
   }
-  cmsg_log (LEVEL_INFO, ("CIMPMSG: Exiting cmsg_server_listen_for_msgs\n"));
-
-  shutdown_server ();
-  return 0;
+  pthread_mutex_unlock (&srv->list_mutex);
+  cmsg_free (frame, sz_frame, CMSG_ALLOC_SEND_BUF);
+  cmsg_free (lz_frame, sz_lz_alloc, CMSG_ALLOC_SEND_BUF);
+  if (NULL != sent_count)
+    *sent_count = sent;
+  return rtn;
 }
 
-int __send_msg (int sock, const char *msg, size_t sz_msg, bool non_block)
+int cmsg_server_close_conn (cmsg_server_t *srv, cmsg_conn_t handle)
 {
-  int flags = 0;
-  ssize_t bytes;
-  char *msg_buf;
+  int rtn = EBADF;
+  struct connection *conn;
 
-  msg_buf = malloc (sz_msg+4);
-  if (NULL == msg_buf) {
-    cmsg_log (LEVEL_ERROR, 
-	("CIMPMSG: Unable to malloc msg buffer for socket %d\n", sock));
-    return ENOMEM;
+  pthread_mutex_lock (&srv->list_mutex);
+  if (srv->listen_state != 1) {
+    if (srv->listen_state == 0)
+      cmsg_log (LEVEL_DEBUG, ("CIMPMSG: cannot close socket, server not started\n"));
+    else
+      cmsg_log (LEVEL_DEBUG, ("CIMPMSG: cannot close socket, server shutting down\n"));
+    pthread_mutex_unlock (&srv->list_mutex);
+    return rtn;
   }
-  msg_buf[0] = MSG_HEADER_MARK;
-  msg_buf[1] = MSG_HEADER_MARK;
-  msg_buf[2] = sz_msg / 256;
-  msg_buf[3] = sz_msg % 256;
-  memcpy (msg_buf+4, msg, sz_msg);
+  conn = server_find_conn (srv, handle);
+  if (NULL != conn) {
+    conn->user_data.close_request = true;
+    rtn = 0;
+  }
+  pthread_mutex_unlock (&srv->list_mutex);
+  if (rtn != 0)
+     cmsg_log (LEVEL_DEBUG, ("CIMPMSG: Requested close connection not found\n"));
+  return rtn;
+}
 
-#if 0
-  if (wait_send_ready () < 0)
-     return -1;
-#endif
-  sz_msg += 4;
-  if (non_block)
-    flags = MSG_DONTWAIT;
-  bytes = send (sock, msg_buf, sz_msg, flags);
-  free (msg_buf);
-  if (bytes < 0) { 
-	cmsg_log_err (LEVEL_ERROR, errno, ("CIMPMSG: Error sending msg:"));
-	return errno;
+int cmsg_server_send (int sock, const char *msg, size_t sz_msg, bool non_block)
+{
+  struct cmsg_server *srv = get_default_server ();
+
+  if (NULL == srv) {
+    cmsg_log (LEVEL_DEBUG, ("CIMPMSG: cannot send, server not started\n"));
+    return EBADF;
   }
-  if ((size_t) bytes != sz_msg) {
-    cmsg_log (LEVEL_ERROR, ("CIMPMSG: Not all bytes sent, just %ld\n", bytes));
-    return EIO;
+  return cmsg_server_send_msg (srv, server_sock_handle (srv, sock), 
+    msg, sz_msg, non_block);
+}
+
+int cmsg_server_close_sock (int sock)
+{
+  struct cmsg_server *srv = get_default_server ();
+
+  if (NULL == srv) {
+    cmsg_log (LEVEL_DEBUG, ("CIMPMSG: cannot close socket, server not started\n"));
+    return EBADF;
   }
+  return cmsg_server_close_conn (srv, server_sock_handle (srv, sock));
+}
+
+int cmsg_server_get_stats (cmsg_server_t *srv, cmsg_stats_t *stats)
+{
+  stats_block_t *b = srv->stats;
+
+  memset (stats, 0, sizeof (*stats));
+  stats->msgs_received = stats_sum (b, STAT_MSGS_RCVD);
+  stats->bytes_received = stats_sum (b, STAT_BYTES_RCVD);
+  stats->msgs_sent = stats_sum (b, STAT_MSGS_SENT);
+  stats->bytes_sent = stats_sum (b, STAT_BYTES_SENT);
+  stats->partial_reads = stats_sum (b, STAT_PARTIAL_READS);
+  stats->receive_errors = stats_sum (b, STAT_RCV_ERRORS);
+  stats->send_errors = stats_sum (b, STAT_SEND_ERRORS);
+  stats->send_drops = stats_sum (b, STAT_SEND_DROPS);
+  stats->conns_accepted = stats_sum (b, STAT_CONNS_ACCEPTED);
+  stats->conns_closed = stats_sum (b, STAT_CONNS_CLOSED);
+  stats->conns_refused = stats_sum (b, STAT_CONNS_REFUSED);
+  stats->msgs_shed = stats_sum (b, STAT_MSGS_SHED);
+  stats->bytes_shed = stats_sum (b, STAT_BYTES_SHED);
+  if (stats->conns_accepted > stats->conns_closed)
+    stats->open_conns = stats->conns_accepted - stats->conns_closed;
   return 0;
 }
 
-int cmsg_client_send (struct client_conn *conn, const char *msg, size_t sz_msg, bool non_block)
+int cmsg_server_get_conn_stats (cmsg_server_t *srv, cmsg_conn_t handle,
+  cmsg_stats_t *stats)
 {
-  int rtn;
+  struct connection *conn;
 
-  if (-1 == conn->sock) {
-    cmsg_log (LEVEL_ERROR, ("CIMPMSG: Invalid socket for cmsg_client_send\n"));
+  memset (stats, 0, sizeof (*stats));
+  pthread_mutex_lock (&srv->list_mutex);
+  conn = server_find_conn (srv, handle);
+  if (NULL == conn) {
+    pthread_mutex_unlock (&srv->list_mutex);
     return EBADF;
   }
-  pthread_mutex_lock (&conn->send_mutex);
-  rtn = __send_msg (conn->sock, msg, sz_msg, non_block);
-  pthread_mutex_unlock (&conn->send_mutex);
-  return rtn;
+  stats->msgs_received = counter_get (&conn->stats.msgs_rcvd);
+  stats->bytes_received = counter_get (&conn->stats.bytes_rcvd);
+  stats->partial_reads = counter_get (&conn->stats.partial_reads);
+  stats->msgs_sent = counter_get (&conn->stats.msgs_sent);
+  stats->bytes_sent = counter_get (&conn->stats.bytes_sent);
+  stats->send_errors = counter_get (&conn->stats.send_errors);
+  pthread_mutex_unlock (&srv->list_mutex);
+  return 0;
 }
 
-int cmsg_server_send (int sock, const char *msg, size_t sz_msg, bool non_block)
+int cmsg_client_get_stats (struct client_conn *conn, cmsg_stats_t *stats)
 {
-  int rtn = EBADF;
-  struct connection *conn;
+  memset (stats, 0, sizeof (*stats));
+  stats->msgs_received = counter_get (&conn->stats.msgs_received);
+  stats->bytes_received = counter_get (&conn->stats.bytes_received);
+  stats->msgs_sent = counter_get (&conn->stats.msgs_sent);
+  stats->bytes_sent = counter_get (&conn->stats.bytes_sent);
+  stats->partial_reads = counter_get (&conn->stats.partial_reads);
+  stats->receive_errors = counter_get (&conn->stats.receive_errors);
+  stats->send_errors = counter_get (&conn->stats.send_errors);
+  stats->send_drops = counter_get (&conn->stats.send_drops);
+  stats->queued_msgs = __atomic_load_n (&conn->queued_count, __ATOMIC_RELAXED);
+  return 0;
+}
 
-  pthread_mutex_lock (&SRV.list_mutex);
-  if (SRV.listen_state != 1) {
-    if (SRV.listen_state == 0)
-      cmsg_log (LEVEL_DEBUG, ("CIMPMSG: cannot send, server not started\n"));
-    else
-      cmsg_log (LEVEL_DEBUG, ("CIMPMSG: cannot send, server shutting down\n"));
-    pthread_mutex_unlock (&SRV.list_mutex);
-    return rtn;
+static const struct stats_metric {
+  const char *name;
+  const char *type;
+  const char *help;
+  size_t offset;
+} stats_metrics[] = {
+  { "cimpmsg_messages_received_total", "counter", "Messages received",
+    offsetof (cmsg_stats_t, msgs_received) },
+  { "cimpmsg_received_bytes_total", "counter", "Bytes received, with frame headers",
+    offsetof (cmsg_stats_t, bytes_received) },
+  { "cimpmsg_messages_sent_total", "counter", "Messages sent",
+    offsetof (cmsg_stats_t, msgs_sent) },
+  { "cimpmsg_sent_bytes_total", "counter", "Bytes sent, with frame headers",
+    offsetof (cmsg_stats_t, bytes_sent) },
+  { "cimpmsg_partial_reads_total", "counter", "Reads that got part of a message",
+    offsetof (cmsg_stats_t, partial_reads) },
+  { "cimpmsg_receive_errors_total", "counter", "Bad frames and receive socket errors",
+    offsetof (cmsg_stats_t, receive_errors) },
+  { "cimpmsg_send_errors_total", "counter", "Failed sends",
+    offsetof (cmsg_stats_t, send_errors) },
+  { "cimpmsg_send_drops_total", "counter", "Sends dropped as would block or queue full",
+    offsetof (cmsg_stats_t, send_drops) },
+  { "cimpmsg_connections_accepted_total", "counter", "Connections accepted",
+    offsetof (cmsg_stats_t, conns_accepted) },
+  { "cimpmsg_connections_closed_total", "counter", "Connections closed",
+    offsetof (cmsg_stats_t, conns_closed) },
+  { "cimpmsg_open_connections", "gauge", "Open connections",
+    offsetof (cmsg_stats_t, open_conns) },
+  { "cimpmsg_queued_messages", "gauge", "Messages waiting in the client send queue",
+    offsetof (cmsg_stats_t, queued_msgs) },
+  { "cimpmsg_connections_refused_total", "counter", "Connections refused over max_conns",
+    offsetof (cmsg_stats_t, conns_refused) },
+  { "cimpmsg_messages_shed_total", "counter", "Messages dropped as overloaded",
+    offsetof (cmsg_stats_t, msgs_shed) },
+  { "cimpmsg_shed_bytes_total", "counter", "Bytes dropped as overloaded, with frame headers",
+    offsetof (cmsg_stats_t, bytes_shed) }
+};
+
+int cmsg_stats_format (const cmsg_stats_t *stats, const char *labels,
+  char *buf, size_t sz_buf)
+{
+  unsigned i;
+  int n;
+  size_t len = 0;
+  uint64_t value;
+  char dummy[1];
+
+  if ((NULL == buf) || (sz_buf == 0)) {
+    buf = dummy;
+    sz_buf = 1;
   }
-  LL_FOREACH (SRV.connection_list, conn)
-  {
-    if (conn->rcv_state >= 0) {
-      if (conn->rcv_data.sock == sock) {
-        //cmsg_log (LEVEL_DEBUG, ("Sending to client %d\n", sock));
-        rtn = __send_msg (sock, msg, sz_msg, non_block);
-        //cmsg_log (LEVEL_DEBUG, ("Sent to client %d, rtn=%d\n", sock, rtn));
-        if (0 == rtn)
-          set_last_active_time (conn);
-        break;
-      }
-    }
+  buf[0] = '\0';
+  for (i=0; i<sizeof (stats_metrics) / sizeof (stats_metrics[0]); i++) {
+    value = *(const uint64_t *) ((const char *) stats + stats_metrics[i].offset);
+    n = snprintf (buf+len, (len < sz_buf) ? sz_buf-len : 0,
+      "# HELP %s %s\n# TYPE %s %s\n%s%s%s%s %llu\n",
+      stats_metrics[i].name, stats_metrics[i].help,
+      stats_metrics[i].name, stats_metrics[i].type, stats_metrics[i].name,
+      (NULL != labels) ? "{" : "", (NULL != labels) ? labels : "",
+      (NULL != labels) ? "}" : "", (unsigned long long) value);
+    if (n < 0)
+      return n;
+    len += n;
   }
-  pthread_mutex_unlock (&SRV.list_mutex);
-  return rtn;
+  return (int) len;
 }
 
-int cmsg_server_close_sock (int sock)
+int cmsg_server_stats_listen (cmsg_server_t *srv, const char *path)
 {
-  int rtn = EBADF;
-  struct connection *conn;
+  int sock, rtn;
+  struct sockaddr_un addr;
 
-  pthread_mutex_lock (&SRV.list_mutex);
-  if (SRV.listen_state != 1) {
-    if (SRV.listen_state == 0)
-      cmsg_log (LEVEL_DEBUG, ("CIMPMSG: cannot close socket, server not started\n"));
-    else
-      cmsg_log (LEVEL_DEBUG, ("CIMPMSG: cannot close socket, server shutting down\n"));
-    pthread_mutex_unlock (&SRV.list_mutex);
+  if ((NULL == path) || (strlen (path) >= sizeof (addr.sun_path)))
+    return EINVAL;
+  if (srv->stats_sock != -1)
+    return EALREADY;
+  memset (&addr, 0, sizeof (addr));
+  addr.sun_family = AF_UNIX;
+  strcpy (addr.sun_path, path);
+  sock = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (sock < 0) {
+    cmsg_log_err (LEVEL_ERROR, errno, ("CIMPMSG: Unable to create stats socket"));
+    return errno;
+  }
+  unlink (path);  // left behind by an earlier run
+  if ((bind (sock, (struct sockaddr *) &addr, sizeof (addr)) != 0) ||
+      (listen (sock, 8) != 0)) {
+    rtn = errno;
+    cmsg_log_err (LEVEL_ERROR, rtn, ("CIMPMSG: Unable to listen on stats socket %s", path));
+    close (sock);
     return rtn;
   }
-  LL_FOREACH (SRV.connection_list, conn)
-  {
-    if (conn->rcv_state >= 0) {
-      if (conn->rcv_data.sock == sock) {
-        conn->user_data->close_request = true;
-	rtn = 0;
-        break;
-      }
-    }
+  free (srv->stats_path);
+  srv->stats_path = strdup (path);
+  if (NULL == srv->stats_path) {
+    close (sock);
+    unlink (path);
+    return ENOMEM;
   }
-  pthread_mutex_unlock (&SRV.list_mutex);
-  if (rtn != 0)
-     cmsg_log (LEVEL_DEBUG, ("CIMPMSG: Requested close socket (%d) not found\n", sock));
-  return rtn;
+  srv->stats_sock = sock;
+  return 0;
+}
+
+int cmsg_server_get_latency (cmsg_server_t *srv, int which, 
+  cmsg_latency_t *latency)
+{
+  unsigned i;
+  cmsg_hist_t *slot;
+  cmsg_hist_t *merged;
+
+  memset (latency, 0, sizeof (*latency));
+  if ((which < 0) || (which >= CMSG_LAT_COUNT))
+    return EINVAL;
+  merged = (cmsg_hist_t *) cmsg_alloc (sizeof (cmsg_hist_t), 0, CMSG_ALLOC_OTHER);
+  if (NULL == merged)
+    return ENOMEM;
+  hist_init (merged);
+  for (i=0; i<STATS_SLOTS; i++) {
+    slot = __atomic_load_n (&srv->latency[i], __ATOMIC_ACQUIRE);
+    if (NULL != slot)
+      hist_merge (merged, &slot[which]);
+  }
+  hist_summary (merged, latency);
+  cmsg_free (merged, sizeof (cmsg_hist_t), CMSG_ALLOC_OTHER);
+  return 0;
 }
 
+int cmsg_client_get_latency (struct client_conn *conn, int which,
+  cmsg_latency_t *latency)
+{
+  cmsg_hist_t *merged;
+  cmsg_hist_t *recorded;
+
+  memset (latency, 0, sizeof (*latency));
+  if ((which < 0) || (which >= CMSG_LAT_COUNT))
+    return EINVAL;
+  recorded = __atomic_load_n (&conn->latency, __ATOMIC_ACQUIRE);
+  if (NULL == recorded)
+    return 0;
+  merged = (cmsg_hist_t *) cmsg_alloc (sizeof (cmsg_hist_t), 0, CMSG_ALLOC_OTHER);
+  if (NULL == merged)
+    return ENOMEM;
+  hist_init (merged);
+  hist_merge (merged, &recorded[which]);
+  hist_summary (merged, latency);
+  cmsg_free (merged, sizeof (cmsg_hist_t), CMSG_ALLOC_OTHER);
+  return 0;
+}
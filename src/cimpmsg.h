@@ -17,6 +17,10 @@
 #ifndef  _CIMPMSG_H
 #define  _CIMPMSG_H
 
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <unistd.h>
@@ -25,6 +29,73 @@
 /*                               Data Structures                              */
 /*----------------------------------------------------------------------------*/
 
+typedef struct client_opts {
+  bool auto_reconnect;
+  unsigned reconnect_min_msecs;  // first backoff delay, 0 for default
+  unsigned reconnect_max_msecs;  // backoff ceiling, 0 for default
+  unsigned max_queued_msgs;      // sends held while disconnected, 0 for default
+  // Largest message sent or accepted, up to 16 MB. Above 65535 the
+  // client sends a HELLO on connecting, which servers older than large
+  // message support reject. 0 = plain messages up to 65535 only.
+  unsigned max_msg_size;
+  // Messages of this many bytes or more are sent compressed once the
+  // server's HELLO says it can take them, and the server may compress
+  // its own. Also sends a HELLO. 0 = no compression either way.
+  unsigned compress_threshold;
+  // The read-ahead buffer is freed after this long empty and without
+  // input, 0 = default 1000
+  unsigned buf_idle_msecs;
+  // Keeps the histograms read by cmsg_client_get_latency, about 20 KB
+  // allocated with the first sample. false = none, to keep idle
+  // connections small.
+  bool record_latency;
+} client_opts_t;
+
+struct client_queued_msg;
+struct cmsg_rpc;
+struct client_subscription;
+struct client_rcv_buf;
+
+// Counters are totals since start, except the gauges.
+typedef struct cmsg_stats {
+  uint64_t msgs_received;
+  uint64_t bytes_received;   // including frame headers
+  uint64_t msgs_sent;
+  uint64_t bytes_sent;       // including frame headers
+  uint64_t partial_reads;    // reads that got only part of a message
+  uint64_t receive_errors;   // bad frames and socket errors
+  uint64_t send_errors;
+  uint64_t send_drops;       // would block, or send queue full
+  uint64_t conns_accepted;   // server only
+  uint64_t conns_closed;     // server only
+  uint64_t open_conns;       // gauge, server only
+  uint64_t queued_msgs;      // gauge, client send queue depth
+  uint64_t conns_refused;    // server only, over max_conns
+  uint64_t msgs_shed;        // server only, dropped as overloaded
+  uint64_t bytes_shed;       // including frame headers
+} cmsg_stats_t;
+
+// latency histograms
+#define CMSG_LAT_READY_TO_CALLBACK	0  // socket readable to callback
+#define CMSG_LAT_CALLBACK		1  // time in the callback
+#define CMSG_LAT_SEND			2  // time in send ()
+#define CMSG_LAT_QUEUE_DELAY		3  // wait in an internal queue
+#define CMSG_LAT_COUNT			4
+
+// percentiles are within about 6% of the true value
+typedef struct cmsg_latency {
+  uint64_t count;
+  uint64_t min_ns;
+  uint64_t max_ns;
+  uint64_t mean_ns;
+  uint64_t p50_ns;
+  uint64_t p90_ns;
+  uint64_t p99_ns;
+  uint64_t p999_ns;
+} cmsg_latency_t;
+
+struct cmsg_hist;
+
 typedef struct client_conn {
   struct sockaddr_in addr;
   int sock;
@@ -35,25 +106,99 @@ typedef struct client_conn {
   bool terminated;
   pthread_mutex_t send_mutex;
   pthread_mutex_t rcv_mutex;
+  // reconnect state, protected by send_mutex
+  client_opts_t opts;
+  int conn_state;
+  unsigned int send_timeout_msecs;
+  unsigned int reconnect_attempts;
+  unsigned int rand_seed;
+  struct timespec next_connect_time;
+  unsigned int queued_count;
+  struct client_queued_msg *send_queue_head;
+  struct client_queued_msg *send_queue_tail;
+  // pending requests, allocated by the first cmsg_client_request
+  struct cmsg_rpc *rpc;
+  // names passed to cmsg_client_subscribe, protected by send_mutex
+  struct client_subscription *subscriptions;
+  // read-ahead for cmsg_client_receive, protected by rcv_mutex
+  struct client_rcv_buf *rcv_buf;
+  // the socket an auto_reconnect client's receive side reads, left open
+  // by a disconnect until it moves on. Protected by send_mutex.
+  int rcv_sock;
+  unsigned int peer_max_msg_size;  // from the server's HELLO, 0 until then
+  bool peer_compress;  // the server's HELLO says it takes compressed messages
+  // send counters are written under send_mutex, receive counters
+  // under rcv_mutex. Read them with cmsg_client_get_stats.
+  cmsg_stats_t stats;
+  struct cmsg_hist *latency;  // CMSG_LAT_COUNT histograms
 } client_conn_t;
 
 #define CMSG_CLIENT_CONN_INITIALIZER { \
   .sock = -1, .oserr = 0, .rcv_msg = NULL, .rcv_msg_size = 0, \
   .rcv_count = 0, .terminated = false, \
   .send_mutex = PTHREAD_MUTEX_INITIALIZER, \
-  .rcv_mutex = PTHREAD_MUTEX_INITIALIZER \
+  .rcv_mutex = PTHREAD_MUTEX_INITIALIZER, \
+  .conn_state = 0, .queued_count = 0, \
+  .send_queue_head = NULL, .send_queue_tail = NULL, .rpc = NULL, \
+  .subscriptions = NULL, .rcv_buf = NULL, .rcv_sock = -1, \
+  .peer_max_msg_size = 0, \
+  .peer_compress = false, .stats = { 0 }, .latency = NULL \
 }
 
 typedef struct server_opts {
   bool terminate_on_keypress;
   unsigned all_idle_notify_secs;
   unsigned inactive_conn_notify_secs;
+  // Read budget per connection per loop pass, so busy connections
+  // can't hold up quiet ones. Each ready connection gets one read,
+  // then more frames while it has data buffered, until it has used
+  // read_quantum_bytes (deficit round robin, default 4096) or read
+  // read_max_msgs messages (default 1). Larger budgets give busy
+  // clients more throughput and quiet ones more latency. 0 = default.
+  unsigned read_quantum_bytes;
+  unsigned read_max_msgs;
+  // Overload protection, 0 = off. Connections beyond max_conns are
+  // closed as soon as they are accepted. When the listen loop is more
+  // than shed_lag_msecs behind (since a pass began with no connection
+  // left backlogged by the read budget), plain messages
+  // of shed_msg_size bytes or more are read and dropped without being
+  // allocated, and at twice the lag requests too. Subscribe and
+  // unsubscribe frames are never dropped. See the _shed stats.
+  unsigned max_conns;
+  unsigned shed_lag_msecs;
+  unsigned shed_msg_size;
+  // A connection's receive state goes back to a shared pool after this
+  // long without input, 0 = default 1000
+  unsigned buf_idle_msecs;
+  // Frames above this are a receive error, 0 = default and ceiling 16 MB.
+  // Plain messages over 65535 are only sent to clients that allow them.
+  unsigned max_msg_size;
+  // Messages of this many bytes or more are compressed for clients
+  // that set compress_threshold, 0 = none. Compressed messages from
+  // clients are accepted either way.
+  unsigned compress_threshold;
 } server_opts_t;
 
+typedef struct cmsg_server cmsg_server_t;
+
+// Identifies a server connection: slab index in the low 32 bits and
+// a generation in the high 32 bits. A handle goes stale when its
+// connection closes, so unlike a socket fd it is never reused.
+typedef uint64_t cmsg_conn_t;
+#define CMSG_CONN_INVALID	((cmsg_conn_t) 0)
+
+#define CMSG_KIND_MSG		0
+#define CMSG_KIND_REQUEST	1
+#define CMSG_KIND_REPLY		2
+
 typedef struct server_rcv_msg_data {
+  cmsg_server_t *server;
+  cmsg_conn_t conn;
   int sock;
   char *rcv_msg;
   size_t rcv_msg_size;
+  int msg_kind;           // CMSG_KIND_MSG or CMSG_KIND_REQUEST
+  unsigned int corr_id;   // pass to cmsg_server_reply for requests
 } server_rcv_msg_data_t;
 
 #define CMSG_ACTION_MSG_RECEIVED	0
@@ -61,10 +206,16 @@ typedef struct server_rcv_msg_data {
 #define CMSG_ACTION_CONN_DROPPED	2
 #define CMSG_ACTION_CONN_INACTIVE       3
 #define CMSG_ACTION_ALL_IDLE_NOTIFY     4
+#define CMSG_ACTION_ROUTE_ADDED         5
+#define CMSG_ACTION_ROUTE_REMOVED       6
+// For the ROUTE actions rcv_msg is the name, and is freed by the library
 
 typedef void (* process_message_t) 
     (int action_code, server_rcv_msg_data_t *rcv_msg_data);
 
+// run on the listen thread, see cmsg_server_post and cmsg_server_add_timer
+typedef void (* cmsg_task_t) (cmsg_server_t *server, void *arg);
+
 #define CMSG_ERR_RCV_OS_ERROR		-1
 #define CMSG_ERR_RCV_TERMINATED		-2
 #define CMSG_ERR_RCV_SOCKET_CLOSED	-3
@@ -72,6 +223,37 @@ typedef void (* process_message_t)
 #define CMSG_ERR_RCV_BAD_HDR_MARK	-5
 #define CMSG_ERR_RCV_MSG_MALLOC_FAIL	-6
 #define CMSG_ERR_RCV_BAD_DATA_BYTE_CT	-7
+#define CMSG_ERR_RCV_MSG_TOO_BIG	-8
+#define CMSG_ERR_RCV_BAD_COMPRESSED	-9
+
+// what an allocation is for, passed to the cmsg_allocator_t hooks
+#define CMSG_ALLOC_OTHER	0
+#define CMSG_ALLOC_CONN		1  // server connection slabs
+#define CMSG_ALLOC_RCV_MSG	2  // received messages and replies
+#define CMSG_ALLOC_SEND_BUF	3  // encoded frames and queued sends
+
+typedef struct cmsg_allocator {
+  void *(* alloc) (size_t size, size_t align, int kind, void *ctx);
+  void (* free) (void *ptr, size_t size, int kind, void *ctx);
+  void *ctx;
+} cmsg_allocator_t;
+
+// status is 0 when a reply arrived (the handler must free reply with
+// cmsg_free_msg),
+// ETIMEDOUT if the deadline passed, ECONNRESET if the connection was lost,
+// EBADMSG or ENOMEM if the reply could not be decompressed or allocated,
+// or ECANCELED when the client is shut down.
+typedef void (* cmsg_reply_handler_t)
+    (int status, char *reply, size_t sz_reply, void *arg);
+
+// Runs many client connections on one thread, see cmsg_client_loop_run.
+typedef struct cmsg_client_loop cmsg_client_loop_t;
+
+// status is 0 for a message (the handler must free msg with
+// cmsg_free_msg), or a CMSG_ERR_RCV_ code when a connection without
+// auto_reconnect is lost, after which it is no longer read.
+typedef void (* cmsg_client_handler_t) (struct client_conn *conn, int status,
+    char *msg, size_t sz_msg, void *arg);
 
 /*----------------------------------------------------------------------------*/
 /*                             Function Prototypes                            */
@@ -83,17 +265,171 @@ int cmsg_server_listen_for_msgs (process_message_t handle_msg, bool *terminated)
 // Will exit and shutdown server if terminated flag is set,
 // or if option terminate_on_keypress specified and a key is pressed
 // When the action code is CMSG_ACTION_MSG_RECEIVED, the message needs to be freed
+// with cmsg_free_msg
 int cmsg_server_send (int sock, const char *msg, size_t sz_msg, bool non_block);
 int cmsg_server_close_sock (int sock);
+// The functions above operate on a single process-wide server.
+// Use the cmsg_server_t functions below to run several independent
+// servers (e.g. on different ports, each with its own listen thread).
+// rcv_msg_data->server identifies the server in the callback, and
+// rcv_msg_data->conn the connection. Functions given a closed
+// connection's handle return EBADF, even if its fd was reused.
+
+cmsg_server_t *cmsg_server_create (const char *ip_addr, unsigned int port,
+  server_opts_t *options, int *err);
+// returns NULL on failure, with the error code in *err
+int cmsg_server_listen (cmsg_server_t *server, process_message_t handle_msg,
+  bool *terminated);
+int cmsg_server_send_msg (cmsg_server_t *server, cmsg_conn_t conn, 
+  const char *msg, size_t sz_msg, bool non_block);
+int cmsg_server_close_conn (cmsg_server_t *server, cmsg_conn_t conn);
+int cmsg_server_reply (cmsg_server_t *server, cmsg_conn_t conn, unsigned int corr_id,
+  const char *msg, size_t sz_msg, bool non_block);
+// Answers a CMSG_KIND_REQUEST message, using its rcv_msg_data->corr_id
+int cmsg_server_add_route (cmsg_server_t *server, cmsg_conn_t conn, const char *name);
+int cmsg_server_remove_route (cmsg_server_t *server, cmsg_conn_t conn,
+  const char *name);
+// Registers a connection under a service name or topic, the same as
+// the client calling cmsg_client_subscribe. Routes are dropped with
+// their connection.
+int cmsg_server_publish (cmsg_server_t *server, const char *name,
+  const char *msg, size_t sz_msg, bool non_block, unsigned int *sent_count);
+// Sends msg to every connection registered under name. Lookup is a
+// single hash probe, and the frame is encoded once for all subscribers.
+// Returns ENOENT if nobody is registered, else 0 or the last send error.
+// sent_count, if not NULL, gets the number of successful sends.
+void cmsg_server_destroy (cmsg_server_t *server);
+// Must not be called while cmsg_server_listen is running, or while
+// other threads may still call cmsg_server_send_msg on this server.
+int cmsg_server_get_stats (cmsg_server_t *server, cmsg_stats_t *stats);
+int cmsg_server_get_conn_stats (cmsg_server_t *server, cmsg_conn_t conn,
+  cmsg_stats_t *stats);
+// May be called from any thread. Counting is per thread and lock-free,
+// so a snapshot taken while traffic flows is not an atomic cut.
+int cmsg_server_get_latency (cmsg_server_t *server, int which, 
+  cmsg_latency_t *latency);
+// which is a CMSG_LAT_ code. Merges the per-thread histograms.
+// QUEUE_DELAY is how long tasks from cmsg_server_post wait to run.
+int cmsg_server_stats_listen (cmsg_server_t *server, const char *path);
+// Serves a text snapshot (see cmsg_stats_format) on a local Unix socket
+// at path, from the listen thread. Call before cmsg_server_listen.
+// Example: socat - UNIX-CONNECT:/run/cimpmsg.stats
+int cmsg_server_capture (cmsg_server_t *server, const char *path);
+// Starts appending every received frame, with its connection and a
+// CLOCK_MONOTONIC timestamp, to the file at path (format in
+// cimpmsg_capture.h). NULL stops the capture. May be called from any
+// thread. Replay a capture with bench/cimpmsg_replay.
+int cmsg_server_handoff_listen (cmsg_server_t *server, const char *path);
+// Lets a new process take over this server without dropping clients.
+// When one connects to the Unix socket at path (with
+// cmsg_server_create_handoff), the listen thread passes it the
+// listening socket and every connection, including partly received
+// messages and routes, and cmsg_server_listen returns. The sockets are
+// then closed here without affecting the clients. Call before
+// cmsg_server_listen.
+cmsg_server_t *cmsg_server_create_handoff (const char *path,
+  server_opts_t *options, int *err);
+// Takes over the server listening for a handoff at path. Returns NULL,
+// with e.g. ENOENT or ECONNREFUSED in *err, if there is none to take
+// over, so the caller can fall back to cmsg_server_create. The taken
+// over connections get new handles, and are reported with
+// CMSG_ACTION_CONN_ADDED when cmsg_server_listen starts.
+int cmsg_server_post (cmsg_server_t *server, cmsg_task_t task, void *arg);
+// Runs task (server, arg) on the listen thread, in posting order. May
+// be called from any thread, and does not take the connection list
+// lock. Tasks still queued when the server is destroyed are not run.
+int cmsg_server_add_timer (cmsg_server_t *server, unsigned first_msecs,
+  unsigned interval_msecs, cmsg_task_t task, void *arg, int *timer_id);
+// Runs task on the listen thread after first_msecs (or interval_msecs
+// if 0), then every interval_msecs, or once if interval_msecs is 0.
+// Missed expirations are run once. May be called from any thread.
+int cmsg_server_cancel_timer (cmsg_server_t *server, int timer_id);
+// Returns ENOENT if the timer has gone, e.g. a one shot timer that ran.
+int cmsg_stats_format (const cmsg_stats_t *stats, const char *labels,
+  char *buf, size_t sz_buf);
+// Writes stats in the Prometheus text format. labels, if not NULL, is
+// put in the braces of each sample, e.g. "port=\"6666\"". Returns the
+// length, like snprintf, so a result >= sz_buf means truncated.
 
 int cmsg_connect_client (struct client_conn *conn, 
   const char *ip_addr, unsigned int port, unsigned int send_timeout_msecs);
+int cmsg_connect_client_opts (struct client_conn *conn, 
+  const char *ip_addr, unsigned int port, unsigned int send_timeout_msecs,
+  client_opts_t *options);
+// With options->auto_reconnect, the connect is done asynchronously and
+// retried with jittered exponential backoff whenever the server goes away.
+// cmsg_client_receive keeps waiting across reconnects instead of returning
+// CMSG_ERR_RCV_SOCKET_CLOSED, and cmsg_client_send queues messages
+// (up to max_queued_msgs, then ENOBUFS) while disconnected.
+// A client that sends a HELLO (see client_opts_t) otherwise waits up to
+// a second for the server's, and fails with ECONNRESET if the server
+// closes the connection instead.
 void cmsg_shutdown_client (struct client_conn *conn);
-// will set conn->terminated
+// will set conn->terminated, and waits for a thread in cmsg_client_receive
+// to return. Don't call it from a reply handler.
 int cmsg_client_receive (struct client_conn *conn);
 // will return -1 if conn->terminated is set
+int cmsg_client_receive_into (struct client_conn *conn, char *buf, size_t sz_buf);
+// Like cmsg_client_receive, but without a buffer per message. The message
+// is copied to buf, and the full size returned, so a result > sz_buf
+// means the message was truncated. With buf NULL, conn->rcv_msg points
+// into the client's receive buffer until the next receive call, and must
+// not be freed.
 int cmsg_client_send (struct client_conn *conn, const char *msg, size_t sz_msg, bool non_block);
 
+int cmsg_client_request (struct client_conn *conn, const char *msg, size_t sz_msg,
+  unsigned int timeout_msecs, cmsg_reply_handler_t on_reply, void *arg);
+// Sends msg as a request and returns without waiting. on_reply is called
+// exactly once, from the thread running cmsg_client_receive, when the reply
+// arrives or the request fails. Any number of requests, from any number of
+// threads, may be outstanding on one connection. timeout_msecs 0 = no deadline.
+// If the request can't be sent, the error is returned and on_reply not called.
+int cmsg_client_call (struct client_conn *conn, const char *msg, size_t sz_msg,
+  unsigned int timeout_msecs, char **reply, size_t *sz_reply);
+// Blocking request. Needs another thread running cmsg_client_receive,
+// or a client loop.
+// On success *reply must be freed with cmsg_free_msg.
+int cmsg_client_subscribe (struct client_conn *conn, const char *name);
+int cmsg_client_unsubscribe (struct client_conn *conn, const char *name);
+// Registers this client on the server under a service name or topic.
+// Subscriptions are remembered and restored after an auto-reconnect.
+int cmsg_client_get_stats (struct client_conn *conn, cmsg_stats_t *stats);
+int cmsg_client_get_latency (struct client_conn *conn, int which,
+  cmsg_latency_t *latency);
+// READY_TO_CALLBACK ends when cmsg_client_receive returns a message or
+// a reply handler is called, CALLBACK is time in reply handlers, and
+// QUEUE_DELAY is time in the auto-reconnect send queue. All counts are
+// 0 unless the client was connected with record_latency set.
+
+cmsg_client_loop_t *cmsg_client_loop_create (int *err);
+// returns NULL on failure, with the error code in *err
+int cmsg_client_loop_add (cmsg_client_loop_t *loop, struct client_conn *conn,
+  cmsg_client_handler_t on_msg, void *arg);
+int cmsg_client_loop_remove (cmsg_client_loop_t *loop, struct client_conn *conn);
+int cmsg_client_loop_run (cmsg_client_loop_t *loop, bool *terminated);
+void cmsg_client_loop_destroy (cmsg_client_loop_t *loop);
+// The thread in cmsg_client_loop_run reads every connection added to the
+// loop, calls on_msg for messages, runs reply handlers and request
+// timeouts, and reconnects auto_reconnect connections, until *terminated
+// is set. Use one loop per thread to spread connections over threads.
+// add and remove may be called from any thread, remove also from a
+// handler. Don't call cmsg_client_receive on a connection in a loop, and
+// remove it before cmsg_shutdown_client. Sends are unchanged.
+
+int cmsg_set_allocator (const cmsg_allocator_t *allocator);
+// Makes the library get its memory from allocator->alloc, NULL restores
+// malloc. align is 0 for malloc's alignment, or a power of 2. free is
+// given the size and kind the block was allocated with. Call before
+// creating any server or client. Returns EINVAL without both hooks.
+// These stay on malloc: arrays resized with realloc (poll sets, the
+// connection slab index, route subscriber lists), copied strings
+// (route names, socket paths), and the per-thread log rings, which
+// can outlive the allocator (see cmsg_log_set_ring_size). A capture
+// file is mapped, not allocated.
+void cmsg_free_msg (char *msg, size_t sz_msg);
+// Frees a received message or reply, with its size. Plain free () is
+// only right while the default allocator is in use.
+
 
 
 #endif
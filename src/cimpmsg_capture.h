@@ -0,0 +1,56 @@
+/**
+ * Copyright 2016 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+#ifndef  _CIMPMSG_CAPTURE_H
+#define  _CIMPMSG_CAPTURE_H
+
+#include <stdint.h>
+
+/*------------------------------------------------------------------
+ * Capture file written by cmsg_server_capture.
+ * A file header, then one record per received frame, in the order
+ * received. Records are 8 byte aligned and in host byte order, so a
+ * capture is read on the kind of machine that wrote it. The file is
+ * extended ahead of the writes, so a record with rec_size 0 marks the
+ * end of a capture that wasn't stopped.
+---------------------------------------------------------------------*/
+
+#define CMSG_CAPTURE_MAGIC	"CMSGCAP1"
+#define CMSG_CAPTURE_VERSION	1
+
+typedef struct cmsg_capture_file_hdr {
+  char magic[8];         // CMSG_CAPTURE_MAGIC, no terminator
+  uint32_t version;
+  uint32_t hdr_size;     // sizeof (cmsg_capture_file_hdr_t)
+  uint64_t start_ns;     // CLOCK_MONOTONIC when the capture started
+} cmsg_capture_file_hdr_t;
+
+typedef struct cmsg_capture_rec {
+  uint32_t rec_size;     // this header, the message and padding to 8
+  uint8_t kind;          // CMSG_KIND_ code, or a subscribe/unsubscribe
+  uint8_t reserved[3];
+  uint32_t corr_id;
+  uint32_t msg_size;
+  uint64_t conn;         // cmsg_conn_t of the sending connection
+  uint64_t time_ns;      // CLOCK_MONOTONIC when the frame was complete
+  // followed by msg_size bytes of message
+} cmsg_capture_rec_t;
+
+// frame kinds a client sends with cmsg_client_subscribe/unsubscribe
+#define CMSG_CAPTURE_KIND_SUBSCRIBE	3
+#define CMSG_CAPTURE_KIND_UNSUBSCRIBE	4
+
+#endif
@@ -0,0 +1,140 @@
+/**
+ * Copyright 2016 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+#include <string.h>
+#include "cimpmsg_hist.h"
+
+unsigned hist_bucket (uint64_t value)
+{
+  unsigned msb, shift;
+
+  if (value < 2 * HIST_SUB_COUNT)
+    return (unsigned) value;
+  msb = 63 - __builtin_clzll (value);
+  if (msb > HIST_MAX_BIT)
+    return HIST_BUCKETS - 1;
+  shift = msb - HIST_SUB_BITS;
+  return ((shift + 1) * HIST_SUB_COUNT) + 
+    (unsigned) ((value >> shift) & (HIST_SUB_COUNT - 1));
+}
+
+// the middle of the range of values that go in bucket
+uint64_t hist_bucket_value (unsigned bucket)
+{
+  unsigned shift;
+  uint64_t low;
+
+  if (bucket < 2 * HIST_SUB_COUNT)
+    return bucket;
+  shift = (bucket / HIST_SUB_COUNT) - 1;
+  low = (uint64_t) (HIST_SUB_COUNT + (bucket % HIST_SUB_COUNT)) << shift;
+  return low + ((1ULL << shift) / 2);
+}
+
+void hist_init (cmsg_hist_t *hist)
+{
+  memset (hist, 0, sizeof (*hist));
+  hist->min_ns = UINT64_MAX;
+}
+
+// single writer: a relaxed load and store is enough
+void hist_add (uint64_t *counter, uint64_t n, bool shared)
+{
+  if (shared)
+    __atomic_fetch_add (counter, n, __ATOMIC_RELAXED);
+  else
+    __atomic_store_n (counter,
+      __atomic_load_n (counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+void hist_record (cmsg_hist_t *hist, uint64_t value_ns, bool shared)
+{
+  uint64_t cur;
+
+  hist_add (&hist->buckets[hist_bucket (value_ns)], 1, shared);
+  hist_add (&hist->sum_ns, value_ns, shared);
+  hist_add (&hist->count, 1, shared);
+  cur = __atomic_load_n (&hist->min_ns, __ATOMIC_RELAXED);
+  while ((value_ns < cur) && !__atomic_compare_exchange_n (&hist->min_ns,
+      &cur, value_ns, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+  cur = __atomic_load_n (&hist->max_ns, __ATOMIC_RELAXED);
+  while ((value_ns > cur) && !__atomic_compare_exchange_n (&hist->max_ns,
+      &cur, value_ns, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+void hist_merge (cmsg_hist_t *into, const cmsg_hist_t *from)
+{
+  unsigned i;
+  uint64_t value;
+
+  for (i=0; i<HIST_BUCKETS; i++)
+    into->buckets[i] += __atomic_load_n (&from->buckets[i], __ATOMIC_RELAXED);
+  into->count += __atomic_load_n (&from->count, __ATOMIC_RELAXED);
+  into->sum_ns += __atomic_load_n (&from->sum_ns, __ATOMIC_RELAXED);
+  value = __atomic_load_n (&from->min_ns, __ATOMIC_RELAXED);
+  if (value < into->min_ns)
+    into->min_ns = value;
+  value = __atomic_load_n (&from->max_ns, __ATOMIC_RELAXED);
+  if (value > into->max_ns)
+    into->max_ns = value;
+}
+
+uint64_t hist_percentile (const cmsg_hist_t *hist, double percent)
+{
+  unsigned i;
+  uint64_t total = 0;
+  uint64_t rank, seen = 0;
+  uint64_t value;
+
+  // count may run ahead of the buckets while recording goes on
+  for (i=0; i<HIST_BUCKETS; i++)
+    total += hist->buckets[i];
+  if (total == 0)
+    return 0;
+  rank = (uint64_t) ((percent / 100.0) * (double) total + 0.5);
+  if (rank == 0)
+    rank = 1;
+  for (i=0; i<HIST_BUCKETS; i++) {
+    seen += hist->buckets[i];
+    if (seen >= rank)
+      break;
+  }
+  if (i >= HIST_BUCKETS - 1)
+    return hist->max_ns;  // the last bucket has no upper bound
+  value = hist_bucket_value (i);
+  if (value > hist->max_ns)
+    value = hist->max_ns;
+  if (value < hist->min_ns)
+    value = hist->min_ns;
+  return value;
+}
+
+void hist_summary (const cmsg_hist_t *hist, cmsg_latency_t *lat)
+{
+  memset (lat, 0, sizeof (*lat));
+  if (hist->count == 0)
+    return;
+  lat->count = hist->count;
+  lat->min_ns = hist->min_ns;
+  lat->max_ns = hist->max_ns;
+  lat->mean_ns = hist->sum_ns / hist->count;
+  lat->p50_ns = hist_percentile (hist, 50.0);
+  lat->p90_ns = hist_percentile (hist, 90.0);
+  lat->p99_ns = hist_percentile (hist, 99.0);
+  lat->p999_ns = hist_percentile (hist, 99.9);
+}
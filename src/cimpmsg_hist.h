@@ -0,0 +1,52 @@
+/**
+ * Copyright 2016 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+#ifndef  _CIMPMSG_HIST_H
+#define  _CIMPMSG_HIST_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "cimpmsg.h"
+
+/*------------------------------------------------------------------
+ * Log bucketed latency histograms, HDR style. Values below
+ * 2*HIST_SUB_COUNT ns get a bucket each, above that every power of
+ * two is split into HIST_SUB_COUNT buckets, so a bucket is within
+ * 1/HIST_SUB_COUNT of its value. Larger than 2^HIST_MAX_BIT ns goes
+ * in the last bucket.
+---------------------------------------------------------------------*/
+#define HIST_SUB_BITS		4
+#define HIST_SUB_COUNT		(1 << HIST_SUB_BITS)
+#define HIST_MAX_BIT		40
+#define HIST_BUCKETS		((HIST_MAX_BIT - HIST_SUB_BITS + 2) * HIST_SUB_COUNT)
+
+typedef struct cmsg_hist {
+  uint64_t count;
+  uint64_t sum_ns;
+  uint64_t min_ns;  // UINT64_MAX while empty
+  uint64_t max_ns;
+  uint64_t buckets[HIST_BUCKETS];
+} cmsg_hist_t;
+
+void hist_init (cmsg_hist_t *hist);
+void hist_record (cmsg_hist_t *hist, uint64_t value_ns, bool shared);
+// shared must be true if more than one thread may record at a time
+void hist_merge (cmsg_hist_t *into, const cmsg_hist_t *from);
+// from may be recorded to meanwhile
+void hist_summary (const cmsg_hist_t *hist, cmsg_latency_t *lat);
+uint64_t hist_percentile (const cmsg_hist_t *hist, double percent);
+
+#endif
@@ -0,0 +1,691 @@
+/**
+ * Copyright 2016 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "cimpmsg_log.h"
+
+/*------------------------------------------------------------------
+ * Asynchronous logging.
+ * Each thread that logs owns a single producer, single consumer byte
+ * ring. A record holds the format pointer and the arguments in binary,
+ * with strings copied, so the caller only parses the format. The log
+ * thread formats records and hands them to the sink. It blocks on an
+ * eventfd while every ring is empty; the first record written after
+ * that wakes it, and it then drains in LOG_DRAIN_MSECS batches.
+ * Format strings must be literals, since they are used after the call.
+---------------------------------------------------------------------*/
+
+#define LOG_RING_SIZE		(64*1024)  // default, power of 2
+#define LOG_MAX_RECORD		2048
+#define LOG_MAX_LINE		4096  // formatted, a record's text and numbers
+#define LOG_DRAIN_MSECS		10
+
+#define LOG_REC_WRAP		1  // rest of the ring is unused
+#define LOG_REC_ERR		2  // errcode is valid
+#define LOG_REC_TEXT		4  // preformatted, format is "%s"
+
+typedef struct log_record {
+  uint32_t size;  // including this header, multiple of 8
+  uint16_t flags;
+  int16_t level;
+  int32_t errcode;
+  uint32_t reserved;
+  uint64_t time_ns;
+  const char *format;
+  // followed by the arguments, each 8 byte aligned
+} log_record_t;
+
+typedef struct log_ring {
+  uint64_t head;  // bytes written, producer only
+  char pad1[56];
+  uint64_t tail;  // bytes consumed, log thread only
+  char pad2[56];
+  uint64_t dropped;
+  size_t size;  // of buf, power of 2
+  bool orphaned;  // its thread has exited
+  struct log_ring *next;
+  char buf[];
+} log_ring_t;
+
+int cmsg_log_level = LEVEL_INFO;
+
+static cmsg_log_sink_t log_sink = NULL;
+static void *log_sink_arg = NULL;
+static log_ring_t *log_rings = NULL;
+static uint64_t log_dropped_freed = 0;  // from freed rings
+static pthread_mutex_t log_drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t log_ring_key;
+static bool log_started = false;
+static size_t log_ring_size = LOG_RING_SIZE;
+static int log_wake_fd = -1;
+static bool log_sleeping = false;  // log thread is blocked on log_wake_fd
+
+static __thread log_ring_t *log_thread_ring = NULL;
+static __thread bool log_thread_exited = false;
+static __thread int log_thread_level;
+static __thread int log_thread_errcode;
+static __thread bool log_thread_has_err;
+
+void cmsg_log_set_level (int level)
+{
+  __atomic_store_n (&cmsg_log_level, level, __ATOMIC_RELAXED);
+}
+
+int cmsg_log_get_level (void)
+{
+  return __atomic_load_n (&cmsg_log_level, __ATOMIC_RELAXED);
+}
+
+void cmsg_log_set_sink (cmsg_log_sink_t sink, void *arg)
+{
+  pthread_mutex_lock (&log_drain_mutex);
+  log_sink = sink;
+  log_sink_arg = arg;
+  pthread_mutex_unlock (&log_drain_mutex);
+}
+
+int cmsg_log_set_ring_size (size_t size)
+{
+  if ((size < 2 * LOG_MAX_RECORD) || ((size & (size - 1)) != 0))
+    return EINVAL;
+  __atomic_store_n (&log_ring_size, size, __ATOMIC_RELAXED);
+  return 0;
+}
+
+void log_default_sink (int level, uint64_t time_ns, const char *line, 
+  size_t len, void *arg)
+{
+  (void) time_ns;
+  (void) arg;
+  if (level == LEVEL_ERROR)
+    fputs ("Error: ", stdout);
+  else if (level == LEVEL_INFO)
+    fputs ("Info: ", stdout);
+  else
+    fputs ("Debug: ", stdout);
+  fwrite (line, 1, len, stdout);
+}
+
+/*------------------------------------------------------------------
+ * Format parsing, shared by the encoder and the decoder
+---------------------------------------------------------------------*/
+
+#define ARG_NONE	0
+#define ARG_INT		1
+#define ARG_LONG	2
+#define ARG_LLONG	3
+#define ARG_SIZE	4
+#define ARG_INTMAX	5
+#define ARG_PTRDIFF	6
+#define ARG_DOUBLE	7
+#define ARG_LDOUBLE	8
+#define ARG_STRING	9
+#define ARG_POINTER	10
+#define ARG_BAD		11  // not supported, format the record eagerly
+
+// Parses the conversion at fmt, just after the '%'.
+// Returns its length and sets *arg_type.
+size_t log_parse_spec (const char *fmt, int *arg_type)
+{
+  const char *p = fmt;
+  int length = 0;  // 'h', 'l', 'L' (ll), 'z', 'j', 't', 'D' (long double)
+
+  *arg_type = ARG_BAD;
+  while ((*p != '\0') && (strchr ("-+ #0", *p) != NULL))
+    p++;
+  while ((*p >= '0') && (*p <= '9'))
+    p++;
+  if (*p == '.') {
+    p++;
+    while ((*p >= '0') && (*p <= '9'))
+      p++;
+  }
+  if ((p[0] == 'h') && (p[1] == 'h')) {
+    length = 'h';
+    p += 2;
+  } else if ((p[0] == 'l') && (p[1] == 'l')) {
+    length = 'L';
+    p += 2;
+  } else if ((*p == 'h') || (*p == 'l') || (*p == 'z') || (*p == 'j') || (*p == 't')) {
+    length = *p++;
+  } else if (*p == 'L') {
+    length = 'D';
+    p++;
+  }
+  switch (*p) {
+    case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+      if (length == 'l')
+        *arg_type = ARG_LONG;
+      else if (length == 'L')
+        *arg_type = ARG_LLONG;
+      else if (length == 'z')
+        *arg_type = ARG_SIZE;
+      else if (length == 'j')
+        *arg_type = ARG_INTMAX;
+      else if (length == 't')
+        *arg_type = ARG_PTRDIFF;
+      else if (length != 'D')
+        *arg_type = ARG_INT;
+      break;
+    case 'c':
+      if (length == 0)
+        *arg_type = ARG_INT;
+      break;
+    case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+      *arg_type = (length == 'D') ? ARG_LDOUBLE : ARG_DOUBLE;
+      break;
+    case 's':
+      if (length == 0)
+        *arg_type = ARG_STRING;
+      break;
+    case 'p':
+      *arg_type = ARG_POINTER;
+      break;
+    case '%':
+      *arg_type = ARG_NONE;
+      break;
+    default:
+      break;  // %n, '*' and the like
+  }
+  if (*p == '\0')
+    return (size_t) (p - fmt);
+  return (size_t) (p - fmt) + 1;
+}
+
+/*------------------------------------------------------------------
+ * Producer side
+---------------------------------------------------------------------*/
+
+size_t log_align (size_t n)
+{
+  return (n + 7) & ~(size_t) 7;
+}
+
+// marks text of len bytes, cut to fit, with a "..." suffix, keeping
+// a trailing newline if it had one
+void log_mark_cut (char *text, size_t len, bool newline)
+{
+  if (newline && (len >= 4))
+    memcpy (text + len - 4, "...\n", 4);
+  else if (len >= 3)
+    memcpy (text + len - 3, "...", 3);
+}
+
+// encodes the arguments after the header. Returns the record size,
+// or 0 if the format has a conversion the encoder doesn't handle or
+// the arguments don't fit in a record. A string takes up to the space
+// left in the record, and is cut with "..." past that.
+size_t log_encode (char *rec, const char *format, va_list ap)
+{
+  const char *p = format;
+  size_t pos = sizeof (log_record_t);
+  size_t len;
+  int arg_type;
+  const char *str;
+
+  while (NULL != (p = strchr (p, '%'))) {
+    p++;
+    p += log_parse_spec (p, &arg_type);
+    if (arg_type == ARG_BAD)
+      return 0;
+    if (pos + 16 > LOG_MAX_RECORD)
+      return 0;
+    switch (arg_type) {
+      case ARG_NONE:
+        break;
+      case ARG_INT:
+        *(int64_t *) (rec+pos) = va_arg (ap, int);
+        pos += 8;
+        break;
+      case ARG_LONG:
+        *(long *) (rec+pos) = va_arg (ap, long);
+        pos += 8;
+        break;
+      case ARG_LLONG:
+        *(long long *) (rec+pos) = va_arg (ap, long long);
+        pos += 8;
+        break;
+      case ARG_SIZE:
+        *(size_t *) (rec+pos) = va_arg (ap, size_t);
+        pos += 8;
+        break;
+      case ARG_INTMAX:
+        *(intmax_t *) (rec+pos) = va_arg (ap, intmax_t);
+        pos += 8;
+        break;
+      case ARG_PTRDIFF:
+        *(ptrdiff_t *) (rec+pos) = va_arg (ap, ptrdiff_t);
+        pos += 8;
+        break;
+      case ARG_DOUBLE:
+        *(double *) (rec+pos) = va_arg (ap, double);
+        pos += 8;
+        break;
+      case ARG_LDOUBLE:
+        {
+          long double ld = va_arg (ap, long double);
+          memcpy (rec+pos, &ld, sizeof (ld));  // records are only 8 byte aligned
+        }
+        pos += 16;
+        break;
+      case ARG_POINTER:
+        *(void **) (rec+pos) = va_arg (ap, void *);
+        pos += 8;
+        break;
+      case ARG_STRING:
+        str = va_arg (ap, const char *);
+        if (NULL == str)
+          str = "(null)";
+        len = strnlen (str, LOG_MAX_RECORD - pos - 8 - 1);
+        *(uint32_t *) (rec+pos) = (uint32_t) len;
+        memcpy (rec+pos+8, str, len);
+        rec[pos+8+len] = '\0';
+        if (str[len] != '\0')
+          log_mark_cut (rec+pos+8, len, false);
+        pos += log_align (8 + len + 1);
+        break;
+    }
+  }
+  return pos;
+}
+
+// Wakes the log thread if it is blocked. The fence orders the ring
+// head store before the log_sleeping load; the log thread drains once
+// more after setting log_sleeping, so one side always sees the other.
+void log_wake (void)
+{
+  uint64_t one = 1;
+
+  __atomic_thread_fence (__ATOMIC_SEQ_CST);
+  if (!__atomic_load_n (&log_sleeping, __ATOMIC_RELAXED))
+    return;
+  if (__atomic_exchange_n (&log_sleeping, false, __ATOMIC_SEQ_CST))
+    if (write (log_wake_fd, &one, sizeof (one)) < 0)
+      return;
+}
+
+// TLS destructor. Records the thread logs after this, from later
+// destructors, are delivered synchronously: the ring may already be
+// freed by the log thread.
+void log_stop_thread (void *arg)
+{
+  log_ring_t *ring = (log_ring_t *) arg;
+
+  log_thread_ring = NULL;
+  log_thread_exited = true;
+  __atomic_store_n (&ring->orphaned, true, __ATOMIC_RELEASE);
+  log_wake ();
+}
+
+void *log_thread (void *arg);
+
+void log_start (void)
+{
+  pthread_t thread;
+  pthread_attr_t attr;
+
+  pthread_key_create (&log_ring_key, log_stop_thread);
+  log_wake_fd = eventfd (0, EFD_CLOEXEC);
+  pthread_attr_init (&attr);
+  pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+  if (pthread_create (&thread, &attr, log_thread, NULL) == 0)
+    __atomic_store_n (&log_started, true, __ATOMIC_RELEASE);
+  pthread_attr_destroy (&attr);
+  atexit (cmsg_log_flush);
+}
+
+log_ring_t *log_get_ring (void)
+{
+  log_ring_t *ring;
+  size_t size;
+
+  if (NULL != log_thread_ring)
+    return log_thread_ring;
+  pthread_once (&log_once, log_start);
+  size = __atomic_load_n (&log_ring_size, __ATOMIC_RELAXED);
+  // aligned for the head and tail cache lines
+  if (posix_memalign ((void **) &ring, 64, sizeof (log_ring_t) + size) != 0)
+    return NULL;
+  ring->size = size;
+  ring->head = 0;
+  ring->tail = 0;
+  ring->dropped = 0;
+  ring->orphaned = false;
+  ring->next = __atomic_load_n (&log_rings, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n (&log_rings, &ring->next, ring,
+      true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+  pthread_setspecific (log_ring_key, ring);
+  log_thread_ring = ring;
+  return ring;
+}
+
+void log_ring_write (log_ring_t *ring, const char *rec, size_t size)
+{
+  uint64_t head = ring->head;
+  uint64_t tail = __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE);
+  size_t pos = head & (ring->size - 1);
+  size_t contiguous = ring->size - pos;
+  size_t needed = size;
+
+  if (size > contiguous)
+    needed += contiguous;
+  if ((ring->size - (head - tail)) < needed) {
+    __atomic_store_n (&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+    return;
+  }
+  if (size > contiguous) {
+    ((log_record_t *) (ring->buf+pos))->size = (uint32_t) contiguous;
+    ((log_record_t *) (ring->buf+pos))->flags = LOG_REC_WRAP;
+    head += contiguous;
+    pos = 0;
+  }
+  memcpy (ring->buf+pos, rec, size);
+  __atomic_store_n (&ring->head, head + size, __ATOMIC_RELEASE);
+  log_wake ();
+}
+
+void log_deliver (const log_record_t *hdr);
+
+
+void cmsg_log_printf (const char *format, ...)
+{
+  char rec[LOG_MAX_RECORD] __attribute__ ((aligned (8)));
+  log_record_t *hdr = (log_record_t *) rec;
+  log_ring_t *ring;
+  struct timespec now;
+  size_t size, len;
+  va_list ap;
+  int n;
+
+  if (log_thread_exited)
+    ring = NULL;
+  else {
+    ring = log_get_ring ();
+    if (NULL == ring)
+      return;
+  }
+  clock_gettime (CLOCK_REALTIME, &now);
+  hdr->flags = log_thread_has_err ? LOG_REC_ERR : 0;
+  hdr->level = (int16_t) log_thread_level;
+  hdr->errcode = log_thread_errcode;
+  hdr->reserved = 0;
+  hdr->time_ns = ((uint64_t) now.tv_sec * 1000000000ULL) + (uint64_t) now.tv_nsec;
+  hdr->format = format;
+  va_start (ap, format);
+  size = log_encode (rec, format, ap);
+  va_end (ap);
+  if (size == 0) {
+    // unsupported conversion or too long: format now, into a "%s" record
+    va_start (ap, format);
+    n = vsnprintf (rec + sizeof (log_record_t) + 8, 
+      LOG_MAX_RECORD - sizeof (log_record_t) - 8, format, ap);
+    va_end (ap);
+    len = strlen (rec + sizeof (log_record_t) + 8);
+    if ((n < 0) || ((size_t) n > len))
+      log_mark_cut (rec + sizeof (log_record_t) + 8, len,
+        (*format != '\0') && (format[strlen (format) - 1] == '\n'));
+    *(uint32_t *) (rec + sizeof (log_record_t)) = (uint32_t) len;
+    hdr->flags |= LOG_REC_TEXT;
+    hdr->format = "%s";
+    size = sizeof (log_record_t) + log_align (8 + len + 1);
+  }
+  hdr->size = (uint32_t) size;
+  if (NULL != ring) {
+    log_ring_write (ring, rec, size);
+    return;
+  }
+  pthread_mutex_lock (&log_drain_mutex);
+  log_deliver (hdr);
+  fflush (stdout);
+  pthread_mutex_unlock (&log_drain_mutex);
+}
+
+cmsg_log_printf_t cmsg_log_begin (int level, int errcode, bool has_err)
+{
+  log_thread_level = level;
+  log_thread_errcode = errcode;
+  log_thread_has_err = has_err;
+  return cmsg_log_printf;
+}
+
+/*------------------------------------------------------------------
+ * Consumer side, log_drain_mutex held
+---------------------------------------------------------------------*/
+
+// marks a line that snprintf filled before the end of the record
+size_t log_cut_line (char *line, size_t sz_line)
+{
+  memcpy (line + sz_line - 5, "...\n", 5);
+  return sz_line - 1;
+}
+
+size_t log_decode (const log_record_t *hdr, char *line, size_t sz_line)
+{
+  const char *args = (const char *) hdr + sizeof (log_record_t);
+  const char *p = hdr->format;
+  const char *pct;
+  char spec[32];
+  size_t spec_len, len = 0, pos = 0;
+  int arg_type, n = 0;
+
+  while (*p != '\0') {
+    pct = strchr (p, '%');
+    if (NULL == pct)
+      pct = p + strlen (p);
+    if (pct > p) {
+      n = snprintf (line+len, sz_line-len, "%.*s", (int) (pct - p), p);
+      if ((n < 0) || ((size_t) n >= sz_line-len))
+        return log_cut_line (line, sz_line);
+      len += n;
+    }
+    if (*pct == '\0')
+      break;
+    spec_len = 1 + log_parse_spec (pct+1, &arg_type);
+    p = pct + spec_len;
+    if (spec_len >= sizeof (spec))
+      spec_len = sizeof (spec) - 1;
+    memcpy (spec, pct, spec_len);
+    spec[spec_len] = '\0';
+    switch (arg_type) {
+      case ARG_NONE:
+        n = snprintf (line+len, sz_line-len, "%%");
+        break;
+      case ARG_INT:
+        n = snprintf (line+len, sz_line-len, spec, (int) *(int64_t *) (args+pos));
+        pos += 8;
+        break;
+      case ARG_LONG:
+        n = snprintf (line+len, sz_line-len, spec, *(long *) (args+pos));
+        pos += 8;
+        break;
+      case ARG_LLONG:
+        n = snprintf (line+len, sz_line-len, spec, *(long long *) (args+pos));
+        pos += 8;
+        break;
+      case ARG_SIZE:
+        n = snprintf (line+len, sz_line-len, spec, *(size_t *) (args+pos));
+        pos += 8;
+        break;
+      case ARG_INTMAX:
+        n = snprintf (line+len, sz_line-len, spec, *(intmax_t *) (args+pos));
+        pos += 8;
+        break;
+      case ARG_PTRDIFF:
+        n = snprintf (line+len, sz_line-len, spec, *(ptrdiff_t *) (args+pos));
+        pos += 8;
+        break;
+      case ARG_DOUBLE:
+        n = snprintf (line+len, sz_line-len, spec, *(double *) (args+pos));
+        pos += 8;
+        break;
+      case ARG_LDOUBLE:
+        {
+          long double ld;
+          memcpy (&ld, args+pos, sizeof (ld));
+          n = snprintf (line+len, sz_line-len, spec, ld);
+        }
+        pos += 16;
+        break;
+      case ARG_POINTER:
+        n = snprintf (line+len, sz_line-len, spec, *(void **) (args+pos));
+        pos += 8;
+        break;
+      case ARG_STRING:
+        n = snprintf (line+len, sz_line-len, spec, args+pos+8);
+        pos += log_align (8 + *(uint32_t *) (args+pos) + 1);
+        break;
+      default:
+        n = 0;
+        break;
+    }
+    if ((n < 0) || ((size_t) n >= sz_line-len))
+      return log_cut_line (line, sz_line);
+    len += n;
+  }
+  return len;
+}
+
+void log_deliver (const log_record_t *hdr)
+{
+  char line[LOG_MAX_LINE];
+  char errbuf[100];
+  size_t len;
+  int n;
+
+  len = log_decode (hdr, line, sizeof (line));
+  if (hdr->flags & LOG_REC_ERR) {
+    n = snprintf (line+len, sizeof (line)-len, " : %s\n",
+      strerror_r (hdr->errcode, errbuf, sizeof (errbuf)));
+    if (n > 0)
+      len += ((size_t) n < sizeof (line)-len) ? (size_t) n : sizeof (line)-len-1;
+  }
+  if (NULL != log_sink)
+    log_sink (hdr->level, hdr->time_ns, line, len, log_sink_arg);
+  else
+    log_default_sink (hdr->level, hdr->time_ns, line, len, NULL);
+}
+
+// returns the number of records delivered
+unsigned log_drain_ring (log_ring_t *ring)
+{
+  uint64_t tail = ring->tail;
+  uint64_t head = __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE);
+  const log_record_t *hdr;
+  unsigned count = 0;
+
+  while (tail != head) {
+    hdr = (const log_record_t *) (ring->buf + (tail & (ring->size - 1)));
+    if (!(hdr->flags & LOG_REC_WRAP)) {
+      log_deliver (hdr);
+      count++;
+    }
+    tail += hdr->size;
+  }
+  __atomic_store_n (&ring->tail, tail, __ATOMIC_RELEASE);
+  return count;
+}
+
+unsigned log_drain (void)
+{
+  log_ring_t *ring;
+  log_ring_t *prev = NULL;
+  log_ring_t *next;
+  unsigned count = 0;
+
+  ring = __atomic_load_n (&log_rings, __ATOMIC_ACQUIRE);
+  while (NULL != ring) {
+    next = ring->next;
+    count += log_drain_ring (ring);
+    // Rings of exited threads are freed once empty. New rings are only
+    // pushed at the head, so unlinking after the head is safe.
+    if ((NULL != prev) && __atomic_load_n (&ring->orphaned, __ATOMIC_ACQUIRE) &&
+        (log_drain_ring (ring) == 0)) {
+      prev->next = next;
+      log_dropped_freed += ring->dropped;
+      free (ring);
+    } else
+      prev = ring;
+    ring = next;
+  }
+  return count;
+}
+
+unsigned log_drain_flush (void)
+{
+  unsigned count;
+
+  pthread_mutex_lock (&log_drain_mutex);
+  count = log_drain ();
+  if (count != 0)
+    fflush (stdout);
+  pthread_mutex_unlock (&log_drain_mutex);
+  return count;
+}
+
+void *log_thread (void *arg)
+{
+  struct timespec delay = { 0, LOG_DRAIN_MSECS * 1000000L };
+  uint64_t count;
+
+  (void) arg;
+  while (true) {
+    nanosleep (&delay, NULL);
+    if ((log_drain_flush () != 0) || (log_wake_fd < 0))
+      continue;
+    // Nothing logged for a batch: block until a record is written.
+    // Records written before log_sleeping was seen are drained here.
+    __atomic_store_n (&log_sleeping, true, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence (__ATOMIC_SEQ_CST);
+    if (log_drain_flush () == 0)
+      while ((read (log_wake_fd, &count, sizeof (count)) < 0) && (errno == EINTR))
+        ;
+    __atomic_store_n (&log_sleeping, false, __ATOMIC_RELAXED);
+  }
+  return NULL;
+}
+
+void cmsg_log_flush (void)
+{
+  pthread_mutex_lock (&log_drain_mutex);
+  log_drain ();
+  fflush (stdout);
+  pthread_mutex_unlock (&log_drain_mutex);
+}
+
+uint64_t cmsg_log_dropped (void)
+{
+  uint64_t dropped;
+  log_ring_t *ring;
+
+  pthread_mutex_lock (&log_drain_mutex);
+  dropped = log_dropped_freed;
+  for (ring = log_rings; NULL != ring; ring = ring->next)
+    dropped += __atomic_load_n (&ring->dropped, __ATOMIC_RELAXED);
+  pthread_mutex_unlock (&log_drain_mutex);
+  return dropped;
+}
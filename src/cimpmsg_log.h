@@ -1,107 +1,94 @@
-/**
- * Copyright 2016 Comcast Cable Communications Management, LLC
- *
- * Licensed under the Apache License, Version 2.0 (the "License");
- * you may not use this file except in compliance with the License.
- * You may obtain a copy of the License at
- *
- *     http://www.apache.org/licenses/LICENSE-2.0
- *
- * Unless required by applicable law or agreed to in writing, software
- * distributed under the License is distributed on an "AS IS" BASIS,
- * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
- * See the License for the specific language governing permissions and
- * limitations under the License.
- *
- */
-#ifndef  _CIMPMSG_LOG_H
-#define  _CIMPMSG_LOG_H
-
-#include <stdbool.h>
-
-#define LEVEL_ERROR 0
-#define LEVEL_INFO  1
-#define LEVEL_DEBUG 2
-
-// if TEST_ENVIRONMENT is not defined, then the macros libpd_log and libpd_log_err
-// generate nothing
-#define TEST_ENVIRONMENT 1
-//#define TEST_LOG_MAX_LEVEL LEVEL_INFO
-
-#ifndef TEST_ENVIRONMENT
-#define cmsg_log(level,msg)
-#define cmsg_log_err(level,errcode,msg)
-
-#else
-// TEST_ENVIRONMENT defined
-
-#include <stdio.h>
-#include <string.h>
-
-// When TEST_ENVIRONMENT == 1, printf is used.
-// If TEST_ENVIRONMENT > 1, then you need to provide
-// external functions 'CheckLevel' and 'Printf'
-
-#if TEST_ENVIRONMENT==1
-#define Printf printf
-
-#define output_level(level) \
-  if ((level) == LEVEL_ERROR) \
-    Printf ("Error: "); \
-  else if ((level) == LEVEL_INFO) \
-    Printf ("Info: "); \
-  else \
-    Printf ("Debug: ");
-
-#ifdef TEST_LOG_MAX_LEVEL
-#define check_level(level) if (level > TEST_LOG_MAX_LEVEL) break
-#else
-#define check_level(level)
-#endif
-
-#define cmsg_log(level,msg) \
-  do { \
-    check_level (level); \
-    output_level (level); \
-    Printf msg; \
-  } while (false)
-
-#define cmsg_log_err(level,errcode,msg) \
-  do { \
-    check_level (level); \
-    cmsg_log (level, msg); \
-    { \
-      char errbuf[100]; \
-      Printf (" : %s\n", strerror_r (errcode, errbuf, 100)); \
-    } \
-  } while (false)
-
-#else
-// TEST_ENVIRONMENT > 1
-
-  extern bool CheckLevel (int level);
-  extern int Printf (const char *format, ...);
-
-#define cmsg_log(level,msg) if (CheckLevel (level)) Printf msg
-    
-#define cmsg_log_err(level,errcode,msg) \
-  if (CheckLevel (level)) { \
-    Printf msg;
-    do { \
-      char errbuf[100]; \
-      Printf (" : %s\n", strerror_r (errcode, errbuf, 100)); \
-    } while (false)
-  }
-#endif
-
-// Example:  cmsg_log (LEVEL_ERROR, ("Unable to allocate new instance\n"));
-// notice you need an extra set of parentheses
-
-// Example: cmsg_log_err (LEVEL_ERROR, errno, ("Unable to bind to receive_socket %s\n", rcv_url));
-// notice you need an extra set of parentheses
-
-#endif
- 
- 
-#endif
-  
+/**
+ * Copyright 2016 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+#ifndef  _CIMPMSG_LOG_H
+#define  _CIMPMSG_LOG_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define LEVEL_ERROR 0
+#define LEVEL_INFO  1
+#define LEVEL_DEBUG 2
+
+// Levels above CMSG_LOG_MAX_LEVEL generate no code.
+// Define it as -1 to remove all logging.
+#ifndef CMSG_LOG_MAX_LEVEL
+#ifdef TEST_LOG_MAX_LEVEL
+#define CMSG_LOG_MAX_LEVEL TEST_LOG_MAX_LEVEL
+#else
+#define CMSG_LOG_MAX_LEVEL LEVEL_DEBUG
+#endif
+#endif
+
+// Log records are written, unformatted, to a lock-free ring owned by
+// the logging thread, and formatted and passed to the sink by a
+// background thread. A record that doesn't fit in a full ring is
+// dropped (and counted) rather than blocking the caller.
+// The background thread sleeps while nothing is logged, and drains
+// every 10 ms while records keep arriving.
+// A record holds up to 2 KB of arguments, strings included; a longer
+// string, or a message formatted eagerly, is cut to fit and ends in
+// "...". So is a formatted line over 4 KB.
+
+typedef void (* cmsg_log_sink_t) (int level, uint64_t time_ns,
+  const char *line, size_t len, void *arg);
+// line is the formatted message, without a level prefix.
+// time_ns is CLOCK_REALTIME when the record was written.
+
+void cmsg_log_set_level (int level);
+int cmsg_log_get_level (void);
+// Records above level are discarded at the call site. Default LEVEL_INFO.
+void cmsg_log_set_sink (cmsg_log_sink_t sink, void *arg);
+// NULL restores the default sink, which writes to stdout with an
+// "Error: ", "Info: " or "Debug: " prefix. Called from the log thread.
+void cmsg_log_flush (void);
+// Formats and delivers all records written so far. Also run at exit.
+uint64_t cmsg_log_dropped (void);
+int cmsg_log_set_ring_size (size_t size);
+// Size of the rings created after the call, one per thread that logs;
+// a power of 2 of at least 4096, else EINVAL. Default 64 KB.
+
+extern int cmsg_log_level;
+
+typedef void (* cmsg_log_printf_t) (const char *format, ...);
+cmsg_log_printf_t cmsg_log_begin (int level, int errcode, bool has_err);
+
+#define cmsg_log_enabled(level) \
+  (((level) <= CMSG_LOG_MAX_LEVEL) && \
+   ((level) <= __atomic_load_n (&cmsg_log_level, __ATOMIC_RELAXED)))
+
+#define cmsg_log(level,msg) \
+  do { \
+    if (cmsg_log_enabled (level)) \
+      cmsg_log_begin (level, 0, false) msg; \
+  } while (false)
+
+// strerror of errcode is appended when the record is formatted
+#define cmsg_log_err(level,errcode,msg) \
+  do { \
+    if (cmsg_log_enabled (level)) \
+      cmsg_log_begin (level, errcode, true) msg; \
+  } while (false)
+
+// Example:  cmsg_log (LEVEL_ERROR, ("Unable to allocate new instance\n"));
+// notice you need an extra set of parentheses
+
+// Example: cmsg_log_err (LEVEL_ERROR, errno, ("Unable to bind to receive_socket %s\n", rcv_url));
+// notice you need an extra set of parentheses
+
+#endif
@@ -0,0 +1,185 @@
+/**
+ * Copyright 2016 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+#include <stdint.h>
+#include <string.h>
+#include "cimpmsg_lz.h"
+
+uint32_t lz_read32 (const unsigned char *p)
+{
+  uint32_t val;
+
+  memcpy (&val, p, sizeof (val));
+  return val;
+}
+
+unsigned lz_hash (uint32_t val)
+{
+  return (val * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// the bytes of 255 that continue a length nibble of 15
+unsigned char *lz_put_len (unsigned char *op, unsigned char *oend, size_t len)
+{
+  while (len >= 255) {
+    if (op >= oend)
+      return NULL;
+    *op++ = 255;
+    len -= 255;
+  }
+  if (op >= oend)
+    return NULL;
+  *op++ = (unsigned char) len;
+  return op;
+}
+
+// Writes lit_len literals and a match, or just the literals if
+// match_len is 0. Returns NULL if dst is full.
+unsigned char *lz_put_seq (unsigned char *op, unsigned char *oend, 
+  const unsigned char *lit, size_t lit_len, size_t offset, size_t match_len)
+{
+  unsigned char *token;
+  size_t ml = (match_len != 0) ? match_len - LZ_MIN_MATCH : 0;
+
+  if (op >= oend)
+    return NULL;
+  token = op++;
+  *token = (unsigned char) (((lit_len < 15) ? lit_len : 15) << 4);
+  *token |= (unsigned char) ((ml < 15) ? ml : 15);
+  if (lit_len >= 15) {
+    op = lz_put_len (op, oend, lit_len - 15);
+    if (NULL == op)
+      return NULL;
+  }
+  if ((size_t) (oend - op) < lit_len)
+    return NULL;
+  memcpy (op, lit, lit_len);
+  op += lit_len;
+  if (match_len == 0)
+    return op;
+  if (oend - op < 2)
+    return NULL;
+  *op++ = (unsigned char) (offset & 255);
+  *op++ = (unsigned char) (offset >> 8);
+  if (ml >= 15)
+    op = lz_put_len (op, oend, ml - 15);
+  return op;
+}
+
+// One probe of a hash table of earlier positions per input byte. Runs
+// without a match step further ahead, so data that won't compress
+// costs little.
+size_t lz_compress (const char *src, size_t sz_src, char *dst, size_t sz_dst)
+{
+  uint32_t table[1 << LZ_HASH_BITS];  // position + 1, 0 = empty
+  const unsigned char *base = (const unsigned char *) src;
+  const unsigned char *iend = base + sz_src;
+  const unsigned char *ip = base;
+  const unsigned char *anchor = base;
+  const unsigned char *ref;
+  unsigned char *op = (unsigned char *) dst;
+  unsigned char *oend = op + sz_dst;
+  uint32_t seq, prev;
+  unsigned h;
+  size_t len, step;
+
+  memset (table, 0, sizeof (table));
+  while ((size_t) (iend - ip) >= LZ_MIN_MATCH) {
+    seq = lz_read32 (ip);
+    h = lz_hash (seq);
+    prev = table[h];
+    table[h] = (uint32_t) (ip - base) + 1;
+    ref = base + ((prev != 0) ? prev - 1 : 0);
+    if ((prev == 0) || (ip - ref > LZ_MAX_OFFSET) || (lz_read32 (ref) != seq)) {
+      step = 1 + ((ip - anchor) >> 6);
+      if (step > (size_t) (iend - ip))
+        break;
+      ip += step;
+      continue;
+    }
+    len = LZ_MIN_MATCH;
+    while ((ip + len < iend) && (ref[len] == ip[len]))
+      len++;
+    op = lz_put_seq (op, oend, anchor, ip - anchor, ip - ref, len);
+    if (NULL == op)
+      return 0;
+    ip += len;
+    anchor = ip;
+  }
+  op = lz_put_seq (op, oend, anchor, iend - anchor, 0, 0);
+  if (NULL == op)
+    return 0;
+  return op - (unsigned char *) dst;
+}
+
+// reads the bytes continuing a length nibble of 15
+int lz_get_len (const unsigned char **ip, const unsigned char *iend, size_t *len)
+{
+  unsigned char b;
+
+  do {
+    if (*ip >= iend)
+      return -1;
+    b = *(*ip)++;
+    *len += b;
+  } while (b == 255);
+  return 0;
+}
+
+int lz_decompress (const char *src, size_t sz_src, char *dst, size_t sz_dst)
+{
+  const unsigned char *ip = (const unsigned char *) src;
+  const unsigned char *iend = ip + sz_src;
+  unsigned char *op = (unsigned char *) dst;
+  unsigned char *oend = op + sz_dst;
+  const unsigned char *match;
+  unsigned char token;
+  size_t len, offset, i;
+
+  while (ip < iend) {
+    token = *ip++;
+    len = token >> 4;
+    if ((len == 15) && (lz_get_len (&ip, iend, &len) < 0))
+      return -1;
+    if ((len > (size_t) (iend - ip)) || (len > (size_t) (oend - op)))
+      return -1;
+    memcpy (op, ip, len);
+    op += len;
+    ip += len;
+    if (ip == iend)
+      break;  // the last sequence
+    if (iend - ip < 2)
+      return -1;
+    offset = (size_t) ip[0] | ((size_t) ip[1] << 8);
+    ip += 2;
+    if ((offset == 0) || (offset > (size_t) (op - (unsigned char *) dst)))
+      return -1;
+    len = token & 15;
+    if ((len == 15) && (lz_get_len (&ip, iend, &len) < 0))
+      return -1;
+    len += LZ_MIN_MATCH;
+    if (len > (size_t) (oend - op))
+      return -1;
+    match = op - offset;
+    if (offset >= len)
+      memcpy (op, match, len);
+    else
+      for (i = 0; i < len; i++)  // overlapping, repeats the last offset bytes
+        op[i] = match[i];
+    op += len;
+  }
+  return (op == oend) ? 0 : -1;
+}
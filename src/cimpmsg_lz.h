@@ -0,0 +1,42 @@
+/**
+ * Copyright 2016 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+#ifndef  _CIMPMSG_LZ_H
+#define  _CIMPMSG_LZ_H
+
+#include <stddef.h>
+
+/*------------------------------------------------------------------
+ * A small LZ77 codec for message payloads, laid out like an LZ4 block:
+ *   token(1) [literal length(n)] literals [offset(2) [match length(n)]]
+ * The token holds the literal length in its high nibble and the match
+ * length less LZ_MIN_MATCH in its low one. A nibble of 15 is continued
+ * in bytes of 255 up to one that is less. The offset is little endian,
+ * and the last sequence has literals only. It trades ratio for speed,
+ * so text and JSON shrink several times at a few hundred MB/s.
+---------------------------------------------------------------------*/
+#define LZ_MIN_MATCH		4
+#define LZ_HASH_BITS		12
+#define LZ_MAX_OFFSET		65535
+
+size_t lz_compress (const char *src, size_t sz_src, char *dst, size_t sz_dst);
+// Returns the compressed size, or 0 if it doesn't fit in sz_dst.
+// Pass a sz_dst below sz_src to give up early on data that won't shrink.
+int lz_decompress (const char *src, size_t sz_src, char *dst, size_t sz_dst);
+// Returns 0 if src expands to exactly sz_dst bytes, else -1.
+// Checks every length and offset, so src may come from the network.
+
+#endif
@@ -0,0 +1,55 @@
+/**
+ * Copyright 2016 Comcast Cable Communications Management, LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ */
+#ifndef  _CIMPMSG_PROBES_H
+#define  _CIMPMSG_PROBES_H
+
+/*------------------------------------------------------------------
+ * USDT probes, built in when CMSG_USDT is defined (cmake finds
+ * sys/sdt.h). Every probe has the arguments
+ *   fd, message size (0 if none), CLOCK_MONOTONIC ns
+ * and is guarded by its semaphore, so the timestamp is only taken
+ * while a tracer is attached. List them with
+ *   bpftrace -l 'usdt:/path/to/libcimpmsg.so:cimpmsg:*'
+ * Probes: accept, header, msg_complete, callback_enter, callback_exit,
+ *   send_start, send_end, close
+---------------------------------------------------------------------*/
+
+#ifdef CMSG_USDT
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define CMSG_PROBE_SEMAPHORE(name) \
+  unsigned short cimpmsg_##name##_semaphore \
+    __attribute__ ((unused)) __attribute__ ((section (".probes")))
+
+#define CMSG_PROBE(name, fd, size) \
+  do { \
+    if (__builtin_expect (cimpmsg_##name##_semaphore != 0, 0)) \
+      DTRACE_PROBE3 (cimpmsg, name, (int) (fd), (size_t) (size), \
+        get_monotonic_ns ()); \
+  } while (0)
+
+#else
+
+#define CMSG_PROBE_SEMAPHORE(name) \
+  extern unsigned short cimpmsg_##name##_semaphore
+#define CMSG_PROBE(name, fd, size) do { (void) (fd); (void) (size); } while (0)
+
+#endif
+
+#endif
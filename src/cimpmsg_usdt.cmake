@@ -0,0 +1,22 @@
+#   Copyright 2016 Comcast Cable Communications Management, LLC
+#
+#   Licensed under the Apache License, Version 2.0 (the "License");
+#   you may not use this file except in compliance with the License.
+#   You may obtain a copy of the License at
+#
+#       http://www.apache.org/licenses/LICENSE-2.0
+#
+#   Unless required by applicable law or agreed to in writing, software
+#   distributed under the License is distributed on an "AS IS" BASIS,
+#   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#   See the License for the specific language governing permissions and
+#   limitations under the License.
+
+# USDT probes, see cimpmsg_probes.h. Included by the top level and the
+# src CMakeLists.txt.
+include(CheckIncludeFile)
+option(CMSG_USDT "Build USDT probes if sys/sdt.h is found" ON)
+check_include_file(sys/sdt.h HAVE_SYS_SDT_H)
+if (CMSG_USDT AND HAVE_SYS_SDT_H)
+  add_definitions(-DCMSG_USDT)
+endif ()
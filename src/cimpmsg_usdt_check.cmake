@@ -0,0 +1,32 @@
+#   Copyright 2016 Comcast Cable Communications Management, LLC
+#
+#   Licensed under the Apache License, Version 2.0 (the "License");
+#   you may not use this file except in compliance with the License.
+#   You may obtain a copy of the License at
+#
+#       http://www.apache.org/licenses/LICENSE-2.0
+#
+#   Unless required by applicable law or agreed to in writing, software
+#   distributed under the License is distributed on an "AS IS" BASIS,
+#   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+#   See the License for the specific language governing permissions and
+#   limitations under the License.
+
+# Checks that LIB has a .note.stapsdt entry with a semaphore for every
+# probe in cimpmsg_probes.h.
+# cmake -DREADELF=readelf -DLIB=libcimpmsg.so -P cimpmsg_usdt_check.cmake
+execute_process(COMMAND ${READELF} -n ${LIB} OUTPUT_VARIABLE notes
+  RESULT_VARIABLE rtn)
+if (NOT rtn EQUAL 0)
+  message(FATAL_ERROR "${READELF} -n ${LIB} failed")
+endif ()
+foreach(probe accept header msg_complete callback_enter callback_exit
+    send_start send_end close)
+  if (NOT notes MATCHES "Provider: cimpmsg\n[ \t]*Name: ${probe}\n")
+    message(FATAL_ERROR "No stapsdt note for cimpmsg:${probe}")
+  endif ()
+endforeach()
+if (notes MATCHES "Semaphore: 0x0+\n")
+  message(FATAL_ERROR "A cimpmsg probe has no semaphore")
+endif ()
+message(STATUS "All cimpmsg probes have stapsdt notes and semaphores")
@@ -25,6 +25,8 @@ struct options {
   bool print_send_msgs;
   bool sleep_at_end;
   bool send_stop_msg_at_end;
+  bool auto_reconnect;
+  bool send_requests;
   unsigned int msg_filler;
 } OPT;
 
@@ -47,6 +49,8 @@ void init_options (void)
   OPT.print_send_msgs = false;
   OPT.sleep_at_end = false;
   OPT.send_stop_msg_at_end = false;
+  OPT.auto_reconnect = false;
+  OPT.send_requests = false;
   OPT.msg_filler = 0;
 }
 
@@ -113,7 +117,7 @@ static void *client_receiver_thread (void *arg)
     if (rtn < 0)
       break;
     printf ("Client %d received: %s\n", getpid(), conn->rcv_msg);
-    free (conn->rcv_msg);
+    cmsg_free_msg (conn->rcv_msg, conn->rcv_msg_size);
     conn->rcv_msg = NULL;
   }
   //printf ("Ending client receiver thread for %d\n", getpid());
@@ -137,6 +141,24 @@ void wait_with_msg (unsigned wait_secs)
   }
 }
 
+int client_send_request (const char *msg, size_t sz_msg)
+{
+  int rtn;
+  char *reply;
+  size_t sz_reply;
+
+  rtn = cmsg_client_call (&CLI.conn, msg, sz_msg, SOCK_SEND_TIMEOUT_MSEC,
+    &reply, &sz_reply);
+  if (rtn != 0) {
+    printf ("Client %d request failed: %s\n", getpid(), strerror (rtn));
+    return rtn;
+  }
+  if ((sz_reply != sz_msg) || (memcmp (reply, msg, sz_msg) != 0))
+    printf ("Client %d reply does not match request\n", getpid());
+  cmsg_free_msg (reply, sz_reply);
+  return 0;
+}
+
 void client_send_multiple (void)
 {
   unsigned long i;
@@ -157,7 +179,10 @@ void client_send_multiple (void)
 	    wait_random ();
 	  make_filled_msg (CLI.send_msg, i, buf);
 	  sz_msg = strlen(buf) + 1;
-	  if (cmsg_client_send(&CLI.conn, buf, sz_msg, false) != 0)
+	  if (OPT.send_requests) {
+		if (client_send_request (buf, sz_msg) != 0)
+		  break;
+	  } else if (cmsg_client_send(&CLI.conn, buf, sz_msg, false) != 0)
 		break;
 	  if (OPT.print_send_msgs)
 	    printf ("Sent msg %lu\n", i);
@@ -213,6 +238,14 @@ int get_args (const int argc, const char **argv)
 			OPT.send_stop_msg_at_end = true;
 			continue;
 		}
+		if ((mode == 0) && (strcmp(arg, "rc") == 0)) {
+			OPT.auto_reconnect = true;
+			continue;
+		}
+		if ((mode == 0) && (strcmp(arg, "rq") == 0)) {
+			OPT.send_requests = true;
+			continue;
+		}
 		if (mode == 'p') {
 			CLI.port_str = arg;
 			mode = 0;
@@ -244,9 +277,20 @@ int get_args (const int argc, const char **argv)
 }
 
 
+void show_client_stats (client_conn_t *conn)
+{
+  cmsg_stats_t stats;
+  char buf[4096];
+
+  cmsg_client_get_stats (conn, &stats);
+  if (cmsg_stats_format (&stats, NULL, buf, sizeof (buf)) > 0)
+    printf ("%s", buf);
+}
+
 int main (const int argc, const char **argv)
 {
   unsigned int port;
+  client_opts_t client_opts = {.auto_reconnect = false};
 
 	srandom (getpid());
 
@@ -273,8 +317,9 @@ int main (const int argc, const char **argv)
 		printf ("Message not specified for client\n");
 		exit(4);
 	}
-	if (cmsg_connect_client (&CLI.conn, IP_ADDR, port, 
-		SOCK_SEND_TIMEOUT_MSEC) != 0)
+	client_opts.auto_reconnect = OPT.auto_reconnect;
+	if (cmsg_connect_client_opts (&CLI.conn, IP_ADDR, port, 
+		SOCK_SEND_TIMEOUT_MSEC, &client_opts) != 0)
 	    exit(4);
 	if (create_thread (&client_rcv_thread_id, client_receiver_thread, &CLI.conn) == 0)
 	{
@@ -287,6 +332,7 @@ int main (const int argc, const char **argv)
 	    }
             CLI.conn.terminated = true;
             pthread_join (client_rcv_thread_id, NULL);
+	    show_client_stats (&CLI.conn);
 	}
         cmsg_shutdown_client (&CLI.conn);
 
@@ -396,11 +396,23 @@ void process_rcv_msg (int action_code, server_rcv_msg_data_t *rcv_msg_data)
       pthread_mutex_unlock (&SRV.list_mutex);
       if (NULL != conn)
         show_msg (rcv_msg_data, conn);
-      free (rcv_msg_data->rcv_msg);
+      if (rcv_msg_data->msg_kind == CMSG_KIND_REQUEST)
+        cmsg_server_reply (rcv_msg_data->server, rcv_msg_data->conn,
+          rcv_msg_data->corr_id, rcv_msg_data->rcv_msg, 
+          rcv_msg_data->rcv_msg_size, true);
+      cmsg_free_msg (rcv_msg_data->rcv_msg, rcv_msg_data->rcv_msg_size);
       rcv_msg_data->rcv_msg = NULL;
       server_received_something = true;
       SRV.idle_notify_count = 0;
       break;
+    case CMSG_ACTION_ROUTE_ADDED:
+      printf ("Socket %d subscribed to %s\n", rcv_msg_data->sock, 
+        rcv_msg_data->rcv_msg);
+      break;
+    case CMSG_ACTION_ROUTE_REMOVED:
+      printf ("Socket %d unsubscribed from %s\n", rcv_msg_data->sock, 
+        rcv_msg_data->rcv_msg);
+      break;
     case CMSG_ACTION_ALL_IDLE_NOTIFY:
       if (!server_received_something) {
         printf (SRV.waiting_msg);